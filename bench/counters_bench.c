@@ -0,0 +1,134 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Compares counting ops in one shared set of atomic counters, as every FUSE thread would without sharding, against
+// blok's per-thread shards.  Each thread does what blok_op_end() does for a read (ops, bytes, a histogram bucket)
+// without the clock reads.  A run whose counts don't add up to the calls made is reported as an error instead of a
+// rate.
+//
+//     blok-bench-counters [max threads] [increments per thread]
+
+#define _GNU_SOURCE
+
+#include "../include/counters.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_BYTES 4096
+
+static struct blok_op_counters shared __attribute__((aligned(64)));
+static uint64_t iterations;
+static pthread_barrier_t start;
+
+static void *bench_shared(void *arg)
+{
+    pthread_barrier_wait(&start);
+    for (uint64_t i = 0; i < iterations; i++) {
+        __atomic_fetch_add(&shared.ops, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shared.bytes, BENCH_BYTES, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shared.latency[blok_hist_bucket(i & 0xffff)], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void *bench_sharded(void *arg)
+{
+    pthread_barrier_wait(&start);
+    for (uint64_t i = 0; i < iterations; i++) {
+        struct blok_op_counters *c = &blok_shard()->counters.op[BLOK_OP_READ];
+        BLOK_SHARD_ADD(c->ops, 1);
+        BLOK_SHARD_ADD(c->bytes, BENCH_BYTES);
+        BLOK_SHARD_ADD(c->latency[blok_hist_bucket(i & 0xffff)], 1);
+    }
+    return NULL;
+}
+
+static double run(void *(*fn)(void *), int nthreads)
+{
+    pthread_t threads[nthreads];
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, fn, NULL);
+    }
+    uint64_t begin = blok_now_ns();
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = blok_now_ns() - begin;
+    pthread_barrier_destroy(&start);
+    return (double) iterations * nthreads / elapsed * 1000.0;
+}
+
+// A run only counts if every call was counted once, with no errors, its bytes and one histogram entry.
+static const char *check(const struct blok_op_counters *c, uint64_t expected)
+{
+    uint64_t hist = 0;
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        hist += c->latency[b];
+    }
+    if (c->ops != expected) {
+        return "op count";
+    }
+    if (c->errors != 0) {
+        return "errors";
+    }
+    if (c->bytes != expected * BENCH_BYTES) {
+        return "byte count";
+    }
+    if (hist != expected) {
+        return "histogram";
+    }
+    return NULL;
+}
+
+// What the shards counted during one run
+static void sharded_delta(struct blok_op_counters *out, const struct blok_counters *before)
+{
+    struct blok_counters after;
+    blok_counters_read(&after);
+    const struct blok_op_counters *a = &after.op[BLOK_OP_READ];
+    const struct blok_op_counters *b = &before->op[BLOK_OP_READ];
+    memset(out, 0, sizeof(*out));
+    out->ops = a->ops - b->ops;
+    out->bytes = a->bytes - b->bytes;
+    out->errors = a->errors - b->errors;
+    for (int i = 0; i < BLOK_HIST_BUCKETS; i++) {
+        out->latency[i] = a->latency[i] - b->latency[i];
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    iterations = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+
+    printf("%8s %16s %16s\n", "threads", "shared Mops/s", "sharded Mops/s");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        memset(&shared, 0, sizeof(shared));
+        double a = run(bench_shared, n);
+        struct blok_counters before;
+        struct blok_op_counters sharded;
+        blok_counters_read(&before);
+        double b = run(bench_sharded, n);
+        sharded_delta(&sharded, &before);
+
+        const char *bad = check(&shared, iterations * n);
+        if (bad != NULL || (bad = check(&sharded, iterations * n)) != NULL) {
+            fprintf(stderr, "%d threads: %s does not match the calls made\n", n, bad);
+            return 1;
+        }
+        printf("%8d %16.1f %16.1f\n", n, a, b);
+        if (n < max_threads && n * 2 > max_threads) {
+            n = max_threads / 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mem.h"
+
+// Bump allocator for objects that live as long as the mount, such as interned paths.  Memory is taken from malloc in
+// chunks, charged to the arena's subsystem, and only given back by blok_arena_destroy().  Not thread-safe; callers
+// serialize.
+struct blok_arena_chunk;
+
+struct blok_arena {
+    const char *name;
+    enum blok_mem_subsys subsys;
+    size_t chunk_size;
+    struct blok_arena_chunk *chunks;
+    char *cur;
+    size_t left;
+    uint64_t nchunks;
+    uint64_t reserved;
+    uint64_t allocated;
+};
+
+void blok_arena_init(struct blok_arena *arena, const char *name, enum blok_mem_subsys subsys, size_t chunk_size);
+void *blok_arena_alloc(struct blok_arena *arena, size_t size);
+void blok_arena_destroy(struct blok_arena *arena);
+
+// Pool of fixed-size objects.  Every thread keeps a small cache of free objects, so allocating and freeing is a
+// thread-local list operation; the caches exchange objects with the shared free list in batches, and the shared list
+// is refilled from malloc a chunk at a time.  Objects are never returned to malloc.  Freeing on a different thread
+// than the one that allocated is fine.
+#define BLOK_SLAB_MAX 8
+
+struct blok_slab {
+    const char *name;
+    enum blok_mem_subsys subsys;
+    size_t size;
+    int index;
+    pthread_mutex_t lock;
+    void *free;
+    uint64_t nfree;
+    uint64_t chunks;
+    uint64_t objects;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t refills;
+};
+
+void blok_slab_init(struct blok_slab *slab, const char *name, enum blok_mem_subsys subsys, size_t size);
+void *blok_slab_alloc(struct blok_slab *slab);
+void blok_slab_free(struct blok_slab *slab, void *obj);
+
+// Registered allocators, for reporting.
+int blok_slab_count(void);
+struct blok_slab *blok_slab_get(int index);
+int blok_arena_count(void);
+struct blok_arena *blok_arena_get(int index);
+
+#endif
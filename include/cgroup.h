@@ -0,0 +1,54 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _CGROUP_H_
+#define _CGROUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+// I/O attribution to cgroups (-o cgroups).  The calling pid is resolved to its cgroup v2 path through
+// /proc/PID/cgroup, and the cgroup is identified by the inode number of its directory in the cgroup2 mount, which is
+// the ID the kernel and BPF tools use as well.  Logged calls carry it as "cgroup", and reads and writes are counted
+// per cgroup in the thread shards.  Processes are cached with their cgroup, see proc.h.
+//
+// Cgroups get slots in a global table as they are first seen.  Slot 0 collects calls whose cgroup couldn't be
+// resolved (processes gone, pid 0) and those past the end of the table.
+#define BLOK_CGROUP_MAX 128
+
+struct blok_cgroup_io {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t latency_ns;
+};
+
+// io[slot][0] counts reads, io[slot][1] writes.
+struct blok_cgroup_shard {
+    struct blok_cgroup_io io[BLOK_CGROUP_MAX][2];
+};
+
+struct blok_cgroup {
+    uint64_t id;
+    const char *path;
+};
+
+extern int blok_cgroup_enabled;
+
+// Finds the cgroup2 mount and turns attribution on; -errno if there is none.
+int blok_cgroup_init(void);
+// Slot of the cgroup pid is in, 0 if it can't be told.
+uint32_t blok_cgroup_resolve(int pid);
+// Counts a read or write in the calling thread's shard.
+void blok_cgroup_io(uint32_t slot, enum blok_op op, int result, uint64_t elapsed);
+// Number of slots in use; slots below it stay valid and never change.
+size_t blok_cgroup_count(void);
+const struct blok_cgroup *blok_cgroup_get(size_t slot);
+// Sums the per-cgroup counters of all shards for the first n slots.
+void blok_cgroup_read(struct blok_cgroup_io (*out)[2], size_t n);
+
+#endif
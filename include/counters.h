@@ -0,0 +1,238 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "event.h"
+#include "flight.h"
+#include "perf.h"
+#include "probes.h"
+#include "proc.h"
+
+// Operation statistics, kept in per-thread shards so that FUSE worker threads never write to a shared cache line.
+// A shard only ever has one writer, which updates it with plain (non-locked) stores; readers sum all shards when the
+// statistics are asked for.  Shards are cache-line aligned and never freed: a thread that exits hands its shard over
+// to the next new thread, so nothing it counted is lost.
+//
+// Latency histograms have log2 buckets over nanoseconds: bucket b counts latencies in [2^(b-1), 2^b), the last bucket
+// everything longer.
+//
+// Each call's time is also split into the backing syscalls and blok's own work around them (path building, identity
+// lookups, heat map, log records), so what tracing costs can be read off the overhead histogram and totals.  With
+// hardware counters on, pmu[] sums their deltas over the pmu_samples calls that could be measured.
+//
+// started counts calls when they begin and ops when they end, on the same thread, so their difference summed over
+// all shards is the number of calls in flight.  dropped counts log records that could not be written,
+// filtered the calls -o filter kept out of the log.  errnos[e]
+// counts failures with -e, errnos[0] those with an errno past the end of the array.
+#define BLOK_HIST_BUCKETS 40
+#define BLOK_ERRNO_MAX 128
+
+struct blok_op_counters {
+    uint64_t started;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t syscall_ns;
+    uint64_t latency[BLOK_HIST_BUCKETS];
+    uint64_t overhead[BLOK_HIST_BUCKETS];
+    uint64_t syscall[BLOK_HIST_BUCKETS];
+    uint64_t pmu_samples;
+    uint64_t pmu[BLOK_PMU_MAX];
+    uint64_t dropped;
+    uint64_t filtered;
+    uint64_t errnos[BLOK_ERRNO_MAX];
+};
+
+struct blok_counters {
+    struct blok_op_counters op[BLOK_OP_MAX];
+};
+
+struct blok_top;
+
+// top is the thread's sketch of its hottest files, directories, processes and jobs (see top.h), procs its process cache
+// (see proc.h), cgroup its per-cgroup counters (see cgroup.h) and flight its flight recorder ring (see flight.h), all
+// allocated on first use.
+struct blok_shard {
+    struct blok_counters counters;
+    struct blok_top *top;
+    struct blok_proc_cache *procs;
+    struct blok_cgroup_shard *cgroup;
+    struct blok_flight_ring *flight;
+    struct blok_shard *next;
+    int owned;
+} __attribute__((aligned(64)));
+
+struct blok_shard *blok_shard_acquire(void);
+// Calls fn for every shard, including those of exited threads, under the registry lock.
+void blok_shard_foreach(void (*fn)(struct blok_shard *shard, void *arg), void *arg);
+
+extern __thread struct blok_shard *blok_thread_shard;
+
+static inline struct blok_shard *blok_shard(void)
+{
+    struct blok_shard *shard = blok_thread_shard;
+    return shard != NULL ? shard : blok_shard_acquire();
+}
+
+// Single-writer increment: a relaxed load and store compile to a plain add, but keep concurrent readers well defined.
+#define BLOK_SHARD_ADD(field, v) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+
+static inline int blok_hist_bucket(uint64_t ns)
+{
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return b < BLOK_HIST_BUCKETS ? b : BLOK_HIST_BUCKETS - 1;
+}
+
+// Sums all shards.  Totals are since the mount; the _epoch variant subtracts what had been counted when the current
+// epoch began.  Starting an epoch only takes a snapshot, writers are never stopped.
+void blok_counters_read(struct blok_counters *out);
+void blok_counters_read_epoch(struct blok_counters *out);
+void blok_counters_new_epoch(void);
+uint64_t blok_counters_epoch(void);
+time_t blok_counters_epoch_start(void);
+uint64_t blok_hist_percentile(const uint64_t *hist, double p);
+
+static inline uint64_t blok_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Operation timing reads the TSC where there is one, which is a few cycles against the tens of nanoseconds of
+// clock_gettime(); blok_ticks_calibrate() measures its rate once at startup.  Elsewhere ticks are nanoseconds.
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t blok_ticks(void)
+{
+    return __rdtsc();
+}
+#else
+static inline uint64_t blok_ticks(void)
+{
+    return blok_now_ns();
+}
+#endif
+
+extern double blok_ns_per_tick;
+
+void blok_ticks_calibrate(void);
+
+static inline uint64_t blok_ticks_ns(uint64_t ticks)
+{
+    return (uint64_t) (ticks * blok_ns_per_tick);
+}
+
+// Brackets every blok_oper callback: blok_op_end() accounts the call in this thread's shard and passes the result
+// through, so callbacks can simply 'return blok_op_end(&frame, result);'.  A non-negative result is counted as bytes
+// transferred.  The frame's event carries the call's arguments for the entry and return probes and, for the traced
+// operations, the log record written when the call returns; callbacks working on an open file use blok_op_begin_io()
+// to supply the descriptor and range, and fill in ev.id or ev.newpath where they know them.
+//
+// Calls into the backing filesystem go through BLOK_SYSCALL(&frame, call), which adds their time to the frame's
+// syscall share; everything else between begin and end is blok's overhead.
+struct blok_op_frame {
+    struct blok_event ev;
+    uint64_t start;
+    uint64_t sys;
+    uint64_t sys_start;
+    int fd;
+    int pmu_valid;
+    uint64_t pmu[BLOK_PMU_MAX];
+};
+
+static inline void blok_op_begin_io(struct blok_op_frame *frame, enum blok_op op, const char *path, int fd,
+                                    int64_t offset, uint64_t size)
+{
+    frame->ev.op = op;
+    frame->ev.path = path;
+    frame->ev.newpath = NULL;
+    frame->ev.id = (struct blok_fileid) { 0 };
+    frame->ev.cgroup = 0;
+    frame->ev.job = 0;
+    frame->ev.offset = offset;
+    frame->ev.size = size;
+    frame->fd = fd;
+    frame->sys = 0;
+    BLOK_SHARD_ADD(blok_shard()->counters.op[op].started, 1);
+    blok_probe_entry(op, path, offset, size, fd);
+    frame->pmu_valid = blok_perf_enabled && blok_perf_read(frame->pmu) == 0;
+    frame->start = blok_ticks();
+}
+
+static inline void blok_op_begin(struct blok_op_frame *frame, enum blok_op op, const char *path)
+{
+    blok_op_begin_io(frame, op, path, -1, 0, 0);
+}
+
+static inline void blok_sys_begin(struct blok_op_frame *frame)
+{
+    frame->sys_start = blok_ticks();
+}
+
+static inline void blok_sys_end(struct blok_op_frame *frame)
+{
+    frame->sys += blok_ticks() - frame->sys_start;
+}
+
+static inline long blok_sys_pass(struct blok_op_frame *frame, long result)
+{
+    blok_sys_end(frame);
+    return result;
+}
+
+// The call is an argument of blok_sys_pass(), so it completes before the second timestamp is taken.
+#define BLOK_SYSCALL(frame, call) (blok_sys_begin(frame), blok_sys_pass((frame), (call)))
+
+// The call's time as reported to the probes and the log stops before the record is filtered and formatted; the
+// counters take a second timestamp afterwards, so the logging shows up in the overhead and latency histograms.
+static inline int blok_op_end(struct blok_op_frame *frame, int result)
+{
+    uint64_t elapsed = blok_ticks_ns(blok_ticks() - frame->start);
+    if (blok_proc_enabled) {
+        blok_proc_account(&frame->ev, result, elapsed);
+    }
+    blok_probe_return(frame->ev.op, frame->ev.path, frame->ev.offset, frame->ev.size, frame->fd, result, elapsed);
+    if (blok_event_traced(frame->ev.op) || blok_flight_enabled) {
+        blok_event_log_op(&frame->ev, result, elapsed);
+    }
+
+    uint64_t ticks = blok_ticks() - frame->start;
+    uint64_t total = blok_ticks_ns(ticks);
+    uint64_t sys = blok_ticks_ns(frame->sys < ticks ? frame->sys : ticks);
+    struct blok_op_counters *c = &blok_shard()->counters.op[frame->ev.op];
+    uint64_t pmu[BLOK_PMU_MAX];
+    if (frame->pmu_valid && blok_perf_read(pmu) == 0) {
+        BLOK_SHARD_ADD(c->pmu_samples, 1);
+        for (int i = 0; i < BLOK_PMU_MAX; i++) {
+            BLOK_SHARD_ADD(c->pmu[i], pmu[i] - frame->pmu[i]);
+        }
+    }
+    BLOK_SHARD_ADD(c->ops, 1);
+    if (result < 0) {
+        BLOK_SHARD_ADD(c->errors, 1);
+        BLOK_SHARD_ADD(c->errnos[-result < BLOK_ERRNO_MAX ? -result : 0], 1);
+    } else {
+        BLOK_SHARD_ADD(c->bytes, result);
+    }
+    BLOK_SHARD_ADD(c->total_ns, total);
+    BLOK_SHARD_ADD(c->syscall_ns, sys);
+    BLOK_SHARD_ADD(c->latency[blok_hist_bucket(total)], 1);
+    BLOK_SHARD_ADD(c->overhead[blok_hist_bucket(total - sys)], 1);
+    BLOK_SHARD_ADD(c->syscall[blok_hist_bucket(sys)], 1);
+    return result;
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include <fuse.h>
+#include <sys/stat.h>
+#include "handle.h"
+
+// The control directory, /.blok under the mount point.  It is not backed by the root directory and isn't listed in
+// the root's readdir, so tree walkers don't stumble over it.
+#define BLOK_CTL_DIR "/.blok"
+
+enum blok_ctl_node {
+    BLOK_CTL_NONE,
+    BLOK_CTL_ROOT,
+    BLOK_CTL_STATS,
+    BLOK_CTL_TOP,
+    BLOK_CTL_CONTROL,
+    BLOK_CTL_MAX
+};
+
+enum blok_ctl_node blok_ctl_lookup(const char *path);
+int blok_ctl_getattr(enum blok_ctl_node node, struct stat *statbuf);
+int blok_ctl_access(enum blok_ctl_node node, int mask);
+int blok_ctl_open(enum blok_ctl_node node, struct fuse_file_info *fi);
+int blok_ctl_read(struct blok_handle *handle, char *buf, size_t size, off_t offset);
+int blok_ctl_write(struct blok_handle *handle, const char *buf, size_t size);
+void blok_ctl_release(struct blok_handle *handle);
+int blok_ctl_readdir(enum blok_ctl_node node, void *buf, fuse_fill_dir_t filler);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "fileid.h"
+#include "ndjson.h"
+
+// One entry per blok_oper callback, as X(NAME, name): BLOK_OP_NAME is the enum value, name what records and probes
+// call it.
+#define BLOK_OP_LIST(X) \
+    X(GETATTR, getattr) \
+    X(READLINK, readlink) \
+    X(MKNOD, mknod) \
+    X(MKDIR, mkdir) \
+    X(UNLINK, unlink) \
+    X(RMDIR, rmdir) \
+    X(SYMLINK, symlink) \
+    X(RENAME, rename) \
+    X(LINK, link) \
+    X(CHMOD, chmod) \
+    X(CHOWN, chown) \
+    X(TRUNCATE, truncate) \
+    X(UTIME, utime) \
+    X(OPEN, open) \
+    X(READ, read) \
+    X(WRITE, write) \
+    X(STATFS, statfs) \
+    X(FLUSH, flush) \
+    X(RELEASE, release) \
+    X(FSYNC, fsync) \
+    X(SETXATTR, setxattr) \
+    X(GETXATTR, getxattr) \
+    X(LISTXATTR, listxattr) \
+    X(REMOVEXATTR, removexattr) \
+    X(OPENDIR, opendir) \
+    X(READDIR, readdir) \
+    X(RELEASEDIR, releasedir) \
+    X(FSYNCDIR, fsyncdir) \
+    X(ACCESS, access) \
+    X(FTRUNCATE, ftruncate) \
+    X(FGETATTR, fgetattr)
+
+enum blok_op {
+#define BLOK_OP_ENUM(NAME, name) BLOK_OP_##NAME,
+    BLOK_OP_LIST(BLOK_OP_ENUM)
+#undef BLOK_OP_ENUM
+    BLOK_OP_MAX
+};
+
+const char *blok_op_name(enum blok_op op);
+// Symbolic name of a positive errno value ("ENOENT"), NULL for one blok has no name for.
+const char *blok_errno_name(int err);
+
+// A single traced call.  newpath is only set for rename and link, where it names the destination; path and id
+// then describe the object being renamed or linked, so analyses can fold both names onto one file.  id is zero where
+// the call has no file identity at hand.  ts is the CLOCK_MONOTONIC start of the call and dur its duration, both in
+// nanoseconds; result is what the callback returned.  cgroup and job identify the caller's cgroup and job with
+// -o cgroups and -o jobs, and are 0 otherwise.
+struct blok_event {
+    enum blok_op op;
+    const char *path;
+    const char *newpath;
+    struct blok_fileid id;
+    int64_t offset;
+    uint64_t size;
+    uint64_t ts;
+    uint64_t dur;
+    int32_t pid;
+    int32_t tid;
+    uint64_t cgroup;
+    int32_t job;
+    int64_t result;
+};
+
+// Operations that are logged, one bit per op.  Reads, renames and links by default; -o trace=LIST picks others.
+extern uint64_t blok_trace_mask;
+
+static inline int blok_event_traced(enum blok_op op)
+{
+    return (blok_trace_mask >> op) & 1;
+}
+
+// Parses a comma-separated list of operation names, or "all", into a trace mask.  -1 for an unknown name.
+int blok_event_parse_mask(const char *list, uint64_t *mask);
+
+// Longest possible formatted record: two fully escaped paths plus the fixed keys and numbers.
+#define BLOK_EVENT_MAX_LEN (2 * BLOK_JSON_STRING_MAX(PATH_MAX) + 512)
+
+size_t blok_event_format(char *buf, const struct blok_event *ev);
+void blok_event_log(const struct blok_event *ev);
+void blok_event_log_op(struct blok_event *ev, int result, uint64_t dur);
+// Phase markers, see marker.h; seq is the phase's number.
+void blok_event_log_marker(const char *name, size_t len, uint64_t ts, int pid, uint64_t seq);
+// Written whenever the log is opened, so that tools can put the records of several mounts on one clock.
+void blok_event_log_header(FILE *log, const char *rootdir, const char *mountpoint);
+
+#endif
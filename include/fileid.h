@@ -0,0 +1,30 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _FILEID_H_
+#define _FILEID_H_
+
+#include <stdint.h>
+
+// Identity of a backing file which, unlike the FUSE path, survives renames and is shared by all hardlinks.  The
+// (dev, ino) pair names the object; gen tells apart objects that reuse a freed inode number.  gen is 0 when the
+// backing file system doesn't expose inode generations.
+struct blok_fileid {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+};
+
+int blok_fileid_from_fd(int fd, struct blok_fileid *id);
+int blok_fileid_from_path(const char *fpath, struct blok_fileid *id);
+
+static inline int blok_fileid_equal(const struct blok_fileid *a, const struct blok_fileid *b)
+{
+    return a->ino == b->ino && a->dev == b->dev && a->gen == b->gen;
+}
+
+#endif
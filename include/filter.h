@@ -0,0 +1,77 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+// Event filters (-o filter=EXPR): only calls matching EXPR are logged and kept by the flight recorder, e.g.
+//
+//     op==read && size<4K && pid.comm=="python"
+//     offset>1G && latency>5ms || errno==EIO
+//
+// Comparisons are FIELD OP VALUE, combined with &&, || and ! and grouped with parentheses.  Numeric fields are op,
+// pid, tid, job, cgroup, offset, size, result, errno (0 for calls that succeeded) and latency, compared with ==, !=,
+// <, <=, > or >=; numbers take K, M, G and T (powers of 1024) or ns, us, ms and s suffixes.  op is compared to an
+// operation name and errno also to a name like ENOENT.  The string fields path, newpath and pid.comm only take == and
+// !=, against a quoted or bare fnmatch() glob, '*' crossing directories.
+//
+// The expression is compiled once into a short program for a single accumulator machine: each comparison sets the
+// accumulator, && and || jump over the rest of their operands once it is decided, ! negates it.  Before the program is
+// used it is verified: every jump goes forward and stays inside it, every field, comparison and string is in range
+// and it ends in a return, so evaluating it touches nothing else and takes at most one step per instruction.
+#define BLOK_FILTER_MAX_INSNS 256
+
+enum blok_filter_code {
+    BLOK_FILTER_CMP,            // acc = field CMP imm
+    BLOK_FILTER_MATCH,          // acc = field matches strings[imm], or doesn't for BLOK_FILTER_NE
+    BLOK_FILTER_JT,             // to imm if acc
+    BLOK_FILTER_JF,             // to imm unless acc
+    BLOK_FILTER_NOT,
+    BLOK_FILTER_RET,            // acc
+    BLOK_FILTER_CODE_MAX
+};
+
+enum blok_filter_cmp {
+    BLOK_FILTER_EQ,
+    BLOK_FILTER_NE,
+    BLOK_FILTER_LT,
+    BLOK_FILTER_LE,
+    BLOK_FILTER_GT,
+    BLOK_FILTER_GE,
+    BLOK_FILTER_CMP_MAX
+};
+
+struct blok_filter_insn {
+    uint8_t code;
+    uint8_t field;
+    uint8_t cmp;
+    int64_t imm;
+};
+
+struct blok_filter {
+    char **strings;
+    size_t nstrings;
+    size_t len;
+    struct blok_filter_insn code[];
+};
+
+// The filter of -o filter, NULL to record every call.
+extern struct blok_filter *blok_filter;
+
+// Compiles and verifies expr.  On errors returns NULL with a message naming the column in err.
+struct blok_filter *blok_filter_compile(const char *expr, char *err, size_t errlen);
+// 0 for a well-formed program, -1 otherwise; blok_filter_compile() only returns programs that pass.
+int blok_filter_verify(const struct blok_filter *filter);
+// Whether the completed call ev (with its pid, result and duration filled in) matches.
+int blok_filter_match(const struct blok_filter *filter, const struct blok_event *ev);
+void blok_filter_free(struct blok_filter *filter);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "event.h"
+
+// Flight recorder (-o flight=SIZE): every call, traced or not, is formatted as a log record into a ring of SIZE
+// bytes in its thread's counter shard, and nothing is written to disk until a trigger fires:
+//
+//  - SIGUSR1, or 'dump' written to /.blok/control,
+//  - a call taking longer than -o flight_latency=MS,
+//  - more than -o flight_errors=N failed calls in a second,
+//  - process -o flight_pid=PID opening a file.
+//
+// A dumper thread then waits a second, so the dump also shows what followed, and writes the rings, merged by start
+// time and cut to the last -o flight_window=SECS, to blok-flight.TIME.N.log in -o flight_dir (the directory blok was
+// started from by default).  The dump is a blok log: a header record, a {"trigger":...} record and the calls.
+// Triggers within ten seconds of the last dump are only counted.
+//
+// Only the owning thread writes a ring.  Like a seqlock, it publishes where the record it is about to copy in ends
+// before copying and how far it has written after, and the dumper drops exactly what the writer may have overwritten
+// while it was being copied.  Rings are at least BLOK_EVENT_MAX_LEN, so every record fits.
+struct blok_flight_ring {
+    uint64_t head;              // bytes ever written
+    uint64_t reserved;          // end of the record being written, head between records
+    uint64_t size;
+    char data[];
+};
+
+struct blok_flight_config {
+    uint64_t ring_size;
+    unsigned int window;
+    unsigned int latency_ms;
+    unsigned int errors;
+    int pid;
+    const char *dir;
+    const char *rootdir;
+    const char *mountpoint;
+};
+
+extern int blok_flight_enabled;
+
+int blok_flight_open(const struct blok_flight_config *config);
+// Starts the dumper and installs the SIGUSR1 handler; like the rollup writer, after fuse_main() has daemonized.
+int blok_flight_start(void);
+void blok_flight_close(void);
+// Appends a formatted record of ev to the calling thread's ring and checks the per-call triggers.
+void blok_flight_record(const struct blok_event *ev, const char *rec, size_t len);
+// Asks for a dump; reason is a static string.  Safe to call from a signal handler.
+void blok_flight_trigger(const char *reason, int pid);
+void blok_flight_stats(FILE *out);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _HANDLE_H_
+#define _HANDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fileid.h"
+#include "intern.h"
+
+// Per-open state kept in fuse_file_info->fh.  The file identity and the interned path are captured once at open, so
+// the read path never has to stat the backing file.  path is NULL if the path couldn't be interned.  Handles come
+// from a slab, so opening a file doesn't go to malloc in steady state.
+//
+// Files under the control directory have no backing file (fd is -1); ctl says which one it is, and the content of
+// readable ones is rendered into buf when they are opened.
+struct blok_handle {
+    int fd;
+    struct blok_fileid id;
+    const struct blok_path *path;
+    int ctl;
+    char *buf;
+    size_t len;
+};
+
+#define BLOK_HANDLE(fi) ((struct blok_handle *) (uintptr_t) (fi)->fh)
+
+void blok_handle_init(void);
+struct blok_handle *blok_handle_new(int fd);
+void blok_handle_free(struct blok_handle *handle);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _HEAT_H_
+#define _HEAT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "fileid.h"
+
+// Per-block access counts, keyed by file identity and block number.  reads makes up the heat map; a non-zero writes
+// marks the block as changed (changed block tracking).  The table is a fixed-size open-addressed hash living in the
+// memory-mapped state file, so entries are inserted lock-free; only compaction moves them.
+//
+// tag is claimed with a CAS before the key is written; ready is published last.  A slot whose tag is set but ready
+// isn't was being inserted when blok died and is turned into a tombstone when the table is loaded again.
+struct blok_heat_entry {
+    uint64_t tag;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    uint32_t ready;
+    uint64_t block;
+    uint64_t reads;
+    uint64_t writes;
+};
+
+// Once this share of the slots is taken the table is compacted: blocks are coarsened, and if that doesn't free
+// enough, the coldest entries are evicted.  Compaction holds 'resize' exclusively, recording holds it shared.
+#define BLOK_HEAT_HIGH_WATER(capacity) ((capacity) / 8 * 7)
+#define BLOK_HEAT_MAX_SHIFT 30
+
+struct blok_state_header;
+
+// The table's size, block size and counters are kept in the state file header.
+struct blok_heat {
+    struct blok_heat_entry *entries;
+    struct blok_state_header *header;
+    uint32_t block_shift;
+    int pressure;
+    pthread_rwlock_t resize;
+};
+
+void blok_heat_attach(struct blok_heat *heat, struct blok_heat_entry *entries, struct blok_state_header *header);
+void blok_heat_detach(struct blok_heat *heat);
+uint64_t blok_heat_recover(struct blok_heat *heat);
+void blok_heat_record(struct blok_heat *heat, const struct blok_fileid *id, uint64_t offset, uint64_t size, int write);
+int blok_heat_under_pressure(struct blok_heat *heat);
+void blok_heat_relieve(struct blok_heat *heat);
+
+#endif
@@ -0,0 +1,28 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+#include <stdint.h>
+
+// FUSE paths interned for the lifetime of the mount.  Every distinct path is stored once, in an arena, and gets a
+// small dense id; the returned pointer stays valid until blok_intern_destroy().  Once the memory budget refuses more
+// room, new paths are no longer interned and blok_intern() returns NULL.
+struct blok_path {
+    uint64_t hash;
+    uint32_t id;
+    uint32_t len;
+    char str[];
+};
+
+void blok_intern_init(void);
+void blok_intern_destroy(void);
+const struct blok_path *blok_intern(const char *path);
+uint64_t blok_intern_count(void);
+
+#endif
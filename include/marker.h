@@ -0,0 +1,35 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _MARKER_H_
+#define _MARKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Application phase markers.  A process marks the start of a phase ("load model", "epoch 3") by writing
+// 'marker NAME' to /.blok/control or by setting the user.blok.marker xattr on any file of the mount to NAME.  Either
+// way a record goes to the log, in line with the calls around it:
+//
+//     {"marker":"epoch 3","ts":81234567890,"pid":311,"tid":312,"phase":4}
+//
+// and a new phase begins.  A phase's counters are the difference between the operation totals at its marker and at
+// the next one, so they cost the callbacks nothing; the last BLOK_PHASE_MAX phases are kept for the statistics.
+#define BLOK_MARKER_XATTR "user.blok.marker"
+#define BLOK_MARKER_MAX 256
+#define BLOK_PHASE_MAX 16
+
+struct fs_state;
+
+// Starts a phase named by the len bytes at name, for pid.  -EINVAL for an empty name, one with a newline or NUL, or
+// one longer than BLOK_MARKER_MAX.
+int blok_marker_set(const char *name, size_t len, int pid);
+// Writes the phase.* lines of the statistics.
+void blok_marker_stats(FILE *out);
+
+#endif
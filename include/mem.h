@@ -0,0 +1,47 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stdint.h>
+
+// Accounting of the memory held by blok's own tracking structures against a global budget.  Subsystems charge what
+// they allocate and uncharge what they free.  Optional allocations use blok_mem_charge(), which may refuse them once
+// the budget is exhausted and shrinkers can't make room; allocations blok can't work without use blok_mem_charge_force(),
+// which never fails but still shows up in the numbers.
+//
+// Shrinkers only give up what nothing points into: the flight recorder rings and process caches of threads that have
+// exited.  Interned paths are referenced for the whole mount and the tables are sized once, so they are not shrunk.
+enum blok_mem_subsys {
+    BLOK_MEM_HANDLES,
+    BLOK_MEM_HEAT,
+    BLOK_MEM_STATS,
+    BLOK_MEM_PATHS,
+    BLOK_MEM_FLIGHT,
+    BLOK_MEM_SHARING,
+    BLOK_MEM_REUSE,
+    BLOK_MEM_MAX
+};
+
+// Asked to release about 'want' bytes; returns how much was actually released (and uncharged).
+typedef uint64_t (*blok_mem_shrinker)(void *arg, uint64_t want);
+
+void blok_mem_init(uint64_t budget);
+void blok_mem_register_shrinker(enum blok_mem_subsys subsys, blok_mem_shrinker shrink, void *arg);
+
+int blok_mem_charge(enum blok_mem_subsys subsys, uint64_t bytes);
+void blok_mem_charge_force(enum blok_mem_subsys subsys, uint64_t bytes);
+void blok_mem_uncharge(enum blok_mem_subsys subsys, uint64_t bytes);
+
+const char *blok_mem_name(enum blok_mem_subsys subsys);
+uint64_t blok_mem_budget(void);
+uint64_t blok_mem_total(void);
+uint64_t blok_mem_usage(enum blok_mem_subsys subsys);
+uint64_t blok_mem_refused(enum blok_mem_subsys subsys);
+
+#endif
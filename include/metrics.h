@@ -0,0 +1,35 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "params.h"
+#include <pthread.h>
+
+// OpenMetrics endpoint: a thread answers 'GET /metrics' on a loopback TCP port or a Unix socket with the per-operation
+// counters, latency histograms and memory usage, summed from the thread shards like the .blok/stats file.  Labels
+// are bounded: per operation, per operation and errno, and the top files of the hot file sketch.
+//
+// The socket is bound by blok_metrics_open() before fuse_main(), so a busy address fails the mount; the thread is
+// started in blok_init, after daemonizing.  Connections are served one at a time.
+struct blok_metrics {
+    struct fs_state *blok_data;
+    int listen_fd;
+    int stop[2];
+    char *unix_path;
+    int running;
+    pthread_t server;
+};
+
+// addr is "PORT" or "HOST:PORT" (default host 127.0.0.1), or "unix:PATH".
+struct blok_metrics *blok_metrics_open(struct fs_state *blok_data, const char *addr);
+int blok_metrics_start(struct blok_metrics *metrics);
+void blok_metrics_close(struct blok_metrics *metrics);
+char *blok_metrics_render(struct fs_state *blok_data, size_t *len);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _NDJSON_H_
+#define _NDJSON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Building blocks for writing JSON without stdio.  Each writes at p and returns the end of what it wrote; the caller
+// makes sure there is room.  A string needs at most 6 * len + 2 bytes, a number at most 20.
+#define BLOK_JSON_STRING_MAX(len) (6 * (len) + 2)
+
+char *blok_json_u64(char *p, uint64_t v);
+char *blok_json_i64(char *p, int64_t v);
+char *blok_json_string(char *p, const char *s, size_t len);
+
+static inline char *blok_json_raw(char *p, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        p[i] = s[i];
+    }
+    return p + len;
+}
+
+// Appends a literal, typically a key with its punctuation: p = BLOK_JSON_LIT(p, ",\"size\":");
+#define BLOK_JSON_LIT(p, lit) blok_json_raw(p, lit, sizeof(lit) - 1)
+
+#endif
@@ -27,6 +27,34 @@
 struct fs_state {
     FILE *logfile;
     char *rootdir;
+
+    // set from the command line, see blok_opts in blokfs.c
+    char *state_path;
+    int no_state;
+    unsigned long heat_block;
+    unsigned long heat_entries;
+    unsigned int checkpoint_interval;
+    char *mem_budget_arg;
+    unsigned int rollup_interval;
+    int rollup_overhead;
+    int perf;
+    char *trace_arg;
+    char *filter_arg;
+    char *metrics_arg;
+    int cgroups;
+    char *jobs_arg;
+    char *sharing_arg;
+    char *reuse_arg;
+    char *flight_arg;
+    unsigned int flight_window;
+    unsigned int flight_latency;
+    unsigned int flight_errors;
+    int flight_pid;
+    char *flight_dir;
+
+    struct blok_state *state;
+    struct blok_rollup *rollup;
+    struct blok_metrics *metrics;
 };
 #define BLOK_DATA ((struct fs_state *) fuse_get_context()->private_data)
 
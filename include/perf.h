@@ -0,0 +1,34 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include <stdint.h>
+
+// Hardware performance counters per operation (-o perf).  Each FUSE thread opens its own perf_event group the first
+// time it needs it, counting this thread in user space only, so the numbers are blok's code and not the kernel's
+// share of the backing syscalls.  Where the kernel allows it the counters are read with rdpmc from the group's
+// mapped pages, otherwise with one read() of the whole group.
+enum blok_pmu {
+    BLOK_PMU_CYCLES,
+    BLOK_PMU_INSTRUCTIONS,
+    BLOK_PMU_CACHE_MISSES,
+    BLOK_PMU_BRANCH_MISSES,
+    BLOK_PMU_MAX
+};
+
+extern int blok_perf_enabled;
+
+// Checks that perf_event_open() is permitted and turns the counters on; -errno if it isn't.
+int blok_perf_init(void);
+// Reads this thread's counters, opening them on first use.  -1 if the thread has none, in which case the operation
+// just isn't sampled.
+int blok_perf_read(uint64_t values[BLOK_PMU_MAX]);
+const char *blok_pmu_name(enum blok_pmu pmu);
+
+#endif
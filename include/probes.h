@@ -0,0 +1,65 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <stdint.h>
+#include "event.h"
+
+// USDT probes for external tracers (SystemTap, bpftrace, perf).  Every blok_oper callback fires provider 'blok',
+// probes '<op>__entry' with (path, offset, size, fd) and '<op>__return' with (path, offset, size, fd, result,
+// duration in ns); fd is -1 and offset and size 0 where the operation has none.  A probe site is a single nop plus
+// an ELF note, so nothing is paid until a tracer attaches.  Without <sys/sdt.h> the probes compile to nothing.
+//
+// The probe name has to be a literal at the site, so the switch below holds one site per operation; every caller
+// passes a constant op, which leaves only the matching site once blok_op_begin() / blok_op_end() are inlined.
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+static inline void blok_probe_entry(enum blok_op op, const char *path, int64_t offset, uint64_t size, int fd)
+{
+    switch (op) {
+#define BLOK_PROBE_ENTRY(NAME, name) \
+    case BLOK_OP_##NAME: STAP_PROBE4(blok, name##__entry, path, offset, size, fd); break;
+    BLOK_OP_LIST(BLOK_PROBE_ENTRY)
+#undef BLOK_PROBE_ENTRY
+    default:
+        break;
+    }
+}
+
+static inline void blok_probe_return(enum blok_op op, const char *path, int64_t offset, uint64_t size, int fd,
+                                     int result, uint64_t duration)
+{
+    switch (op) {
+#define BLOK_PROBE_RETURN(NAME, name) \
+    case BLOK_OP_##NAME: STAP_PROBE6(blok, name##__return, path, offset, size, fd, result, duration); break;
+    BLOK_OP_LIST(BLOK_PROBE_RETURN)
+#undef BLOK_PROBE_RETURN
+    default:
+        break;
+    }
+}
+
+#else
+
+static inline void blok_probe_entry(enum blok_op op, const char *path, int64_t offset, uint64_t size, int fd)
+{
+    (void) op; (void) path; (void) offset; (void) size; (void) fd;
+}
+
+static inline void blok_probe_return(enum blok_op op, const char *path, int64_t offset, uint64_t size, int fd,
+                                     int result, uint64_t duration)
+{
+    (void) op; (void) path; (void) offset; (void) size; (void) fd; (void) result; (void) duration;
+}
+
+#endif
+
+#endif
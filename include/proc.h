@@ -0,0 +1,76 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _PROC_H_
+#define _PROC_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "event.h"
+
+// What blok knows about a calling process beyond its pid, for -o cgroups and -o jobs: its cgroup (see cgroup.h) and
+// the job it belongs to.
+//
+// A job is a session (-o jobs=sid), a process group (-o jobs=pgid) or the nearest ancestor whose command name is NAME
+// (-o jobs=exe:NAME), falling back to the session when there is none; the job ID is the sid, pgid or ancestor pid.
+// Batch jobs run many short-lived processes, which this folds into one.
+//
+// Every thread caches processes in a direct-mapped table of BLOK_PROC_CACHE entries in its counter shard.  An entry
+// is trusted for a second; after that /proc/PID/stat is read again, which also refreshes the session and process
+// group, and only a different start time, a reused pid, makes the cgroup and ancestors be resolved anew.  A pid reused
+// within that second, or a process moved to another cgroup, is attributed as before until then.
+#define BLOK_PROC_CACHE 256
+
+enum blok_job_mode {
+    BLOK_JOB_NONE,
+    BLOK_JOB_SID,
+    BLOK_JOB_PGID,
+    BLOK_JOB_EXE
+};
+
+struct blok_proc {
+    int32_t pid;                // 0 for an unused entry
+    int32_t job;
+    uint32_t cgroup;            // slot in the cgroup table
+    char comm[16];              // command name, as of the last validation
+    uint64_t starttime;         // in clock ticks since boot, from /proc/PID/stat
+    uint64_t checked;           // blok_now_ns() of the last validation
+};
+
+// The fields of /proc/PID/stat blok uses.
+struct blok_proc_stat {
+    char comm[16];
+    int ppid;
+    int pgrp;
+    int session;
+    uint64_t starttime;
+};
+
+struct blok_proc_cache {
+    struct blok_proc entries[BLOK_PROC_CACHE];
+};
+
+extern enum blok_job_mode blok_job_mode;
+// Set when calls are attributed to cgroups or jobs.
+extern int blok_proc_enabled;
+
+// Parses the -o jobs argument, "sid", "pgid" or "exe:NAME", and turns jobs on.  -1 for anything else.
+int blok_job_parse(const char *arg);
+// Reads /proc/PID/FILE into buf, terminated; its length, or -1.
+ssize_t blok_proc_read(int pid, const char *file, char *buf, size_t size);
+// Parses the contents of /proc/PID/stat; -1 if they are malformed.
+int blok_proc_parse_stat(const char *buf, struct blok_proc_stat *st);
+// The calling thread's cache entry for pid, resolved or revalidated as needed; an all-zero entry for pid 0 or a
+// process that is gone.
+const struct blok_proc *blok_proc_lookup(int pid);
+// Memory shrinker for BLOK_MEM_STATS: frees the process caches of threads that have exited, which a thread taking
+// over their shard rebuilds as it goes.
+uint64_t blok_proc_shrink(void *arg, uint64_t want);
+// Fills in the event's cgroup and job for the calling process and counts its reads and writes per cgroup.
+void blok_proc_account(struct blok_event *ev, int result, uint64_t elapsed);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _REUSE_H_
+#define _REUSE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "counters.h"
+#include "fileid.h"
+#include "intern.h"
+
+// Reuse times (-o reuse=RANGE): for every read or write of a RANGE-sized range of a file, how long ago the range was
+// last accessed, in log2 buckets of microseconds per file.  Ranges reused within seconds are what a cache is for;
+// ranges never seen again, streaming, are better kept out of it.
+//
+// The last access times live in a table of BLOK_REUSE_SLOTS 64-bit words, a fingerprint of the range and the time in
+// microseconds since the mount packed into one, so they are updated with a single compare-and-swap.  The table is
+// 8-way set associative, a set being a cache line; a range that finds its set full replaces the least recently used
+// one, whose next access then counts as a first one.  Fingerprint collisions make about one access in 10^5 a false
+// reuse.  Files get their histograms from a second table inserted into lock-free like the heat map; accesses of files
+// that don't fit any more are counted together.
+#define BLOK_REUSE_SLOTS (1UL << 20)
+#define BLOK_REUSE_FILES 4096
+
+struct blok_reuse_file {
+    uint64_t tag;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    uint32_t ready;
+    const struct blok_path *path;       // as first accessed, NULL if it couldn't be interned
+    uint64_t first;                     // accesses of ranges not seen before (or no longer remembered)
+    uint64_t hist[BLOK_HIST_BUCKETS];   // reuses by time since the last access, bucket b below 2^b microseconds
+};
+
+extern int blok_reuse_enabled;
+
+// range_size is a power of two.  The tables get at most a quarter of the memory budget.
+int blok_reuse_open(uint64_t range_size);
+void blok_reuse_close(void);
+// Counts an access of [offset, offset + size).
+void blok_reuse_record(const struct blok_fileid *id, const struct blok_path *path, uint64_t offset, uint64_t size);
+void blok_reuse_stats(FILE *out);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <pthread.h>
+#include <stdio.h>
+#include "counters.h"
+
+// Periodic rollups: every interval one record per active operation goes to the log, with the counts and latency
+// percentiles of that interval, and optionally the split between blok's own time and the backing syscalls:
+//
+//     {"rollup":"read","ts":1700000000,"interval":10,"ops":N,"bytes":N,"errors":N,"latency_p50":N,"latency_p99":N}
+//
+// The 'rollup' key comes first, so readers can tell these records from operation records by it.
+struct blok_rollup {
+    FILE *log;
+    unsigned int interval;
+    int overhead;
+    struct blok_counters prev;
+    int running;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+struct blok_rollup *blok_rollup_open(FILE *log, unsigned int interval, int overhead);
+int blok_rollup_start(struct blok_rollup *rollup);
+void blok_rollup_close(struct blok_rollup *rollup);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _SHARE_H_
+#define _SHARE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "fileid.h"
+#include "intern.h"
+
+// Block sharing analysis (-o sharing=RANGE): how many distinct readers, processes or with -o jobs jobs, read each
+// RANGE-sized range of each file, to tell whether a cache shared between them would be hit.
+//
+// The first BLOK_SHARE_EXACT readers seen get a bit each, and a range records them exactly in its mask; every later
+// reader goes into a small HyperLogLog of BLOK_SHARE_HLL registers, about 13% error, so a range's degree is the
+// mask's population count plus the estimate.  Both are updated with atomics only, and per file they merge by OR and
+// register-wise max.  Ranges live in a fixed open-addressed table inserted into lock-free like the heat map; reads of
+// ranges that don't fit any more are only counted.
+#define BLOK_SHARE_EXACT 64
+#define BLOK_SHARE_HLL 64
+#define BLOK_SHARE_ENTRIES (1UL << 16)
+
+struct blok_share_entry {
+    uint64_t tag;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    uint32_t ready;
+    uint64_t range;
+    const struct blok_path *path;       // as first read, NULL if it couldn't be interned
+    uint64_t reads;
+    uint64_t mask;
+    uint8_t hll[BLOK_SHARE_HLL];
+};
+
+extern int blok_share_enabled;
+
+// range_size is a power of two.  The table gets at most a quarter of the memory budget.
+int blok_share_open(uint64_t range_size);
+void blok_share_close(void);
+// Counts a read of [offset, offset + size) by the calling process.
+void blok_share_record(const struct blok_fileid *id, const struct blok_path *path, uint64_t offset, uint64_t size);
+void blok_share_stats(FILE *out);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "event.h"
+#include "heat.h"
+
+// Persistent state, kept in a file that is mapped MAP_SHARED for the lifetime of the mount.  Heat map updates go
+// straight into the mapping, so the page cache always holds the latest state and a crash of blok loses nothing.  The
+// op counters are sharded in memory (see counters.h) and folded into the mapping every second.  The checkpoint thread
+// bounds what a crash of the whole machine can lose.
+//
+// The layout is versioned.  Counter arrays are sized for BLOK_STATE_MAX_OPS so new ops can be added to enum blok_op
+// without changing it.
+#define BLOK_STATE_MAGIC 0x31544154534b4f42ULL // "BOKSTAT1"
+#define BLOK_STATE_VERSION 1
+#define BLOK_STATE_MAX_OPS 64
+#define BLOK_STATE_HEADER_SIZE 4096
+
+struct blok_state_counters {
+    uint64_t ops[BLOK_STATE_MAX_OPS];
+    uint64_t bytes[BLOK_STATE_MAX_OPS];
+    uint64_t errors[BLOK_STATE_MAX_OPS];
+};
+
+struct blok_state_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+    uint64_t created;
+    uint64_t mounts;
+    uint32_t clean;
+    uint32_t heat_block_shift;
+    uint64_t heat_capacity;
+    uint64_t heat_used;
+    uint64_t heat_dropped;
+    struct blok_state_counters counters;
+
+    // heat map compaction, see heat.c; zero in files written before it existed
+    uint64_t heat_evicted;
+    uint64_t heat_coarsened;
+    uint32_t heat_target_shift;
+    uint32_t heat_compacting;
+};
+
+struct blok_state {
+    int fd;
+    void *map;
+    uint64_t size;
+    struct blok_state_header *header;
+    struct blok_heat heat;
+    struct blok_state_counters base;
+    unsigned int checkpoint_interval;
+    int running;
+    pthread_t checkpointer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+struct blok_state *blok_state_open(const char *path, uint64_t heat_entries, uint32_t heat_block_shift,
+                                   unsigned int checkpoint_interval);
+int blok_state_start(struct blok_state *state);
+void blok_state_close(struct blok_state *state);
+void blok_state_fold_counters(struct blok_state *state);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+
+struct fs_state;
+
+// Renders the statistics as "name value" lines.  Returns a malloc()ed buffer charged to BLOK_MEM_STATS, even over
+// budget, or NULL.
+char *blok_stats_render(struct fs_state *blok_data, size_t *len);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _TOP_H_
+#define _TOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "intern.h"
+
+// The hottest files, directories, processes and, with -o jobs, jobs by reads and writes, for /.blok/top.  Every thread keeps a
+// space-saving sketch of BLOK_TOP_K entries per kind in its counter shard: a key that isn't tracked takes over the
+// entry with the fewest ops and inherits its counts, so counts are overestimates by at most 'error' and every key
+// with more than 1/K of the thread's calls is tracked.
+//
+// Only the owning thread writes a sketch.  Counting a tracked key is two relaxed stores; replacing an entry is
+// bracketed by the sketch's sequence number (odd while it changes), so the renderer can copy a sketch without
+// stopping the thread and retry a copy that a replacement tore.
+#define BLOK_TOP_K 32
+
+enum blok_top_kind {
+    BLOK_TOP_FILE,
+    BLOK_TOP_DIR,
+    BLOK_TOP_PID,
+    BLOK_TOP_JOB,
+    BLOK_TOP_MAX
+};
+
+struct blok_top_entry {
+    uint64_t key;               // 0 for an unused entry
+    const struct blok_path *path;
+    uint32_t len;               // of the directory prefix of path
+    int32_t pid;                // or job ID
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t error;
+};
+
+struct blok_top_sketch {
+    uint64_t seq;
+    struct blok_top_entry entries[BLOK_TOP_K];
+};
+
+struct blok_top {
+    struct blok_top_sketch sketch[BLOK_TOP_MAX];
+};
+
+struct fs_state;
+
+// Counts a read or write of 'bytes' through an open file; path may be NULL if it couldn't be interned.
+void blok_top_record(const struct blok_path *path, int pid, uint64_t bytes);
+// Merges the sketches of all threads for one kind into a malloc()ed array sorted by ops, descending; returns its
+// length.  Entries of the same key are summed, errors included.
+size_t blok_top_collect(enum blok_top_kind kind, struct blok_top_entry **out);
+const char *blok_top_kind_name(enum blok_top_kind kind);
+// Renders the merged sketches, one entry per line: kind, ops, bytes, error and the file (a JSON string), pid or
+// job ID.
+char *blok_top_render(struct fs_state *blok_data, size_t *len);
+
+#endif
@@ -0,0 +1,291 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#include "../include/alloc.h"
+#include <stdlib.h>
+
+#define BLOK_ARENA_MAX 8
+
+// Objects per malloc() when a slab runs dry, and how many a thread cache holds before half of them go back to the
+// shared list.
+#define SLAB_CHUNK_OBJECTS 64
+#define SLAB_CACHE_MAX 64
+
+struct blok_arena_chunk {
+    struct blok_arena_chunk *next;
+    char data[];
+};
+
+struct slab_object {
+    struct slab_object *next;
+};
+
+// allocs and frees are counted here, without atomics, and folded into the slab whenever the cache exchanges objects
+// with the shared list, so the slab's counters lag by at most a cache's worth per thread.
+struct slab_cache {
+    struct slab_object *head;
+    unsigned int count;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+static void slab_fold(struct blok_slab *slab, struct slab_cache *cache)
+{
+    slab->allocs += cache->allocs;
+    slab->frees += cache->frees;
+    cache->allocs = 0;
+    cache->frees = 0;
+}
+
+static struct {
+    pthread_mutex_t lock;
+    struct blok_slab *slabs[BLOK_SLAB_MAX];
+    int nslabs;
+    struct blok_arena *arenas[BLOK_ARENA_MAX];
+    int narenas;
+    pthread_key_t thread_exit;
+    int key_created;
+} registry = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct slab_cache caches[BLOK_SLAB_MAX];
+static __thread int cache_registered;
+
+void blok_arena_init(struct blok_arena *arena, const char *name, enum blok_mem_subsys subsys, size_t chunk_size)
+{
+    arena->name = name;
+    arena->subsys = subsys;
+    arena->chunk_size = chunk_size;
+    arena->chunks = NULL;
+    arena->cur = NULL;
+    arena->left = 0;
+    arena->nchunks = 0;
+    arena->reserved = 0;
+    arena->allocated = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    if (registry.narenas < BLOK_ARENA_MAX) {
+        registry.arenas[registry.narenas++] = arena;
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+// Returns NULL when malloc fails or the memory budget refuses another chunk.
+void *blok_arena_alloc(struct blok_arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t) 7;
+    if (size > arena->left) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        if (blok_mem_charge(arena->subsys, sizeof(struct blok_arena_chunk) + chunk_size) < 0) {
+            return NULL;
+        }
+        struct blok_arena_chunk *chunk = malloc(sizeof(struct blok_arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            blok_mem_uncharge(arena->subsys, sizeof(struct blok_arena_chunk) + chunk_size);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->cur = chunk->data;
+        arena->left = chunk_size;
+        arena->nchunks++;
+        arena->reserved += sizeof(struct blok_arena_chunk) + chunk_size;
+    }
+    void *p = arena->cur;
+    arena->cur += size;
+    arena->left -= size;
+    arena->allocated += size;
+    return p;
+}
+
+void blok_arena_destroy(struct blok_arena *arena)
+{
+    while (arena->chunks != NULL) {
+        struct blok_arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    blok_mem_uncharge(arena->subsys, arena->reserved);
+    arena->reserved = 0;
+    arena->nchunks = 0;
+    arena->cur = NULL;
+    arena->left = 0;
+}
+
+// Hands a thread's cached objects back to the shared lists when the thread exits, so FUSE's short-lived worker
+// threads don't strand them.
+static void slab_thread_exit(void *arg)
+{
+    pthread_mutex_lock(&registry.lock);
+    int nslabs = registry.nslabs;
+    pthread_mutex_unlock(&registry.lock);
+
+    for (int i = 0; i < nslabs; i++) {
+        struct slab_cache *cache = &caches[i];
+        struct blok_slab *slab = registry.slabs[i];
+        pthread_mutex_lock(&slab->lock);
+        slab_fold(slab, cache);
+        if (cache->head != NULL) {
+            struct slab_object *tail = cache->head;
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+            tail->next = slab->free;
+            slab->free = cache->head;
+            slab->nfree += cache->count;
+        }
+        pthread_mutex_unlock(&slab->lock);
+        cache->head = NULL;
+        cache->count = 0;
+    }
+}
+
+void blok_slab_init(struct blok_slab *slab, const char *name, enum blok_mem_subsys subsys, size_t size)
+{
+    slab->name = name;
+    slab->subsys = subsys;
+    slab->size = size < sizeof(struct slab_object) ? sizeof(struct slab_object) : (size + 15) & ~(size_t) 15;
+    slab->free = NULL;
+    slab->nfree = 0;
+    slab->chunks = 0;
+    slab->objects = 0;
+    slab->allocs = 0;
+    slab->frees = 0;
+    slab->refills = 0;
+    pthread_mutex_init(&slab->lock, NULL);
+
+    pthread_mutex_lock(&registry.lock);
+    if (!registry.key_created) {
+        pthread_key_create(&registry.thread_exit, slab_thread_exit);
+        registry.key_created = 1;
+    }
+    slab->index = registry.nslabs < BLOK_SLAB_MAX ? registry.nslabs++ : -1;
+    if (slab->index >= 0) {
+        registry.slabs[slab->index] = slab;
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+// Carves a fresh chunk into objects.  Called with slab->lock held.  Slab memory is what keeps blok working (handles),
+// so it is always charged.
+static int slab_grow(struct blok_slab *slab)
+{
+    char *chunk = malloc(slab->size * SLAB_CHUNK_OBJECTS);
+    if (chunk == NULL) {
+        return -1;
+    }
+    blok_mem_charge_force(slab->subsys, slab->size * SLAB_CHUNK_OBJECTS);
+    for (int i = 0; i < SLAB_CHUNK_OBJECTS; i++) {
+        struct slab_object *obj = (struct slab_object *) (chunk + i * slab->size);
+        obj->next = slab->free;
+        slab->free = obj;
+    }
+    slab->nfree += SLAB_CHUNK_OBJECTS;
+    slab->objects += SLAB_CHUNK_OBJECTS;
+    slab->chunks++;
+    return 0;
+}
+
+// Moves up to half a cache's worth of objects from the shared list into this thread's cache.
+static void slab_refill(struct blok_slab *slab, struct slab_cache *cache)
+{
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free == NULL) {
+        slab_grow(slab);
+    }
+    while (slab->free != NULL && cache->count < SLAB_CACHE_MAX / 2) {
+        struct slab_object *obj = slab->free;
+        slab->free = obj->next;
+        slab->nfree--;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+    slab->refills++;
+    slab_fold(slab, cache);
+    pthread_mutex_unlock(&slab->lock);
+}
+
+static void slab_drain(struct blok_slab *slab, struct slab_cache *cache)
+{
+    pthread_mutex_lock(&slab->lock);
+    while (cache->count > SLAB_CACHE_MAX / 2) {
+        struct slab_object *obj = cache->head;
+        cache->head = obj->next;
+        cache->count--;
+        obj->next = slab->free;
+        slab->free = obj;
+        slab->nfree++;
+    }
+    slab_fold(slab, cache);
+    pthread_mutex_unlock(&slab->lock);
+}
+
+static struct slab_cache *slab_cache(struct blok_slab *slab)
+{
+    if (!cache_registered) {
+        // any non-NULL value makes the destructor run at thread exit
+        pthread_setspecific(registry.thread_exit, &cache_registered);
+        cache_registered = 1;
+    }
+    return &caches[slab->index];
+}
+
+void *blok_slab_alloc(struct blok_slab *slab)
+{
+    if (slab->index < 0) {
+        return malloc(slab->size);
+    }
+    struct slab_cache *cache = slab_cache(slab);
+    if (cache->head == NULL) {
+        slab_refill(slab, cache);
+        if (cache->head == NULL) {
+            return NULL;
+        }
+    }
+    struct slab_object *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    cache->allocs++;
+    return obj;
+}
+
+void blok_slab_free(struct blok_slab *slab, void *obj)
+{
+    if (slab->index < 0) {
+        free(obj);
+        return;
+    }
+    struct slab_cache *cache = slab_cache(slab);
+    struct slab_object *o = obj;
+    o->next = cache->head;
+    cache->head = o;
+    cache->count++;
+    cache->frees++;
+    if (cache->count > SLAB_CACHE_MAX) {
+        slab_drain(slab, cache);
+    }
+}
+
+int blok_slab_count(void)
+{
+    return registry.nslabs;
+}
+
+struct blok_slab *blok_slab_get(int index)
+{
+    return registry.slabs[index];
+}
+
+int blok_arena_count(void)
+{
+    return registry.narenas;
+}
+
+struct blok_arena *blok_arena_get(int index)
+{
+    return registry.arenas[index];
+}
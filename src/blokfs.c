@@ -14,11 +14,29 @@
 */
 
 #include "../include/params.h"
+#include "../include/cgroup.h"
+#include "../include/counters.h"
+#include "../include/ctl.h"
+#include "../include/event.h"
+#include "../include/filter.h"
+#include "../include/flight.h"
+#include "../include/handle.h"
+#include "../include/intern.h"
+#include "../include/marker.h"
+#include "../include/mem.h"
+#include "../include/perf.h"
+#include "../include/proc.h"
+#include "../include/metrics.h"
+#include "../include/rollup.h"
+#include "../include/reuse.h"
+#include "../include/share.h"
+#include "../include/state.h"
+#include "../include/top.h"
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
-#include <stdarg.h>
+#include <stddef.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,13 +48,6 @@
 #include <sys/xattr.h>
 #endif
 
-void log_msg(const char *format, ...)
-{
-    va_list ap;
-    va_start(ap, format);
-    vfprintf(BLOK_DATA->logfile, format, ap);
-}
-
 //  All the paths I see are relative to the root of the mounted filesystem.  In order to get to the underlying
 //  filesystem, I need to have the mountpoint. I'll save it away early on in main(), and then whenever I need a path
 //  for something I'll call this to construct it.
@@ -53,30 +64,48 @@ static int wrap_return_code(int real_code) {
     return real_code;
 }
 
-int blok_getattr(const char *path, struct stat *statbuf)
+static int getattr_path(struct blok_op_frame *frame, const char *path, struct stat *statbuf)
 {
+    enum blok_ctl_node node = blok_ctl_lookup(path);
+    if (node != BLOK_CTL_NONE) {
+        return blok_ctl_getattr(node, statbuf);
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(lstat(fpath, statbuf));
+    return wrap_return_code(BLOK_SYSCALL(frame, lstat(fpath, statbuf)));
+}
+
+int blok_getattr(const char *path, struct stat *statbuf)
+{
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_GETATTR, path);
+    return blok_op_end(&frame, getattr_path(&frame, path, statbuf));
 }
 
 // Note the system readlink() will truncate and lose the terminating null. So, the size passed to to the system
 // readlink() must be one less than the size passed to blok_readlink() blok_readlink() code by Bernardo F Costa (thanks!)
 int blok_readlink(const char *path, char *link, size_t size)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_READLINK, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
 
-    int retstat = wrap_return_code(readlink(fpath, link, size - 1));
+    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, readlink(fpath, link, size - 1)));
     if (retstat >= 0) {
 	    link[retstat] = '\0';
 	    retstat = 0;
     }
-    return retstat;
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_mknod(const char *path, mode_t mode, dev_t dev)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_MKNOD, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
     
@@ -84,40 +113,49 @@ int blok_mknod(const char *path, mode_t mode, dev_t dev)
     // the quote in the Linux mknod man page stating the only portable use of mknod() is to make a fifo, but saying
     // it should never actually be used for that.
     if (S_ISREG(mode)) {
-	    int retstat = wrap_return_code(open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode));
+	    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode)));
 	    if (retstat >= 0) {
-            return wrap_return_code(close(retstat));
+            return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, close(retstat))));
         }
-	    return retstat;
+	    return blok_op_end(&frame, retstat);
     } else {
         if (S_ISFIFO(mode)) {
-            return wrap_return_code(mkfifo(fpath, mode));
+            return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, mkfifo(fpath, mode))));
         }
         else {
-            return wrap_return_code(mknod(fpath, mode, dev));
+            return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, mknod(fpath, mode, dev))));
         }
     }
 }
 
 int blok_mkdir(const char *path, mode_t mode)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_MKDIR, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(mkdir(fpath, mode));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, mkdir(fpath, mode))));
 }
 
 int blok_unlink(const char *path)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_UNLINK, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(unlink(fpath));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, unlink(fpath))));
 }
 
 int blok_rmdir(const char *path)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_RMDIR, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(rmdir(fpath));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, rmdir(fpath))));
 }
 
 // The parameters here are a little bit confusing, but do correspond to the symlink() system call.  The 'path' is where
@@ -125,110 +163,229 @@ int blok_rmdir(const char *path)
 // into the mounted directory.
 int blok_symlink(const char *path, const char *link)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_SYMLINK, link);
+
     char flink[PATH_MAX];
     blok_fullpath(flink, link);
-    return wrap_return_code(symlink(path, flink));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, symlink(path, flink))));
 }
 
-// both path and newpath are fs-relative
+// both path and newpath are fs-relative.  The identity is taken before the rename, as the object keeps it afterwards
+// while the old name may already be gone.
 int blok_rename(const char *path, const char *newpath)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_RENAME, path);
+
     char fpath[PATH_MAX];
     char fnewpath[PATH_MAX];
     blok_fullpath(fpath, path);
     blok_fullpath(fnewpath, newpath);
-    return wrap_return_code(rename(fpath, fnewpath));
+
+    frame.ev.newpath = newpath;
+    if (blok_event_traced(BLOK_OP_RENAME)) {
+        blok_fileid_from_path(fpath, &frame.ev.id);
+    }
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, rename(fpath, fnewpath))));
 }
 
 int blok_link(const char *path, const char *newpath)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_LINK, path);
+
     char fpath[PATH_MAX];
     char fnewpath[PATH_MAX];
     blok_fullpath(fpath, path);
     blok_fullpath(fnewpath, newpath);
-    return wrap_return_code(link(fpath, fnewpath));
+
+    frame.ev.newpath = newpath;
+    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, link(fpath, fnewpath)));
+    if (retstat == 0 && blok_event_traced(BLOK_OP_LINK)) {
+        blok_fileid_from_path(fnewpath, &frame.ev.id);
+    }
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_chmod(const char *path, mode_t mode)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_CHMOD, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(chmod(fpath, mode));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, chmod(fpath, mode))));
 }
 
 int blok_chown(const char *path, uid_t uid, gid_t gid)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_CHOWN, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(chown(fpath, uid, gid));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, chown(fpath, uid, gid))));
 }
 
 int blok_truncate(const char *path, off_t newsize)
 {
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_TRUNCATE, path, -1, newsize, 0);
+
+    // shells truncate before writing a command with '>'
+    enum blok_ctl_node node = blok_ctl_lookup(path);
+    if (node != BLOK_CTL_NONE) {
+        return blok_op_end(&frame, blok_ctl_access(node, W_OK));
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(truncate(fpath, newsize));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, truncate(fpath, newsize))));
 }
 
 int blok_utime(const char *path, struct utimbuf *ubuf)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_UTIME, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(utime(fpath, ubuf));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, utime(fpath, ubuf))));
 }
 
 int blok_open(const char *path, struct fuse_file_info *fi)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_OPEN, path);
+
+    enum blok_ctl_node node = blok_ctl_lookup(path);
+    if (node != BLOK_CTL_NONE) {
+        return blok_op_end(&frame, blok_ctl_open(node, fi));
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
 
-    // if the open call succeeds, my retstat is the file descriptor, else it's -errno.  I'm making sure that in that
-    // case the saved file descriptor is exactly -1.
-    int fd = wrap_return_code(open(fpath, fi->flags));
-    fi->fh = fd;
+    // if the open call succeeds, my retstat is the file descriptor, else it's -errno.
+    int fd = wrap_return_code(BLOK_SYSCALL(&frame, open(fpath, fi->flags)));
     if(fd < 0) {
-        return -errno;
+        return blok_op_end(&frame, fd);
     }
-    return 0;
+
+    // the file identity is captured here once, so reads can be attributed to the file rather than to the name it
+    // was opened under
+    struct blok_handle *handle = blok_handle_new(fd);
+    if (handle == NULL) {
+        BLOK_SYSCALL(&frame, close(fd));
+        return blok_op_end(&frame, -ENOMEM);
+    }
+    handle->path = blok_intern(path);
+    fi->fh = (uintptr_t) handle;
+    frame.ev.id = handle->id;
+    return blok_op_end(&frame, 0);
 }
 
 int blok_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    log_msg("{filename: \"%s\", offset: %ld, size: %zu}\n", path, offset, size);
-    return wrap_return_code(pread(fi->fh, buf, size, offset));
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_READ, path, BLOK_HANDLE(fi)->fd, offset, size);
+
+    struct blok_handle *handle = BLOK_HANDLE(fi);
+    if (handle->fd < 0) {
+        return blok_op_end(&frame, blok_ctl_read(handle, buf, size, offset));
+    }
+
+    frame.ev.id = handle->id;
+    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, pread(handle->fd, buf, size, offset)));
+    struct blok_state *state = BLOK_DATA->state;
+    if (state != NULL && retstat > 0) {
+        blok_heat_record(&state->heat, &handle->id, offset, retstat, 0);
+    }
+    if (blok_share_enabled && retstat > 0) {
+        blok_share_record(&handle->id, handle->path, offset, retstat);
+    }
+    if (blok_reuse_enabled && retstat > 0) {
+        blok_reuse_record(&handle->id, handle->path, offset, retstat);
+    }
+    blok_top_record(handle->path, fuse_get_context()->pid, retstat > 0 ? retstat : 0);
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    return wrap_return_code(pwrite(fi->fh, buf, size, offset));
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_WRITE, path, BLOK_HANDLE(fi)->fd, offset, size);
+
+    struct blok_handle *handle = BLOK_HANDLE(fi);
+    if (handle->fd < 0) {
+        return blok_op_end(&frame, blok_ctl_write(handle, buf, size));
+    }
+    frame.ev.id = handle->id;
+
+    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, pwrite(handle->fd, buf, size, offset)));
+    struct blok_state *state = BLOK_DATA->state;
+    if (state != NULL && retstat > 0) {
+        blok_heat_record(&state->heat, &handle->id, offset, retstat, 1);
+    }
+    if (blok_reuse_enabled && retstat > 0) {
+        blok_reuse_record(&handle->id, handle->path, offset, retstat);
+    }
+    blok_top_record(handle->path, fuse_get_context()->pid, retstat > 0 ? retstat : 0);
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_statfs(const char *path, struct statvfs *statv)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_STATFS, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(statvfs(fpath, statv));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, statvfs(fpath, statv))));
 }
 
 int blok_flush(const char *path, struct fuse_file_info *fi)
 {
-    return 0;
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_FLUSH, path, BLOK_HANDLE(fi)->fd, 0, 0);
+    return blok_op_end(&frame, 0);
 }
 
 int blok_release(const char *path, struct fuse_file_info *fi)
 {
-    return wrap_return_code(close(fi->fh));
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_RELEASE, path, BLOK_HANDLE(fi)->fd, 0, 0);
+
+    struct blok_handle *handle = BLOK_HANDLE(fi);
+    if (handle->fd < 0) {
+        blok_ctl_release(handle);
+        return blok_op_end(&frame, 0);
+    }
+
+    frame.ev.id = handle->id;
+    int retstat = wrap_return_code(BLOK_SYSCALL(&frame, close(handle->fd)));
+    blok_handle_free(handle);
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_FSYNC, path, BLOK_HANDLE(fi)->fd, 0, 0);
+
+    if (BLOK_HANDLE(fi)->fd < 0) {
+        return blok_op_end(&frame, 0);
+    }
+    frame.ev.id = BLOK_HANDLE(fi)->id;
+
     // some unix-like systems (notably freebsd) don't have a datasync call
 #ifdef HAVE_FDATASYNC
     if (datasync)
-	    return wrap_return_code(fdatasync(fi->fh));
+	    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, fdatasync(BLOK_HANDLE(fi)->fd))));
     else
 #endif	
-	return wrap_return_code(fsync(fi->fh));
+	return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, fsync(BLOK_HANDLE(fi)->fd))));
 }
 
 #ifdef HAVE_SYS_XATTR_H
@@ -241,53 +398,87 @@ int blok_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 
 int blok_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_SETXATTR, path);
+    if (strcmp(name, BLOK_MARKER_XATTR) == 0) {
+        return blok_op_end(&frame, blok_marker_set(value, size, fuse_get_context()->pid));
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(lsetxattr(fpath, name, value, size, flags));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, lsetxattr(fpath, name, value, size, flags))));
 }
 
 int blok_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_GETXATTR, path);
+
     int retstat = 0;
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(lgetxattr(fpath, name, value, size));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, lgetxattr(fpath, name, value, size))));
 }
 
 int blok_listxattr(const char *path, char *list, size_t size)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_LISTXATTR, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(llistxattr(fpath, list, size));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, llistxattr(fpath, list, size))));
 }
 
 int blok_removexattr(const char *path, const char *name)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_REMOVEXATTR, path);
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
-    return wrap_return_code(lremovexattr(fpath, name));
+    return blok_op_end(&frame, wrap_return_code(BLOK_SYSCALL(&frame, lremovexattr(fpath, name))));
 }
 #endif
 
 int blok_opendir(const char *path, struct fuse_file_info *fi)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_OPENDIR, path);
+
+    // the control directory has no DIR stream; readdir recognizes it by the null handle
+    if (blok_ctl_lookup(path) == BLOK_CTL_ROOT) {
+        fi->fh = 0;
+        return blok_op_end(&frame, 0);
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
+    blok_sys_begin(&frame);
     DIR *dp = opendir(fpath);
+    blok_sys_end(&frame);
     fi->fh = (intptr_t) dp;
     if (dp == NULL)
-	    return -errno;
-    return 0;
+	    return blok_op_end(&frame, -errno);
+    return blok_op_end(&frame, 0);
 }
 
 int blok_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_READDIR, path, -1, offset, 0);
+
     int retstat = 0;
     DIR *dp = (DIR *) (uintptr_t) fi->fh;
+    if (dp == NULL) {
+        return blok_op_end(&frame, blok_ctl_readdir(BLOK_CTL_ROOT, buf, filler));
+    }
 
+    blok_sys_begin(&frame);
     struct dirent *de = readdir(dp);
+    blok_sys_end(&frame);
     if (de == 0) {
-	    return -errno;
+	    return blok_op_end(&frame, -errno);
     }
 
     // This will copy the entire directory into the buffer.  The loop exits when either the system readdir() returns
@@ -295,21 +486,31 @@ int blok_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
     // the second means the buffer is full.
     do {
         if (filler(buf, de->d_name, NULL, 0) != 0) {
-            return -ENOMEM;
+            return blok_op_end(&frame, -ENOMEM);
         }
-    } while ((de = readdir(dp)) != NULL);
-    return retstat;
+        blok_sys_begin(&frame);
+        de = readdir(dp);
+        blok_sys_end(&frame);
+    } while (de != NULL);
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_releasedir(const char *path, struct fuse_file_info *fi)
 {
-    closedir((DIR *) (uintptr_t) fi->fh);
-    return 0;
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_RELEASEDIR, path);
+
+    if (fi->fh != 0) {
+        BLOK_SYSCALL(&frame, closedir((DIR *) (uintptr_t) fi->fh));
+    }
+    return blok_op_end(&frame, 0);
 }
 
 int blok_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    return 0;
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_FSYNCDIR, path);
+    return blok_op_end(&frame, 0);
 }
 
 // Undocumented but extraordinarily useful fact:  the fuse_context is set up before this function is called, and
@@ -318,51 +519,93 @@ int blok_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 // it did in older versions of FUSE).
 void *blok_init(struct fuse_conn_info *conn)
 {
-    return BLOK_DATA;
+    struct fs_state *blok_data = BLOK_DATA;
+    if (blok_data->state != NULL && blok_state_start(blok_data->state) < 0) {
+        fprintf(blok_data->logfile, "blok: could not start state checkpointing\n");
+    }
+    if (blok_data->rollup != NULL && blok_rollup_start(blok_data->rollup) < 0) {
+        fprintf(blok_data->logfile, "blok: could not start rollups\n");
+    }
+    if (blok_data->metrics != NULL && blok_metrics_start(blok_data->metrics) < 0) {
+        fprintf(blok_data->logfile, "blok: could not start the metrics endpoint\n");
+    }
+    if (blok_flight_enabled && blok_flight_start() < 0) {
+        fprintf(blok_data->logfile, "blok: could not start the flight recorder\n");
+    }
+    return blok_data;
 }
 
 void blok_destroy(void *userdata)
 {
-
+    struct fs_state *blok_data = userdata;
+    blok_state_close(blok_data->state);
+    blok_data->state = NULL;
+    blok_rollup_close(blok_data->rollup);
+    blok_data->rollup = NULL;
+    blok_metrics_close(blok_data->metrics);
+    blok_data->metrics = NULL;
+    blok_flight_close();
+    blok_share_close();
+    blok_reuse_close();
+    blok_intern_destroy();
 }
 
 int blok_access(const char *path, int mask)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_ACCESS, path);
+
+    enum blok_ctl_node node = blok_ctl_lookup(path);
+    if (node != BLOK_CTL_NONE) {
+        return blok_op_end(&frame, blok_ctl_access(node, mask));
+    }
+
     char fpath[PATH_MAX];
     blok_fullpath(fpath, path);
     
-    int retstat = access(fpath, mask);
+    int retstat = BLOK_SYSCALL(&frame, access(fpath, mask));
     if (retstat < 0) {
-        return -errno;
+        return blok_op_end(&frame, -errno);
     }
-    return retstat;
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-    int retstat = ftruncate(fi->fh, offset);
+    struct blok_op_frame frame;
+    blok_op_begin_io(&frame, BLOK_OP_FTRUNCATE, path, BLOK_HANDLE(fi)->fd, offset, 0);
+
+    if (BLOK_HANDLE(fi)->fd < 0) {
+        return blok_op_end(&frame, -EACCES);
+    }
+    frame.ev.id = BLOK_HANDLE(fi)->id;
+
+    int retstat = BLOK_SYSCALL(&frame, ftruncate(BLOK_HANDLE(fi)->fd, offset));
     if (retstat < 0) {
-        return -errno;
+        return blok_op_end(&frame, -errno);
     }
-    return retstat;
+    return blok_op_end(&frame, retstat);
 }
 
 int blok_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
+    struct blok_op_frame frame;
+    blok_op_begin(&frame, BLOK_OP_FGETATTR, path);
+
     // On FreeBSD, trying to do anything with the mountpoint ends up
     // opening it, and then using the FD for an fgetattr.  So in the
     // special case of a path of "/", I need to do a getattr on the
     // underlying root directory instead of doing the fgetattr().
-    if (!strcmp(path, "/")) {
-        return blok_getattr(path, statbuf);
+    if (!strcmp(path, "/") || BLOK_HANDLE(fi)->fd < 0) {
+        return blok_op_end(&frame, getattr_path(&frame, path, statbuf));
     }
 
     
-    int retstat = fstat(fi->fh, statbuf);
+    int retstat = BLOK_SYSCALL(&frame, fstat(BLOK_HANDLE(fi)->fd, statbuf));
     if (retstat < 0) {
-        return -errno;
+        return blok_op_end(&frame, -errno);
     }
-    return retstat;
+    return blok_op_end(&frame, retstat);
 }
 
 struct fuse_operations blok_oper = {
@@ -404,19 +647,93 @@ struct fuse_operations blok_oper = {
   .fgetattr = blok_fgetattr
 };
 
+#define BLOK_OPT(t, p, v) { t, offsetof(struct fs_state, p), v }
+
+static struct fuse_opt blok_opts[] = {
+    BLOK_OPT("state=%s", state_path, 0),
+    BLOK_OPT("nostate", no_state, 1),
+    BLOK_OPT("heat_block=%lu", heat_block, 0),
+    BLOK_OPT("heat_entries=%lu", heat_entries, 0),
+    BLOK_OPT("checkpoint=%u", checkpoint_interval, 0),
+    BLOK_OPT("mem_budget=%s", mem_budget_arg, 0),
+    BLOK_OPT("rollup=%u", rollup_interval, 0),
+    BLOK_OPT("rollup_overhead", rollup_overhead, 1),
+    BLOK_OPT("perf", perf, 1),
+    BLOK_OPT("trace=%s", trace_arg, 0),
+    BLOK_OPT("filter=%s", filter_arg, 0),
+    BLOK_OPT("metrics=%s", metrics_arg, 0),
+    BLOK_OPT("cgroups", cgroups, 1),
+    BLOK_OPT("jobs=%s", jobs_arg, 0),
+    BLOK_OPT("sharing=%s", sharing_arg, 0),
+    BLOK_OPT("reuse=%s", reuse_arg, 0),
+    BLOK_OPT("flight=%s", flight_arg, 0),
+    BLOK_OPT("flight_window=%u", flight_window, 0),
+    BLOK_OPT("flight_latency=%u", flight_latency, 0),
+    BLOK_OPT("flight_errors=%u", flight_errors, 0),
+    BLOK_OPT("flight_pid=%d", flight_pid, 0),
+    BLOK_OPT("flight_dir=%s", flight_dir, 0),
+    FUSE_OPT_END
+};
+
 void blok_usage()
 {
-    fprintf(stderr, "usage:  blok [FUSE and mount options] rootDir mountPoint\n");
+    fprintf(stderr, "usage:  blok [FUSE and mount options] rootDir mountPoint\n"
+                    "\n"
+                    "blok options:\n"
+                    "    -o state=PATH          persistent state file (default: blok.state)\n"
+                    "    -o nostate             keep no persistent state\n"
+                    "    -o heat_block=BYTES    heat map block size, a power of two (default: 4096)\n"
+                    "    -o heat_entries=N      heat map capacity, a power of two (default: 262144)\n"
+                    "    -o checkpoint=SECS     state sync interval, 0 syncs only at unmount (default: 30)\n"
+                    "    -o mem_budget=SIZE     memory for tracking structures, 0 for unlimited (default: 256M)\n"
+                    "    -o rollup=SECS         log per-operation rollups every SECS seconds (default: off)\n"
+                    "    -o rollup_overhead     include blok's own overhead in the rollups\n"
+                    "    -o perf                count cycles, instructions and misses per operation\n"
+                    "    -o trace=LIST          operations to log, comma separated or 'all' (default: read,rename,link)\n"
+                    "    -o filter=EXPR         log only calls matching EXPR, e.g. 'op==read && size<4K'\n"
+                    "    -o cgroups             attribute calls to the callers' cgroups\n"
+                    "    -o jobs=MODE           group callers into jobs: sid, pgid or exe:NAME (nearest ancestor NAME)\n"
+                    "    -o sharing=RANGE       count distinct readers (jobs with -o jobs) per RANGE bytes of each file\n"
+                    "    -o reuse=RANGE         histogram the time between accesses of each RANGE bytes of each file\n"
+                    "    -o metrics=ADDR        serve OpenMetrics on PORT, HOST:PORT or unix:PATH (default: off)\n"
+                    "    -o flight=SIZE         keep every call in a per-thread ring of SIZE, dumped on triggers (default: off)\n"
+                    "    -o flight_window=SECS  how much of the rings a dump covers (default: 30)\n"
+                    "    -o flight_latency=MS   dump when a call takes longer than MS (default: off)\n"
+                    "    -o flight_errors=N     dump when more than N calls fail in a second (default: off)\n"
+                    "    -o flight_pid=PID      dump when process PID opens a file (default: off)\n"
+                    "    -o flight_dir=DIR      where dumps are written (default: the working directory)\n");
     abort();
 }
 
+static int is_power_of_two(unsigned long v)
+{
+    return v != 0 && (v & (v - 1)) == 0;
+}
+
+// Parses sizes like 512K, 64M or 2G.  Returns -1 for anything else.
+static long long parse_size(const char *arg)
+{
+    char *end;
+    long long size = strtoll(arg, &end, 10);
+    if (end == arg || size < 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
 FILE *log_open()
 {
     FILE *logfile;
 
     // very first thing, open up the logfile and mark that we got in
-    // here.  If we can't open the logfile, we're dead.
-    logfile = fopen("blok.log", "w");
+    // here.  If we can't open the logfile, we're dead.  Earlier mounts' records are kept, the same way the persistent
+    // state is.
+    logfile = fopen("blok.log", "a");
     if (logfile == NULL) {
         perror("logfile");
         exit(EXIT_FAILURE);
@@ -439,7 +756,7 @@ int main(int argc, char *argv[])
         blok_usage();
     }
 
-    struct fs_state *blok_data = malloc(sizeof(struct fs_state));
+    struct fs_state *blok_data = calloc(1, sizeof(struct fs_state));
     if (blok_data == NULL) {
 	    perror("main calloc");
 	    abort();
@@ -451,8 +768,139 @@ int main(int argc, char *argv[])
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
+    char *mountpoint = realpath(argv[argc-1], NULL);
+    blok_event_log_header(blok_data->logfile, blok_data->rootdir ? blok_data->rootdir : "",
+                          mountpoint ? mountpoint : argv[argc-1]);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    blok_data->heat_block = 4096;
+    blok_data->heat_entries = 1UL << 18;
+    blok_data->checkpoint_interval = 30;
+    blok_data->flight_window = 30;
+    if (fuse_opt_parse(&args, blok_data, blok_opts, NULL) < 0) {
+        blok_usage();
+    }
+    if (blok_data->trace_arg != NULL && blok_event_parse_mask(blok_data->trace_arg, &blok_trace_mask) < 0) {
+        blok_usage();
+    }
+    if (blok_data->filter_arg != NULL) {
+        char err[256];
+        blok_filter = blok_filter_compile(blok_data->filter_arg, err, sizeof(err));
+        if (blok_filter == NULL) {
+            fprintf(stderr, "filter: %s\n", err);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (blok_data->jobs_arg != NULL && blok_job_parse(blok_data->jobs_arg) < 0) {
+        blok_usage();
+    }
+    if (!is_power_of_two(blok_data->heat_block) || !is_power_of_two(blok_data->heat_entries)) {
+        blok_usage();
+    }
+
+    // the heat map is the one structure that grows with the data set, so it gets at most half of the budget
+    long long mem_budget = parse_size(blok_data->mem_budget_arg ? blok_data->mem_budget_arg : "256M");
+    if (mem_budget < 0) {
+        blok_usage();
+    }
+    blok_mem_init(mem_budget);
+    blok_mem_register_shrinker(BLOK_MEM_STATS, blok_proc_shrink, NULL);
+    blok_ticks_calibrate();
+    if (blok_data->perf) {
+        int err = blok_perf_init();
+        if (err < 0) {
+            fprintf(stderr, "blok: hardware counters unavailable (%s), continuing without them\n", strerror(-err));
+        }
+    }
+    if (blok_data->cgroups) {
+        int err = blok_cgroup_init();
+        if (err < 0) {
+            fprintf(stderr, "blok: no cgroup2 hierarchy (%s), continuing without cgroup attribution\n",
+                    strerror(-err));
+        }
+    }
+    if (blok_data->sharing_arg != NULL) {
+        long long range_size = parse_size(blok_data->sharing_arg);
+        if (range_size <= 0 || !is_power_of_two(range_size)) {
+            blok_usage();
+        }
+        int err = blok_share_open(range_size);
+        if (err < 0) {
+            fprintf(stderr, "sharing: %s\n", strerror(-err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (blok_data->reuse_arg != NULL) {
+        long long range_size = parse_size(blok_data->reuse_arg);
+        if (range_size <= 0 || !is_power_of_two(range_size)) {
+            blok_usage();
+        }
+        int err = blok_reuse_open(range_size);
+        if (err < 0) {
+            fprintf(stderr, "reuse: %s\n", strerror(-err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    blok_handle_init();
+    blok_intern_init();
+    while (mem_budget != 0 && blok_data->heat_entries > 1
+           && blok_data->heat_entries * sizeof(struct blok_heat_entry) > mem_budget / 2) {
+        blok_data->heat_entries >>= 1;
+    }
+
+    if (!blok_data->no_state) {
+        blok_data->state = blok_state_open(blok_data->state_path ? blok_data->state_path : "blok.state",
+                                           blok_data->heat_entries, __builtin_ctzl(blok_data->heat_block),
+                                           blok_data->checkpoint_interval);
+        if (blok_data->state == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (blok_data->rollup_interval != 0) {
+        blok_data->rollup = blok_rollup_open(blok_data->logfile, blok_data->rollup_interval,
+                                             blok_data->rollup_overhead);
+        if (blok_data->rollup == NULL) {
+            perror("rollup");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (blok_data->metrics_arg != NULL) {
+        blok_data->metrics = blok_metrics_open(blok_data, blok_data->metrics_arg);
+        if (blok_data->metrics == NULL) {
+            perror("metrics");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // dumps go to the directory blok was started from unless told otherwise, like the log; fuse_main() changes it
+    if (blok_data->flight_arg != NULL) {
+        long long ring_size = parse_size(blok_data->flight_arg);
+        char cwd[PATH_MAX];
+        if (ring_size < BLOK_EVENT_MAX_LEN || blok_data->flight_window == 0) {
+            blok_usage();
+        }
+        struct blok_flight_config config = {
+            .ring_size = ring_size,
+            .window = blok_data->flight_window,
+            .latency_ms = blok_data->flight_latency,
+            .errors = blok_data->flight_errors,
+            .pid = blok_data->flight_pid,
+            .dir = blok_data->flight_dir ? blok_data->flight_dir : getcwd(cwd, sizeof(cwd)),
+            .rootdir = blok_data->rootdir ? blok_data->rootdir : "",
+            .mountpoint = mountpoint ? mountpoint : argv[argc-1],
+        };
+        int err = config.dir != NULL ? blok_flight_open(&config) : -errno;
+        if (err < 0) {
+            fprintf(stderr, "flight: %s\n", strerror(-err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(mountpoint);
 
-    int fuse_stat = fuse_main(argc, argv, &blok_oper, blok_data);
+    int fuse_stat = fuse_main(args.argc, args.argv, &blok_oper, blok_data);
+    fuse_opt_free_args(&args);
 
     return fuse_stat;
 }
@@ -0,0 +1,155 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/cgroup.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include "../include/proc.h"
+#include <errno.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int blok_cgroup_enabled;
+
+static char cgroup_root[PATH_MAX];
+
+static struct {
+    pthread_mutex_t lock;
+    size_t count;
+    struct blok_cgroup slots[BLOK_CGROUP_MAX];
+} table = { .lock = PTHREAD_MUTEX_INITIALIZER, .count = 1, .slots = { { 0, "" } } };
+
+int blok_cgroup_init(void)
+{
+    FILE *mounts = setmntent("/proc/self/mounts", "r");
+    if (mounts == NULL) {
+        return -errno;
+    }
+    struct mntent *m;
+    while ((m = getmntent(mounts)) != NULL) {
+        if (strcmp(m->mnt_type, "cgroup2") == 0 && strlen(m->mnt_dir) < sizeof(cgroup_root)) {
+            strcpy(cgroup_root, m->mnt_dir);
+            break;
+        }
+    }
+    endmntent(mounts);
+    if (cgroup_root[0] == '\0') {
+        return -ENOENT;
+    }
+    blok_cgroup_enabled = 1;
+    blok_proc_enabled = 1;
+    return 0;
+}
+
+static uint32_t slot_of(uint64_t id, const char *path)
+{
+    pthread_mutex_lock(&table.lock);
+    size_t slot;
+    for (slot = 1; slot < table.count && table.slots[slot].id != id; slot++) {
+    }
+    if (slot == table.count) {
+        char *copy = NULL;
+        if (slot == BLOK_CGROUP_MAX || (copy = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&table.lock);
+            return 0;
+        }
+        blok_mem_charge_force(BLOK_MEM_STATS, strlen(path) + 1);
+        table.slots[slot].id = id;
+        table.slots[slot].path = copy;
+        // readers take the count without the lock
+        __atomic_store_n(&table.count, slot + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&table.lock);
+    return slot;
+}
+
+// The unified hierarchy is the "0::" line of /proc/PID/cgroup.
+uint32_t blok_cgroup_resolve(int pid)
+{
+    char buf[PATH_MAX + 64];
+    if (blok_proc_read(pid, "cgroup", buf, sizeof(buf)) < 0) {
+        return 0;
+    }
+    char *line = strncmp(buf, "0::", 3) == 0 ? buf : strstr(buf, "\n0::");
+    if (line == NULL) {
+        return 0;
+    }
+    char *path = line + (line == buf ? 3 : 4);
+    path[strcspn(path, "\n")] = '\0';
+
+    char dir[2 * PATH_MAX];
+    struct stat st;
+    snprintf(dir, sizeof(dir), "%s%s", cgroup_root, path);
+    if (stat(dir, &st) < 0) {
+        return 0;
+    }
+    return slot_of(st.st_ino, path);
+}
+
+void blok_cgroup_io(uint32_t slot, enum blok_op op, int result, uint64_t elapsed)
+{
+    struct blok_shard *shard = blok_shard();
+    struct blok_cgroup_shard *cg = shard->cgroup;
+    if (cg == NULL) {
+        // bounded by the number of threads like the top sketches, so it isn't refused
+        if (posix_memalign((void **) &cg, 64, sizeof(struct blok_cgroup_shard)) != 0) {
+            return;
+        }
+        memset(cg, 0, sizeof(*cg));
+        blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct blok_cgroup_shard));
+        __atomic_store_n(&shard->cgroup, cg, __ATOMIC_RELEASE);
+    }
+    struct blok_cgroup_io *io = &cg->io[slot][op == BLOK_OP_WRITE];
+    BLOK_SHARD_ADD(io->ops, 1);
+    BLOK_SHARD_ADD(io->bytes, result > 0 ? result : 0);
+    BLOK_SHARD_ADD(io->latency_ns, elapsed);
+}
+
+size_t blok_cgroup_count(void)
+{
+    return __atomic_load_n(&table.count, __ATOMIC_ACQUIRE);
+}
+
+const struct blok_cgroup *blok_cgroup_get(size_t slot)
+{
+    return &table.slots[slot];
+}
+
+struct cgroup_sum {
+    struct blok_cgroup_io (*out)[2];
+    size_t n;
+};
+
+static void cgroup_sum_shard(struct blok_shard *shard, void *arg)
+{
+    struct cgroup_sum *sum = arg;
+    const struct blok_cgroup_shard *cg = __atomic_load_n(&shard->cgroup, __ATOMIC_ACQUIRE);
+    if (cg == NULL) {
+        return;
+    }
+    for (size_t slot = 0; slot < sum->n; slot++) {
+        for (int dir = 0; dir < 2; dir++) {
+            const struct blok_cgroup_io *io = &cg->io[slot][dir];
+            sum->out[slot][dir].ops += __atomic_load_n(&io->ops, __ATOMIC_RELAXED);
+            sum->out[slot][dir].bytes += __atomic_load_n(&io->bytes, __ATOMIC_RELAXED);
+            sum->out[slot][dir].latency_ns += __atomic_load_n(&io->latency_ns, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void blok_cgroup_read(struct blok_cgroup_io (*out)[2], size_t n)
+{
+    memset(out, 0, n * sizeof(*out));
+    struct cgroup_sum sum = { out, n };
+    blok_shard_foreach(cgroup_sum_shard, &sum);
+}
@@ -0,0 +1,172 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/counters.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread struct blok_shard *blok_thread_shard;
+
+double blok_ns_per_tick = 1.0;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t thread_exit;
+    struct blok_shard *shards;
+    struct blok_counters base;
+    uint64_t epoch;
+    time_t epoch_start;
+} registry = { .lock = PTHREAD_MUTEX_INITIALIZER, .once = PTHREAD_ONCE_INIT };
+
+static void shard_release(void *arg)
+{
+    struct blok_shard *shard = arg;
+    __atomic_store_n(&shard->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void counters_once(void)
+{
+    pthread_key_create(&registry.thread_exit, shard_release);
+    registry.epoch_start = time(NULL);
+}
+
+// Slow path of blok_shard(), taken once per thread.  Reuses the shard of a thread that has exited if there is one.
+struct blok_shard *blok_shard_acquire(void)
+{
+    pthread_once(&registry.once, counters_once);
+
+    pthread_mutex_lock(&registry.lock);
+    struct blok_shard *shard;
+    for (shard = registry.shards; shard != NULL; shard = shard->next) {
+        if (!__atomic_load_n(&shard->owned, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        if (posix_memalign((void **) &shard, 64, sizeof(struct blok_shard)) != 0) {
+            abort();
+        }
+        memset(shard, 0, sizeof(*shard));
+        shard->next = registry.shards;
+        registry.shards = shard;
+    }
+    shard->owned = 1;
+    pthread_mutex_unlock(&registry.lock);
+
+    pthread_setspecific(registry.thread_exit, shard);
+    blok_thread_shard = shard;
+    return shard;
+}
+
+void blok_shard_foreach(void (*fn)(struct blok_shard *shard, void *arg), void *arg)
+{
+    pthread_mutex_lock(&registry.lock);
+    for (struct blok_shard *shard = registry.shards; shard != NULL; shard = shard->next) {
+        fn(shard, arg);
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+// Counts TSC ticks over 20ms of the monotonic clock.  Assumes an invariant TSC, as every x86 CPU of the last decade
+// has; blok only uses it for durations within a single call.
+void blok_ticks_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec pause = { 0, 20000000 };
+    uint64_t ns = blok_now_ns();
+    uint64_t ticks = blok_ticks();
+    nanosleep(&pause, NULL);
+    ns = blok_now_ns() - ns;
+    ticks = blok_ticks() - ticks;
+    if (ticks != 0) {
+        blok_ns_per_tick = (double) ns / ticks;
+    }
+#endif
+}
+
+static void counters_sum(struct blok_counters *out)
+{
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&registry.lock);
+    for (struct blok_shard *shard = registry.shards; shard != NULL; shard = shard->next) {
+        const uint64_t *src = (const uint64_t *) &shard->counters;
+        uint64_t *dst = (uint64_t *) out;
+        for (size_t i = 0; i < sizeof(struct blok_counters) / sizeof(uint64_t); i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void blok_counters_read(struct blok_counters *out)
+{
+    counters_sum(out);
+}
+
+void blok_counters_read_epoch(struct blok_counters *out)
+{
+    counters_sum(out);
+    pthread_mutex_lock(&registry.lock);
+    uint64_t *dst = (uint64_t *) out;
+    const uint64_t *base = (const uint64_t *) &registry.base;
+    for (size_t i = 0; i < sizeof(struct blok_counters) / sizeof(uint64_t); i++) {
+        dst[i] -= base[i];
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void blok_counters_new_epoch(void)
+{
+    pthread_once(&registry.once, counters_once);
+
+    struct blok_counters now;
+    counters_sum(&now);
+    pthread_mutex_lock(&registry.lock);
+    registry.base = now;
+    registry.epoch++;
+    registry.epoch_start = time(NULL);
+    pthread_mutex_unlock(&registry.lock);
+}
+
+uint64_t blok_counters_epoch(void)
+{
+    return __atomic_load_n(&registry.epoch, __ATOMIC_RELAXED);
+}
+
+time_t blok_counters_epoch_start(void)
+{
+    pthread_once(&registry.once, counters_once);
+    return registry.epoch_start;
+}
+
+// Upper bound of the bucket holding the p-th percentile (0 < p <= 1), 0 for an empty histogram.
+uint64_t blok_hist_percentile(const uint64_t *hist, double p)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p * total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank) {
+            return 1ULL << b;
+        }
+    }
+    return 1ULL << (BLOK_HIST_BUCKETS - 1);
+}
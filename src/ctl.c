@@ -0,0 +1,204 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#include "../include/params.h"
+#include "../include/ctl.h"
+#include "../include/counters.h"
+#include "../include/flight.h"
+#include "../include/marker.h"
+#include "../include/mem.h"
+#include "../include/stats.h"
+#include "../include/top.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef char *(*ctl_render)(struct fs_state *blok_data, size_t *len);
+
+// Commands accepted by the control file, one per line.
+static int ctl_reset(const char *arg)
+{
+    blok_counters_new_epoch();
+    return 0;
+}
+
+static int ctl_marker(const char *arg)
+{
+    return blok_marker_set(arg, strlen(arg), fuse_get_context()->pid);
+}
+
+static int ctl_dump(const char *arg)
+{
+    if (!blok_flight_enabled) {
+        return -ENOTSUP;
+    }
+    blok_flight_trigger("control", fuse_get_context()->pid);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(const char *arg);
+} ctl_commands[] = {
+    { "reset", ctl_reset },
+    { "marker", ctl_marker },
+    { "dump", ctl_dump },
+};
+
+static int ctl_command(const char *line)
+{
+    size_t len = strcspn(line, " ");
+    const char *arg = line[len] == ' ' ? line + len + 1 : "";
+    for (size_t i = 0; i < sizeof(ctl_commands) / sizeof(ctl_commands[0]); i++) {
+        if (strlen(ctl_commands[i].name) == len && strncmp(line, ctl_commands[i].name, len) == 0) {
+            return ctl_commands[i].run(arg);
+        }
+    }
+    return -EINVAL;
+}
+
+static const struct {
+    const char *name;
+    mode_t mode;
+    ctl_render render;
+} ctl_nodes[BLOK_CTL_MAX] = {
+    [BLOK_CTL_ROOT] = { "", S_IFDIR | 0555, NULL },
+    [BLOK_CTL_STATS] = { "stats", S_IFREG | 0444, blok_stats_render },
+    [BLOK_CTL_TOP] = { "top", S_IFREG | 0444, blok_top_render },
+    [BLOK_CTL_CONTROL] = { "control", S_IFREG | 0222, NULL },
+};
+
+enum blok_ctl_node blok_ctl_lookup(const char *path)
+{
+    size_t dirlen = sizeof(BLOK_CTL_DIR) - 1;
+    if (strncmp(path, BLOK_CTL_DIR, dirlen) != 0) {
+        return BLOK_CTL_NONE;
+    }
+    if (path[dirlen] == '\0') {
+        return BLOK_CTL_ROOT;
+    }
+    if (path[dirlen] != '/') {
+        return BLOK_CTL_NONE;
+    }
+    for (int node = BLOK_CTL_ROOT + 1; node < BLOK_CTL_MAX; node++) {
+        if (strcmp(path + dirlen + 1, ctl_nodes[node].name) == 0) {
+            return node;
+        }
+    }
+    return BLOK_CTL_NONE;
+}
+
+// Files report a size of 0, as their content only exists once they are opened; open sets direct_io so the kernel
+// reads them anyway.
+int blok_ctl_getattr(enum blok_ctl_node node, struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = ctl_nodes[node].mode;
+    statbuf->st_nlink = S_ISDIR(statbuf->st_mode) ? 2 : 1;
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    return 0;
+}
+
+int blok_ctl_access(enum blok_ctl_node node, int mask)
+{
+    if ((mask & W_OK) && !(ctl_nodes[node].mode & 0222)) {
+        return -EACCES;
+    }
+    return 0;
+}
+
+int blok_ctl_open(enum blok_ctl_node node, struct fuse_file_info *fi)
+{
+    if (S_ISDIR(ctl_nodes[node].mode)) {
+        return -EISDIR;
+    }
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+    if (writing ? ctl_nodes[node].render != NULL : ctl_nodes[node].render == NULL) {
+        return -EACCES;
+    }
+
+    struct blok_handle *handle = blok_handle_new(-1);
+    if (handle == NULL) {
+        return -ENOMEM;
+    }
+    handle->ctl = node;
+    if (!writing) {
+        handle->buf = ctl_nodes[node].render(BLOK_DATA, &handle->len);
+        if (handle->buf == NULL) {
+            blok_handle_free(handle);
+            return -ENOMEM;
+        }
+    }
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) handle;
+    return 0;
+}
+
+int blok_ctl_read(struct blok_handle *handle, char *buf, size_t size, off_t offset)
+{
+    if (offset >= handle->len) {
+        return 0;
+    }
+    if (size > handle->len - offset) {
+        size = handle->len - offset;
+    }
+    memcpy(buf, handle->buf + offset, size);
+    return size;
+}
+
+// Every write has to carry whole commands, which is what 'echo reset > .blok/control' does.
+int blok_ctl_write(struct blok_handle *handle, const char *buf, size_t size)
+{
+    if (handle->ctl != BLOK_CTL_CONTROL) {
+        return -EACCES;
+    }
+    char line[PATH_MAX];
+    size_t start = 0;
+    while (start < size) {
+        size_t end = start;
+        while (end < size && buf[end] != '\n') {
+            end++;
+        }
+        size_t len = end - start;
+        if (len >= sizeof(line)) {
+            return -EINVAL;
+        }
+        if (len > 0) {
+            memcpy(line, buf + start, len);
+            line[len] = '\0';
+            int retstat = ctl_command(line);
+            if (retstat < 0) {
+                return retstat;
+            }
+        }
+        start = end + 1;
+    }
+    return size;
+}
+
+void blok_ctl_release(struct blok_handle *handle)
+{
+    blok_mem_uncharge(BLOK_MEM_STATS, handle->len);
+    free(handle->buf);
+    blok_handle_free(handle);
+}
+
+int blok_ctl_readdir(enum blok_ctl_node node, void *buf, fuse_fill_dir_t filler)
+{
+    if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0) {
+        return -ENOMEM;
+    }
+    for (int i = BLOK_CTL_ROOT + 1; i < BLOK_CTL_MAX; i++) {
+        if (filler(buf, ctl_nodes[i].name, NULL, 0) != 0) {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/event.h"
+#include "../include/counters.h"
+#include "../include/filter.h"
+#include "../include/ndjson.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <time.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+uint64_t blok_trace_mask = (1ULL << BLOK_OP_READ) | (1ULL << BLOK_OP_RENAME) | (1ULL << BLOK_OP_LINK);
+
+static const char *op_names[BLOK_OP_MAX] = {
+#define BLOK_OP_NAME(NAME, name) [BLOK_OP_##NAME] = #name,
+    BLOK_OP_LIST(BLOK_OP_NAME)
+#undef BLOK_OP_NAME
+};
+
+const char *blok_op_name(enum blok_op op)
+{
+    if (op < 0 || op >= BLOK_OP_MAX) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+// The errors a passthrough file system can get back from its backing calls
+static const char *errno_names[] = {
+    [EPERM] = "EPERM", [ENOENT] = "ENOENT", [EINTR] = "EINTR", [EIO] = "EIO", [ENXIO] = "ENXIO",
+    [E2BIG] = "E2BIG", [EBADF] = "EBADF", [EAGAIN] = "EAGAIN", [ENOMEM] = "ENOMEM", [EACCES] = "EACCES",
+    [EFAULT] = "EFAULT", [EBUSY] = "EBUSY", [EEXIST] = "EEXIST", [EXDEV] = "EXDEV", [ENODEV] = "ENODEV",
+    [ENOTDIR] = "ENOTDIR", [EISDIR] = "EISDIR", [EINVAL] = "EINVAL", [ENFILE] = "ENFILE", [EMFILE] = "EMFILE",
+    [ETXTBSY] = "ETXTBSY", [EFBIG] = "EFBIG", [ENOSPC] = "ENOSPC", [ESPIPE] = "ESPIPE", [EROFS] = "EROFS",
+    [EMLINK] = "EMLINK", [ERANGE] = "ERANGE", [EDEADLK] = "EDEADLK", [ENAMETOOLONG] = "ENAMETOOLONG",
+    [ENOLCK] = "ENOLCK", [ENOSYS] = "ENOSYS", [ENOTEMPTY] = "ENOTEMPTY", [ELOOP] = "ELOOP", [ENODATA] = "ENODATA",
+    [EOVERFLOW] = "EOVERFLOW", [EOPNOTSUPP] = "EOPNOTSUPP", [ESTALE] = "ESTALE", [EDQUOT] = "EDQUOT",
+};
+
+const char *blok_errno_name(int err)
+{
+    if (err <= 0 || err >= (int) (sizeof(errno_names) / sizeof(errno_names[0]))) {
+        return NULL;
+    }
+    return errno_names[err];
+}
+
+int blok_event_parse_mask(const char *list, uint64_t *mask)
+{
+    if (strcmp(list, "all") == 0) {
+        *mask = (1ULL << BLOK_OP_MAX) - 1;
+        return 0;
+    }
+    uint64_t m = 0;
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        int op;
+        for (op = 0; op < BLOK_OP_MAX; op++) {
+            if (strlen(op_names[op]) == len && strncmp(op_names[op], list, len) == 0) {
+                break;
+            }
+        }
+        if (op == BLOK_OP_MAX) {
+            return -1;
+        }
+        m |= 1ULL << op;
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    *mask = m;
+    return 0;
+}
+
+// Records are NDJSON: one object per line, with the keys in a fixed order.
+size_t blok_event_format(char *buf, const struct blok_event *ev)
+{
+    char *p = buf;
+    const char *op = blok_op_name(ev->op);
+
+    p = BLOK_JSON_LIT(p, "{\"op\":\"");
+    p = blok_json_raw(p, op, strlen(op));
+    p = BLOK_JSON_LIT(p, "\",\"ts\":");
+    p = blok_json_u64(p, ev->ts);
+    p = BLOK_JSON_LIT(p, ",\"dur\":");
+    p = blok_json_u64(p, ev->dur);
+    p = BLOK_JSON_LIT(p, ",\"pid\":");
+    p = blok_json_i64(p, ev->pid);
+    p = BLOK_JSON_LIT(p, ",\"tid\":");
+    p = blok_json_i64(p, ev->tid);
+    if (ev->cgroup != 0) {
+        p = BLOK_JSON_LIT(p, ",\"cgroup\":");
+        p = blok_json_u64(p, ev->cgroup);
+    }
+    if (ev->job != 0) {
+        p = BLOK_JSON_LIT(p, ",\"job\":");
+        p = blok_json_i64(p, ev->job);
+    }
+    p = BLOK_JSON_LIT(p, ",\"result\":");
+    p = blok_json_i64(p, ev->result);
+    // Paths are cut at PATH_MAX bytes so the record fits BLOK_EVENT_MAX_LEN whatever the callback passed in.
+    size_t path_len = strnlen(ev->path, PATH_MAX);
+    int truncated = ev->path[path_len] != '\0';
+    p = BLOK_JSON_LIT(p, ",\"filename\":");
+    p = blok_json_string(p, ev->path, path_len);
+    if (ev->newpath != NULL) {
+        size_t newpath_len = strnlen(ev->newpath, PATH_MAX);
+        truncated |= ev->newpath[newpath_len] != '\0';
+        p = BLOK_JSON_LIT(p, ",\"newname\":");
+        p = blok_json_string(p, ev->newpath, newpath_len);
+    }
+    if (truncated) {
+        p = BLOK_JSON_LIT(p, ",\"truncated\":1");
+    }
+    if (ev->op == BLOK_OP_READ || ev->op == BLOK_OP_WRITE) {
+        p = BLOK_JSON_LIT(p, ",\"offset\":");
+        p = blok_json_i64(p, ev->offset);
+        p = BLOK_JSON_LIT(p, ",\"size\":");
+        p = blok_json_u64(p, ev->size);
+    }
+    p = BLOK_JSON_LIT(p, ",\"dev\":");
+    p = blok_json_u64(p, ev->id.dev);
+    p = BLOK_JSON_LIT(p, ",\"ino\":");
+    p = blok_json_u64(p, ev->id.ino);
+    p = BLOK_JSON_LIT(p, ",\"gen\":");
+    p = blok_json_u64(p, ev->id.gen);
+    p = BLOK_JSON_LIT(p, "}\n");
+    return p - buf;
+}
+
+// The record is formatted into a per-thread buffer and handed to stdio in one fwrite(), so concurrent records never
+// interleave and the log stays line buffered.
+static __thread char record[BLOK_EVENT_MAX_LEN];
+
+void blok_event_log(const struct blok_event *ev)
+{
+    size_t len = blok_event_format(record, ev);
+    if (fwrite(record, 1, len, BLOK_DATA->logfile) != len) {
+        BLOK_SHARD_ADD(blok_shard()->counters.op[ev->op].dropped, 1);
+    }
+}
+
+static pid_t thread_id(void)
+{
+    static __thread pid_t tid;
+    if (tid == 0) {
+        tid = syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+// Completes a callback's event with what is only known when it returns.  The start time is taken back from the
+// duration rather than kept in every frame, as only traced calls need it.  The record is formatted once for the log
+// and the flight recorder, and not at all for calls -o filter rejects.
+void blok_event_log_op(struct blok_event *ev, int result, uint64_t dur)
+{
+    ev->dur = dur;
+    ev->ts = blok_now_ns() - dur;
+    ev->pid = fuse_get_context()->pid;
+    ev->tid = thread_id();
+    ev->result = result;
+    if (blok_filter != NULL && !blok_filter_match(blok_filter, ev)) {
+        BLOK_SHARD_ADD(blok_shard()->counters.op[ev->op].filtered, 1);
+        return;
+    }
+    size_t len = blok_event_format(record, ev);
+    if (blok_event_traced(ev->op) && fwrite(record, 1, len, BLOK_DATA->logfile) != len) {
+        BLOK_SHARD_ADD(blok_shard()->counters.op[ev->op].dropped, 1);
+    }
+    if (blok_flight_enabled) {
+        blok_flight_record(ev, record, len);
+    }
+}
+
+// Same NDJSON as the calls, so the tools can read markers where they fall among them.
+void blok_event_log_marker(const char *name, size_t len, uint64_t ts, int pid, uint64_t seq)
+{
+    char buf[BLOK_JSON_STRING_MAX(PATH_MAX) + 128];
+    char *p = buf;
+    p = BLOK_JSON_LIT(p, "{\"marker\":");
+    p = blok_json_string(p, name, len);
+    p = BLOK_JSON_LIT(p, ",\"ts\":");
+    p = blok_json_u64(p, ts);
+    p = BLOK_JSON_LIT(p, ",\"pid\":");
+    p = blok_json_i64(p, pid);
+    p = BLOK_JSON_LIT(p, ",\"tid\":");
+    p = blok_json_i64(p, thread_id());
+    p = BLOK_JSON_LIT(p, ",\"phase\":");
+    p = blok_json_u64(p, seq);
+    p = BLOK_JSON_LIT(p, "}\n");
+    fwrite(buf, 1, p - buf, BLOK_DATA->logfile);
+}
+
+// The header anchors the log's monotonic timestamps to the realtime clock, read between two monotonic readings.  Logs
+// from the same boot share the monotonic clock and need no anchor; the boot ID tells the tools when that is the case.
+void blok_event_log_header(FILE *log, const char *rootdir, const char *mountpoint)
+{
+    char buf[2 * BLOK_JSON_STRING_MAX(PATH_MAX) + 256];
+    char boot_id[40] = "";
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, boot_id, sizeof(boot_id) - 1);
+        boot_id[n > 0 ? n : 0] = '\0';
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+        close(fd);
+    }
+    struct timespec real;
+    uint64_t before = blok_now_ns();
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t after = blok_now_ns();
+
+    char *p = buf;
+    p = BLOK_JSON_LIT(p, "{\"header\":\"blok\",\"version\":1,\"realtime\":");
+    p = blok_json_u64(p, (uint64_t) real.tv_sec * 1000000000ULL + real.tv_nsec);
+    p = BLOK_JSON_LIT(p, ",\"monotonic\":");
+    p = blok_json_u64(p, before + (after - before) / 2);
+    p = BLOK_JSON_LIT(p, ",\"boot_id\":");
+    p = blok_json_string(p, boot_id, strlen(boot_id));
+    p = BLOK_JSON_LIT(p, ",\"rootdir\":");
+    p = blok_json_string(p, rootdir, strlen(rootdir));
+    p = BLOK_JSON_LIT(p, ",\"mount\":");
+    p = blok_json_string(p, mountpoint, strlen(mountpoint));
+    p = BLOK_JSON_LIT(p, "}\n");
+    fwrite(buf, 1, p - buf, log);
+}
@@ -0,0 +1,70 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/fileid.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Inode generation is only exposed through an ioctl on an open descriptor, and not every file system implements it.
+// Anything going wrong here just leaves the generation at 0.
+static uint32_t fileid_generation(int fd)
+{
+#ifdef FS_IOC_GETVERSION
+    long gen = 0;
+    if (ioctl(fd, FS_IOC_GETVERSION, &gen) == 0) {
+        return (uint32_t) gen;
+    }
+#endif
+    return 0;
+}
+
+static void fileid_from_stat(const struct stat *st, struct blok_fileid *id)
+{
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->gen = 0;
+}
+
+int blok_fileid_from_fd(int fd, struct blok_fileid *id)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        memset(id, 0, sizeof(*id));
+        return -errno;
+    }
+    fileid_from_stat(&st, id);
+    id->gen = fileid_generation(fd);
+    return 0;
+}
+
+// Used where FUSE hands us a path rather than a handle (rename, link).  The generation needs a descriptor, so it is
+// fetched only for regular files and directories we are allowed to open; symlinks and special files are never opened.
+int blok_fileid_from_path(const char *fpath, struct blok_fileid *id)
+{
+    struct stat st;
+    if (lstat(fpath, &st) < 0) {
+        memset(id, 0, sizeof(*id));
+        return -errno;
+    }
+    fileid_from_stat(&st, id);
+
+    if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+        int fd = open(fpath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY);
+        if (fd >= 0) {
+            id->gen = fileid_generation(fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,525 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/filter.h"
+#include "../include/proc.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Deeper nesting of parentheses and negations than this is refused rather than recursed into.
+#define FILTER_MAX_DEPTH 64
+
+enum field {
+    FIELD_OP,
+    FIELD_PID,
+    FIELD_TID,
+    FIELD_JOB,
+    FIELD_CGROUP,
+    FIELD_OFFSET,
+    FIELD_SIZE,
+    FIELD_RESULT,
+    FIELD_ERRNO,
+    FIELD_LATENCY,
+    // string fields from here on
+    FIELD_PATH,
+    FIELD_NEWPATH,
+    FIELD_COMM,
+    FIELD_MAX
+};
+
+static const char *const field_names[FIELD_MAX] = {
+    "op", "pid", "tid", "job", "cgroup", "offset", "size", "result", "errno", "latency", "path", "newpath", "pid.comm"
+};
+
+static const struct {
+    const char *name;
+    int64_t scale;
+} suffixes[] = {
+    { "K", 1LL << 10 }, { "k", 1LL << 10 }, { "M", 1LL << 20 }, { "m", 1LL << 20 }, { "G", 1LL << 30 },
+    { "g", 1LL << 30 }, { "T", 1LL << 40 }, { "t", 1LL << 40 },
+    { "ns", 1 }, { "us", 1000 }, { "ms", 1000000 }, { "s", 1000000000 },
+};
+
+struct blok_filter *blok_filter;
+
+struct parser {
+    const char *expr;
+    const char *p;
+    struct blok_filter_insn code[BLOK_FILTER_MAX_INSNS];
+    size_t len;
+    char **strings;
+    size_t nstrings;
+    int depth;
+    char *err;
+    size_t errlen;
+    int failed;
+};
+
+static int fail(struct parser *ps, const char *fmt, ...)
+{
+    if (!ps->failed) {
+        char msg[128];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        snprintf(ps->err, ps->errlen, "%s at column %zu", msg, (size_t) (ps->p - ps->expr) + 1);
+        ps->failed = 1;
+    }
+    return -1;
+}
+
+static void skip_space(struct parser *ps)
+{
+    while (isspace((unsigned char) *ps->p)) {
+        ps->p++;
+    }
+}
+
+// Consumes tok if it comes next.
+static int accept(struct parser *ps, const char *tok)
+{
+    skip_space(ps);
+    size_t len = strlen(tok);
+    if (strncmp(ps->p, tok, len) != 0) {
+        return 0;
+    }
+    ps->p += len;
+    return 1;
+}
+
+static size_t emit(struct parser *ps, uint8_t code, uint8_t field, uint8_t cmp, int64_t imm)
+{
+    // one instruction is kept for the final return
+    if (ps->len >= BLOK_FILTER_MAX_INSNS - 1) {
+        fail(ps, "expression too long");
+        return 0;
+    }
+    ps->code[ps->len] = (struct blok_filter_insn) { code, field, cmp, imm };
+    return ps->len++;
+}
+
+static int is_word(char c)
+{
+    return c != '\0' && !isspace((unsigned char) c) && strchr("()&|!<>=\"", c) == NULL;
+}
+
+// A run of characters up to the next space or operator: field names, operation and errno names and unquoted globs.
+static size_t word(struct parser *ps, const char **start)
+{
+    skip_space(ps);
+    *start = ps->p;
+    while (is_word(*ps->p)) {
+        ps->p++;
+    }
+    return ps->p - *start;
+}
+
+static int parse_cmp(struct parser *ps, enum blok_filter_cmp *cmp)
+{
+    static const struct {
+        const char *tok;
+        enum blok_filter_cmp cmp;
+    } cmps[] = {
+        { "==", BLOK_FILTER_EQ }, { "!=", BLOK_FILTER_NE }, { "<=", BLOK_FILTER_LE }, { ">=", BLOK_FILTER_GE },
+        { "<", BLOK_FILTER_LT }, { ">", BLOK_FILTER_GT },
+    };
+    for (size_t i = 0; i < sizeof(cmps) / sizeof(cmps[0]); i++) {
+        if (accept(ps, cmps[i].tok)) {
+            *cmp = cmps[i].cmp;
+            return 0;
+        }
+    }
+    return fail(ps, "expected a comparison");
+}
+
+static int parse_number(struct parser *ps, int64_t *value)
+{
+    skip_space(ps);
+    char *end;
+    errno = 0;
+    long long n = strtoll(ps->p, &end, 10);
+    if (end == ps->p || errno == ERANGE) {
+        return fail(ps, "expected a number");
+    }
+    ps->p = end;
+    const char *suffix = ps->p;
+    while (isalpha((unsigned char) *ps->p)) {
+        ps->p++;
+    }
+    size_t len = ps->p - suffix;
+    if (len == 0) {
+        *value = n;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        if (strlen(suffixes[i].name) == len && strncmp(suffix, suffixes[i].name, len) == 0) {
+            if (__builtin_mul_overflow(n, suffixes[i].scale, value)) {
+                return fail(ps, "number out of range");
+            }
+            return 0;
+        }
+    }
+    ps->p = suffix;
+    return fail(ps, "unknown suffix '%.*s'", (int) len, suffix);
+}
+
+static int parse_op(struct parser *ps, int64_t *value)
+{
+    const char *name;
+    size_t len = word(ps, &name);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        if (strlen(blok_op_name(op)) == len && strncmp(name, blok_op_name(op), len) == 0) {
+            *value = op;
+            return 0;
+        }
+    }
+    ps->p = name;
+    return fail(ps, "unknown operation '%.*s'", (int) len, name);
+}
+
+static int parse_errno(struct parser *ps, int64_t *value)
+{
+    skip_space(ps);
+    if (isdigit((unsigned char) *ps->p)) {
+        return parse_number(ps, value);
+    }
+    const char *name;
+    size_t len = word(ps, &name);
+    // errno values stay well below 256 on Linux
+    for (int err = 1; err < 256; err++) {
+        const char *errname = blok_errno_name(err);
+        if (errname != NULL && strlen(errname) == len && strncmp(name, errname, len) == 0) {
+            *value = err;
+            return 0;
+        }
+    }
+    ps->p = name;
+    return fail(ps, "unknown errno '%.*s'", (int) len, name);
+}
+
+// A quoted string, with \" and \\ escapes, or a bare word; added to the program's strings.
+static int parse_string(struct parser *ps, int64_t *index)
+{
+    skip_space(ps);
+    const char *start = ps->p;
+    char *s;
+    if (*ps->p == '"') {
+        s = malloc(strlen(ps->p));
+        if (s == NULL) {
+            return fail(ps, "out of memory");
+        }
+        size_t len = 0;
+        for (ps->p++; *ps->p != '"'; ps->p++) {
+            if (*ps->p == '\\' && (ps->p[1] == '"' || ps->p[1] == '\\')) {
+                ps->p++;
+            }
+            if (*ps->p == '\0') {
+                free(s);
+                ps->p = start;
+                return fail(ps, "unterminated string");
+            }
+            s[len++] = *ps->p;
+        }
+        ps->p++;
+        s[len] = '\0';
+    } else {
+        size_t len = word(ps, &start);
+        if (len == 0) {
+            return fail(ps, "expected a string");
+        }
+        s = strndup(start, len);
+        if (s == NULL) {
+            return fail(ps, "out of memory");
+        }
+    }
+    char **grown = realloc(ps->strings, (ps->nstrings + 1) * sizeof(char *));
+    if (grown == NULL) {
+        free(s);
+        return fail(ps, "out of memory");
+    }
+    ps->strings = grown;
+    ps->strings[ps->nstrings] = s;
+    *index = ps->nstrings++;
+    return 0;
+}
+
+static int parse_comparison(struct parser *ps)
+{
+    const char *name;
+    size_t len = word(ps, &name);
+    enum field field;
+    for (field = 0; field < FIELD_MAX; field++) {
+        if (strlen(field_names[field]) == len && strncmp(name, field_names[field], len) == 0) {
+            break;
+        }
+    }
+    if (field == FIELD_MAX && len == 3 && strncmp(name, "dur", 3) == 0) {
+        field = FIELD_LATENCY;
+    }
+    if (field == FIELD_MAX) {
+        ps->p = name;
+        return len == 0 ? fail(ps, "expected a field") : fail(ps, "unknown field '%.*s'", (int) len, name);
+    }
+
+    const char *at = ps->p;
+    enum blok_filter_cmp cmp = BLOK_FILTER_EQ;
+    if (parse_cmp(ps, &cmp) < 0) {
+        return -1;
+    }
+    int64_t value = 0;
+    if (field >= FIELD_PATH || field == FIELD_OP) {
+        if (cmp != BLOK_FILTER_EQ && cmp != BLOK_FILTER_NE) {
+            ps->p = at;
+            return fail(ps, "%s only compares with == and !=", field_names[field]);
+        }
+    }
+    if (field >= FIELD_PATH) {
+        if (parse_string(ps, &value) < 0) {
+            return -1;
+        }
+        emit(ps, BLOK_FILTER_MATCH, field, cmp, value);
+        return 0;
+    }
+    int err = field == FIELD_OP ? parse_op(ps, &value)
+              : field == FIELD_ERRNO ? parse_errno(ps, &value)
+              : parse_number(ps, &value);
+    if (err < 0) {
+        return -1;
+    }
+    emit(ps, BLOK_FILTER_CMP, field, cmp, value);
+    return 0;
+}
+
+static int parse_or(struct parser *ps);
+
+static int parse_unary(struct parser *ps)
+{
+    if (++ps->depth > FILTER_MAX_DEPTH) {
+        return fail(ps, "nested too deeply");
+    }
+    int err;
+    if (accept(ps, "!")) {
+        err = parse_unary(ps);
+        emit(ps, BLOK_FILTER_NOT, 0, 0, 0);
+    } else if (accept(ps, "(")) {
+        err = parse_or(ps);
+        if (err == 0 && !accept(ps, ")")) {
+            err = fail(ps, "expected ')'");
+        }
+    } else {
+        err = parse_comparison(ps);
+    }
+    ps->depth--;
+    return err;
+}
+
+// Left to right with short-circuit jumps: each operand but the last jumps to the end when it decides the result,
+// leaving its value in the accumulator.  Until the end is known the jumps are chained through their targets.
+static int parse_chain(struct parser *ps, const char *tok, uint8_t jump, int (*operand)(struct parser *))
+{
+    int64_t chain = -1;
+    if (operand(ps) < 0) {
+        return -1;
+    }
+    while (accept(ps, tok)) {
+        size_t at = emit(ps, jump, 0, 0, chain);
+        if (ps->failed || operand(ps) < 0) {
+            return -1;
+        }
+        chain = at;
+    }
+    while (chain >= 0) {
+        int64_t next = ps->code[chain].imm;
+        ps->code[chain].imm = ps->len;
+        chain = next;
+    }
+    return 0;
+}
+
+static int parse_and(struct parser *ps)
+{
+    return parse_chain(ps, "&&", BLOK_FILTER_JF, parse_unary);
+}
+
+static int parse_or(struct parser *ps)
+{
+    return parse_chain(ps, "||", BLOK_FILTER_JT, parse_and);
+}
+
+void blok_filter_free(struct blok_filter *filter)
+{
+    if (filter == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < filter->nstrings; i++) {
+        free(filter->strings[i]);
+    }
+    free(filter->strings);
+    free(filter);
+}
+
+struct blok_filter *blok_filter_compile(const char *expr, char *err, size_t errlen)
+{
+    struct parser *ps = calloc(1, sizeof(struct parser));
+    if (ps == NULL) {
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    ps->expr = ps->p = expr;
+    ps->err = err;
+    ps->errlen = errlen;
+    if (parse_or(ps) == 0) {
+        skip_space(ps);
+        if (*ps->p != '\0') {
+            fail(ps, "unexpected '%c'", *ps->p);
+        }
+    }
+    emit(ps, BLOK_FILTER_RET, 0, 0, 0);
+
+    struct blok_filter *filter = NULL;
+    if (!ps->failed) {
+        filter = malloc(sizeof(struct blok_filter) + ps->len * sizeof(struct blok_filter_insn));
+        if (filter == NULL) {
+            fail(ps, "out of memory");
+        }
+    }
+    if (filter == NULL) {
+        for (size_t i = 0; i < ps->nstrings; i++) {
+            free(ps->strings[i]);
+        }
+        free(ps->strings);
+        free(ps);
+        return NULL;
+    }
+    filter->strings = ps->strings;
+    filter->nstrings = ps->nstrings;
+    filter->len = ps->len;
+    memcpy(filter->code, ps->code, ps->len * sizeof(struct blok_filter_insn));
+    free(ps);
+    if (blok_filter_verify(filter) < 0) {
+        snprintf(err, errlen, "compiled program failed verification");
+        blok_filter_free(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+int blok_filter_verify(const struct blok_filter *filter)
+{
+    if (filter->len == 0 || filter->len > BLOK_FILTER_MAX_INSNS
+        || filter->code[filter->len - 1].code != BLOK_FILTER_RET) {
+        return -1;
+    }
+    for (size_t i = 0; i < filter->len; i++) {
+        const struct blok_filter_insn *insn = &filter->code[i];
+        switch (insn->code) {
+        case BLOK_FILTER_CMP:
+            if (insn->field >= FIELD_PATH || insn->cmp >= BLOK_FILTER_CMP_MAX) {
+                return -1;
+            }
+            break;
+        case BLOK_FILTER_MATCH:
+            if (insn->field < FIELD_PATH || insn->field >= FIELD_MAX
+                || (insn->cmp != BLOK_FILTER_EQ && insn->cmp != BLOK_FILTER_NE)
+                || insn->imm < 0 || (uint64_t) insn->imm >= filter->nstrings || filter->strings[insn->imm] == NULL) {
+                return -1;
+            }
+            break;
+        case BLOK_FILTER_JT:
+        case BLOK_FILTER_JF:
+            // forward only, so every instruction runs at most once
+            if (insn->imm <= (int64_t) i || (uint64_t) insn->imm >= filter->len) {
+                return -1;
+            }
+            break;
+        case BLOK_FILTER_NOT:
+        case BLOK_FILTER_RET:
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int64_t field_value(enum field field, const struct blok_event *ev)
+{
+    switch (field) {
+    case FIELD_OP:      return ev->op;
+    case FIELD_PID:     return ev->pid;
+    case FIELD_TID:     return ev->tid;
+    case FIELD_JOB:     return ev->job;
+    case FIELD_CGROUP:  return (int64_t) ev->cgroup;
+    case FIELD_OFFSET:  return ev->offset;
+    case FIELD_SIZE:    return (int64_t) ev->size;
+    case FIELD_RESULT:  return ev->result;
+    case FIELD_ERRNO:   return ev->result < 0 ? -ev->result : 0;
+    case FIELD_LATENCY: return (int64_t) ev->dur;
+    default:            return 0;
+    }
+}
+
+static const char *field_string(enum field field, const struct blok_event *ev)
+{
+    switch (field) {
+    case FIELD_PATH:    return ev->path != NULL ? ev->path : "";
+    case FIELD_NEWPATH: return ev->newpath != NULL ? ev->newpath : "";
+    case FIELD_COMM:    return blok_proc_lookup(ev->pid)->comm;
+    default:            return "";
+    }
+}
+
+static int compare(enum blok_filter_cmp cmp, int64_t a, int64_t b)
+{
+    switch (cmp) {
+    case BLOK_FILTER_EQ: return a == b;
+    case BLOK_FILTER_NE: return a != b;
+    case BLOK_FILTER_LT: return a < b;
+    case BLOK_FILTER_LE: return a <= b;
+    case BLOK_FILTER_GT: return a > b;
+    default:             return a >= b;
+    }
+}
+
+int blok_filter_match(const struct blok_filter *filter, const struct blok_event *ev)
+{
+    int acc = 0;
+    for (const struct blok_filter_insn *insn = filter->code;; insn++) {
+        switch (insn->code) {
+        case BLOK_FILTER_CMP:
+            acc = compare(insn->cmp, field_value(insn->field, ev), insn->imm);
+            break;
+        case BLOK_FILTER_MATCH:
+            acc = (fnmatch(filter->strings[insn->imm], field_string(insn->field, ev), 0) == 0)
+                  == (insn->cmp == BLOK_FILTER_EQ);
+            break;
+        case BLOK_FILTER_JT:
+            if (acc) {
+                insn = filter->code + insn->imm - 1;
+            }
+            break;
+        case BLOK_FILTER_JF:
+            if (!acc) {
+                insn = filter->code + insn->imm - 1;
+            }
+            break;
+        case BLOK_FILTER_NOT:
+            acc = !acc;
+            break;
+        default:
+            return acc;
+        }
+    }
+}
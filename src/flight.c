@@ -0,0 +1,404 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/flight.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// how long after a trigger the rings are dumped, and how long after a dump further triggers are ignored
+#define FLIGHT_POST_MS 1000
+#define FLIGHT_HOLDOFF_NS (10 * 1000000000ULL)
+
+int blok_flight_enabled;
+
+// Threads whose ring the memory budget refused record nothing.
+static struct blok_flight_ring no_ring;
+
+static struct {
+    struct blok_flight_config config;
+    uint64_t window_ns;
+    uint64_t latency_ns;
+    int wake[2];
+    int running;
+    int stop;
+    pthread_t dumper;
+    pthread_mutex_t lock;       // of dumps and last_file, which the statistics read
+
+    const char *reason;         // of the pending trigger, NULL if there is none
+    int reason_pid;
+    uint64_t triggers;
+    uint64_t suppressed;
+    uint64_t dumps;
+    uint64_t last_dump;
+    char last_file[PATH_MAX];
+    struct blok_counters scratch;
+} flight = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct flight_shrink {
+    uint64_t want;
+    uint64_t freed;
+};
+
+static void shrink_ring(struct blok_shard *shard, void *arg)
+{
+    struct flight_shrink *s = arg;
+    struct blok_flight_ring *ring = shard->flight;
+    if (s->freed >= s->want || ring == NULL || ring == &no_ring || __atomic_load_n(&shard->owned, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&shard->flight, NULL, __ATOMIC_RELEASE);
+    free(ring);
+    blok_mem_uncharge(BLOK_MEM_FLIGHT, sizeof(struct blok_flight_ring) + flight.config.ring_size);
+    s->freed += sizeof(struct blok_flight_ring) + flight.config.ring_size;
+}
+
+// Gives up the rings of threads that have exited, and with them what those threads last did.  The registry lock
+// blok_shard_foreach() holds keeps both a new thread taking over the shard and the dumper copying the ring away.
+static uint64_t flight_shrink(void *arg, uint64_t want)
+{
+    struct flight_shrink s = { want, 0 };
+    blok_shard_foreach(shrink_ring, &s);
+    return s.freed;
+}
+
+int blok_flight_open(const struct blok_flight_config *config)
+{
+    flight.config = *config;
+    flight.config.dir = strdup(config->dir);
+    flight.config.rootdir = strdup(config->rootdir);
+    flight.config.mountpoint = strdup(config->mountpoint);
+    if (flight.config.dir == NULL || flight.config.rootdir == NULL || flight.config.mountpoint == NULL) {
+        return -ENOMEM;
+    }
+    flight.window_ns = config->window * 1000000000ULL;
+    flight.latency_ns = config->latency_ms * 1000000ULL;
+    if (pipe2(flight.wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        return -errno;
+    }
+    blok_mem_register_shrinker(BLOK_MEM_FLIGHT, flight_shrink, NULL);
+    blok_flight_enabled = 1;
+    return 0;
+}
+
+static struct blok_flight_ring *flight_ring(void)
+{
+    struct blok_shard *shard = blok_shard();
+    struct blok_flight_ring *ring = shard->flight;
+    if (ring != NULL) {
+        return ring;
+    }
+    ring = &no_ring;
+    if (blok_mem_charge(BLOK_MEM_FLIGHT, sizeof(struct blok_flight_ring) + flight.config.ring_size) == 0) {
+        ring = malloc(sizeof(struct blok_flight_ring) + flight.config.ring_size);
+        if (ring != NULL) {
+            ring->head = 0;
+            ring->reserved = 0;
+            ring->size = flight.config.ring_size;
+        } else {
+            blok_mem_uncharge(BLOK_MEM_FLIGHT, sizeof(struct blok_flight_ring) + flight.config.ring_size);
+            ring = &no_ring;
+        }
+    }
+    __atomic_store_n(&shard->flight, ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+void blok_flight_record(const struct blok_event *ev, const char *rec, size_t len)
+{
+    struct blok_flight_ring *ring = flight_ring();
+    if (len <= ring->size) {
+        __atomic_store_n(&ring->reserved, ring->head + len, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        size_t at = ring->head % ring->size;
+        size_t first = len < ring->size - at ? len : ring->size - at;
+        memcpy(ring->data + at, rec, first);
+        memcpy(ring->data, rec + first, len - first);
+        __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+    }
+
+    if (flight.latency_ns != 0 && ev->dur >= flight.latency_ns) {
+        blok_flight_trigger("latency", ev->pid);
+    }
+    if (flight.config.pid != 0 && ev->op == BLOK_OP_OPEN && ev->pid == flight.config.pid && ev->result >= 0) {
+        blok_flight_trigger("pid", ev->pid);
+    }
+}
+
+// Only the first trigger wakes the dumper; the rest are counted until it has taken the reason.
+void blok_flight_trigger(const char *reason, int pid)
+{
+    const char *none = NULL;
+    __atomic_fetch_add(&flight.triggers, 1, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&flight.reason, &none, reason, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&flight.reason_pid, pid, __ATOMIC_RELAXED);
+        char c = 't';
+        if (write(flight.wake[1], &c, 1) < 0) {
+            // the pipe is full of earlier wakeups, which is just as good
+        }
+    }
+}
+
+static void flight_signal(int sig)
+{
+    int saved = errno;
+    blok_flight_trigger("signal", 0);
+    errno = saved;
+}
+
+struct ring_copy {
+    char *data;
+    size_t len;
+};
+
+struct ring_copies {
+    struct ring_copy *copies;
+    size_t n;
+    size_t cap;
+};
+
+// Copies what the ring holds, then drops the bytes the writer may have overwritten meanwhile, up to the end of the
+// record it may be in the middle of, and the partial record they, or the ring's wrapping, leave at the start.
+static void copy_ring(struct blok_shard *shard, void *arg)
+{
+    struct ring_copies *rc = arg;
+    struct blok_flight_ring *ring = __atomic_load_n(&shard->flight, __ATOMIC_ACQUIRE);
+    if (ring == NULL || ring->size == 0 || rc->n == rc->cap) {
+        return;
+    }
+    uint64_t before = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t len = before < ring->size ? before : ring->size;
+    char *data = malloc(len);
+    if (data == NULL) {
+        return;
+    }
+    uint64_t start = before - len;
+    size_t at = start % ring->size;
+    size_t first = len < ring->size - at ? len : ring->size - at;
+    memcpy(data, ring->data + at, first);
+    memcpy(data + first, ring->data, len - first);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t reserved = __atomic_load_n(&ring->reserved, __ATOMIC_RELAXED);
+
+    // writing up to reserved overwrites everything before reserved - size
+    uint64_t overwritten = reserved > start + ring->size ? reserved - ring->size - start : 0;
+    size_t skip = overwritten < len ? overwritten : len;
+    if (start > 0 || skip > 0) {
+        // the oldest record may have been cut by the wrap, or overwritten
+        char *nl = memchr(data + skip, '\n', len - skip);
+        skip = nl != NULL ? nl + 1 - data : len;
+    }
+    rc->copies[rc->n++] = (struct ring_copy) { data, len };
+    memmove(data, data + skip, len - skip);
+    rc->copies[rc->n - 1].len = len - skip;
+}
+
+static void count_shard(struct blok_shard *shard, void *arg)
+{
+    (*(size_t *) arg)++;
+}
+
+struct line {
+    uint64_t ts;
+    const char *p;
+    size_t len;
+};
+
+static int line_cmp(const void *x, const void *y)
+{
+    const struct line *a = x;
+    const struct line *b = y;
+    return (a->ts > b->ts) - (a->ts < b->ts);
+}
+
+// Records start with {"op":"NAME","ts":, as blok_event_format() writes them.
+static uint64_t line_ts(const char *p, size_t len)
+{
+    const char *ts = memmem(p, len < 48 ? len : 48, "\"ts\":", 5);
+    return ts != NULL ? strtoull(ts + 5, NULL, 10) : 0;
+}
+
+static void flight_dump(const char *reason, int pid)
+{
+    size_t shards = 0;
+    blok_shard_foreach(count_shard, &shards);
+    struct ring_copies rc = { calloc(shards + 4, sizeof(struct ring_copy)), 0, shards + 4 };
+    if (rc.copies == NULL) {
+        return;
+    }
+    blok_shard_foreach(copy_ring, &rc);
+
+    uint64_t now = blok_now_ns();
+    uint64_t from = flight.window_ns != 0 && now > flight.window_ns ? now - flight.window_ns : 0;
+    size_t nlines = 0, cap = 0;
+    struct line *lines = NULL;
+    for (size_t i = 0; i < rc.n; i++) {
+        const char *p = rc.copies[i].data;
+        const char *end = p + rc.copies[i].len;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            size_t len = (nl != NULL ? nl + 1 : end) - p;
+            uint64_t ts = line_ts(p, len);
+            if (ts >= from) {
+                if (nlines == cap) {
+                    cap = cap ? cap * 2 : 4096;
+                    struct line *grown = realloc(lines, cap * sizeof(struct line));
+                    if (grown == NULL) {
+                        break;
+                    }
+                    lines = grown;
+                }
+                lines[nlines++] = (struct line) { ts, p, len };
+            }
+            p += len;
+        }
+    }
+    qsort(lines, nlines, sizeof(struct line), line_cmp);
+
+    char path[PATH_MAX];
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    snprintf(path, sizeof(path), "%s/blok-flight.%lld.%llu.log", flight.config.dir, (long long) real.tv_sec,
+             (unsigned long long) flight.dumps + 1);
+    FILE *out = fopen(path, "w");
+    if (out != NULL) {
+        blok_event_log_header(out, flight.config.rootdir, flight.config.mountpoint);
+        fprintf(out, "{\"trigger\":\"%s\",\"ts\":%llu,\"pid\":%d,\"calls\":%zu}\n", reason,
+                (unsigned long long) now, pid, nlines);
+        for (size_t i = 0; i < nlines; i++) {
+            fwrite(lines[i].p, 1, lines[i].len, out);
+        }
+        if (fclose(out) == 0) {
+            pthread_mutex_lock(&flight.lock);
+            flight.dumps++;
+            strcpy(flight.last_file, path);
+            pthread_mutex_unlock(&flight.lock);
+        }
+    }
+    free(lines);
+    for (size_t i = 0; i < rc.n; i++) {
+        free(rc.copies[i].data);
+    }
+    free(rc.copies);
+}
+
+static uint64_t total_errors(void)
+{
+    blok_counters_read(&flight.scratch);
+    uint64_t errors = 0;
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        errors += flight.scratch.op[op].errors;
+    }
+    return errors;
+}
+
+// Returns 0 when asked to stop.
+static int drain(void)
+{
+    char buf[64];
+    while (read(flight.wake[0], buf, sizeof(buf)) > 0) {
+    }
+    return !__atomic_load_n(&flight.stop, __ATOMIC_ACQUIRE);
+}
+
+static void *flight_dumper(void *arg)
+{
+    struct pollfd pfd = { .fd = flight.wake[0], .events = POLLIN };
+    uint64_t errors = total_errors();
+    uint64_t checked = blok_now_ns();
+    for (;;) {
+        int ready = poll(&pfd, 1, flight.config.errors != 0 ? 1000 : -1);
+        if (ready > 0 && !drain()) {
+            break;
+        }
+        if (flight.config.errors != 0 && blok_now_ns() - checked >= 1000000000ULL) {
+            uint64_t now_errors = total_errors();
+            uint64_t now = blok_now_ns();
+            if ((now_errors - errors) * 1e9 / (now - checked) > flight.config.errors) {
+                blok_flight_trigger("errors", 0);
+            }
+            errors = now_errors;
+            checked = now;
+        }
+
+        const char *reason = __atomic_load_n(&flight.reason, __ATOMIC_ACQUIRE);
+        if (reason == NULL) {
+            continue;
+        }
+        int pid = __atomic_load_n(&flight.reason_pid, __ATOMIC_RELAXED);
+        if (flight.dumps > 0 && blok_now_ns() - flight.last_dump < FLIGHT_HOLDOFF_NS) {
+            __atomic_fetch_add(&flight.suppressed, 1, __ATOMIC_RELAXED);
+        } else {
+            uint64_t until = blok_now_ns() + FLIGHT_POST_MS * 1000000ULL;
+            int stopping = 0;
+            for (uint64_t now; !stopping && (now = blok_now_ns()) < until; ) {
+                stopping = poll(&pfd, 1, (until - now) / 1000000 + 1) > 0 && !drain();
+            }
+            if (stopping) {
+                break;
+            }
+            flight_dump(reason, pid);
+            flight.last_dump = blok_now_ns();
+        }
+        __atomic_store_n(&flight.reason, NULL, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int blok_flight_start(void)
+{
+    int err = pthread_create(&flight.dumper, NULL, flight_dumper, NULL);
+    if (err != 0) {
+        return -err;
+    }
+    flight.running = 1;
+    struct sigaction sa = { .sa_handler = flight_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    return 0;
+}
+
+void blok_flight_close(void)
+{
+    if (!blok_flight_enabled) {
+        return;
+    }
+    signal(SIGUSR1, SIG_DFL);
+    if (flight.running) {
+        __atomic_store_n(&flight.stop, 1, __ATOMIC_RELEASE);
+        char c = 'q';
+        while (write(flight.wake[1], &c, 1) < 0 && errno == EINTR) {
+        }
+        pthread_join(flight.dumper, NULL);
+        flight.running = 0;
+    }
+}
+
+void blok_flight_stats(FILE *out)
+{
+    fprintf(out, "flight.triggers %llu\n", (unsigned long long) __atomic_load_n(&flight.triggers, __ATOMIC_RELAXED));
+    fprintf(out, "flight.suppressed %llu\n",
+            (unsigned long long) __atomic_load_n(&flight.suppressed, __ATOMIC_RELAXED));
+    pthread_mutex_lock(&flight.lock);
+    fprintf(out, "flight.dumps %llu\n", (unsigned long long) flight.dumps);
+    if (flight.dumps > 0) {
+        fprintf(out, "flight.last_dump %s\n", flight.last_file);
+    }
+    pthread_mutex_unlock(&flight.lock);
+}
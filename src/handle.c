@@ -0,0 +1,36 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#include "../include/handle.h"
+#include "../include/alloc.h"
+#include <string.h>
+
+static struct blok_slab handles;
+
+void blok_handle_init(void)
+{
+    blok_slab_init(&handles, "handles", BLOK_MEM_HANDLES, sizeof(struct blok_handle));
+}
+
+struct blok_handle *blok_handle_new(int fd)
+{
+    struct blok_handle *handle = blok_slab_alloc(&handles);
+    if (handle == NULL) {
+        return NULL;
+    }
+    memset(handle, 0, sizeof(*handle));
+    handle->fd = fd;
+    if (fd >= 0) {
+        blok_fileid_from_fd(fd, &handle->id);
+    }
+    return handle;
+}
+
+void blok_handle_free(struct blok_handle *handle)
+{
+    blok_slab_free(&handles, handle);
+}
@@ -0,0 +1,330 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/heat.h"
+#include "../include/state.h"
+#include <stddef.h>
+#include <string.h>
+
+// Tags are always odd, so neither value collides with a claimed slot.
+#define HEAT_EMPTY 0
+#define HEAT_TOMBSTONE 2
+
+// Values of ready.  Entries are PENDING only while a compaction is moving them; a compaction interrupted by a crash
+// is finished when the table is loaded again.
+#define HEAT_PUBLISHED 1
+#define HEAT_PENDING 2
+
+// Give up on a block after this many probes; the access is then only counted in heat_dropped.
+#define HEAT_MAX_PROBES 64
+
+static uint64_t heat_hash(const struct blok_fileid *id, uint64_t block)
+{
+    uint64_t h = id->ino * 0x9e3779b97f4a7c15ULL;
+    h ^= (id->dev + ((uint64_t) id->gen << 32)) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= block * 0x165667b19e3779f9ULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h | 1;
+}
+
+static void heat_entry_id(const struct blok_heat_entry *e, struct blok_fileid *id)
+{
+    id->dev = e->dev;
+    id->ino = e->ino;
+    id->gen = e->gen;
+}
+
+static int heat_matches(const struct blok_heat_entry *e, const struct blok_fileid *id, uint64_t block)
+{
+    return e->block == block && e->ino == id->ino && e->dev == id->dev && e->gen == id->gen;
+}
+
+static int heat_same_key(const struct blok_heat_entry *a, const struct blok_heat_entry *b)
+{
+    return a->block == b->block && a->ino == b->ino && a->dev == b->dev && a->gen == b->gen;
+}
+
+static void heat_compact(struct blok_heat *heat, uint32_t target_shift, uint64_t evict_below, int resume);
+
+void blok_heat_attach(struct blok_heat *heat, struct blok_heat_entry *entries, struct blok_state_header *header)
+{
+    heat->entries = entries;
+    heat->header = header;
+    heat->block_shift = header->heat_block_shift;
+    heat->pressure = 0;
+
+    // compaction must not be starved by a steady stream of reads
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&heat->resize, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+void blok_heat_detach(struct blok_heat *heat)
+{
+    if (heat->entries != NULL) {
+        pthread_rwlock_destroy(&heat->resize);
+        heat->entries = NULL;
+    }
+}
+
+// Called once at mount, before any FUSE thread is running.  Returns the number of half-inserted slots found.
+uint64_t blok_heat_recover(struct blok_heat *heat)
+{
+    struct blok_state_header *h = heat->header;
+    uint64_t torn = 0;
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < h->heat_capacity; i++) {
+        struct blok_heat_entry *e = &heat->entries[i];
+        if (e->tag == HEAT_EMPTY || e->tag == HEAT_TOMBSTONE) {
+            continue;
+        }
+        if (!e->ready) {
+            e->tag = HEAT_TOMBSTONE;
+            torn++;
+            continue;
+        }
+        used++;
+    }
+    h->heat_used = used;
+
+    if (h->heat_compacting) {
+        heat_compact(heat, h->heat_target_shift, 0, 1);
+    }
+    return torn;
+}
+
+static struct blok_heat_entry *heat_lookup(struct blok_heat *heat, const struct blok_fileid *id, uint64_t block)
+{
+    uint64_t tag = heat_hash(id, block);
+    uint64_t mask = heat->header->heat_capacity - 1;
+
+    for (uint64_t probe = 0; probe < HEAT_MAX_PROBES; probe++) {
+        struct blok_heat_entry *e = &heat->entries[(tag + probe) & mask];
+        uint64_t cur = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);
+
+        if (cur == HEAT_EMPTY) {
+            uint64_t expected = HEAT_EMPTY;
+            if (__atomic_compare_exchange_n(&e->tag, &expected, tag, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                e->dev = id->dev;
+                e->ino = id->ino;
+                e->gen = id->gen;
+                e->block = block;
+                __atomic_store_n(&e->ready, HEAT_PUBLISHED, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&heat->header->heat_used, 1, __ATOMIC_RELAXED);
+                return e;
+            }
+            cur = expected;
+        }
+        if (cur != tag) {
+            continue;
+        }
+        // someone else claimed a slot for the same hash; wait for the key to become visible before comparing
+        while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        }
+        if (heat_matches(e, id, block)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void blok_heat_record(struct blok_heat *heat, const struct blok_fileid *id, uint64_t offset, uint64_t size, int write)
+{
+    if (heat->entries == NULL || size == 0) {
+        return;
+    }
+    struct blok_state_header *h = heat->header;
+
+    pthread_rwlock_rdlock(&heat->resize);
+    uint64_t first = offset >> heat->block_shift;
+    uint64_t last = (offset + size - 1) >> heat->block_shift;
+
+    for (uint64_t block = first; block <= last; block++) {
+        struct blok_heat_entry *e = heat_lookup(heat, id, block);
+        if (e == NULL) {
+            __atomic_fetch_add(&h->heat_dropped, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&heat->pressure, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_fetch_add(write ? &e->writes : &e->reads, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&h->heat_used, __ATOMIC_RELAXED) >= BLOK_HEAT_HIGH_WATER(h->heat_capacity)) {
+        __atomic_store_n(&heat->pressure, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&heat->resize);
+}
+
+int blok_heat_under_pressure(struct blok_heat *heat)
+{
+    return heat->entries != NULL && __atomic_load_n(&heat->pressure, __ATOMIC_RELAXED);
+}
+
+// Re-inserts an entry taken out of its slot by compaction.  Landing on an entry that is itself still waiting to be
+// moved swaps the two and carries on with the displaced one, so the table is rehashed in place without scratch memory.
+static void heat_place(struct blok_heat *heat, struct blok_heat_entry *moving, uint32_t shift_delta,
+                       uint64_t evict_below)
+{
+    struct blok_state_header *h = heat->header;
+    uint64_t mask = h->heat_capacity - 1;
+
+    for (;;) {
+        if (moving->reads + moving->writes < evict_below) {
+            h->heat_evicted++;
+            return;
+        }
+        struct blok_fileid id;
+        heat_entry_id(moving, &id);
+        moving->block >>= shift_delta;
+        moving->tag = heat_hash(&id, moving->block);
+        moving->ready = HEAT_PUBLISHED;
+
+        uint64_t probe;
+        for (probe = 0; probe < HEAT_MAX_PROBES; probe++) {
+            struct blok_heat_entry *e = &heat->entries[(moving->tag + probe) & mask];
+            if (e->tag == HEAT_EMPTY) {
+                *e = *moving;
+                h->heat_used++;
+                return;
+            }
+            if (e->ready == HEAT_PENDING) {
+                struct blok_heat_entry displaced = *e;
+                *e = *moving;
+                *moving = displaced;
+                break;
+            }
+            if (e->tag == moving->tag && heat_same_key(e, moving)) {
+                e->reads += moving->reads;
+                e->writes += moving->writes;
+                return;
+            }
+        }
+        if (probe == HEAT_MAX_PROBES) {
+            h->heat_dropped += moving->reads + moving->writes;
+            return;
+        }
+        // the slot stays taken, so heat_used is unchanged; the displaced entry is placed on the next round
+    }
+}
+
+// Rehashes the table at target_shift, dropping entries accessed fewer than evict_below times.  Runs with 'resize'
+// held exclusively (or before the mount is live).  The target is recorded in the header first, so a compaction cut
+// short by a crash can be resumed: entries still PENDING are at the old block size, PUBLISHED ones at the new one.
+static void heat_compact(struct blok_heat *heat, uint32_t target_shift, uint64_t evict_below, int resume)
+{
+    struct blok_state_header *h = heat->header;
+    uint32_t shift_delta = target_shift - h->heat_block_shift;
+
+    if (!resume) {
+        h->heat_target_shift = target_shift;
+        __atomic_store_n(&h->heat_compacting, 1, __ATOMIC_RELEASE);
+        for (uint64_t i = 0; i < h->heat_capacity; i++) {
+            struct blok_heat_entry *e = &heat->entries[i];
+            if (e->tag == HEAT_TOMBSTONE) {
+                memset(e, 0, sizeof(*e));
+            } else if (e->tag != HEAT_EMPTY) {
+                e->ready = HEAT_PENDING;
+            }
+        }
+    }
+
+    for (uint64_t i = 0; i < h->heat_capacity; i++) {
+        struct blok_heat_entry *e = &heat->entries[i];
+        while (e->tag != HEAT_EMPTY && e->tag != HEAT_TOMBSTONE && e->ready == HEAT_PENDING) {
+            struct blok_heat_entry moving = *e;
+            memset(e, 0, sizeof(*e));
+            h->heat_used--;
+            heat_place(heat, &moving, shift_delta, evict_below);
+        }
+    }
+
+    h->heat_block_shift = target_shift;
+    heat->block_shift = target_shift;
+    __atomic_store_n(&h->heat_compacting, 0, __ATOMIC_RELEASE);
+}
+
+// Coarsening only pays off when neighbouring blocks of the same file are both present, as each such pair folds into
+// one entry.  Counts the entries that have their buddy block in the table.
+static uint64_t heat_mergeable(struct blok_heat *heat)
+{
+    struct blok_state_header *h = heat->header;
+    uint64_t mask = h->heat_capacity - 1;
+    uint64_t mergeable = 0;
+
+    for (uint64_t i = 0; i < h->heat_capacity; i++) {
+        struct blok_heat_entry *e = &heat->entries[i];
+        if (e->tag == HEAT_EMPTY || e->tag == HEAT_TOMBSTONE) {
+            continue;
+        }
+        struct blok_fileid id;
+        heat_entry_id(e, &id);
+        uint64_t buddy = e->block ^ 1;
+        uint64_t tag = heat_hash(&id, buddy);
+        for (uint64_t probe = 0; probe < HEAT_MAX_PROBES; probe++) {
+            struct blok_heat_entry *b = &heat->entries[(tag + probe) & mask];
+            if (b->tag == HEAT_EMPTY) {
+                break;
+            }
+            if (b->tag == tag && heat_matches(b, &id, buddy)) {
+                mergeable++;
+                break;
+            }
+        }
+    }
+    return mergeable;
+}
+
+// Smallest power of two such that evicting every entry with fewer accesses frees at least 'need' slots.
+static uint64_t heat_evict_threshold(struct blok_heat *heat, uint64_t need)
+{
+    struct blok_state_header *h = heat->header;
+    uint64_t below[65] = { 0 };
+
+    for (uint64_t i = 0; i < h->heat_capacity; i++) {
+        struct blok_heat_entry *e = &heat->entries[i];
+        if (e->tag == HEAT_EMPTY || e->tag == HEAT_TOMBSTONE) {
+            continue;
+        }
+        uint64_t accesses = e->reads + e->writes;
+        below[accesses == 0 ? 0 : 64 - __builtin_clzll(accesses)]++;
+    }
+    uint64_t freed = 0;
+    for (int bit = 0; bit < 64; bit++) {
+        freed += below[bit];
+        if (freed >= need) {
+            return 1ULL << bit;
+        }
+    }
+    return UINT64_MAX;
+}
+
+// Brings the table back under its low water mark (half full).  Coarsening keeps every count but loses resolution,
+// so it is tried first and only when it folds a worthwhile share of the entries; the coldest entries are evicted for
+// whatever is still missing.
+void blok_heat_relieve(struct blok_heat *heat)
+{
+    struct blok_state_header *h = heat->header;
+
+    pthread_rwlock_wrlock(&heat->resize);
+    __atomic_store_n(&heat->pressure, 0, __ATOMIC_RELAXED);
+    uint64_t low_water = h->heat_capacity / 2;
+
+    if (h->heat_used > low_water && heat->block_shift < BLOK_HEAT_MAX_SHIFT
+        && heat_mergeable(heat) >= h->heat_used / 8) {
+        heat_compact(heat, heat->block_shift + 1, 0, 0);
+        h->heat_coarsened++;
+    }
+    if (h->heat_used > low_water) {
+        heat_compact(heat, heat->block_shift, heat_evict_threshold(heat, h->heat_used - low_water), 0);
+    }
+    pthread_rwlock_unlock(&heat->resize);
+}
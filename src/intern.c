@@ -0,0 +1,150 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/intern.h"
+#include "../include/alloc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_ARENA_CHUNK (256 * 1024)
+#define INTERN_INITIAL_SLOTS 4096
+
+// Open-addressed table of pointers into the arena.  Lookups of known paths, the steady state, only take the lock
+// shared; the table is rebuilt at twice the size when three quarters full.
+static struct {
+    pthread_rwlock_t lock;
+    struct blok_arena arena;
+    const struct blok_path **slots;
+    uint64_t nslots;
+    uint64_t count;
+} table = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// FNV-1a
+static uint64_t intern_hash(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static const struct blok_path **intern_slots_alloc(uint64_t nslots)
+{
+    if (blok_mem_charge(BLOK_MEM_PATHS, nslots * sizeof(struct blok_path *)) < 0) {
+        return NULL;
+    }
+    const struct blok_path **slots = calloc(nslots, sizeof(struct blok_path *));
+    if (slots == NULL) {
+        blok_mem_uncharge(BLOK_MEM_PATHS, nslots * sizeof(struct blok_path *));
+    }
+    return slots;
+}
+
+void blok_intern_init(void)
+{
+    blok_arena_init(&table.arena, "paths", BLOK_MEM_PATHS, INTERN_ARENA_CHUNK);
+    table.slots = intern_slots_alloc(INTERN_INITIAL_SLOTS);
+    table.nslots = table.slots != NULL ? INTERN_INITIAL_SLOTS : 0;
+    table.count = 0;
+}
+
+void blok_intern_destroy(void)
+{
+    pthread_rwlock_wrlock(&table.lock);
+    if (table.slots != NULL) {
+        free(table.slots);
+        blok_mem_uncharge(BLOK_MEM_PATHS, table.nslots * sizeof(struct blok_path *));
+    }
+    blok_arena_destroy(&table.arena);
+    table.slots = NULL;
+    table.nslots = 0;
+    pthread_rwlock_unlock(&table.lock);
+}
+
+static const struct blok_path *intern_find(const char *path, size_t len, uint64_t hash, uint64_t *slot)
+{
+    uint64_t mask = table.nslots - 1;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        const struct blok_path *p = table.slots[i];
+        if (p == NULL) {
+            *slot = i;
+            return NULL;
+        }
+        if (p->hash == hash && p->len == len && memcmp(p->str, path, len) == 0) {
+            return p;
+        }
+    }
+}
+
+// Called with the lock held exclusively.  On failure the old table stays in place and just fills up further.
+static void intern_grow(void)
+{
+    uint64_t nslots = table.nslots * 2;
+    const struct blok_path **slots = intern_slots_alloc(nslots);
+    if (slots == NULL) {
+        return;
+    }
+    for (uint64_t i = 0; i < table.nslots; i++) {
+        const struct blok_path *p = table.slots[i];
+        if (p == NULL) {
+            continue;
+        }
+        uint64_t j = p->hash & (nslots - 1);
+        while (slots[j] != NULL) {
+            j = (j + 1) & (nslots - 1);
+        }
+        slots[j] = p;
+    }
+    free(table.slots);
+    blok_mem_uncharge(BLOK_MEM_PATHS, table.nslots * sizeof(struct blok_path *));
+    table.slots = slots;
+    table.nslots = nslots;
+}
+
+const struct blok_path *blok_intern(const char *path)
+{
+    size_t len = strlen(path);
+    uint64_t hash = intern_hash(path, len);
+    uint64_t slot;
+
+    pthread_rwlock_rdlock(&table.lock);
+    const struct blok_path *p = table.slots != NULL ? intern_find(path, len, hash, &slot) : NULL;
+    pthread_rwlock_unlock(&table.lock);
+    if (p != NULL || table.slots == NULL) {
+        return p;
+    }
+
+    pthread_rwlock_wrlock(&table.lock);
+    // somebody may have inserted it in between
+    p = intern_find(path, len, hash, &slot);
+    if (p == NULL && (table.count + 1) * 4 <= table.nslots * 3) {
+        struct blok_path *n = blok_arena_alloc(&table.arena, sizeof(struct blok_path) + len + 1);
+        if (n != NULL) {
+            n->hash = hash;
+            n->id = table.count++;
+            n->len = len;
+            memcpy(n->str, path, len + 1);
+            table.slots[slot] = n;
+            p = n;
+        }
+        if (table.count * 4 > table.nslots * 3 - 4) {
+            intern_grow();
+        }
+    }
+    pthread_rwlock_unlock(&table.lock);
+    return p;
+}
+
+uint64_t blok_intern_count(void)
+{
+    return __atomic_load_n(&table.count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,122 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/marker.h"
+#include "../include/counters.h"
+#include "../include/event.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct phase_counts {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t latency_ns;
+};
+
+// counts holds the totals at the phase's marker until the next marker turns them into the phase's own.
+struct phase {
+    char name[BLOK_MARKER_MAX + 1];
+    int32_t pid;
+    uint64_t start;
+    uint64_t end;
+    struct phase_counts counts[BLOK_OP_MAX];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    uint64_t count;
+    struct phase phases[BLOK_PHASE_MAX];    // phase n in phases[(n - 1) % BLOK_PHASE_MAX]
+    struct blok_counters scratch;
+} markers = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Called under the lock, which guards the scratch copy of the counters as well.
+static void totals(struct phase_counts *out)
+{
+    struct blok_counters *c = &markers.scratch;
+    blok_counters_read(c);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        out[op] = (struct phase_counts) { c->op[op].ops, c->op[op].bytes, c->op[op].errors, c->op[op].total_ns };
+    }
+}
+
+static void phase_close(struct phase *p, const struct phase_counts *now, uint64_t end)
+{
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        p->counts[op].ops = now[op].ops - p->counts[op].ops;
+        p->counts[op].bytes = now[op].bytes - p->counts[op].bytes;
+        p->counts[op].errors = now[op].errors - p->counts[op].errors;
+        p->counts[op].latency_ns = now[op].latency_ns - p->counts[op].latency_ns;
+    }
+    p->end = end;
+}
+
+// Markers are rare, so they are serialized; the record is logged under the lock too, so phase numbers in the log
+// come in order.
+int blok_marker_set(const char *name, size_t len, int pid)
+{
+    if (len == 0 || len > BLOK_MARKER_MAX || memchr(name, '\n', len) != NULL || memchr(name, '\0', len) != NULL) {
+        return -EINVAL;
+    }
+    struct phase_counts now[BLOK_OP_MAX];
+    pthread_mutex_lock(&markers.lock);
+    uint64_t ts = blok_now_ns();
+    totals(now);
+    if (markers.count > 0) {
+        phase_close(&markers.phases[(markers.count - 1) % BLOK_PHASE_MAX], now, ts);
+    }
+    struct phase *p = &markers.phases[markers.count++ % BLOK_PHASE_MAX];
+    memcpy(p->name, name, len);
+    p->name[len] = '\0';
+    p->pid = pid;
+    p->start = ts;
+    p->end = 0;
+    memcpy(p->counts, now, sizeof(now));
+    blok_event_log_marker(p->name, len, ts, pid, markers.count);
+    pthread_mutex_unlock(&markers.lock);
+    return 0;
+}
+
+// The current phase is shown with its counts so far.
+void blok_marker_stats(FILE *out)
+{
+    struct phase_counts now[BLOK_OP_MAX];
+    pthread_mutex_lock(&markers.lock);
+    uint64_t ts = blok_now_ns();
+    totals(now);
+    fprintf(out, "phase.count %llu\n", (unsigned long long) markers.count);
+    uint64_t first = markers.count > BLOK_PHASE_MAX ? markers.count - BLOK_PHASE_MAX + 1 : 1;
+    for (uint64_t n = first; n <= markers.count; n++) {
+        struct phase p = markers.phases[(n - 1) % BLOK_PHASE_MAX];
+        if (n == markers.count) {
+            phase_close(&p, now, ts);
+        }
+        fprintf(out, "phase.%llu.name %s\n", (unsigned long long) n, p.name);
+        fprintf(out, "phase.%llu.pid %d\n", (unsigned long long) n, p.pid);
+        fprintf(out, "phase.%llu.seconds %.3f\n", (unsigned long long) n, (p.end - p.start) / 1e9);
+        for (int op = 0; op < BLOK_OP_MAX; op++) {
+            const struct phase_counts *c = &p.counts[op];
+            if (c->ops == 0) {
+                continue;
+            }
+            const char *name = blok_op_name(op);
+            fprintf(out, "phase.%llu.op.%s.ops %llu\n", (unsigned long long) n, name, (unsigned long long) c->ops);
+            fprintf(out, "phase.%llu.op.%s.bytes %llu\n", (unsigned long long) n, name,
+                    (unsigned long long) c->bytes);
+            fprintf(out, "phase.%llu.op.%s.errors %llu\n", (unsigned long long) n, name,
+                    (unsigned long long) c->errors);
+            fprintf(out, "phase.%llu.op.%s.latency_ns %llu\n", (unsigned long long) n, name,
+                    (unsigned long long) c->latency_ns);
+        }
+    }
+    pthread_mutex_unlock(&markers.lock);
+}
@@ -0,0 +1,113 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#include "../include/mem.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+
+static const char *mem_names[BLOK_MEM_MAX] = {
+    [BLOK_MEM_HANDLES] = "handles",
+    [BLOK_MEM_HEAT] = "heat",
+    [BLOK_MEM_STATS] = "stats",
+    [BLOK_MEM_PATHS] = "paths",
+    [BLOK_MEM_FLIGHT] = "flight",
+    [BLOK_MEM_SHARING] = "sharing",
+    [BLOK_MEM_REUSE] = "reuse",
+};
+
+static struct {
+    uint64_t budget;
+    uint64_t total;
+    uint64_t used[BLOK_MEM_MAX];
+    uint64_t refused[BLOK_MEM_MAX];
+    struct {
+        blok_mem_shrinker shrink;
+        void *arg;
+    } shrinkers[BLOK_MEM_MAX];
+    pthread_mutex_t shrinking;
+} mem = { .shrinking = PTHREAD_MUTEX_INITIALIZER };
+
+// A budget of 0 means unlimited; usage is still accounted.
+void blok_mem_init(uint64_t budget)
+{
+    mem.budget = budget;
+}
+
+void blok_mem_register_shrinker(enum blok_mem_subsys subsys, blok_mem_shrinker shrink, void *arg)
+{
+    mem.shrinkers[subsys].arg = arg;
+    mem.shrinkers[subsys].shrink = shrink;
+}
+
+// Only one thread shrinks at a time; the others don't wait for it and just see whether room was made.
+static void mem_shrink(uint64_t want)
+{
+    if (pthread_mutex_trylock(&mem.shrinking) != 0) {
+        return;
+    }
+    for (int i = 0; i < BLOK_MEM_MAX && want > 0; i++) {
+        if (mem.shrinkers[i].shrink == NULL) {
+            continue;
+        }
+        uint64_t freed = mem.shrinkers[i].shrink(mem.shrinkers[i].arg, want);
+        want = freed >= want ? 0 : want - freed;
+    }
+    pthread_mutex_unlock(&mem.shrinking);
+}
+
+int blok_mem_charge(enum blok_mem_subsys subsys, uint64_t bytes)
+{
+    uint64_t total = __atomic_add_fetch(&mem.total, bytes, __ATOMIC_RELAXED);
+    if (mem.budget != 0 && total > mem.budget) {
+        mem_shrink(total - mem.budget);
+        if (__atomic_load_n(&mem.total, __ATOMIC_RELAXED) > mem.budget) {
+            __atomic_sub_fetch(&mem.total, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&mem.refused[subsys], 1, __ATOMIC_RELAXED);
+            return -ENOMEM;
+        }
+    }
+    __atomic_add_fetch(&mem.used[subsys], bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void blok_mem_charge_force(enum blok_mem_subsys subsys, uint64_t bytes)
+{
+    __atomic_add_fetch(&mem.total, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem.used[subsys], bytes, __ATOMIC_RELAXED);
+}
+
+void blok_mem_uncharge(enum blok_mem_subsys subsys, uint64_t bytes)
+{
+    __atomic_sub_fetch(&mem.total, bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem.used[subsys], bytes, __ATOMIC_RELAXED);
+}
+
+const char *blok_mem_name(enum blok_mem_subsys subsys)
+{
+    return mem_names[subsys];
+}
+
+uint64_t blok_mem_budget(void)
+{
+    return mem.budget;
+}
+
+uint64_t blok_mem_total(void)
+{
+    return __atomic_load_n(&mem.total, __ATOMIC_RELAXED);
+}
+
+uint64_t blok_mem_usage(enum blok_mem_subsys subsys)
+{
+    return __atomic_load_n(&mem.used[subsys], __ATOMIC_RELAXED);
+}
+
+uint64_t blok_mem_refused(enum blok_mem_subsys subsys)
+{
+    return __atomic_load_n(&mem.refused[subsys], __ATOMIC_RELAXED);
+}
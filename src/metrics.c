@@ -0,0 +1,506 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/metrics.h"
+#include "../include/cgroup.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include "../include/proc.h"
+#include "../include/state.h"
+#include "../include/top.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Top files exported as labelled series; the sketch keeps more, but every file is a new series for the scraper.
+#define METRICS_TOP_FILES 10
+#define METRICS_REQUEST_MAX 4096
+
+static void metrics_label(FILE *out, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        switch (s[i]) {
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        default:
+            fputc(s[i], out);
+        }
+    }
+}
+
+// Counters are totals across mounts, like op.X.ops in the stats file; errnos, histograms and dropped records count
+// since the mount.
+static void metrics_counters(FILE *out, struct blok_state *state)
+{
+    struct blok_counters total;
+    blok_counters_read(&total);
+
+    fputs("# TYPE blok_ops counter\n# HELP blok_ops Completed calls.\n", out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        uint64_t ops = total.op[op].ops + (state != NULL ? state->base.ops[op] : 0);
+        if (ops != 0) {
+            fprintf(out, "blok_ops_total{op=\"%s\"} %llu\n", blok_op_name(op), (unsigned long long) ops);
+        }
+    }
+    fputs("# TYPE blok_bytes counter\n# UNIT blok_bytes bytes\n# HELP blok_bytes Bytes returned by calls.\n", out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        uint64_t bytes = total.op[op].bytes + (state != NULL ? state->base.bytes[op] : 0);
+        if (bytes != 0) {
+            fprintf(out, "blok_bytes_total{op=\"%s\"} %llu\n", blok_op_name(op), (unsigned long long) bytes);
+        }
+    }
+    fputs("# TYPE blok_errors counter\n# HELP blok_errors Failed calls by errno.\n", out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        for (int err = 0; err < BLOK_ERRNO_MAX; err++) {
+            uint64_t n = total.op[op].errnos[err];
+            if (n == 0) {
+                continue;
+            }
+            const char *errname = err == 0 ? "other" : blok_errno_name(err);
+            if (errname != NULL) {
+                fprintf(out, "blok_errors_total{op=\"%s\",errno=\"%s\"} %llu\n", blok_op_name(op), errname,
+                        (unsigned long long) n);
+            } else {
+                fprintf(out, "blok_errors_total{op=\"%s\",errno=\"%d\"} %llu\n", blok_op_name(op), err,
+                        (unsigned long long) n);
+            }
+        }
+    }
+    fputs("# TYPE blok_in_flight gauge\n# HELP blok_in_flight Calls running now.\n", out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        struct blok_op_counters *t = &total.op[op];
+        if (t->started != 0) {
+            fprintf(out, "blok_in_flight{op=\"%s\"} %llu\n", blok_op_name(op),
+                    (unsigned long long) (t->started > t->ops ? t->started - t->ops : 0));
+        }
+    }
+    fputs("# TYPE blok_dropped_records counter\n# HELP blok_dropped_records Log records that couldn't be written.\n",
+          out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        if (total.op[op].dropped != 0) {
+            fprintf(out, "blok_dropped_records_total{op=\"%s\"} %llu\n", blok_op_name(op),
+                    (unsigned long long) total.op[op].dropped);
+        }
+    }
+
+    // bucket b holds latencies below 2^b ns, so its cumulative count is the le="2^b" bucket; the last one is open
+    fputs("# TYPE blok_latency_seconds histogram\n# UNIT blok_latency_seconds seconds\n"
+          "# HELP blok_latency_seconds Call latency.\n", out);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        struct blok_op_counters *t = &total.op[op];
+        if (t->ops == 0) {
+            continue;
+        }
+        const char *name = blok_op_name(op);
+        uint64_t count = 0;
+        for (int b = 0; b < BLOK_HIST_BUCKETS - 1; b++) {
+            count += t->latency[b];
+            fprintf(out, "blok_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", name, (double) (1ULL << b) / 1e9,
+                    (unsigned long long) count);
+        }
+        count += t->latency[BLOK_HIST_BUCKETS - 1];
+        fprintf(out, "blok_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+        fprintf(out, "blok_latency_seconds_count{op=\"%s\"} %llu\n", name, (unsigned long long) count);
+        fprintf(out, "blok_latency_seconds_sum{op=\"%s\"} %.9f\n", name, t->total_ns / 1e9);
+    }
+}
+
+static void metrics_top(FILE *out)
+{
+    struct blok_top_entry *entries;
+    size_t n = blok_top_collect(BLOK_TOP_FILE, &entries);
+    if (n > METRICS_TOP_FILES) {
+        n = METRICS_TOP_FILES;
+    }
+    fputs("# TYPE blok_file_ops counter\n# HELP blok_file_ops Reads and writes of the hottest files.\n", out);
+    for (size_t i = 0; i < n; i++) {
+        fputs("blok_file_ops_total{file=\"", out);
+        metrics_label(out, entries[i].path->str, entries[i].len);
+        fprintf(out, "\"} %llu\n", (unsigned long long) entries[i].ops);
+    }
+    fputs("# TYPE blok_file_bytes counter\n# UNIT blok_file_bytes bytes\n"
+          "# HELP blok_file_bytes Bytes read and written of the hottest files.\n", out);
+    for (size_t i = 0; i < n; i++) {
+        fputs("blok_file_bytes_total{file=\"", out);
+        metrics_label(out, entries[i].path->str, entries[i].len);
+        fprintf(out, "\"} %llu\n", (unsigned long long) entries[i].bytes);
+    }
+    free(entries);
+}
+
+// Jobs come and go, so like files only the busiest are series.
+static void metrics_jobs(FILE *out)
+{
+    struct blok_top_entry *entries;
+    size_t n = blok_top_collect(BLOK_TOP_JOB, &entries);
+    if (n > METRICS_TOP_FILES) {
+        n = METRICS_TOP_FILES;
+    }
+    fputs("# TYPE blok_job_ops counter\n# HELP blok_job_ops Reads and writes of the busiest jobs.\n", out);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "blok_job_ops_total{job=\"%d\"} %llu\n", entries[i].pid, (unsigned long long) entries[i].ops);
+    }
+    fputs("# TYPE blok_job_bytes counter\n# UNIT blok_job_bytes bytes\n"
+          "# HELP blok_job_bytes Bytes read and written by the busiest jobs.\n", out);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(out, "blok_job_bytes_total{job=\"%d\"} %llu\n", entries[i].pid, (unsigned long long) entries[i].bytes);
+    }
+    free(entries);
+}
+
+static void metrics_cgroup_label(FILE *out, size_t slot, const char *dir)
+{
+    const struct blok_cgroup *cg = blok_cgroup_get(slot);
+    fputs("{cgroup=\"", out);
+    if (slot != 0) {
+        metrics_label(out, cg->path, strlen(cg->path));
+    } else {
+        fputs("unknown", out);
+    }
+    fprintf(out, "\",op=\"%s\"}", dir);
+}
+
+// One series per cgroup slot, so bounded by BLOK_CGROUP_MAX.
+static void metrics_cgroups(FILE *out)
+{
+    static const char *dirs[2] = { "read", "write" };
+    size_t n = blok_cgroup_count();
+    struct blok_cgroup_io (*io)[2] = malloc(n * sizeof(*io));
+    if (io == NULL) {
+        return;
+    }
+    blok_cgroup_read(io, n);
+    fputs("# TYPE blok_cgroup_ops counter\n# HELP blok_cgroup_ops Reads and writes by cgroup.\n", out);
+    for (size_t slot = 0; slot < n; slot++) {
+        for (int dir = 0; dir < 2; dir++) {
+            if (io[slot][dir].ops != 0) {
+                fputs("blok_cgroup_ops_total", out);
+                metrics_cgroup_label(out, slot, dirs[dir]);
+                fprintf(out, " %llu\n", (unsigned long long) io[slot][dir].ops);
+            }
+        }
+    }
+    fputs("# TYPE blok_cgroup_bytes counter\n# UNIT blok_cgroup_bytes bytes\n"
+          "# HELP blok_cgroup_bytes Bytes read and written by cgroup.\n", out);
+    for (size_t slot = 0; slot < n; slot++) {
+        for (int dir = 0; dir < 2; dir++) {
+            if (io[slot][dir].ops != 0) {
+                fputs("blok_cgroup_bytes_total", out);
+                metrics_cgroup_label(out, slot, dirs[dir]);
+                fprintf(out, " %llu\n", (unsigned long long) io[slot][dir].bytes);
+            }
+        }
+    }
+    fputs("# TYPE blok_cgroup_latency_seconds counter\n# UNIT blok_cgroup_latency_seconds seconds\n"
+          "# HELP blok_cgroup_latency_seconds Time spent in reads and writes by cgroup.\n", out);
+    for (size_t slot = 0; slot < n; slot++) {
+        for (int dir = 0; dir < 2; dir++) {
+            if (io[slot][dir].ops != 0) {
+                fputs("blok_cgroup_latency_seconds_total", out);
+                metrics_cgroup_label(out, slot, dirs[dir]);
+                fprintf(out, " %.9f\n", io[slot][dir].latency_ns / 1e9);
+            }
+        }
+    }
+    free(io);
+}
+
+static void metrics_state(FILE *out, struct blok_state *state)
+{
+    struct blok_state_header *h = state->header;
+    fprintf(out, "# TYPE blok_heat_blocks gauge\n# HELP blok_heat_blocks Blocks tracked in the heat map.\n"
+                 "blok_heat_blocks %llu\n",
+            (unsigned long long) __atomic_load_n(&h->heat_used, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE blok_heat_capacity_blocks gauge\n# HELP blok_heat_capacity_blocks Heat map capacity.\n"
+                 "blok_heat_capacity_blocks %llu\n",
+            (unsigned long long) h->heat_capacity);
+    fprintf(out, "# TYPE blok_heat_block_size_bytes gauge\n# UNIT blok_heat_block_size_bytes bytes\n"
+                 "# HELP blok_heat_block_size_bytes Heat map block size.\nblok_heat_block_size_bytes %llu\n",
+            1ULL << state->heat.block_shift);
+}
+
+static void metrics_mem(FILE *out)
+{
+    fputs("# TYPE blok_mem_bytes gauge\n# UNIT blok_mem_bytes bytes\n"
+          "# HELP blok_mem_bytes Memory used by tracking structures.\n", out);
+    for (int i = 0; i < BLOK_MEM_MAX; i++) {
+        fprintf(out, "blok_mem_bytes{subsys=\"%s\"} %llu\n", blok_mem_name(i), (unsigned long long) blok_mem_usage(i));
+    }
+    fprintf(out, "# TYPE blok_mem_budget_bytes gauge\n# UNIT blok_mem_budget_bytes bytes\n"
+                 "# HELP blok_mem_budget_bytes Memory budget, 0 for unlimited.\nblok_mem_budget_bytes %llu\n",
+            (unsigned long long) blok_mem_budget());
+}
+
+char *blok_metrics_render(struct fs_state *blok_data, size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        return NULL;
+    }
+    metrics_counters(out, blok_data->state);
+    metrics_top(out);
+    if (blok_job_mode != BLOK_JOB_NONE) {
+        metrics_jobs(out);
+    }
+    if (blok_cgroup_enabled) {
+        metrics_cgroups(out);
+    }
+    if (blok_data->state != NULL) {
+        metrics_state(out, blok_data->state);
+    }
+    metrics_mem(out);
+    fputs("# EOF\n", out);
+    if (fclose(out) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int metrics_listen(struct blok_metrics *metrics, const char *addr)
+{
+    char host[PATH_MAX] = "127.0.0.1";
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+            return -ENAMETOOLONG;
+        }
+        strcpy(sun.sun_path, addr + 5);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+        // a socket left behind by an earlier mount would make bind() fail; anything else is left alone
+        struct stat st;
+        if (lstat(sun.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(sun.sun_path);
+        }
+        if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 8) < 0) {
+            int err = errno;
+            close(fd);
+            return -err;
+        }
+        // removed at unmount, after daemonizing has changed the working directory
+        if (sun.sun_path[0] == '/' || asprintf(&metrics->unix_path, "%s/%s", getcwd(host, sizeof(host)) ?: ".",
+                                               sun.sun_path) < 0) {
+            metrics->unix_path = strdup(sun.sun_path);
+        }
+        return fd;
+    }
+
+    const char *port = strrchr(addr, ':');
+    if (port != NULL) {
+        size_t len = port - addr;
+        if (len >= sizeof(host)) {
+            return -EINVAL;
+        }
+        memcpy(host, addr, len);
+        host[len] = '\0';
+        port++;
+    } else {
+        port = addr;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -EINVAL;
+    }
+    int err = -EADDRNOTAVAIL;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = -errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 8) == 0) {
+            freeaddrinfo(res);
+            return fd;
+        }
+        err = -errno;
+        close(fd);
+    }
+    freeaddrinfo(res);
+    return err;
+}
+
+struct blok_metrics *blok_metrics_open(struct fs_state *blok_data, const char *addr)
+{
+    struct blok_metrics *metrics = calloc(1, sizeof(struct blok_metrics));
+    if (metrics == NULL) {
+        return NULL;
+    }
+    metrics->blok_data = blok_data;
+    metrics->listen_fd = metrics_listen(metrics, addr);
+    if (metrics->listen_fd < 0) {
+        errno = -metrics->listen_fd;
+        free(metrics);
+        return NULL;
+    }
+    blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct blok_metrics));
+    return metrics;
+}
+
+static void metrics_send(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void metrics_reply(int fd, const char *status, const char *type, const char *body, size_t len)
+{
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status,
+                     type, len);
+    metrics_send(fd, head, n);
+    metrics_send(fd, body, len);
+}
+
+// Reads the request head; the body of anything but a GET is of no interest.  A slow client gets a second.
+static void metrics_serve(struct blok_metrics *metrics, int fd)
+{
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char req[METRICS_REQUEST_MAX];
+    size_t len = 0;
+    while (len < sizeof(req) - 1) {
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    static const char not_found[] = "not found\n";
+    const char *path = strchr(req, ' ');
+    if (strncmp(req, "GET ", 4) != 0 && strncmp(req, "HEAD ", 5) != 0) {
+        static const char bad[] = "method not allowed\n";
+        metrics_reply(fd, "405 Method Not Allowed", "text/plain", bad, sizeof(bad) - 1);
+        return;
+    }
+    path++;
+    size_t path_len = strcspn(path, " ?\r\n");
+    if (path_len != 8 || strncmp(path, "/metrics", 8) != 0) {
+        metrics_reply(fd, "404 Not Found", "text/plain", not_found, sizeof(not_found) - 1);
+        return;
+    }
+    size_t body_len;
+    char *body = blok_metrics_render(metrics->blok_data, &body_len);
+    if (body == NULL) {
+        static const char failed[] = "out of memory\n";
+        metrics_reply(fd, "500 Internal Server Error", "text/plain", failed, sizeof(failed) - 1);
+        return;
+    }
+    metrics_reply(fd, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8", body,
+                  req[0] == 'H' ? 0 : body_len);
+    free(body);
+}
+
+static void *metrics_server(void *arg)
+{
+    struct blok_metrics *metrics = arg;
+    struct pollfd fds[2] = {
+        { .fd = metrics->listen_fd, .events = POLLIN },
+        { .fd = metrics->stop[0], .events = POLLIN },
+    };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(metrics->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                metrics_serve(metrics, fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Has to run after fuse_main() has daemonized, like the rollup writer.
+int blok_metrics_start(struct blok_metrics *metrics)
+{
+    if (pipe2(metrics->stop, O_CLOEXEC) < 0) {
+        return -errno;
+    }
+    int err = pthread_create(&metrics->server, NULL, metrics_server, metrics);
+    if (err != 0) {
+        close(metrics->stop[0]);
+        close(metrics->stop[1]);
+        return -err;
+    }
+    metrics->running = 1;
+    return 0;
+}
+
+void blok_metrics_close(struct blok_metrics *metrics)
+{
+    if (metrics == NULL) {
+        return;
+    }
+    if (metrics->running) {
+        // closing the write end wakes the server's poll() with POLLHUP
+        close(metrics->stop[1]);
+        pthread_join(metrics->server, NULL);
+        close(metrics->stop[0]);
+    }
+    close(metrics->listen_fd);
+    if (metrics->unix_path != NULL) {
+        unlink(metrics->unix_path);
+        free(metrics->unix_path);
+    }
+    free(metrics);
+    blok_mem_uncharge(BLOK_MEM_STATS, sizeof(struct blok_metrics));
+}
@@ -0,0 +1,177 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#include "../include/ndjson.h"
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Writes two digits per division, back to front into a scratch buffer.
+char *blok_json_u64(char *p, uint64_t v)
+{
+    char tmp[20];
+    char *end = tmp + sizeof(tmp);
+    char *q = end;
+    while (v >= 100) {
+        unsigned int pair = (v % 100) * 2;
+        v /= 100;
+        *--q = digit_pairs[pair + 1];
+        *--q = digit_pairs[pair];
+    }
+    if (v >= 10) {
+        *--q = digit_pairs[v * 2 + 1];
+        *--q = digit_pairs[v * 2];
+    } else {
+        *--q = '0' + v;
+    }
+    size_t len = end - q;
+    memcpy(p, q, len);
+    return p + len;
+}
+
+char *blok_json_i64(char *p, int64_t v)
+{
+    if (v < 0) {
+        *p++ = '-';
+        return blok_json_u64(p, -(uint64_t) v);
+    }
+    return blok_json_u64(p, v);
+}
+
+// Length of a well-formed UTF-8 sequence starting at s, or 0 if the bytes there aren't one.
+static size_t utf8_sequence(const unsigned char *s, size_t left)
+{
+    unsigned char c = s[0];
+    size_t len;
+    uint32_t cp;
+    if (c >= 0xc2 && c <= 0xdf) {
+        len = 2;
+        cp = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        cp = c & 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (len > left) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    // overlong encodings, surrogates and code points past U+10FFFF
+    if ((len == 3 && cp < 0x800) || (cp >= 0xd800 && cp <= 0xdfff) || (len == 4 && (cp < 0x10000 || cp > 0x10ffff))) {
+        return 0;
+    }
+    return len;
+}
+
+// Handles one byte the scan stopped at: a quote, backslash or control character gets escaped; a multi-byte UTF-8
+// character is copied as is.  Paths are arbitrary bytes, so anything that isn't valid UTF-8 is written as \u00XX,
+// which keeps every record valid JSON.  Returns the number of input bytes consumed.
+static size_t json_escape(char **out, const unsigned char *s, size_t left)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *p = *out;
+    unsigned char c = s[0];
+
+    if (c >= 0x80) {
+        size_t len = utf8_sequence(s, left);
+        if (len != 0) {
+            memcpy(p, s, len);
+            *out = p + len;
+            return len;
+        }
+    }
+    *p++ = '\\';
+    switch (c) {
+    case '"': *p++ = '"'; break;
+    case '\\': *p++ = '\\'; break;
+    case '\n': *p++ = 'n'; break;
+    case '\t': *p++ = 't'; break;
+    case '\r': *p++ = 'r'; break;
+    case '\b': *p++ = 'b'; break;
+    case '\f': *p++ = 'f'; break;
+    default:
+        *p++ = 'u';
+        *p++ = '0';
+        *p++ = '0';
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0xf];
+        break;
+    }
+    *out = p;
+    return 1;
+}
+
+// Most paths need no escaping at all, so the scan looks for the next byte that needs attention 16 bytes at a time and
+// copies everything before it in one go.  A signed compare against 0x20 catches control characters and, since they
+// are negative as signed bytes, everything from 0x80 up as well.
+char *blok_json_string(char *p, const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    size_t i = 0;
+    *p++ = '"';
+
+    while (i < len) {
+        size_t run = i;
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i space = _mm_set1_epi8(0x20);
+        for (;;) {
+            if (run + 16 > len) {
+                while (run < len && s[run] >= 0x20 && s[run] < 0x80 && s[run] != '"' && s[run] != '\\') {
+                    run++;
+                }
+                break;
+            }
+            __m128i chunk = _mm_loadu_si128((const __m128i *) (s + run));
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                           _mm_cmplt_epi8(chunk, space));
+            unsigned int mask = _mm_movemask_epi8(special);
+            if (mask != 0) {
+                run += __builtin_ctz(mask);
+                break;
+            }
+            run += 16;
+        }
+#else
+        while (run < len && s[run] >= 0x20 && s[run] < 0x80 && s[run] != '"' && s[run] != '\\') {
+            run++;
+        }
+#endif
+        memcpy(p, s + i, run - i);
+        p += run - i;
+        i = run;
+        if (i < len) {
+            i += json_escape(&p, s + i, len - i);
+        }
+    }
+    *p++ = '"';
+    return p;
+}
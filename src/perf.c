@@ -0,0 +1,196 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/perf.h"
+#include "../include/mem.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int blok_perf_enabled;
+
+static const struct {
+    const char *name;
+    uint64_t config;
+} pmu_events[BLOK_PMU_MAX] = {
+    [BLOK_PMU_CYCLES] = { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+    [BLOK_PMU_INSTRUCTIONS] = { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+    [BLOK_PMU_CACHE_MISSES] = { "cache_misses", PERF_COUNT_HW_CACHE_MISSES },
+    [BLOK_PMU_BRANCH_MISSES] = { "branch_misses", PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+struct perf_thread {
+    int fd[BLOK_PMU_MAX];
+    struct perf_event_mmap_page *page[BLOK_PMU_MAX];
+    int rdpmc;
+};
+
+enum {
+    PERF_UNOPENED,
+    PERF_OPEN,
+    PERF_FAILED
+};
+
+static __thread int thread_status;
+static __thread struct perf_thread *thread_perf;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t perf_key;
+
+static long page_size;
+
+const char *blok_pmu_name(enum blok_pmu pmu)
+{
+    return pmu_events[pmu].name;
+}
+
+static int perf_open(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group == -1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void perf_close(struct perf_thread *perf)
+{
+    for (int i = BLOK_PMU_MAX - 1; i >= 0; i--) {
+        if (perf->page[i] != NULL) {
+            munmap(perf->page[i], page_size);
+        }
+        if (perf->fd[i] >= 0) {
+            close(perf->fd[i]);
+        }
+    }
+    free(perf);
+    blok_mem_uncharge(BLOK_MEM_STATS, sizeof(struct perf_thread));
+}
+
+static void perf_thread_exit(void *arg)
+{
+    perf_close(arg);
+}
+
+static void perf_key_create(void)
+{
+    pthread_key_create(&perf_key, perf_thread_exit);
+}
+
+int blok_perf_init(void)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    int fd = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (fd < 0) {
+        return -errno;
+    }
+    close(fd);
+    blok_perf_enabled = 1;
+    return 0;
+}
+
+static struct perf_thread *perf_thread_open(void)
+{
+    struct perf_thread *perf = calloc(1, sizeof(struct perf_thread));
+    if (perf == NULL) {
+        return NULL;
+    }
+    blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct perf_thread));
+    for (int i = 0; i < BLOK_PMU_MAX; i++) {
+        perf->fd[i] = -1;
+    }
+
+    perf->rdpmc = 1;
+    for (int i = 0; i < BLOK_PMU_MAX; i++) {
+        perf->fd[i] = perf_open(pmu_events[i].config, i == 0 ? -1 : perf->fd[0]);
+        if (perf->fd[i] < 0) {
+            perf_close(perf);
+            return NULL;
+        }
+        // the first page of the mapping is all rdpmc needs
+        void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, perf->fd[i], 0);
+        if (page == MAP_FAILED || !((struct perf_event_mmap_page *) page)->cap_user_rdpmc) {
+            perf->rdpmc = 0;
+        }
+        perf->page[i] = page == MAP_FAILED ? NULL : page;
+    }
+    ioctl(perf->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    pthread_once(&perf_once, perf_key_create);
+    pthread_setspecific(perf_key, perf);
+    return perf;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The self-monitoring protocol from perf_event.h: the kernel bumps 'lock' around updates, index is the hardware
+// counter + 1 while the event is scheduled, and the counter holds pmc_width significant bits added to 'offset'.
+static int perf_rdpmc(struct perf_event_mmap_page *page, uint64_t *value)
+{
+    uint32_t seq;
+    uint64_t count;
+    do {
+        seq = __atomic_load_n(&page->lock, __ATOMIC_ACQUIRE);
+        uint32_t index = page->index;
+        if (index == 0) {
+            return -1;
+        }
+        int64_t pmc = __builtin_ia32_rdpmc(index - 1);
+        pmc <<= 64 - page->pmc_width;
+        pmc >>= 64 - page->pmc_width;
+        count = page->offset + pmc;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&page->lock, __ATOMIC_RELAXED) != seq);
+    *value = count;
+    return 0;
+}
+#endif
+
+int blok_perf_read(uint64_t values[BLOK_PMU_MAX])
+{
+    if (thread_status != PERF_OPEN) {
+        if (thread_status == PERF_FAILED) {
+            return -1;
+        }
+        thread_perf = perf_thread_open();
+        thread_status = thread_perf != NULL ? PERF_OPEN : PERF_FAILED;
+        if (thread_perf == NULL) {
+            return -1;
+        }
+    }
+
+    struct perf_thread *perf = thread_perf;
+#if defined(__x86_64__) || defined(__i386__)
+    if (perf->rdpmc) {
+        for (int i = 0; i < BLOK_PMU_MAX; i++) {
+            if (perf_rdpmc(perf->page[i], &values[i]) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    // PERF_FORMAT_GROUP: the number of events, then one value per event in the order they were opened
+    uint64_t buf[1 + BLOK_PMU_MAX];
+    if (read(perf->fd[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != BLOK_PMU_MAX) {
+        return -1;
+    }
+    memcpy(values, buf + 1, sizeof(uint64_t) * BLOK_PMU_MAX);
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/proc.h"
+#include "../include/cgroup.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROC_TTL_NS 1000000000ULL
+// Deeper process trees than this are cut off when looking for a job's ancestor.
+#define PROC_MAX_DEPTH 64
+
+enum blok_job_mode blok_job_mode;
+int blok_proc_enabled;
+
+// comm is at most 15 characters, so a longer name is matched by its prefix, as the kernel truncates it
+static char job_exe[16];
+
+int blok_job_parse(const char *arg)
+{
+    if (strcmp(arg, "sid") == 0) {
+        blok_job_mode = BLOK_JOB_SID;
+    } else if (strcmp(arg, "pgid") == 0) {
+        blok_job_mode = BLOK_JOB_PGID;
+    } else if (strncmp(arg, "exe:", 4) == 0 && arg[4] != '\0') {
+        blok_job_mode = BLOK_JOB_EXE;
+        snprintf(job_exe, sizeof(job_exe), "%s", arg + 4);
+    } else {
+        return -1;
+    }
+    blok_proc_enabled = 1;
+    return 0;
+}
+
+ssize_t blok_proc_read(int pid, const char *file, char *buf, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// The command name is in parentheses and may contain anything, spaces and parentheses included, so it ends at the
+// last ')' and the numbered fields are counted from there: state is field 3, starttime field 22.
+int blok_proc_parse_stat(const char *buf, struct blok_proc_stat *st)
+{
+    const char *open = strchr(buf, '(');
+    const char *close = strrchr(buf, ')');
+    if (open == NULL || close == NULL || close < open) {
+        return -1;
+    }
+    size_t len = close - open - 1;
+    len = len < sizeof(st->comm) - 1 ? len : sizeof(st->comm) - 1;
+    memcpy(st->comm, open + 1, len);
+    st->comm[len] = '\0';
+
+    // p is at the space before field 3
+    const char *p = close + 1;
+    unsigned long long starttime = 0;
+    if (sscanf(p, " %*c %d %d %d", &st->ppid, &st->pgrp, &st->session) != 3) {
+        return -1;
+    }
+    for (int field = 3; field < 22 && p != NULL; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    if (p == NULL || sscanf(p, " %llu", &starttime) != 1) {
+        return -1;
+    }
+    st->starttime = starttime;
+    return 0;
+}
+
+static int proc_stat(int pid, struct blok_proc_stat *st)
+{
+    char buf[1024];
+    if (blok_proc_read(pid, "stat", buf, sizeof(buf)) < 0) {
+        return -1;
+    }
+    return blok_proc_parse_stat(buf, st);
+}
+
+static int32_t job_of(int pid, const struct blok_proc_stat *st)
+{
+    switch (blok_job_mode) {
+    case BLOK_JOB_SID:
+        return st->session;
+    case BLOK_JOB_PGID:
+        return st->pgrp;
+    case BLOK_JOB_EXE: {
+        struct blok_proc_stat ancestor = *st;
+        for (int depth = 0; depth < PROC_MAX_DEPTH; depth++) {
+            if (strncmp(ancestor.comm, job_exe, sizeof(job_exe) - 1) == 0) {
+                return pid;
+            }
+            pid = ancestor.ppid;
+            if (pid <= 1 || proc_stat(pid, &ancestor) < 0) {
+                break;
+            }
+        }
+        return st->session;
+    }
+    default:
+        return 0;
+    }
+}
+
+const struct blok_proc *blok_proc_lookup(int pid)
+{
+    static const struct blok_proc unknown;
+    if (pid <= 0) {
+        return &unknown;
+    }
+    struct blok_shard *shard = blok_shard();
+    struct blok_proc_cache *cache = shard->procs;
+    if (cache == NULL) {
+        // bounded by the number of threads like the top sketches, so it isn't refused
+        cache = calloc(1, sizeof(struct blok_proc_cache));
+        if (cache == NULL) {
+            return &unknown;
+        }
+        blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct blok_proc_cache));
+        shard->procs = cache;
+    }
+
+    struct blok_proc *e = &cache->entries[(uint32_t) pid * 2654435761U % BLOK_PROC_CACHE];
+    uint64_t now = blok_now_ns();
+    if (e->pid == pid && now - e->checked < PROC_TTL_NS) {
+        return e;
+    }
+    struct blok_proc_stat st;
+    if (proc_stat(pid, &st) < 0) {
+        e->pid = 0;
+        return &unknown;
+    }
+    if (e->pid != pid || e->starttime != st.starttime) {
+        e->pid = pid;
+        e->starttime = st.starttime;
+        e->cgroup = blok_cgroup_enabled ? blok_cgroup_resolve(pid) : 0;
+        e->job = job_of(pid, &st);
+    } else if (blok_job_mode != BLOK_JOB_EXE) {
+        // shells put a child into its own process group after forking it
+        e->job = job_of(pid, &st);
+    }
+    // exec changes the name but not the start time
+    memcpy(e->comm, st.comm, sizeof(e->comm));
+    e->checked = now;
+    return e;
+}
+
+struct proc_shrink {
+    uint64_t want;
+    uint64_t freed;
+};
+
+static void shrink_shard(struct blok_shard *shard, void *arg)
+{
+    struct proc_shrink *s = arg;
+    if (s->freed >= s->want || shard->procs == NULL || __atomic_load_n(&shard->owned, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    free(shard->procs);
+    shard->procs = NULL;
+    blok_mem_uncharge(BLOK_MEM_STATS, sizeof(struct blok_proc_cache));
+    s->freed += sizeof(struct blok_proc_cache);
+}
+
+// blok_shard_foreach() holds the registry lock, so no new thread can take over a shard while its cache is freed.
+uint64_t blok_proc_shrink(void *arg, uint64_t want)
+{
+    struct proc_shrink s = { want, 0 };
+    blok_shard_foreach(shrink_shard, &s);
+    return s.freed;
+}
+
+void blok_proc_account(struct blok_event *ev, int result, uint64_t elapsed)
+{
+    const struct blok_proc *p = blok_proc_lookup(fuse_get_context()->pid);
+    ev->cgroup = blok_cgroup_get(p->cgroup)->id;
+    ev->job = p->job;
+    if (blok_cgroup_enabled && (ev->op == BLOK_OP_READ || ev->op == BLOK_OP_WRITE)) {
+        blok_cgroup_io(p->cgroup, ev->op, result, elapsed);
+    }
+}
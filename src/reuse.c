@@ -0,0 +1,332 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/reuse.h"
+#include "../include/mem.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A slot is the fingerprint in the top REUSE_FP_BITS bits and the access time + 1 below, 0 for an empty slot.  The
+// time wraps after 2^44 microseconds, about 200 days, which differences modulo that survive.
+#define REUSE_FP_BITS 20
+#define REUSE_TIME_BITS (64 - REUSE_FP_BITS)
+#define REUSE_TIME_MASK ((1ULL << REUSE_TIME_BITS) - 1)
+#define REUSE_WAYS 8
+#define REUSE_RETRIES 4
+// Same conventions as the heat map for the files: tags are odd, so an empty slot is 0.
+#define REUSE_EMPTY 0
+#define REUSE_MAX_PROBES 64
+// Files with fewer of their accesses reused are counted as streaming.
+#define REUSE_STREAMING_PCT 10
+#define REUSE_TOP_FILES 10
+
+int blok_reuse_enabled;
+
+static struct {
+    uint64_t *slots;
+    uint64_t sets;
+    struct blok_reuse_file *files;
+    uint64_t capacity;
+    uint32_t shift;
+    uint64_t base_ns;
+    struct blok_reuse_file other;       // files that found no room
+} reuse;
+
+static uint64_t reuse_bytes(void)
+{
+    return reuse.sets * REUSE_WAYS * sizeof(uint64_t) + reuse.capacity * sizeof(struct blok_reuse_file);
+}
+
+int blok_reuse_open(uint64_t range_size)
+{
+    uint64_t budget = blok_mem_budget();
+    reuse.sets = BLOK_REUSE_SLOTS / REUSE_WAYS;
+    reuse.capacity = BLOK_REUSE_FILES;
+    while (budget != 0 && reuse.sets > 1024 && reuse_bytes() > budget / 4) {
+        reuse.sets >>= 1;
+        reuse.capacity = reuse.capacity > 256 ? reuse.capacity >> 1 : reuse.capacity;
+    }
+    if (blok_mem_charge(BLOK_MEM_REUSE, reuse_bytes()) < 0) {
+        return -ENOMEM;
+    }
+    // sets are cache lines
+    reuse.slots = aligned_alloc(64, reuse.sets * REUSE_WAYS * sizeof(uint64_t));
+    reuse.files = calloc(reuse.capacity, sizeof(struct blok_reuse_file));
+    if (reuse.slots == NULL || reuse.files == NULL) {
+        free(reuse.slots);
+        free(reuse.files);
+        reuse.slots = NULL;
+        blok_mem_uncharge(BLOK_MEM_REUSE, reuse_bytes());
+        return -ENOMEM;
+    }
+    memset(reuse.slots, 0, reuse.sets * REUSE_WAYS * sizeof(uint64_t));
+    reuse.shift = __builtin_ctzll(range_size);
+    reuse.base_ns = blok_now_ns();
+    blok_reuse_enabled = 1;
+    return 0;
+}
+
+void blok_reuse_close(void)
+{
+    if (reuse.slots == NULL) {
+        return;
+    }
+    blok_reuse_enabled = 0;
+    free(reuse.slots);
+    free(reuse.files);
+    blok_mem_uncharge(BLOK_MEM_REUSE, reuse_bytes());
+    reuse.slots = NULL;
+    reuse.files = NULL;
+}
+
+static uint64_t reuse_hash(const struct blok_fileid *id, uint64_t range)
+{
+    uint64_t h = id->ino * 0x9e3779b97f4a7c15ULL;
+    h ^= (id->dev + ((uint64_t) id->gen << 32)) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= range * 0x165667b19e3779f9ULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Threads read the clock before racing for a slot, so the last access can be a little after now.
+static uint64_t reuse_age(uint64_t now, uint64_t slot)
+{
+    uint64_t age = (now - (slot & REUSE_TIME_MASK)) & REUSE_TIME_MASK;
+    return age <= REUSE_TIME_MASK / 2 ? age : 0;
+}
+
+static struct blok_reuse_file *file_lookup(const struct blok_fileid *id, const struct blok_path *path)
+{
+    uint64_t tag = reuse_hash(id, 0) | 1;
+    uint64_t mask = reuse.capacity - 1;
+
+    for (uint64_t probe = 0; probe < REUSE_MAX_PROBES; probe++) {
+        struct blok_reuse_file *f = &reuse.files[(tag + probe) & mask];
+        uint64_t cur = __atomic_load_n(&f->tag, __ATOMIC_ACQUIRE);
+
+        if (cur == REUSE_EMPTY) {
+            uint64_t expected = REUSE_EMPTY;
+            if (__atomic_compare_exchange_n(&f->tag, &expected, tag, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                f->dev = id->dev;
+                f->ino = id->ino;
+                f->gen = id->gen;
+                f->path = path;
+                __atomic_store_n(&f->ready, 1, __ATOMIC_RELEASE);
+                return f;
+            }
+            cur = expected;
+        }
+        if (cur != tag) {
+            continue;
+        }
+        while (!__atomic_load_n(&f->ready, __ATOMIC_ACQUIRE)) {
+        }
+        if (f->ino == id->ino && f->dev == id->dev && f->gen == id->gen) {
+            return f;
+        }
+    }
+    return &reuse.other;
+}
+
+// Stores now as the range's last access; returns 1 and the time since the previous one if the range was remembered.
+// Otherwise the set's least recently used slot, or an empty one, is taken over.  Losing a race retries the set a few
+// times before giving up, which only loses this access's time.
+static int range_touch(uint64_t hash, uint64_t now, uint64_t *age)
+{
+    uint64_t *set = &reuse.slots[(hash & (reuse.sets - 1)) * REUSE_WAYS];
+    uint64_t fp = hash >> REUSE_TIME_BITS;
+    uint64_t want = fp << REUSE_TIME_BITS | now;
+
+    for (int attempt = 0; attempt < REUSE_RETRIES; attempt++) {
+        int victim = 0;
+        uint64_t victim_word = 0;
+        uint64_t victim_age = 0;
+        int way;
+        for (way = 0; way < REUSE_WAYS; way++) {
+            uint64_t w = __atomic_load_n(&set[way], __ATOMIC_RELAXED);
+            if (w != 0 && w >> REUSE_TIME_BITS == fp) {
+                if (__atomic_compare_exchange_n(&set[way], &w, want, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    *age = reuse_age(now, w);
+                    return 1;
+                }
+                break;
+            }
+            uint64_t a = w == 0 ? UINT64_MAX : reuse_age(now, w);
+            if (way == 0 || a > victim_age) {
+                victim = way;
+                victim_word = w;
+                victim_age = a;
+            }
+        }
+        if (way == REUSE_WAYS
+            && __atomic_compare_exchange_n(&set[victim], &victim_word, want, 0, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+void blok_reuse_record(const struct blok_fileid *id, const struct blok_path *path, uint64_t offset, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    struct blok_reuse_file *f = file_lookup(id, path);
+    uint64_t now = ((blok_now_ns() - reuse.base_ns) / 1000 + 1) & REUSE_TIME_MASK;
+    now = now != 0 ? now : 1;
+
+    uint64_t first = offset >> reuse.shift;
+    uint64_t last = (offset + size - 1) >> reuse.shift;
+    for (uint64_t range = first; range <= last; range++) {
+        uint64_t age;
+        if (range_touch(reuse_hash(id, range), now, &age)) {
+            __atomic_fetch_add(&f->hist[blok_hist_bucket(age)], 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&f->first, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+struct reuse_sum {
+    const struct blok_reuse_file *file;
+    uint64_t first;
+    uint64_t reused;
+    uint64_t hist[BLOK_HIST_BUCKETS];
+};
+
+static void reuse_sum(struct reuse_sum *s, const struct blok_reuse_file *f)
+{
+    memset(s, 0, sizeof(*s));
+    s->file = f;
+    s->first = __atomic_load_n(&f->first, __ATOMIC_RELAXED);
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        s->hist[b] = __atomic_load_n(&f->hist[b], __ATOMIC_RELAXED);
+        s->reused += s->hist[b];
+    }
+}
+
+static double reuse_pct(const struct reuse_sum *s)
+{
+    uint64_t accesses = s->first + s->reused;
+    return accesses != 0 ? 100.0 * s->reused / accesses : 0.0;
+}
+
+// Keeps the REUSE_TOP_FILES most accessed files, sorted.
+static void top_insert(struct reuse_sum *top, size_t *n, const struct reuse_sum *s)
+{
+    size_t at = *n;
+    while (at > 0 && top[at - 1].first + top[at - 1].reused < s->first + s->reused) {
+        at--;
+    }
+    if (at == REUSE_TOP_FILES) {
+        return;
+    }
+    size_t last = *n < REUSE_TOP_FILES ? (*n)++ : REUSE_TOP_FILES - 1;
+    memmove(&top[at + 1], &top[at], (last - at) * sizeof(struct reuse_sum));
+    top[at] = *s;
+}
+
+// The age of the least recently used slot of the full set that has the youngest one: reuse times much longer than
+// this are likely to have been forgotten and counted as first accesses.
+static uint64_t reuse_horizon(uint64_t *used)
+{
+    uint64_t now = ((blok_now_ns() - reuse.base_ns) / 1000 + 1) & REUSE_TIME_MASK;
+    uint64_t horizon = 0;
+    *used = 0;
+    for (uint64_t set = 0; set < reuse.sets; set++) {
+        uint64_t oldest = 0;
+        int full = 1;
+        for (int way = 0; way < REUSE_WAYS; way++) {
+            uint64_t w = __atomic_load_n(&reuse.slots[set * REUSE_WAYS + way], __ATOMIC_RELAXED);
+            if (w == 0) {
+                full = 0;
+                continue;
+            }
+            (*used)++;
+            uint64_t a = reuse_age(now, w);
+            oldest = a > oldest ? a : oldest;
+        }
+        if (full && (horizon == 0 || oldest < horizon)) {
+            horizon = oldest;
+        }
+    }
+    return horizon;
+}
+
+void blok_reuse_stats(FILE *out)
+{
+    struct reuse_sum total = { 0 };
+    struct reuse_sum top[REUSE_TOP_FILES];
+    size_t ntop = 0;
+    uint64_t files = 0, streaming = 0, streaming_accesses = 0, dropped = 0;
+    uint64_t used;
+    uint64_t horizon = reuse_horizon(&used);
+
+    for (uint64_t i = 0; i <= reuse.capacity; i++) {
+        const struct blok_reuse_file *f = i < reuse.capacity ? &reuse.files[i] : &reuse.other;
+        if (f != &reuse.other && !__atomic_load_n(&f->ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        struct reuse_sum s;
+        reuse_sum(&s, f);
+        total.first += s.first;
+        total.reused += s.reused;
+        for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+            total.hist[b] += s.hist[b];
+        }
+        if (f == &reuse.other) {
+            dropped = s.first + s.reused;
+            continue;
+        }
+        if (s.first + s.reused == 0) {
+            continue;
+        }
+        files++;
+        if (reuse_pct(&s) < REUSE_STREAMING_PCT) {
+            streaming++;
+            streaming_accesses += s.first + s.reused;
+        }
+        top_insert(top, &ntop, &s);
+    }
+
+    uint64_t accesses = total.first + total.reused;
+    fprintf(out, "reuse.range_bytes %llu\n", 1ULL << reuse.shift);
+    fprintf(out, "reuse.slots %llu\n", (unsigned long long) (reuse.sets * REUSE_WAYS));
+    fprintf(out, "reuse.slots_used %llu\n", (unsigned long long) used);
+    fprintf(out, "reuse.horizon_us %llu\n", (unsigned long long) horizon);
+    fprintf(out, "reuse.accesses %llu\n", (unsigned long long) accesses);
+    fprintf(out, "reuse.first %llu\n", (unsigned long long) total.first);
+    fprintf(out, "reuse.reused_pct %.2f\n", reuse_pct(&total));
+    fprintf(out, "reuse.p50_us %llu\n", (unsigned long long) blok_hist_percentile(total.hist, 0.5));
+    fprintf(out, "reuse.p90_us %llu\n", (unsigned long long) blok_hist_percentile(total.hist, 0.9));
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        if (total.hist[b] != 0) {
+            fprintf(out, "reuse.lt_%llu %llu\n", 1ULL << b, (unsigned long long) total.hist[b]);
+        }
+    }
+    fprintf(out, "reuse.files %llu\n", (unsigned long long) files);
+    fprintf(out, "reuse.files.dropped_accesses %llu\n", (unsigned long long) dropped);
+    fprintf(out, "reuse.files.streaming %llu\n", (unsigned long long) streaming);
+    fprintf(out, "reuse.streaming_accesses_pct %.2f\n", accesses ? 100.0 * streaming_accesses / accesses : 0.0);
+    for (size_t i = 0; i < ntop; i++) {
+        const struct blok_reuse_file *f = top[i].file;
+        fprintf(out, "reuse.file.%zu.path %s\n", i + 1, f->path ? f->path->str : "?");
+        fprintf(out, "reuse.file.%zu.accesses %llu\n", i + 1, (unsigned long long) (top[i].first + top[i].reused));
+        fprintf(out, "reuse.file.%zu.reused_pct %.2f\n", i + 1, reuse_pct(&top[i]));
+        fprintf(out, "reuse.file.%zu.p50_us %llu\n", i + 1,
+                (unsigned long long) blok_hist_percentile(top[i].hist, 0.5));
+        fprintf(out, "reuse.file.%zu.p90_us %llu\n", i + 1,
+                (unsigned long long) blok_hist_percentile(top[i].hist, 0.9));
+    }
+}
@@ -0,0 +1,128 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/rollup.h"
+#include "../include/mem.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct blok_rollup *blok_rollup_open(FILE *log, unsigned int interval, int overhead)
+{
+    struct blok_rollup *rollup = calloc(1, sizeof(struct blok_rollup));
+    if (rollup == NULL) {
+        return NULL;
+    }
+    blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct blok_rollup));
+    rollup->log = log;
+    rollup->interval = interval;
+    rollup->overhead = overhead;
+    pthread_mutex_init(&rollup->lock, NULL);
+    pthread_cond_init(&rollup->wakeup, NULL);
+    blok_counters_read(&rollup->prev);
+    return rollup;
+}
+
+static void rollup_write(struct blok_rollup *rollup, unsigned int elapsed)
+{
+    struct blok_counters now;
+    blok_counters_read(&now);
+
+    // the interval's counts are the difference to the previous snapshot, histograms included
+    struct blok_counters delta = now;
+    uint64_t *dst = (uint64_t *) &delta;
+    const uint64_t *prev = (const uint64_t *) &rollup->prev;
+    for (size_t i = 0; i < sizeof(struct blok_counters) / sizeof(uint64_t); i++) {
+        dst[i] -= prev[i];
+    }
+    rollup->prev = now;
+
+    unsigned long long ts = time(NULL);
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        struct blok_op_counters *c = &delta.op[op];
+        if (c->ops == 0) {
+            continue;
+        }
+        char line[512];
+        int len = snprintf(line, sizeof(line),
+                           "{\"rollup\":\"%s\",\"ts\":%llu,\"interval\":%u,\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,"
+                           "\"latency_p50\":%llu,\"latency_p99\":%llu",
+                           blok_op_name(op), ts, elapsed, (unsigned long long) c->ops,
+                           (unsigned long long) c->bytes, (unsigned long long) c->errors,
+                           (unsigned long long) blok_hist_percentile(c->latency, 0.5),
+                           (unsigned long long) blok_hist_percentile(c->latency, 0.99));
+        if (rollup->overhead) {
+            uint64_t overhead_ns = c->total_ns - c->syscall_ns;
+            len += snprintf(line + len, sizeof(line) - len,
+                            ",\"overhead_ns\":%llu,\"syscall_ns\":%llu,\"overhead_p50\":%llu,\"overhead_p99\":%llu,"
+                            "\"overhead_pct\":%.2f",
+                            (unsigned long long) overhead_ns, (unsigned long long) c->syscall_ns,
+                            (unsigned long long) blok_hist_percentile(c->overhead, 0.5),
+                            (unsigned long long) blok_hist_percentile(c->overhead, 0.99),
+                            c->total_ns != 0 ? 100.0 * overhead_ns / c->total_ns : 0.0);
+        }
+        len += snprintf(line + len, sizeof(line) - len, "}\n");
+        fwrite(line, 1, len, rollup->log);
+    }
+}
+
+static void *rollup_writer(void *arg)
+{
+    struct blok_rollup *rollup = arg;
+    time_t last = time(NULL);
+
+    pthread_mutex_lock(&rollup->lock);
+    while (rollup->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += rollup->interval;
+        while (rollup->running && pthread_cond_timedwait(&rollup->wakeup, &rollup->lock, &deadline) == 0) {
+        }
+        pthread_mutex_unlock(&rollup->lock);
+
+        time_t now = time(NULL);
+        rollup_write(rollup, now - last);
+        last = now;
+
+        pthread_mutex_lock(&rollup->lock);
+    }
+    pthread_mutex_unlock(&rollup->lock);
+    return NULL;
+}
+
+// Has to run after fuse_main() has daemonized, like the state checkpointer.
+int blok_rollup_start(struct blok_rollup *rollup)
+{
+    rollup->running = 1;
+    int err = pthread_create(&rollup->writer, NULL, rollup_writer, rollup);
+    if (err != 0) {
+        rollup->running = 0;
+        return -err;
+    }
+    return 0;
+}
+
+// Stopping the writer also flushes the last, partial interval.
+void blok_rollup_close(struct blok_rollup *rollup)
+{
+    if (rollup == NULL) {
+        return;
+    }
+    if (rollup->running) {
+        pthread_mutex_lock(&rollup->lock);
+        rollup->running = 0;
+        pthread_cond_signal(&rollup->wakeup);
+        pthread_mutex_unlock(&rollup->lock);
+        pthread_join(rollup->writer, NULL);
+    }
+    pthread_mutex_destroy(&rollup->lock);
+    pthread_cond_destroy(&rollup->wakeup);
+    free(rollup);
+    blok_mem_uncharge(BLOK_MEM_STATS, sizeof(struct blok_rollup));
+}
@@ -0,0 +1,351 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/share.h"
+#include "../include/mem.h"
+#include "../include/proc.h"
+#include <errno.h>
+#include <fuse.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same conventions as the heat map: tags are odd, so an empty slot is 0.
+#define SHARE_EMPTY 0
+#define SHARE_MAX_PROBES 64
+#define SHARE_HLL_BITS __builtin_ctz(BLOK_SHARE_HLL)
+// Slots for the readers that have a bit, kept sparse so lookups end at an empty slot quickly.
+#define SHARE_READER_SLOTS (4 * BLOK_SHARE_EXACT)
+// Degrees up to 2^(SHARE_DEGREES - 2) in powers of two, and one bucket for everything above.
+#define SHARE_DEGREES 9
+#define SHARE_TOP_FILES 10
+
+int blok_share_enabled;
+
+static struct {
+    struct blok_share_entry *entries;
+    uint64_t capacity;
+    uint32_t shift;
+    uint64_t used;
+    uint64_t dropped;
+    // (reader << 32) | (bit + 1), 0 for an empty slot
+    uint64_t readers[SHARE_READER_SLOTS];
+    uint32_t next_bit;
+} share;
+
+int blok_share_open(uint64_t range_size)
+{
+    uint64_t capacity = BLOK_SHARE_ENTRIES;
+    uint64_t budget = blok_mem_budget();
+    while (budget != 0 && capacity > 1024 && capacity * sizeof(struct blok_share_entry) > budget / 4) {
+        capacity >>= 1;
+    }
+    if (blok_mem_charge(BLOK_MEM_SHARING, capacity * sizeof(struct blok_share_entry)) < 0) {
+        return -ENOMEM;
+    }
+    share.entries = calloc(capacity, sizeof(struct blok_share_entry));
+    if (share.entries == NULL) {
+        blok_mem_uncharge(BLOK_MEM_SHARING, capacity * sizeof(struct blok_share_entry));
+        return -ENOMEM;
+    }
+    share.capacity = capacity;
+    share.shift = __builtin_ctzll(range_size);
+    blok_share_enabled = 1;
+    return 0;
+}
+
+void blok_share_close(void)
+{
+    if (share.entries == NULL) {
+        return;
+    }
+    blok_share_enabled = 0;
+    free(share.entries);
+    blok_mem_uncharge(BLOK_MEM_SHARING, share.capacity * sizeof(struct blok_share_entry));
+    share.entries = NULL;
+}
+
+static uint64_t share_hash(const struct blok_fileid *id, uint64_t range)
+{
+    uint64_t h = id->ino * 0x9e3779b97f4a7c15ULL;
+    h ^= (id->dev + ((uint64_t) id->gen << 32)) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= range * 0x165667b19e3779f9ULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h | 1;
+}
+
+static uint64_t reader_hash(uint32_t reader)
+{
+    uint64_t h = reader + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static struct blok_share_entry *share_lookup(const struct blok_fileid *id, const struct blok_path *path,
+                                             uint64_t range)
+{
+    uint64_t tag = share_hash(id, range);
+    uint64_t mask = share.capacity - 1;
+
+    for (uint64_t probe = 0; probe < SHARE_MAX_PROBES; probe++) {
+        struct blok_share_entry *e = &share.entries[(tag + probe) & mask];
+        uint64_t cur = __atomic_load_n(&e->tag, __ATOMIC_ACQUIRE);
+
+        if (cur == SHARE_EMPTY) {
+            uint64_t expected = SHARE_EMPTY;
+            if (__atomic_compare_exchange_n(&e->tag, &expected, tag, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                e->dev = id->dev;
+                e->ino = id->ino;
+                e->gen = id->gen;
+                e->range = range;
+                e->path = path;
+                __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&share.used, 1, __ATOMIC_RELAXED);
+                return e;
+            }
+            cur = expected;
+        }
+        if (cur != tag) {
+            continue;
+        }
+        while (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+        }
+        if (e->range == range && e->ino == id->ino && e->dev == id->dev && e->gen == id->gen) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// The reader's bit, handed out on first sight while there are any left; -1 for the readers that only go into the
+// HyperLogLogs.  A bit taken by a thread that then loses the race for the slot to another reader is kept for the
+// next free slot.
+static int reader_bit(uint32_t reader)
+{
+    int mine = -1;
+    uint32_t h = reader * 2654435761U;
+    for (uint32_t probe = 0; probe < SHARE_READER_SLOTS; probe++) {
+        uint64_t *slot = &share.readers[(h + probe) % SHARE_READER_SLOTS];
+        uint64_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if (cur == 0) {
+            if (mine < 0) {
+                if (__atomic_load_n(&share.next_bit, __ATOMIC_RELAXED) >= BLOK_SHARE_EXACT) {
+                    return -1;
+                }
+                uint32_t bit = __atomic_fetch_add(&share.next_bit, 1, __ATOMIC_RELAXED);
+                if (bit >= BLOK_SHARE_EXACT) {
+                    return -1;
+                }
+                mine = bit;
+            }
+            uint64_t want = (uint64_t) reader << 32 | (uint64_t) (mine + 1);
+            if (__atomic_compare_exchange_n(slot, &cur, want, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return mine;
+            }
+        }
+        if ((uint32_t) (cur >> 32) == reader) {
+            return (int) (uint32_t) cur - 1;
+        }
+    }
+    return -1;
+}
+
+// Jobs where they are known, otherwise processes.
+static uint32_t share_reader(void)
+{
+    int pid = fuse_get_context()->pid;
+    if (blok_job_mode != BLOK_JOB_NONE) {
+        int32_t job = blok_proc_lookup(pid)->job;
+        if (job != 0) {
+            return job;
+        }
+    }
+    return pid;
+}
+
+void blok_share_record(const struct blok_fileid *id, const struct blok_path *path, uint64_t offset, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    uint32_t reader = share_reader();
+    int bit = reader_bit(reader);
+    uint64_t hash = reader_hash(reader);
+    uint32_t reg = hash >> (64 - SHARE_HLL_BITS);
+    uint8_t rank = __builtin_clzll(hash << SHARE_HLL_BITS | 1ULL << (SHARE_HLL_BITS - 1)) + 1;
+
+    uint64_t first = offset >> share.shift;
+    uint64_t last = (offset + size - 1) >> share.shift;
+    for (uint64_t range = first; range <= last; range++) {
+        struct blok_share_entry *e = share_lookup(id, path, range);
+        if (e == NULL) {
+            __atomic_fetch_add(&share.dropped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_fetch_add(&e->reads, 1, __ATOMIC_RELAXED);
+        // readers mostly come back to ranges they already read, so the shared line is only written when it changes
+        if (bit >= 0) {
+            if (!(__atomic_load_n(&e->mask, __ATOMIC_RELAXED) & 1ULL << bit)) {
+                __atomic_fetch_or(&e->mask, 1ULL << bit, __ATOMIC_RELAXED);
+            }
+        } else {
+            uint8_t cur = __atomic_load_n(&e->hll[reg], __ATOMIC_RELAXED);
+            while (cur < rank && !__atomic_compare_exchange_n(&e->hll[reg], &cur, rank, 1, __ATOMIC_RELAXED,
+                                                              __ATOMIC_RELAXED)) {
+            }
+        }
+    }
+}
+
+static double hll_estimate(const uint8_t *hll)
+{
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < BLOK_SHARE_HLL; i++) {
+        sum += ldexp(1.0, -hll[i]);
+        zeros += hll[i] == 0;
+    }
+    double m = BLOK_SHARE_HLL;
+    double e = 0.709 * m * m / sum;
+    if (e <= 2.5 * m && zeros != 0) {
+        e = m * log(m / zeros);
+    }
+    return e;
+}
+
+static uint64_t share_degree(uint64_t mask, const uint8_t *hll)
+{
+    return __builtin_popcountll(mask) + (uint64_t) llround(hll_estimate(hll));
+}
+
+static int degree_bucket(uint64_t degree)
+{
+    int b = degree <= 1 ? 0 : 64 - __builtin_clzll(degree - 1);
+    return b < SHARE_DEGREES - 1 ? b : SHARE_DEGREES - 1;
+}
+
+struct share_file {
+    const struct blok_share_entry *first;
+    uint64_t mask;
+    uint8_t hll[BLOK_SHARE_HLL];
+    uint64_t degree;
+    uint64_t reads;
+    uint64_t shared_ranges;
+};
+
+static int entry_cmp(const void *x, const void *y)
+{
+    const struct blok_share_entry *a = *(const struct blok_share_entry * const *) x;
+    const struct blok_share_entry *b = *(const struct blok_share_entry * const *) y;
+    if (a->dev != b->dev) {
+        return a->dev < b->dev ? -1 : 1;
+    }
+    if (a->ino != b->ino) {
+        return a->ino < b->ino ? -1 : 1;
+    }
+    return (a->gen > b->gen) - (a->gen < b->gen);
+}
+
+// Keeps the SHARE_TOP_FILES files with the most readers, sorted, ties going to the one with more reads.
+static void top_insert(struct share_file *top, size_t *n, const struct share_file *f)
+{
+    size_t at = *n;
+    while (at > 0 && (top[at - 1].degree < f->degree
+                      || (top[at - 1].degree == f->degree && top[at - 1].reads < f->reads))) {
+        at--;
+    }
+    if (at == SHARE_TOP_FILES) {
+        return;
+    }
+    size_t last = *n < SHARE_TOP_FILES ? (*n)++ : SHARE_TOP_FILES - 1;
+    memmove(&top[at + 1], &top[at], (last - at) * sizeof(struct share_file));
+    top[at] = *f;
+}
+
+void blok_share_stats(FILE *out)
+{
+    uint64_t ranges[SHARE_DEGREES] = { 0 };
+    uint64_t reads[SHARE_DEGREES] = { 0 };
+    uint64_t total_reads = 0, shared_reads = 0;
+    size_t n = 0;
+    const struct blok_share_entry **sorted = malloc(share.capacity * sizeof(struct blok_share_entry *));
+
+    for (uint64_t i = 0; i < share.capacity; i++) {
+        const struct blok_share_entry *e = &share.entries[i];
+        if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        uint64_t degree = share_degree(__atomic_load_n(&e->mask, __ATOMIC_RELAXED), e->hll);
+        uint64_t r = __atomic_load_n(&e->reads, __ATOMIC_RELAXED);
+        ranges[degree_bucket(degree)]++;
+        reads[degree_bucket(degree)] += r;
+        total_reads += r;
+        shared_reads += degree > 1 ? r : 0;
+        if (sorted != NULL) {
+            sorted[n++] = e;
+        }
+    }
+
+    fprintf(out, "sharing.range_bytes %llu\n", 1ULL << share.shift);
+    fprintf(out, "sharing.ranges %llu\n", (unsigned long long) __atomic_load_n(&share.used, __ATOMIC_RELAXED));
+    fprintf(out, "sharing.dropped %llu\n", (unsigned long long) __atomic_load_n(&share.dropped, __ATOMIC_RELAXED));
+    uint32_t exact = __atomic_load_n(&share.next_bit, __ATOMIC_RELAXED);
+    fprintf(out, "sharing.exact_readers %u\n", exact < BLOK_SHARE_EXACT ? exact : BLOK_SHARE_EXACT);
+    for (int b = 0; b < SHARE_DEGREES; b++) {
+        if (b < SHARE_DEGREES - 1) {
+            fprintf(out, "sharing.ranges.readers_le_%llu %llu\n", 1ULL << b, (unsigned long long) ranges[b]);
+            fprintf(out, "sharing.reads.readers_le_%llu %llu\n", 1ULL << b, (unsigned long long) reads[b]);
+        } else {
+            fprintf(out, "sharing.ranges.readers_gt_%llu %llu\n", 1ULL << (b - 1), (unsigned long long) ranges[b]);
+            fprintf(out, "sharing.reads.readers_gt_%llu %llu\n", 1ULL << (b - 1), (unsigned long long) reads[b]);
+        }
+    }
+    fprintf(out, "sharing.shared_reads_pct %.2f\n", total_reads ? 100.0 * shared_reads / total_reads : 0.0);
+
+    if (sorted == NULL) {
+        return;
+    }
+    // files are the ranges' sketches merged
+    qsort(sorted, n, sizeof(sorted[0]), entry_cmp);
+    struct share_file top[SHARE_TOP_FILES];
+    size_t ntop = 0;
+    for (size_t i = 0; i < n; ) {
+        struct share_file f = { .first = sorted[i] };
+        size_t j;
+        for (j = i; j < n && entry_cmp(&sorted[i], &sorted[j]) == 0; j++) {
+            const struct blok_share_entry *e = sorted[j];
+            uint64_t mask = __atomic_load_n(&e->mask, __ATOMIC_RELAXED);
+            f.mask |= mask;
+            for (int r = 0; r < BLOK_SHARE_HLL; r++) {
+                f.hll[r] = e->hll[r] > f.hll[r] ? e->hll[r] : f.hll[r];
+            }
+            f.reads += __atomic_load_n(&e->reads, __ATOMIC_RELAXED);
+            f.shared_ranges += share_degree(mask, e->hll) > 1;
+            if (f.first->path == NULL) {
+                f.first = e;
+            }
+        }
+        f.degree = share_degree(f.mask, f.hll);
+        if (f.degree > 1) {
+            top_insert(top, &ntop, &f);
+        }
+        i = j;
+    }
+    for (size_t i = 0; i < ntop; i++) {
+        fprintf(out, "sharing.file.%zu.path %s\n", i + 1, top[i].first->path ? top[i].first->path->str : "?");
+        fprintf(out, "sharing.file.%zu.readers %llu\n", i + 1, (unsigned long long) top[i].degree);
+        fprintf(out, "sharing.file.%zu.shared_ranges %llu\n", i + 1, (unsigned long long) top[i].shared_ranges);
+        fprintf(out, "sharing.file.%zu.reads %llu\n", i + 1, (unsigned long long) top[i].reads);
+    }
+    free(sorted);
+}
@@ -0,0 +1,224 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/state.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t state_size(uint64_t heat_capacity)
+{
+    return BLOK_STATE_HEADER_SIZE + heat_capacity * sizeof(struct blok_heat_entry);
+}
+
+// A state file is only reused when every size recorded in it agrees with the file itself; anything else is treated
+// as foreign or corrupt and the file is started over.
+static int state_header_valid(const struct blok_state_header *h, uint64_t file_size)
+{
+    return h->magic == BLOK_STATE_MAGIC
+        && h->version == BLOK_STATE_VERSION
+        && h->header_size == BLOK_STATE_HEADER_SIZE
+        && h->file_size == file_size
+        && h->heat_capacity != 0
+        && (h->heat_capacity & (h->heat_capacity - 1)) == 0
+        && h->heat_block_shift <= BLOK_HEAT_MAX_SHIFT
+        && h->heat_target_shift <= BLOK_HEAT_MAX_SHIFT
+        && state_size(h->heat_capacity) == file_size;
+}
+
+struct blok_state *blok_state_open(const char *path, uint64_t heat_entries, uint32_t heat_block_shift,
+                                   unsigned int checkpoint_interval)
+{
+    struct blok_state *state = calloc(1, sizeof(struct blok_state));
+    if (state == NULL) {
+        return NULL;
+    }
+    state->checkpoint_interval = checkpoint_interval;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->wakeup, NULL);
+
+    state->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (state->fd < 0) {
+        goto fail;
+    }
+    // a second mount on the same file would checkpoint over this one's heat map; flock() locks belong to the open
+    // file, so the lock survives FUSE daemonizing and goes away with the mount
+    if (flock(state->fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK) {
+            goto fail;
+        }
+        fprintf(stderr, "blok: %s: state file in use by another blok\n", path);
+        blok_state_close(state);
+        return NULL;
+    }
+
+    struct stat st;
+    struct blok_state_header old;
+    if (fstat(state->fd, &st) < 0) {
+        goto fail;
+    }
+    int reuse = pread(state->fd, &old, sizeof(old), 0) == sizeof(old) && state_header_valid(&old, st.st_size);
+    if (reuse && blok_mem_budget() != 0 && old.heat_capacity * sizeof(struct blok_heat_entry) > blok_mem_budget() / 2) {
+        fprintf(stderr, "blok: heat map in %s does not fit the memory budget, starting over\n", path);
+        reuse = 0;
+        st.st_size = 0;
+    }
+
+    if (reuse) {
+        state->size = old.file_size;
+        if (old.heat_capacity != heat_entries || old.heat_block_shift != heat_block_shift) {
+            fprintf(stderr, "blok: keeping heat map layout of %s (%llu entries, %llu byte blocks)\n", path,
+                    (unsigned long long) old.heat_capacity, 1ULL << old.heat_block_shift);
+        }
+    } else {
+        if (st.st_size != 0) {
+            fprintf(stderr, "blok: %s is not a usable state file, starting over\n", path);
+        }
+        state->size = state_size(heat_entries);
+        // truncating to 0 first makes sure no stale bytes survive in the new layout
+        if (ftruncate(state->fd, 0) < 0 || ftruncate(state->fd, state->size) < 0) {
+            goto fail;
+        }
+    }
+
+    state->map = mmap(NULL, state->size, PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+    if (state->map == MAP_FAILED) {
+        state->map = NULL;
+        goto fail;
+    }
+    state->header = state->map;
+    struct blok_state_header *h = state->header;
+
+    if (!reuse) {
+        h->version = BLOK_STATE_VERSION;
+        h->header_size = BLOK_STATE_HEADER_SIZE;
+        h->file_size = state->size;
+        h->created = time(NULL);
+        h->heat_capacity = heat_entries;
+        h->heat_block_shift = heat_block_shift;
+        h->clean = 1;
+        // the magic goes in last and is synced on its own, so a half-initialized file is never taken for valid
+        msync(state->map, state->size, MS_SYNC);
+        h->magic = BLOK_STATE_MAGIC;
+    }
+
+    blok_heat_attach(&state->heat, (struct blok_heat_entry *) ((char *) state->map + BLOK_STATE_HEADER_SIZE), h);
+    blok_mem_charge_force(BLOK_MEM_HEAT, h->heat_capacity * sizeof(struct blok_heat_entry));
+    if (!h->clean) {
+        uint64_t torn = blok_heat_recover(&state->heat);
+        fprintf(stderr, "blok: %s was not closed cleanly, recovered (%llu torn heat map entries)\n", path,
+                (unsigned long long) torn);
+    }
+
+    // counts of earlier mounts, which this mount's shards are added to
+    state->base = h->counters;
+    h->mounts++;
+    h->clean = 0;
+    msync(state->map, BLOK_STATE_HEADER_SIZE, MS_SYNC);
+    return state;
+
+fail:
+    perror(path);
+    blok_state_close(state);
+    return NULL;
+}
+
+void blok_state_fold_counters(struct blok_state *state)
+{
+    struct blok_counters now;
+    blok_counters_read(&now);
+    struct blok_state_counters *c = &state->header->counters;
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        __atomic_store_n(&c->ops[op], state->base.ops[op] + now.op[op].ops, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->bytes[op], state->base.bytes[op] + now.op[op].bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->errors[op], state->base.errors[op] + now.op[op].errors, __ATOMIC_RELAXED);
+    }
+}
+
+// Wakes up every second to fold the counters into the mapping and to compact the heat map when it is filling up.
+// Syncing the mapping only pushes dirty pages to disk, so that a power loss costs at most one interval's worth of
+// updates.
+static void *state_checkpointer(void *arg)
+{
+    struct blok_state *state = arg;
+    time_t last_sync = time(NULL);
+
+    pthread_mutex_lock(&state->lock);
+    while (state->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&state->wakeup, &state->lock, &deadline);
+        pthread_mutex_unlock(&state->lock);
+
+        blok_state_fold_counters(state);
+        if (blok_heat_under_pressure(&state->heat)) {
+            blok_heat_relieve(&state->heat);
+        }
+        time_t now = time(NULL);
+        if (state->checkpoint_interval != 0 && now - last_sync >= state->checkpoint_interval) {
+            msync(state->map, state->size, MS_SYNC);
+            last_sync = now;
+        }
+
+        pthread_mutex_lock(&state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Has to run after fuse_main() has daemonized, since threads don't survive the fork.
+int blok_state_start(struct blok_state *state)
+{
+    state->running = 1;
+    int err = pthread_create(&state->checkpointer, NULL, state_checkpointer, state);
+    if (err != 0) {
+        state->running = 0;
+        return -err;
+    }
+    return 0;
+}
+
+void blok_state_close(struct blok_state *state)
+{
+    if (state == NULL) {
+        return;
+    }
+    if (state->running) {
+        pthread_mutex_lock(&state->lock);
+        state->running = 0;
+        pthread_cond_signal(&state->wakeup);
+        pthread_mutex_unlock(&state->lock);
+        pthread_join(state->checkpointer, NULL);
+    }
+    if (state->map != NULL) {
+        blok_state_fold_counters(state);
+        blok_heat_detach(&state->heat);
+        blok_mem_uncharge(BLOK_MEM_HEAT, state->header->heat_capacity * sizeof(struct blok_heat_entry));
+        msync(state->map, state->size, MS_SYNC);
+        state->header->clean = 1;
+        msync(state->map, BLOK_STATE_HEADER_SIZE, MS_SYNC);
+        munmap(state->map, state->size);
+    }
+    if (state->fd >= 0) {
+        close(state->fd);
+    }
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->wakeup);
+    free(state);
+}
@@ -0,0 +1,215 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/stats.h"
+#include "../include/alloc.h"
+#include "../include/cgroup.h"
+#include "../include/counters.h"
+#include "../include/filter.h"
+#include "../include/flight.h"
+#include "../include/intern.h"
+#include "../include/marker.h"
+#include "../include/mem.h"
+#include "../include/reuse.h"
+#include "../include/share.h"
+#include "../include/state.h"
+#include <stdlib.h>
+
+static void stats_hist(FILE *out, const char *name, const char *hist_name, const uint64_t *hist)
+{
+    fprintf(out, "op.%s.%s.p50 %llu\n", name, hist_name, (unsigned long long) blok_hist_percentile(hist, 0.5));
+    fprintf(out, "op.%s.%s.p99 %llu\n", name, hist_name, (unsigned long long) blok_hist_percentile(hist, 0.99));
+    for (int b = 0; b < BLOK_HIST_BUCKETS; b++) {
+        if (hist[b] != 0) {
+            fprintf(out, "op.%s.%s.lt_%llu %llu\n", name, hist_name, 1ULL << b, (unsigned long long) hist[b]);
+        }
+    }
+}
+
+static double stats_pct(uint64_t part, uint64_t whole)
+{
+    return whole != 0 ? 100.0 * part / whole : 0.0;
+}
+
+// Totals include the counts of earlier mounts kept in the state file; the epoch_ values, latencies and overhead only
+// cover the time since the last reset.  Overhead is the time spent in a callback outside the backing syscalls.
+static void stats_counters(FILE *out, struct blok_state *state)
+{
+    struct blok_counters total;
+    struct blok_counters epoch;
+    uint64_t total_ns = 0;
+    uint64_t syscall_ns = 0;
+    blok_counters_read(&total);
+    blok_counters_read_epoch(&epoch);
+
+    fprintf(out, "epoch %llu\n", (unsigned long long) blok_counters_epoch());
+    fprintf(out, "epoch.seconds %llu\n", (unsigned long long) (time(NULL) - blok_counters_epoch_start()));
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        struct blok_op_counters *t = &total.op[op];
+        struct blok_op_counters *e = &epoch.op[op];
+        uint64_t ops = t->ops + (state != NULL ? state->base.ops[op] : 0);
+        if (ops == 0) {
+            continue;
+        }
+        const char *name = blok_op_name(op);
+        fprintf(out, "op.%s.ops %llu\n", name, (unsigned long long) ops);
+        fprintf(out, "op.%s.bytes %llu\n", name,
+                (unsigned long long) (t->bytes + (state != NULL ? state->base.bytes[op] : 0)));
+        fprintf(out, "op.%s.errors %llu\n", name,
+                (unsigned long long) (t->errors + (state != NULL ? state->base.errors[op] : 0)));
+        for (int err = 0; err < BLOK_ERRNO_MAX; err++) {
+            if (t->errnos[err] != 0) {
+                const char *errname = err == 0 ? "other" : blok_errno_name(err);
+                if (errname != NULL) {
+                    fprintf(out, "op.%s.errors.%s %llu\n", name, errname, (unsigned long long) t->errnos[err]);
+                } else {
+                    fprintf(out, "op.%s.errors.%d %llu\n", name, err, (unsigned long long) t->errnos[err]);
+                }
+            }
+        }
+        // shards are read while they change, so a call may show up as ended before it shows up as started
+        fprintf(out, "op.%s.in_flight %llu\n", name,
+                (unsigned long long) (t->started > t->ops ? t->started - t->ops : 0));
+        fprintf(out, "op.%s.dropped %llu\n", name, (unsigned long long) t->dropped);
+        if (blok_filter != NULL) {
+            fprintf(out, "op.%s.filtered %llu\n", name, (unsigned long long) t->filtered);
+        }
+        fprintf(out, "op.%s.epoch_ops %llu\n", name, (unsigned long long) e->ops);
+        fprintf(out, "op.%s.epoch_bytes %llu\n", name, (unsigned long long) e->bytes);
+        fprintf(out, "op.%s.epoch_errors %llu\n", name, (unsigned long long) e->errors);
+        stats_hist(out, name, "latency_ns", e->latency);
+        fprintf(out, "op.%s.overhead_ns %llu\n", name, (unsigned long long) (e->total_ns - e->syscall_ns));
+        fprintf(out, "op.%s.syscall_ns %llu\n", name, (unsigned long long) e->syscall_ns);
+        fprintf(out, "op.%s.overhead_pct %.2f\n", name, stats_pct(e->total_ns - e->syscall_ns, e->total_ns));
+        stats_hist(out, name, "overhead_ns", e->overhead);
+        stats_hist(out, name, "syscall_ns", e->syscall);
+        if (e->pmu_samples != 0) {
+            fprintf(out, "op.%s.pmu_samples %llu\n", name, (unsigned long long) e->pmu_samples);
+            for (int i = 0; i < BLOK_PMU_MAX; i++) {
+                fprintf(out, "op.%s.%s %llu\n", name, blok_pmu_name(i), (unsigned long long) e->pmu[i]);
+            }
+            if (e->pmu[BLOK_PMU_CYCLES] != 0) {
+                fprintf(out, "op.%s.ipc %.2f\n", name,
+                        (double) e->pmu[BLOK_PMU_INSTRUCTIONS] / e->pmu[BLOK_PMU_CYCLES]);
+            }
+        }
+        total_ns += e->total_ns;
+        syscall_ns += e->syscall_ns;
+    }
+    fprintf(out, "overhead.ns %llu\n", (unsigned long long) (total_ns - syscall_ns));
+    fprintf(out, "overhead.syscall_ns %llu\n", (unsigned long long) syscall_ns);
+    fprintf(out, "overhead.pct %.2f\n", stats_pct(total_ns - syscall_ns, total_ns));
+}
+
+// Slot 0 holds the calls whose cgroup is unknown.
+static void stats_cgroups(FILE *out)
+{
+    static const char *dirs[2] = { "read", "write" };
+    size_t n = blok_cgroup_count();
+    struct blok_cgroup_io (*io)[2] = malloc(n * sizeof(*io));
+    if (io == NULL) {
+        return;
+    }
+    blok_cgroup_read(io, n);
+    for (size_t slot = 0; slot < n; slot++) {
+        if (io[slot][0].ops + io[slot][1].ops == 0) {
+            continue;
+        }
+        const struct blok_cgroup *cg = blok_cgroup_get(slot);
+        fprintf(out, "cgroup.%llu.path %s\n", (unsigned long long) cg->id, slot != 0 ? cg->path : "unknown");
+        for (int dir = 0; dir < 2; dir++) {
+            fprintf(out, "cgroup.%llu.%s.ops %llu\n", (unsigned long long) cg->id, dirs[dir],
+                    (unsigned long long) io[slot][dir].ops);
+            fprintf(out, "cgroup.%llu.%s.bytes %llu\n", (unsigned long long) cg->id, dirs[dir],
+                    (unsigned long long) io[slot][dir].bytes);
+            fprintf(out, "cgroup.%llu.%s.latency_ns %llu\n", (unsigned long long) cg->id, dirs[dir],
+                    (unsigned long long) io[slot][dir].latency_ns);
+        }
+    }
+    free(io);
+}
+
+static void stats_heat(FILE *out, struct blok_state *state)
+{
+    struct blok_state_header *h = state->header;
+    fprintf(out, "heat.block_size %llu\n", 1ULL << state->heat.block_shift);
+    fprintf(out, "heat.capacity %llu\n", (unsigned long long) h->heat_capacity);
+    fprintf(out, "heat.used %llu\n", (unsigned long long) __atomic_load_n(&h->heat_used, __ATOMIC_RELAXED));
+    fprintf(out, "heat.dropped %llu\n", (unsigned long long) __atomic_load_n(&h->heat_dropped, __ATOMIC_RELAXED));
+    fprintf(out, "heat.evicted %llu\n", (unsigned long long) h->heat_evicted);
+    fprintf(out, "heat.coarsened %llu\n", (unsigned long long) h->heat_coarsened);
+    fprintf(out, "state.mounts %llu\n", (unsigned long long) h->mounts);
+}
+
+static void stats_mem(FILE *out)
+{
+    fprintf(out, "mem.budget %llu\n", (unsigned long long) blok_mem_budget());
+    fprintf(out, "mem.total %llu\n", (unsigned long long) blok_mem_total());
+    for (int i = 0; i < BLOK_MEM_MAX; i++) {
+        fprintf(out, "mem.%s.bytes %llu\n", blok_mem_name(i), (unsigned long long) blok_mem_usage(i));
+        fprintf(out, "mem.%s.refused %llu\n", blok_mem_name(i), (unsigned long long) blok_mem_refused(i));
+    }
+}
+
+static void stats_alloc(FILE *out)
+{
+    for (int i = 0; i < blok_slab_count(); i++) {
+        struct blok_slab *slab = blok_slab_get(i);
+        fprintf(out, "slab.%s.objects %llu\n", slab->name, (unsigned long long) slab->objects);
+        fprintf(out, "slab.%s.shared_free %llu\n", slab->name, (unsigned long long) slab->nfree);
+        fprintf(out, "slab.%s.chunks %llu\n", slab->name, (unsigned long long) slab->chunks);
+        fprintf(out, "slab.%s.allocs %llu\n", slab->name, (unsigned long long) slab->allocs);
+        fprintf(out, "slab.%s.frees %llu\n", slab->name, (unsigned long long) slab->frees);
+        fprintf(out, "slab.%s.refills %llu\n", slab->name, (unsigned long long) slab->refills);
+    }
+    for (int i = 0; i < blok_arena_count(); i++) {
+        struct blok_arena *arena = blok_arena_get(i);
+        fprintf(out, "arena.%s.chunks %llu\n", arena->name, (unsigned long long) arena->nchunks);
+        fprintf(out, "arena.%s.reserved %llu\n", arena->name, (unsigned long long) arena->reserved);
+        fprintf(out, "arena.%s.allocated %llu\n", arena->name, (unsigned long long) arena->allocated);
+    }
+    fprintf(out, "paths.interned %llu\n", (unsigned long long) blok_intern_count());
+}
+
+char *blok_stats_render(struct fs_state *blok_data, size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        return NULL;
+    }
+    stats_counters(out, blok_data->state);
+    if (blok_cgroup_enabled) {
+        stats_cgroups(out);
+    }
+    blok_marker_stats(out);
+    if (blok_flight_enabled) {
+        blok_flight_stats(out);
+    }
+    if (blok_share_enabled) {
+        blok_share_stats(out);
+    }
+    if (blok_reuse_enabled) {
+        blok_reuse_stats(out);
+    }
+    if (blok_data->state != NULL) {
+        stats_heat(out, blok_data->state);
+    }
+    stats_mem(out);
+    stats_alloc(out);
+    if (fclose(out) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    // forced: the snapshot is freed on release, and it is what shows where the budget went
+    blok_mem_charge_force(BLOK_MEM_STATS, *len);
+    return buf;
+}
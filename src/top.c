@@ -0,0 +1,210 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/top.h"
+#include "../include/counters.h"
+#include "../include/mem.h"
+#include "../include/ndjson.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *kind_names[BLOK_TOP_MAX] = { "file", "dir", "pid", "job" };
+
+static void sketch_add(struct blok_top_sketch *s, uint64_t key, const struct blok_path *path, uint32_t len, int pid,
+                       uint64_t bytes)
+{
+    struct blok_top_entry *min = &s->entries[0];
+    for (int i = 0; i < BLOK_TOP_K; i++) {
+        struct blok_top_entry *e = &s->entries[i];
+        if (e->key == key) {
+            BLOK_SHARD_ADD(e->ops, 1);
+            BLOK_SHARD_ADD(e->bytes, bytes);
+            return;
+        }
+        if (e->ops < min->ops) {
+            min = e;
+        }
+    }
+
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&min->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->path, path, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->len, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->pid, pid, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->error, min->ops, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->ops, min->ops + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&min->bytes, min->bytes + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t prefix_hash(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+    }
+    return h | 1;
+}
+
+void blok_top_record(const struct blok_path *path, int pid, uint64_t bytes)
+{
+    struct blok_shard *shard = blok_shard();
+    struct blok_top *top = shard->top;
+    if (top == NULL) {
+        // small and bounded by the number of threads, so it isn't refused
+        if (posix_memalign((void **) &top, 64, sizeof(struct blok_top)) != 0) {
+            return;
+        }
+        memset(top, 0, sizeof(*top));
+        blok_mem_charge_force(BLOK_MEM_STATS, sizeof(struct blok_top));
+        __atomic_store_n(&shard->top, top, __ATOMIC_RELEASE);
+    }
+    if (path != NULL) {
+        sketch_add(&top->sketch[BLOK_TOP_FILE], (uint64_t) path->id + 1, path, path->len, 0, bytes);
+        const char *slash = memrchr(path->str, '/', path->len);
+        uint32_t dir = slash == NULL || slash == path->str ? 1 : slash - path->str;
+        sketch_add(&top->sketch[BLOK_TOP_DIR], prefix_hash(path->str, dir), path, dir, 0, bytes);
+    }
+    sketch_add(&top->sketch[BLOK_TOP_PID], (uint64_t) pid + 1, NULL, 0, pid, bytes);
+    if (blok_job_mode != BLOK_JOB_NONE) {
+        int32_t job = blok_proc_lookup(pid)->job;
+        sketch_add(&top->sketch[BLOK_TOP_JOB], (uint64_t) job + 1, NULL, 0, job, bytes);
+    }
+}
+
+struct top_merge {
+    enum blok_top_kind kind;
+    struct blok_top_entry *entries;
+    size_t count;
+    size_t cap;
+};
+
+static void sketch_copy(const struct blok_top_sketch *s, struct blok_top_entry *out)
+{
+    for (int attempt = 0; attempt < 16; attempt++) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        for (int i = 0; i < BLOK_TOP_K; i++) {
+            const struct blok_top_entry *e = &s->entries[i];
+            out[i].key = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+            out[i].path = __atomic_load_n(&e->path, __ATOMIC_RELAXED);
+            out[i].len = __atomic_load_n(&e->len, __ATOMIC_RELAXED);
+            out[i].pid = __atomic_load_n(&e->pid, __ATOMIC_RELAXED);
+            out[i].ops = __atomic_load_n(&e->ops, __ATOMIC_RELAXED);
+            out[i].bytes = __atomic_load_n(&e->bytes, __ATOMIC_RELAXED);
+            out[i].error = __atomic_load_n(&e->error, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+    // the thread kept replacing entries; leave its sketch out rather than show torn entries
+    memset(out, 0, BLOK_TOP_K * sizeof(struct blok_top_entry));
+}
+
+// Entries of the same key from different threads are added up, counts and errors alike.
+static void top_merge_shard(struct blok_shard *shard, void *arg)
+{
+    struct top_merge *m = arg;
+    const struct blok_top *top = __atomic_load_n(&shard->top, __ATOMIC_ACQUIRE);
+    if (top == NULL) {
+        return;
+    }
+    struct blok_top_entry copy[BLOK_TOP_K];
+    sketch_copy(&top->sketch[m->kind], copy);
+    for (int i = 0; i < BLOK_TOP_K; i++) {
+        if (copy[i].key == 0) {
+            continue;
+        }
+        size_t j;
+        for (j = 0; j < m->count && m->entries[j].key != copy[i].key; j++) {
+        }
+        if (j == m->count) {
+            if (j < m->cap) {
+                m->entries[m->count++] = copy[i];
+            }
+            continue;
+        }
+        m->entries[j].ops += copy[i].ops;
+        m->entries[j].bytes += copy[i].bytes;
+        m->entries[j].error += copy[i].error;
+    }
+}
+
+static void count_shards(struct blok_shard *shard, void *arg)
+{
+    (*(size_t *) arg)++;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct blok_top_entry *x = a;
+    const struct blok_top_entry *y = b;
+    return (x->ops < y->ops) - (x->ops > y->ops);
+}
+
+size_t blok_top_collect(enum blok_top_kind kind, struct blok_top_entry **out)
+{
+    size_t shards = 0;
+    blok_shard_foreach(count_shards, &shards);
+    // threads started since counting only make the merge drop a few entries
+    struct top_merge m = { .kind = kind, .cap = (shards + 4) * BLOK_TOP_K };
+    m.entries = malloc(m.cap * sizeof(struct blok_top_entry));
+    if (m.entries == NULL) {
+        *out = NULL;
+        return 0;
+    }
+    blok_shard_foreach(top_merge_shard, &m);
+    qsort(m.entries, m.count, sizeof(struct blok_top_entry), entry_cmp);
+    *out = m.entries;
+    return m.count;
+}
+
+const char *blok_top_kind_name(enum blok_top_kind kind)
+{
+    return kind_names[kind];
+}
+
+char *blok_top_render(struct fs_state *blok_data, size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        return NULL;
+    }
+    char name[BLOK_JSON_STRING_MAX(PATH_MAX)];
+    for (int kind = 0; kind < BLOK_TOP_MAX; kind++) {
+        struct blok_top_entry *entries;
+        size_t n = blok_top_collect(kind, &entries);
+        for (size_t i = 0; i < n; i++) {
+            const struct blok_top_entry *e = &entries[i];
+            fprintf(out, "%s %llu %llu %llu ", kind_names[kind], (unsigned long long) e->ops,
+                    (unsigned long long) e->bytes, (unsigned long long) e->error);
+            if (kind == BLOK_TOP_PID || kind == BLOK_TOP_JOB) {
+                fprintf(out, "%d\n", e->pid);
+            } else {
+                char *end = blok_json_string(name, e->path->str, e->len);
+                fprintf(out, "%.*s\n", (int) (end - name), name);
+            }
+        }
+        free(entries);
+    }
+    if (fclose(out) != 0) {
+        free(buf);
+        return NULL;
+    }
+    // forced: the snapshot only lives until the file is released, and top must stay readable over budget
+    blok_mem_charge_force(BLOK_MEM_STATS, *len);
+    return buf;
+}
@@ -0,0 +1,72 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "../include/params.h"
+#include "../include/proc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// Field n (1-based, as in proc(5)) of a stat line, split the plain way: fields 1 and 2 up to the last ')', the rest
+// one per space after it.
+static unsigned long long stat_field(const char *line, int n)
+{
+    const char *p = strrchr(line, ')') + 2;
+    for (int field = 3; field < n; field++) {
+        p = strchr(p, ' ') + 1;
+    }
+    return strtoull(p, NULL, 10);
+}
+
+static void check_line(const char *line)
+{
+    struct blok_proc_stat st;
+    CHECK(blok_proc_parse_stat(line, &st) == 0);
+    CHECK((unsigned long long) st.ppid == stat_field(line, 4));
+    CHECK((unsigned long long) st.pgrp == stat_field(line, 5));
+    CHECK((unsigned long long) st.session == stat_field(line, 6));
+    CHECK(st.starttime == stat_field(line, 22));
+}
+
+int main(void)
+{
+    char line[1024];
+    CHECK(blok_proc_read(getpid(), "stat", line, sizeof(line)) > 0);
+    check_line(line);
+
+    // a command name with spaces and parentheses, and distinct values around starttime
+    const char *odd = "4242 (a) b (c) S 1 4242 4242 0 -1 4194560 100 0 0 0 1 2 0 0 20 0 1 0 548470 2535424 300 "
+                      "18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 17 3 0 0 0 0 0";
+    struct blok_proc_stat st;
+    CHECK(blok_proc_parse_stat(odd, &st) == 0);
+    CHECK(strcmp(st.comm, "a) b (c") == 0);
+    CHECK(st.ppid == 1 && st.pgrp == 4242 && st.session == 4242);
+    CHECK(st.starttime == 548470);
+    check_line(odd);
+
+    CHECK(blok_proc_parse_stat("4242 (truncated) S 1 2", &st) < 0);
+    CHECK(blok_proc_parse_stat("garbage", &st) < 0);
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,563 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "columnar.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum col_encoding {
+    ENC_DELTA,
+    ENC_VARINT,
+    ENC_DICT,
+    ENC_FOR
+};
+
+static const struct {
+    const char *name;
+    enum col_encoding encoding;
+} columns[BLOK_COL_MAX] = {
+    [BLOK_COL_TS] = { "ts", ENC_DELTA },
+    [BLOK_COL_DUR] = { "dur", ENC_VARINT },
+    [BLOK_COL_OP] = { "op", ENC_DICT },
+    [BLOK_COL_PID] = { "pid", ENC_DICT },
+    [BLOK_COL_TID] = { "tid", ENC_DICT },
+    [BLOK_COL_FILE] = { "file", ENC_DICT },
+    [BLOK_COL_OFFSET] = { "offset", ENC_DELTA },
+    [BLOK_COL_SIZE] = { "size", ENC_FOR },
+    [BLOK_COL_RESULT] = { "result", ENC_VARINT },
+};
+
+const char *blok_col_name(enum blok_col col)
+{
+    return columns[col].name;
+}
+
+// Encoding
+
+struct buf {
+    uint8_t *p;
+    size_t len;
+    size_t cap;
+};
+
+static void buf_reserve(struct buf *b, size_t n)
+{
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) {
+            b->cap = b->cap ? b->cap * 2 : 4096;
+        }
+        b->p = realloc(b->p, b->cap);
+        if (b->p == NULL) {
+            perror("blok columnar");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void put_varint(struct buf *b, uint64_t v)
+{
+    buf_reserve(b, 10);
+    while (v >= 0x80) {
+        b->p[b->len++] = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    b->p[b->len++] = (uint8_t) v;
+}
+
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static int bit_width(uint64_t v)
+{
+    return v == 0 ? 0 : 64 - __builtin_clzll(v);
+}
+
+static void put_packed(struct buf *b, const uint64_t *v, size_t n, int width)
+{
+    buf_reserve(b, 1);
+    b->p[b->len++] = width;
+    if (width == 0) {
+        return;
+    }
+    size_t words = (n * width + 63) / 64;
+    buf_reserve(b, words * 8);
+    uint64_t *out = (uint64_t *) (b->p + b->len);
+    memset(out, 0, words * 8);
+    for (size_t i = 0; i < n; i++) {
+        size_t bit = i * width;
+        out[bit / 64] |= v[i] << (bit % 64);
+        if (bit % 64 + width > 64) {
+            out[bit / 64 + 1] |= v[i] >> (64 - bit % 64);
+        }
+    }
+    b->len += words * 8;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t find_i64(const int64_t *sorted, size_t n, int64_t v)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (sorted[mid] < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void encode_column(struct buf *b, enum col_encoding enc, const int64_t *v, size_t n, int64_t min, int64_t max)
+{
+    switch (enc) {
+    case ENC_DELTA:
+        for (size_t i = 0; i < n; i++) {
+            put_varint(b, zigzag(i == 0 ? v[0] : (int64_t) ((uint64_t) v[i] - (uint64_t) v[i - 1])));
+        }
+        break;
+    case ENC_VARINT:
+        for (size_t i = 0; i < n; i++) {
+            put_varint(b, zigzag(v[i]));
+        }
+        break;
+    case ENC_DICT: {
+        int64_t *distinct = malloc(n * sizeof(int64_t));
+        uint64_t *index = malloc(n * sizeof(uint64_t));
+        if (distinct == NULL || index == NULL) {
+            perror("blok columnar");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(distinct, v, n * sizeof(int64_t));
+        qsort(distinct, n, sizeof(int64_t), cmp_i64);
+        size_t d = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (d == 0 || distinct[d - 1] != distinct[i]) {
+                distinct[d++] = distinct[i];
+            }
+        }
+        put_varint(b, d);
+        for (size_t i = 0; i < d; i++) {
+            put_varint(b, zigzag(distinct[i]));
+        }
+        for (size_t i = 0; i < n; i++) {
+            index[i] = find_i64(distinct, d, v[i]);
+        }
+        put_packed(b, index, n, bit_width(d - 1));
+        free(distinct);
+        free(index);
+        break;
+    }
+    case ENC_FOR: {
+        uint64_t *diff = malloc(n * sizeof(uint64_t));
+        if (diff == NULL) {
+            perror("blok columnar");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < n; i++) {
+            diff[i] = (uint64_t) v[i] - (uint64_t) min;
+        }
+        put_varint(b, zigzag(min));
+        put_packed(b, diff, n, bit_width((uint64_t) max - (uint64_t) min));
+        free(diff);
+        break;
+    }
+    }
+}
+
+int blok_col_writer_open(struct blok_col_writer *w, FILE *out)
+{
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        w->values[c] = malloc(BLOK_COL_ROWS * sizeof(int64_t));
+        if (w->values[c] == NULL) {
+            return -1;
+        }
+    }
+    blok_dict_init(&w->files);
+    return fwrite(BLOK_COL_MAGIC, 8, 1, out) == 1 ? 0 : -1;
+}
+
+static void writer_flush(struct blok_col_writer *w)
+{
+    if (w->rows == 0) {
+        return;
+    }
+    if (w->nrowgroups == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 16;
+        w->rowgroups = realloc(w->rowgroups, w->cap * sizeof(struct blok_col_rowgroup));
+        if (w->rowgroups == NULL) {
+            perror("blok columnar");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct blok_col_rowgroup *rg = &w->rowgroups[w->nrowgroups++];
+    rg->rows = w->rows;
+    struct buf b = { 0 };
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        int64_t min = INT64_MAX, max = INT64_MIN;
+        for (size_t i = 0; i < w->rows; i++) {
+            min = w->values[c][i] < min ? w->values[c][i] : min;
+            max = w->values[c][i] > max ? w->values[c][i] : max;
+        }
+        b.len = 0;
+        encode_column(&b, columns[c].encoding, w->values[c], w->rows, min, max);
+        rg->col[c].offset = ftello(w->out);
+        rg->col[c].length = b.len;
+        rg->col[c].min = min;
+        rg->col[c].max = max;
+        fwrite(b.p, 1, b.len, w->out);
+    }
+    free(b.p);
+    w->rows = 0;
+}
+
+void blok_col_writer_add(struct blok_col_writer *w, const struct blok_record *rec)
+{
+    char path[PATH_MAX];
+    struct blok_file_key key;
+    blok_file_key_from_record(rec, &key, path);
+
+    size_t i = w->rows;
+    w->values[BLOK_COL_TS][i] = rec->ts;
+    w->values[BLOK_COL_DUR][i] = rec->dur;
+    w->values[BLOK_COL_OP][i] = rec->op;
+    w->values[BLOK_COL_PID][i] = rec->pid;
+    w->values[BLOK_COL_TID][i] = rec->tid;
+    w->values[BLOK_COL_FILE][i] = blok_dict_add(&w->files, &key);
+    w->values[BLOK_COL_OFFSET][i] = rec->offset;
+    w->values[BLOK_COL_SIZE][i] = rec->size;
+    w->values[BLOK_COL_RESULT][i] = rec->result;
+    if (++w->rows == BLOK_COL_ROWS) {
+        writer_flush(w);
+    }
+}
+
+static void put_u64(FILE *out, uint64_t v)
+{
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+int blok_col_writer_close(struct blok_col_writer *w)
+{
+    writer_flush(w);
+    uint64_t footer = ftello(w->out);
+    put_u64(w->out, w->nrowgroups);
+    for (size_t r = 0; r < w->nrowgroups; r++) {
+        put_u64(w->out, w->rowgroups[r].rows);
+        for (int c = 0; c < BLOK_COL_MAX; c++) {
+            put_u64(w->out, w->rowgroups[r].col[c].offset);
+            put_u64(w->out, w->rowgroups[r].col[c].length);
+            put_u64(w->out, w->rowgroups[r].col[c].min);
+            put_u64(w->out, w->rowgroups[r].col[c].max);
+        }
+    }
+    put_u64(w->out, w->files.count);
+    for (size_t i = 0; i < w->files.count; i++) {
+        const struct blok_file_key *key = &w->files.entries[i].key;
+        uint32_t meta[2] = { key->gen, key->len };
+        put_u64(w->out, key->dev);
+        put_u64(w->out, key->ino);
+        fwrite(meta, sizeof(meta), 1, w->out);
+        fwrite(key->path, 1, key->len, w->out);
+    }
+    put_u64(w->out, footer);
+    fwrite(BLOK_COL_MAGIC, 8, 1, w->out);
+
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        free(w->values[c]);
+    }
+    free(w->rowgroups);
+    blok_dict_free(&w->files);
+    return ferror(w->out) ? -1 : 0;
+}
+
+// Decoding
+
+struct cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+    int error;
+};
+
+static uint64_t get_varint(struct cursor *c)
+{
+    uint64_t v = 0;
+    for (int shift = 0; c->p < c->end && shift < 64; shift += 7) {
+        uint8_t byte = *c->p++;
+        v |= (uint64_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return v;
+        }
+    }
+    c->error = 1;
+    return 0;
+}
+
+static uint64_t get_u64(struct cursor *c)
+{
+    uint64_t v = 0;
+    if (c->end - c->p < 8) {
+        c->error = 1;
+        return 0;
+    }
+    memcpy(&v, c->p, 8);
+    c->p += 8;
+    return v;
+}
+
+static int get_packed(struct cursor *c, uint64_t *out, size_t n)
+{
+    if (c->p >= c->end) {
+        return -1;
+    }
+    int width = *c->p++;
+    if (width == 0) {
+        memset(out, 0, n * sizeof(uint64_t));
+        return 0;
+    }
+    size_t words = (n * width + 63) / 64;
+    if ((size_t) (c->end - c->p) < words * 8 || width > 64) {
+        return -1;
+    }
+    uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+    for (size_t i = 0; i < n; i++) {
+        size_t bit = i * width;
+        uint64_t word;
+        memcpy(&word, c->p + bit / 64 * 8, 8);
+        uint64_t v = word >> (bit % 64);
+        if (bit % 64 + width > 64) {
+            memcpy(&word, c->p + (bit / 64 + 1) * 8, 8);
+            v |= word << (64 - bit % 64);
+        }
+        out[i] = v & mask;
+    }
+    c->p += words * 8;
+    return 0;
+}
+
+int blok_col_decode(const struct blok_col_file *f, size_t rg, enum blok_col col, int64_t *out)
+{
+    const struct blok_col_rowgroup *g = &f->rowgroups[rg];
+    const struct blok_col_chunk *chunk = &g->col[col];
+    struct cursor c = { f->map + chunk->offset, f->map + chunk->offset + chunk->length, 0 };
+    size_t n = g->rows;
+
+    switch (columns[col].encoding) {
+    case ENC_DELTA: {
+        int64_t prev = 0;
+        for (size_t i = 0; i < n; i++) {
+            prev = (int64_t) ((uint64_t) prev + (uint64_t) unzigzag(get_varint(&c)));
+            out[i] = prev;
+        }
+        break;
+    }
+    case ENC_VARINT:
+        for (size_t i = 0; i < n; i++) {
+            out[i] = unzigzag(get_varint(&c));
+        }
+        break;
+    case ENC_DICT: {
+        uint64_t d = get_varint(&c);
+        if (d > n) {
+            return -1;
+        }
+        int64_t *distinct = malloc((d > 0 ? d : 1) * sizeof(int64_t));
+        if (distinct == NULL) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < d; i++) {
+            distinct[i] = unzigzag(get_varint(&c));
+        }
+        int ok = !c.error && get_packed(&c, (uint64_t *) out, n) == 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            ok = (uint64_t) out[i] < d;
+            out[i] = ok ? distinct[out[i]] : 0;
+        }
+        free(distinct);
+        if (!ok) {
+            return -1;
+        }
+        break;
+    }
+    case ENC_FOR: {
+        int64_t min = unzigzag(get_varint(&c));
+        if (c.error || get_packed(&c, (uint64_t *) out, n) < 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (int64_t) ((uint64_t) out[i] + (uint64_t) min);
+        }
+        break;
+    }
+    }
+    return c.error ? -1 : 0;
+}
+
+// Whether a dictionary chunk holds any value in [lo, hi]; only its value list is read.
+static int dict_contains(const struct blok_col_file *f, const struct blok_col_chunk *chunk, int64_t lo, int64_t hi)
+{
+    struct cursor c = { f->map + chunk->offset, f->map + chunk->offset + chunk->length, 0 };
+    uint64_t d = get_varint(&c);
+    for (uint64_t i = 0; i < d && !c.error; i++) {
+        int64_t v = unzigzag(get_varint(&c));
+        if (v >= lo && v <= hi) {
+            return 1;
+        }
+        if (v > hi) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void blok_col_filter_init(struct blok_col_filter *filter)
+{
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        filter->min[c] = INT64_MIN;
+        filter->max[c] = INT64_MAX;
+    }
+}
+
+int blok_col_rowgroup_may_match(const struct blok_col_file *f, size_t rg, const struct blok_col_filter *filter)
+{
+    const struct blok_col_rowgroup *g = &f->rowgroups[rg];
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        if (filter->min[c] == INT64_MIN && filter->max[c] == INT64_MAX) {
+            continue;
+        }
+        if (g->col[c].max < filter->min[c] || g->col[c].min > filter->max[c]) {
+            return 0;
+        }
+        // statistics can't rule out a value between a dictionary's extremes, its value list can
+        if (columns[c].encoding == ENC_DICT && !dict_contains(f, &g->col[c], filter->min[c], filter->max[c])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int blok_col_is_columnar(const char *path)
+{
+    char magic[8];
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return 0;
+    }
+    int is = fread(magic, 8, 1, in) == 1 && memcmp(magic, BLOK_COL_MAGIC, 8) == 0;
+    fclose(in);
+    return is;
+}
+
+int blok_col_open(struct blok_col_file *f, const char *path)
+{
+    memset(f, 0, sizeof(*f));
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(f->fd, &st) < 0 || st.st_size < 24) {
+        close(f->fd);
+        return -1;
+    }
+    f->size = st.st_size;
+    void *map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED) {
+        close(f->fd);
+        return -1;
+    }
+    f->map = map;
+
+    struct cursor tail = { f->map + f->size - 16, f->map + f->size, 0 };
+    uint64_t footer = get_u64(&tail);
+    if (memcmp(f->map, BLOK_COL_MAGIC, 8) != 0 || memcmp(tail.p, BLOK_COL_MAGIC, 8) != 0
+        || footer > f->size - 16) {
+        blok_col_close(f);
+        return -1;
+    }
+    struct cursor c = { f->map + footer, f->map + f->size - 16, 0 };
+    f->nrowgroups = get_u64(&c);
+    if (f->nrowgroups > f->size / (8 + BLOK_COL_MAX * 32)) {
+        blok_col_close(f);
+        return -1;
+    }
+    f->rowgroups = calloc(f->nrowgroups ? f->nrowgroups : 1, sizeof(struct blok_col_rowgroup));
+    for (size_t r = 0; r < f->nrowgroups && f->rowgroups != NULL; r++) {
+        f->rowgroups[r].rows = get_u64(&c);
+        for (int col = 0; col < BLOK_COL_MAX; col++) {
+            struct blok_col_chunk *chunk = &f->rowgroups[r].col[col];
+            chunk->offset = get_u64(&c);
+            chunk->length = get_u64(&c);
+            chunk->min = get_u64(&c);
+            chunk->max = get_u64(&c);
+            if (chunk->offset > footer || chunk->length > footer - chunk->offset) {
+                c.error = 1;
+            }
+        }
+        if (f->rowgroups[r].rows > BLOK_COL_ROWS) {
+            c.error = 1;
+        }
+    }
+    f->nfiles = get_u64(&c);
+    if (f->nfiles > f->size / 24) {
+        c.error = 1;
+        f->nfiles = 0;
+    }
+    f->files = calloc(f->nfiles ? f->nfiles : 1, sizeof(struct blok_col_fileinfo));
+    for (size_t i = 0; i < f->nfiles && f->files != NULL && !c.error; i++) {
+        f->files[i].dev = get_u64(&c);
+        f->files[i].ino = get_u64(&c);
+        uint64_t meta = get_u64(&c);
+        f->files[i].gen = (uint32_t) meta;
+        f->files[i].len = meta >> 32;
+        if ((size_t) (c.end - c.p) < f->files[i].len) {
+            c.error = 1;
+            break;
+        }
+        f->files[i].path = (const char *) c.p;
+        c.p += f->files[i].len;
+    }
+    if (c.error || f->rowgroups == NULL || f->files == NULL) {
+        blok_col_close(f);
+        return -1;
+    }
+    return 0;
+}
+
+void blok_col_close(struct blok_col_file *f)
+{
+    free(f->rowgroups);
+    free(f->files);
+    if (f->map != NULL) {
+        munmap((void *) f->map, f->size);
+    }
+    close(f->fd);
+    memset(f, 0, sizeof(*f));
+    f->fd = -1;
+}
@@ -0,0 +1,109 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _COLUMNAR_H_
+#define _COLUMNAR_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "dict.h"
+#include "trace.h"
+
+// Columnar trace files (.blokc) for analyses that only need a few fields of many records.  Operation records are
+// stored in row groups of up to BLOK_COL_ROWS rows; within a row group each column is one contiguous chunk:
+//
+//   ts, offset           delta encoded, zigzag varints
+//   dur, result          zigzag varints
+//   op, pid, tid, file   dictionary encoded: the row group's distinct values, then bit-packed indexes into them
+//   size                 frame of reference: bit-packed differences from the row group's minimum
+//
+// Every chunk has min/max statistics in the footer, so a reader skips row groups that can't match a filter without
+// touching them, and decodes only the columns it asks for.  The footer also holds the file dictionary: file IDs
+// number files in order of first appearance, keyed by dev/ino/gen as in the replay exports.  Renames' new names
+// aren't stored.  Integers are little-endian.
+//
+//   "BLOKCOL1" | row group chunks ... | footer | footer offset (u64) | "BLOKCOL1"
+
+#define BLOK_COL_MAGIC "BLOKCOL1"
+#define BLOK_COL_ROWS 65536
+
+enum blok_col {
+    BLOK_COL_TS,
+    BLOK_COL_DUR,
+    BLOK_COL_OP,
+    BLOK_COL_PID,
+    BLOK_COL_TID,
+    BLOK_COL_FILE,
+    BLOK_COL_OFFSET,
+    BLOK_COL_SIZE,
+    BLOK_COL_RESULT,
+    BLOK_COL_MAX
+};
+
+struct blok_col_chunk {
+    uint64_t offset;
+    uint64_t length;
+    int64_t min;
+    int64_t max;
+};
+
+struct blok_col_rowgroup {
+    uint64_t rows;
+    struct blok_col_chunk col[BLOK_COL_MAX];
+};
+
+struct blok_col_fileinfo {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    const char *path;           // points into the mapping, not terminated
+    uint32_t len;
+};
+
+struct blok_col_file {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    size_t nrowgroups;
+    struct blok_col_rowgroup *rowgroups;
+    size_t nfiles;
+    struct blok_col_fileinfo *files;
+};
+
+// Inclusive ranges per column; a column without a constraint spans INT64_MIN..INT64_MAX.
+struct blok_col_filter {
+    int64_t min[BLOK_COL_MAX];
+    int64_t max[BLOK_COL_MAX];
+};
+
+struct blok_col_writer {
+    FILE *out;
+    uint64_t rows;
+    int64_t *values[BLOK_COL_MAX];
+    struct blok_col_rowgroup *rowgroups;
+    size_t nrowgroups;
+    size_t cap;
+    struct blok_dict files;
+};
+
+int blok_col_writer_open(struct blok_col_writer *w, FILE *out);
+void blok_col_writer_add(struct blok_col_writer *w, const struct blok_record *rec);
+int blok_col_writer_close(struct blok_col_writer *w);
+
+int blok_col_open(struct blok_col_file *f, const char *path);
+void blok_col_close(struct blok_col_file *f);
+const char *blok_col_name(enum blok_col col);
+// Checks the magic at the start of a file, so tools can take either a log or a columnar file.
+int blok_col_is_columnar(const char *path);
+
+void blok_col_filter_init(struct blok_col_filter *filter);
+// 0 if the row group's statistics (and, for a single file, its dictionary) rule the filter out.
+int blok_col_rowgroup_may_match(const struct blok_col_file *f, size_t rg, const struct blok_col_filter *filter);
+// Decodes one column of a row group into out[rows].
+int blok_col_decode(const struct blok_col_file *f, size_t rg, enum blok_col col, int64_t *out);
+
+#endif
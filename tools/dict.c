@@ -0,0 +1,132 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "dict.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *dict_alloc(size_t size)
+{
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("blok dict");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static uint64_t key_hash(const struct blok_file_key *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    if (key->ino != 0) {
+        uint64_t words[3] = { key->dev, key->ino, key->gen };
+        const unsigned char *p = (const unsigned char *) words;
+        for (size_t i = 0; i < sizeof(words); i++) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+    } else {
+        for (uint32_t i = 0; i < key->len; i++) {
+            h = (h ^ (unsigned char) key->path[i]) * 1099511628211ULL;
+        }
+    }
+    return h ^ (h >> 29);
+}
+
+static int key_equal(const struct blok_file_key *a, const struct blok_file_key *b)
+{
+    if (a->ino != 0 || b->ino != 0) {
+        return a->ino == b->ino && a->dev == b->dev && a->gen == b->gen;
+    }
+    return a->len == b->len && memcmp(a->path, b->path, a->len) == 0;
+}
+
+void blok_dict_init(struct blok_dict *dict)
+{
+    memset(dict, 0, sizeof(*dict));
+    dict->cap = 64;
+    dict->slots = dict_alloc(dict->cap * sizeof(uint32_t));
+}
+
+void blok_dict_free(struct blok_dict *dict)
+{
+    for (size_t i = 0; i < dict->count; i++) {
+        free((char *) dict->entries[i].key.path);
+    }
+    free(dict->entries);
+    free(dict->slots);
+}
+
+static size_t dict_slot(const struct blok_dict *dict, const struct blok_file_key *key, uint64_t hash)
+{
+    size_t i = hash & (dict->cap - 1);
+    while (dict->slots[i] != 0) {
+        const struct blok_dict_entry *e = &dict->entries[dict->slots[i] - 1];
+        if (e->hash == hash && key_equal(&e->key, key)) {
+            break;
+        }
+        i = (i + 1) & (dict->cap - 1);
+    }
+    return i;
+}
+
+uint32_t blok_dict_find(const struct blok_dict *dict, const struct blok_file_key *key)
+{
+    size_t i = dict_slot(dict, key, key_hash(key));
+    return dict->slots[i] != 0 ? dict->slots[i] - 1 : UINT32_MAX;
+}
+
+uint32_t blok_dict_add(struct blok_dict *dict, const struct blok_file_key *key)
+{
+    uint64_t hash = key_hash(key);
+    size_t i = dict_slot(dict, key, hash);
+    if (dict->slots[i] != 0) {
+        return dict->slots[i] - 1;
+    }
+
+    if (dict->count == dict->entries_cap) {
+        dict->entries_cap = dict->entries_cap ? dict->entries_cap * 2 : 64;
+        dict->entries = realloc(dict->entries, dict->entries_cap * sizeof(struct blok_dict_entry));
+        if (dict->entries == NULL) {
+            perror("blok dict");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct blok_dict_entry *e = &dict->entries[dict->count];
+    e->key = *key;
+    e->hash = hash;
+    char *path = dict_alloc(key->len + 1);
+    memcpy(path, key->path, key->len);
+    e->key.path = path;
+    dict->slots[i] = ++dict->count;
+
+    if (dict->count * 4 >= dict->cap * 3) {
+        free(dict->slots);
+        dict->cap *= 2;
+        dict->slots = dict_alloc(dict->cap * sizeof(uint32_t));
+        for (size_t n = 0; n < dict->count; n++) {
+            size_t j = dict->entries[n].hash & (dict->cap - 1);
+            while (dict->slots[j] != 0) {
+                j = (j + 1) & (dict->cap - 1);
+            }
+            dict->slots[j] = n + 1;
+        }
+    }
+    return dict->count - 1;
+}
+
+void blok_file_key_from_record(const struct blok_record *rec, struct blok_file_key *key, char *buf)
+{
+    key->dev = rec->dev;
+    key->ino = rec->ino;
+    key->gen = rec->gen;
+    key->len = blok_str_copy(&rec->filename, buf, PATH_MAX);
+    key->path = buf;
+}
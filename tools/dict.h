@@ -0,0 +1,48 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <stdint.h>
+#include "trace.h"
+
+// Dense file IDs for the converters.  A file is keyed by its identity (dev, ino, gen) where the record has one, so
+// renamed and hardlinked names fold onto one ID, and by its path otherwise.  IDs are handed out in order of first
+// insertion, starting at 0; the name kept for an ID is the first path it was seen under.
+struct blok_file_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    const char *path;           // unescaped, only part of the key when ino is 0
+    uint32_t len;
+};
+
+struct blok_dict_entry {
+    struct blok_file_key key;
+    uint64_t hash;
+};
+
+struct blok_dict {
+    uint32_t *slots;            // entry index + 1, 0 for empty
+    size_t cap;
+    struct blok_dict_entry *entries;
+    size_t count;
+    size_t entries_cap;
+};
+
+void blok_dict_init(struct blok_dict *dict);
+void blok_dict_free(struct blok_dict *dict);
+// Returns the key's ID, adding it (with a copy of its path) if it is new.
+uint32_t blok_dict_add(struct blok_dict *dict, const struct blok_file_key *key);
+// Returns the key's ID, or UINT32_MAX if it isn't there.
+uint32_t blok_dict_find(const struct blok_dict *dict, const struct blok_file_key *key);
+
+// Fills key from a record; buf (PATH_MAX) receives the unescaped path.
+void blok_file_key_from_record(const struct blok_record *rec, struct blok_file_key *key, char *buf);
+
+#endif
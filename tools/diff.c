@@ -0,0 +1,843 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Compares the I/O of two traces (logs or columnar files) of the same workload, for catching access-pattern
+// regressions between releases:
+//
+//     blok-diff [--phases=N|markers] [--block=SIZE] [--limit=N] [--fail-...] before.log after.log
+//
+// It prints one JSON document: totals and per-phase ops and bytes, files newly read or written and files no longer
+// read or written, per-file block coverage changes, the request size distributions, and files whose access pattern
+// changed class (sequential, random, mixed). Files are matched by path, since inode numbers differ between runs.
+// Phases are --phases equal slices of each trace's duration, or with --phases=markers the phases the application
+// marked (see marker.h), matched between the traces by name and, for names that repeat, by occurrence.  Columnar
+// files carry no markers, so all of their calls fall before the first one.
+//
+// The --fail-* options turn changes into regressions, which are listed in the document and make blok-diff exit
+// with 1. Like diff(1), it exits with 0 when nothing regressed and 2 on errors.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "columnar.h"
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXIT_REGRESSION 1
+#define EXIT_TROUBLE 2
+
+#define SIZE_BUCKETS 48
+#define MAX_PHASES 1024
+
+// A file is classified once it has this many reads and writes
+#define PATTERN_MIN_ACCESSES 8
+
+enum pattern {
+    PATTERN_UNKNOWN,
+    PATTERN_SEQUENTIAL,
+    PATTERN_MIXED,
+    PATTERN_RANDOM
+};
+
+static const char *pattern_names[] = { "unknown", "sequential", "mixed", "random" };
+
+struct file_stats {
+    char *path;
+    size_t len;
+    uint64_t hash;
+    uint64_t ops[2];            // reads, writes
+    uint64_t bytes[2];
+    uint64_t sequential;        // accesses starting where the previous one ended
+    uint64_t accesses;
+    int64_t next_offset;
+    uint64_t blocks;
+};
+
+struct phase_stats {
+    uint64_t ops;
+    uint64_t bytes[2];
+};
+
+struct marker {
+    char *name;
+    uint64_t ts;
+    int occurrence;             // of the same name before it, from 0
+};
+
+struct side {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint64_t ops;
+    uint64_t bytes[2];
+    struct phase_stats *phases;  // phase 0 is before the first marker, phase i after marker i - 1
+    int nphases;
+    struct marker *markers;     // sorted by time
+    size_t nmarkers;
+    uint64_t sizes[2][SIZE_BUCKETS];
+
+    struct file_stats *files;   // in order of first appearance
+    size_t nfiles;
+    size_t files_cap;
+    uint32_t *file_slots;       // open addressing over files, 0 for empty, else index + 1
+    size_t file_slots_cap;
+
+    uint64_t *blocks;           // set of file index << 40 | block, 0 for empty, else key + 1
+    size_t blocks_cap;
+    size_t nblocks;
+};
+
+struct options {
+    int nphases;
+    int markers;
+    uint64_t block_size;
+    size_t limit;
+    double fail_bytes;          // percent, negative when off
+    double fail_ops;
+    double fail_sizes;          // distance, negative when off
+    int fail_new_files;
+    int fail_pattern;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("blok-diff");
+        exit(EXIT_TROUBLE);
+    }
+    return p;
+}
+
+static uint64_t hash_bytes(const void *p, size_t len)
+{
+    const uint8_t *b = p;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ b[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static long file_find(const struct side *s, const char *path, size_t len, uint64_t hash)
+{
+    if (s->file_slots_cap == 0) {
+        return -1;
+    }
+    for (size_t i = hash & (s->file_slots_cap - 1);; i = (i + 1) & (s->file_slots_cap - 1)) {
+        uint32_t slot = s->file_slots[i];
+        if (slot == 0) {
+            return -1;
+        }
+        const struct file_stats *f = &s->files[slot - 1];
+        if (f->hash == hash && f->len == len && memcmp(f->path, path, len) == 0) {
+            return slot - 1;
+        }
+    }
+}
+
+static void file_slot_insert(struct side *s, uint32_t index)
+{
+    size_t i = s->files[index].hash & (s->file_slots_cap - 1);
+    while (s->file_slots[i] != 0) {
+        i = (i + 1) & (s->file_slots_cap - 1);
+    }
+    s->file_slots[i] = index + 1;
+}
+
+static struct file_stats *file_get(struct side *s, const char *path, size_t len)
+{
+    uint64_t hash = hash_bytes(path, len);
+    long found = file_find(s, path, len, hash);
+    if (found >= 0) {
+        return &s->files[found];
+    }
+    if ((s->nfiles + 1) * 2 > s->file_slots_cap) {
+        free(s->file_slots);
+        s->file_slots_cap = s->file_slots_cap ? s->file_slots_cap * 2 : 1024;
+        s->file_slots = calloc(s->file_slots_cap, sizeof(uint32_t));
+        if (s->file_slots == NULL) {
+            perror("blok-diff");
+            exit(EXIT_TROUBLE);
+        }
+        for (size_t i = 0; i < s->nfiles; i++) {
+            file_slot_insert(s, i);
+        }
+    }
+    if (s->nfiles == s->files_cap) {
+        s->files_cap = s->files_cap ? s->files_cap * 2 : 256;
+        s->files = xrealloc(s->files, s->files_cap * sizeof(struct file_stats));
+    }
+    struct file_stats *f = &s->files[s->nfiles];
+    memset(f, 0, sizeof(*f));
+    f->path = xrealloc(NULL, len + 1);
+    memcpy(f->path, path, len);
+    f->path[len] = '\0';
+    f->len = len;
+    f->hash = hash;
+    f->next_offset = -1;
+    file_slot_insert(s, s->nfiles++);
+    return f;
+}
+
+static int block_insert(struct side *s, uint64_t key)
+{
+    if ((s->nblocks + 1) * 2 > s->blocks_cap) {
+        uint64_t *old = s->blocks;
+        size_t old_cap = s->blocks_cap;
+        s->blocks_cap = s->blocks_cap ? s->blocks_cap * 2 : 1 << 16;
+        s->blocks = calloc(s->blocks_cap, sizeof(uint64_t));
+        if (s->blocks == NULL) {
+            perror("blok-diff");
+            exit(EXIT_TROUBLE);
+        }
+        s->nblocks = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i] != 0) {
+                block_insert(s, old[i] - 1);
+            }
+        }
+        free(old);
+    }
+    for (size_t i = mix64(key) & (s->blocks_cap - 1);; i = (i + 1) & (s->blocks_cap - 1)) {
+        if (s->blocks[i] == key + 1) {
+            return 0;
+        }
+        if (s->blocks[i] == 0) {
+            s->blocks[i] = key + 1;
+            s->nblocks++;
+            return 1;
+        }
+    }
+}
+
+static int block_contains(const struct side *s, uint64_t key)
+{
+    if (s->blocks_cap == 0) {
+        return 0;
+    }
+    for (size_t i = mix64(key) & (s->blocks_cap - 1);; i = (i + 1) & (s->blocks_cap - 1)) {
+        if (s->blocks[i] == key + 1) {
+            return 1;
+        }
+        if (s->blocks[i] == 0) {
+            return 0;
+        }
+    }
+}
+
+static int size_bucket(uint64_t size)
+{
+    int b = size == 0 ? 0 : 64 - __builtin_clzll(size);
+    return b < SIZE_BUCKETS ? b : SIZE_BUCKETS - 1;
+}
+
+static void side_add(struct side *s, const struct options *o, int op, uint64_t ts, int64_t offset, uint64_t size,
+                     int64_t result, const char *path, size_t len)
+{
+    s->ops++;
+    int phase;
+    if (o->markers) {
+        size_t lo = 0, hi = s->nmarkers;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (s->markers[mid].ts <= ts) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        phase = lo;
+    } else {
+        phase = s->end > s->start ? (int) ((double) (ts - s->start) * o->nphases / (s->end - s->start + 1)) : 0;
+        phase = phase < 0 ? 0 : phase >= o->nphases ? o->nphases - 1 : phase;
+    }
+    s->phases[phase].ops++;
+    if (op != BLOK_OP_READ && op != BLOK_OP_WRITE) {
+        return;
+    }
+    int dir = op == BLOK_OP_WRITE;
+    uint64_t moved = result > 0 ? result : 0;
+    s->bytes[dir] += moved;
+    s->phases[phase].bytes[dir] += moved;
+    s->sizes[dir][size_bucket(size)]++;
+
+    struct file_stats *f = file_get(s, path, len);
+    f->ops[dir]++;
+    f->bytes[dir] += moved;
+    if (f->next_offset >= 0) {
+        f->accesses++;
+        f->sequential += offset == f->next_offset;
+    }
+    f->next_offset = offset + (moved > 0 ? moved : size);
+
+    if (moved > 0) {
+        uint64_t index = f - s->files;
+        for (uint64_t b = offset / o->block_size; b * o->block_size < offset + moved; b++) {
+            f->blocks += block_insert(s, index << 40 | b);
+        }
+    }
+}
+
+static int marker_cmp(const void *x, const void *y)
+{
+    const struct marker *p = x;
+    const struct marker *q = y;
+    return (p->ts > q->ts) - (p->ts < q->ts);
+}
+
+static void add_marker(struct side *s, const struct blok_record *rec)
+{
+    if (s->nmarkers + 1 >= MAX_PHASES) {
+        return;
+    }
+    char name[PATH_MAX];
+    size_t len = blok_str_copy(&rec->marker, name, sizeof(name));
+    s->markers = xrealloc(s->markers, (s->nmarkers + 1) * sizeof(struct marker));
+    struct marker *m = &s->markers[s->nmarkers++];
+    m->name = xrealloc(NULL, len + 1);
+    memcpy(m->name, name, len + 1);
+    m->ts = rec->ts;
+    m->occurrence = 0;
+}
+
+// With markers the phases are only known after the first pass over the trace.
+static void side_phases(struct side *s, const struct options *o)
+{
+    if (o->markers) {
+        qsort(s->markers, s->nmarkers, sizeof(struct marker), marker_cmp);
+        for (size_t i = 0; i < s->nmarkers; i++) {
+            for (size_t j = 0; j < i; j++) {
+                s->markers[i].occurrence += strcmp(s->markers[j].name, s->markers[i].name) == 0;
+            }
+        }
+    }
+    s->nphases = o->markers ? s->nmarkers + 1 : o->nphases;
+    s->phases = calloc(s->nphases, sizeof(struct phase_stats));
+    if (s->phases == NULL) {
+        perror("blok-diff");
+        exit(EXIT_TROUBLE);
+    }
+}
+
+static int load_log(struct side *s, const struct options *o, const char *path)
+{
+    struct blok_trace trace;
+    if (blok_trace_open(&trace, path) < 0) {
+        perror(path);
+        return -1;
+    }
+    // calls are logged when they return, so the time range takes a pass of its own
+    struct blok_segment seg = { trace.map, trace.map + trace.size };
+    const char *line;
+    size_t len;
+    s->start = UINT64_MAX;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) == 0 && rec.kind == BLOK_RECORD_OP && (rec.fields & BLOK_FIELD_TIME)) {
+            s->start = rec.ts < s->start ? rec.ts : s->start;
+            s->end = rec.ts > s->end ? rec.ts : s->end;
+        } else if (rec.kind == BLOK_RECORD_MARKER && o->markers) {
+            add_marker(s, &rec);
+        }
+    }
+    s->start = s->start == UINT64_MAX ? 0 : s->start;
+    side_phases(s, o);
+
+    char name[PATH_MAX];
+    seg = (struct blok_segment) { trace.map, trace.map + trace.size };
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) < 0 || rec.kind != BLOK_RECORD_OP) {
+            continue;
+        }
+        size_t n = blok_str_copy(&rec.filename, name, sizeof(name));
+        side_add(s, o, rec.op, (rec.fields & BLOK_FIELD_TIME) ? rec.ts : s->start, rec.offset, rec.size,
+                 rec.result, name, n);
+    }
+    blok_trace_close(&trace);
+    return 0;
+}
+
+static int load_columnar(struct side *s, const struct options *o, const char *path)
+{
+    struct blok_col_file f;
+    if (blok_col_open(&f, path) < 0) {
+        fprintf(stderr, "blok-diff: %s: not a valid columnar file\n", path);
+        return -1;
+    }
+    s->start = UINT64_MAX;
+    for (size_t rg = 0; rg < f.nrowgroups; rg++) {
+        uint64_t lo = f.rowgroups[rg].col[BLOK_COL_TS].min;
+        uint64_t hi = f.rowgroups[rg].col[BLOK_COL_TS].max;
+        s->start = lo < s->start ? lo : s->start;
+        s->end = hi > s->end ? hi : s->end;
+    }
+    s->start = s->start == UINT64_MAX ? 0 : s->start;
+    side_phases(s, o);
+
+    static const enum blok_col needed[] = {
+        BLOK_COL_TS, BLOK_COL_OP, BLOK_COL_FILE, BLOK_COL_OFFSET, BLOK_COL_SIZE, BLOK_COL_RESULT
+    };
+    int64_t *col[BLOK_COL_MAX] = { NULL };
+    int ret = 0;
+    for (size_t rg = 0; rg < f.nrowgroups && ret == 0; rg++) {
+        size_t rows = f.rowgroups[rg].rows;
+        for (size_t c = 0; c < sizeof(needed) / sizeof(needed[0]); c++) {
+            col[needed[c]] = xrealloc(col[needed[c]], rows * sizeof(int64_t));
+            if (blok_col_decode(&f, rg, needed[c], col[needed[c]]) < 0) {
+                fprintf(stderr, "blok-diff: %s: row group %zu is damaged\n", path, rg);
+                ret = -1;
+            }
+        }
+        for (size_t i = 0; i < rows && ret == 0; i++) {
+            uint64_t id = col[BLOK_COL_FILE][i];
+            const char *name = id < f.nfiles ? f.files[id].path : "";
+            size_t len = id < f.nfiles ? f.files[id].len : 0;
+            side_add(s, o, col[BLOK_COL_OP][i], col[BLOK_COL_TS][i], col[BLOK_COL_OFFSET][i], col[BLOK_COL_SIZE][i],
+                     col[BLOK_COL_RESULT][i], name, len);
+        }
+    }
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        free(col[c]);
+    }
+    blok_col_close(&f);
+    return ret;
+}
+
+static enum pattern file_pattern(const struct file_stats *f)
+{
+    if (f->accesses < PATTERN_MIN_ACCESSES) {
+        return PATTERN_UNKNOWN;
+    }
+    double sequential = (double) f->sequential / f->accesses;
+    return sequential >= 0.8 ? PATTERN_SEQUENTIAL : sequential <= 0.2 ? PATTERN_RANDOM : PATTERN_MIXED;
+}
+
+// Percent change from a to b; a new nonzero value counts as an infinite increase
+static double change_pct(uint64_t a, uint64_t b)
+{
+    if (a == 0) {
+        return b == 0 ? 0 : INFINITY;
+    }
+    return ((double) b - (double) a) * 100 / a;
+}
+
+static void json_change(FILE *out, double pct)
+{
+    if (isinf(pct)) {
+        fputs("null", out);
+    } else {
+        fprintf(out, "%.2f", pct);
+    }
+}
+
+struct regressions {
+    char **items;
+    size_t n;
+};
+
+static void regression(struct regressions *r, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void regression(struct regressions *r, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    r->items = xrealloc(r->items, (r->n + 1) * sizeof(char *));
+    if (vasprintf(&r->items[r->n], fmt, ap) < 0) {
+        perror("blok-diff");
+        exit(EXIT_TROUBLE);
+    }
+    r->n++;
+    va_end(ap);
+}
+
+static void check_growth(struct regressions *r, const struct options *o, const char *what, uint64_t ops_a,
+                         uint64_t ops_b, uint64_t bytes_a, uint64_t bytes_b)
+{
+    double ops = change_pct(ops_a, ops_b);
+    double bytes = change_pct(bytes_a, bytes_b);
+    if (o->fail_ops >= 0 && ops > o->fail_ops) {
+        regression(r, "%s: ops grew from %llu to %llu", what, (unsigned long long) ops_a, (unsigned long long) ops_b);
+    }
+    if (o->fail_bytes >= 0 && bytes > o->fail_bytes) {
+        regression(r, "%s: bytes grew from %llu to %llu", what, (unsigned long long) bytes_a,
+                   (unsigned long long) bytes_b);
+    }
+}
+
+static void print_totals(FILE *out, const char *name, uint64_t ops, const uint64_t bytes[2])
+{
+    fprintf(out, "\"%s\":{\"ops\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu}", name, (unsigned long long) ops,
+            (unsigned long long) bytes[0], (unsigned long long) bytes[1]);
+}
+
+// Prints the rest of a phase's object; what names it in regressions, NULL to not check it.
+static void print_phase(FILE *out, struct regressions *reg, const struct options *o, const char *what,
+                        const struct phase_stats *pa, const struct phase_stats *pb)
+{
+    print_totals(out, "before", pa->ops, pa->bytes);
+    putc(',', out);
+    print_totals(out, "after", pb->ops, pb->bytes);
+    fputs(",\"ops_change_pct\":", out);
+    json_change(out, change_pct(pa->ops, pb->ops));
+    fputs(",\"bytes_change_pct\":", out);
+    json_change(out, change_pct(pa->bytes[0] + pa->bytes[1], pb->bytes[0] + pb->bytes[1]));
+    putc('}', out);
+    if (what != NULL) {
+        check_growth(reg, o, what, pa->ops, pb->ops, pa->bytes[0] + pa->bytes[1], pb->bytes[0] + pb->bytes[1]);
+    }
+}
+
+// Phase p of s, or -1 if s has none of that name and occurrence; phase 0, before any marker, matches itself.
+static int find_phase(const struct side *s, const struct side *other, int p)
+{
+    if (p == 0) {
+        return 0;
+    }
+    const struct marker *m = &other->markers[p - 1];
+    for (size_t i = 0; i < s->nmarkers; i++) {
+        if (s->markers[i].occurrence == m->occurrence && strcmp(s->markers[i].name, m->name) == 0) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// The phases of the first trace in its order, then those only the second has.  A phase missing on one side counts
+// as empty there.
+static void print_marker_phases(FILE *out, struct regressions *reg, const struct options *o, const struct side *a,
+                                const struct side *b)
+{
+    static const struct phase_stats none;
+    int first = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        const struct side *s = pass == 0 ? a : b;
+        const struct side *other = pass == 0 ? b : a;
+        for (int p = 0; p < s->nphases; p++) {
+            int q = find_phase(other, s, p);
+            if (pass == 1 && q >= 0) {
+                continue;
+            }
+            const struct phase_stats *ps = &s->phases[p];
+            const struct phase_stats *pq = q >= 0 ? &other->phases[q] : &none;
+            fprintf(out, "%s{\"phase\":", first ? "" : ",");
+            first = 0;
+            char what[PATH_MAX + 64];
+            if (p == 0) {
+                fputs("null,", out);
+                snprintf(what, sizeof(what), "before the first marker");
+            } else {
+                const struct marker *m = &s->markers[p - 1];
+                blok_json_str(out, m->name, strlen(m->name));
+                fprintf(out, ",\"occurrence\":%d,", m->occurrence);
+                snprintf(what, sizeof(what), "phase \"%s\" #%d", m->name, m->occurrence);
+            }
+            print_phase(out, reg, o, what, pass == 0 ? ps : pq, pass == 0 ? pq : ps);
+        }
+    }
+}
+
+// Files accessed in one direction (read or write) by 'from' but not by 'to'
+static void print_file_set(FILE *out, const struct side *from, const struct side *to, int dir,
+                           const struct options *o, size_t *count)
+{
+    size_t n = 0;
+    putc('[', out);
+    for (size_t i = 0; i < from->nfiles; i++) {
+        const struct file_stats *f = &from->files[i];
+        if (f->ops[dir] == 0) {
+            continue;
+        }
+        long j = file_find(to, f->path, f->len, f->hash);
+        if (j >= 0 && to->files[j].ops[dir] > 0) {
+            continue;
+        }
+        if (n < o->limit) {
+            if (n > 0) {
+                putc(',', out);
+            }
+            blok_json_str(out, f->path, f->len);
+        }
+        n++;
+    }
+    putc(']', out);
+    *count = n;
+}
+
+struct coverage {
+    const struct file_stats *a;
+    const struct file_stats *b;
+    uint64_t added;
+    uint64_t removed;
+};
+
+static int coverage_cmp(const void *x, const void *y)
+{
+    const struct coverage *p = x;
+    const struct coverage *q = y;
+    uint64_t dp = p->added + p->removed;
+    uint64_t dq = q->added + q->removed;
+    return (dp < dq) - (dp > dq);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-diff [--phases=N|markers] [--block=SIZE] [--limit=N] [--fail-bytes=PCT] [--fail-ops=PCT]\n"
+                    "                 [--fail-sizes=DIST] [--fail-new-files] [--fail-pattern] BEFORE AFTER\n");
+    exit(EXIT_TROUBLE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "phases", required_argument, NULL, 'p' },
+        { "block", required_argument, NULL, 'b' },
+        { "limit", required_argument, NULL, 'l' },
+        { "fail-bytes", required_argument, NULL, 'B' },
+        { "fail-ops", required_argument, NULL, 'O' },
+        { "fail-sizes", required_argument, NULL, 'S' },
+        { "fail-new-files", no_argument, NULL, 'N' },
+        { "fail-pattern", no_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct options o = { .nphases = 1, .block_size = 4096, .limit = 50, .fail_bytes = -1, .fail_ops = -1,
+                         .fail_sizes = -1 };
+    int c;
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            o.markers = strcmp(optarg, "markers") == 0;
+            o.nphases = o.markers ? 1 : atoi(optarg);
+            break;
+        case 'b': o.block_size = strtoull(optarg, NULL, 10); break;
+        case 'l': o.limit = strtoull(optarg, NULL, 10); break;
+        case 'B': o.fail_bytes = atof(optarg); break;
+        case 'O': o.fail_ops = atof(optarg); break;
+        case 'S': o.fail_sizes = atof(optarg); break;
+        case 'N': o.fail_new_files = 1; break;
+        case 'P': o.fail_pattern = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 2 || o.nphases < 1 || o.nphases > MAX_PHASES || o.block_size == 0) {
+        usage();
+    }
+
+    struct side sides[2] = { { .name = argv[optind] }, { .name = argv[optind + 1] } };
+    for (int i = 0; i < 2; i++) {
+        int ret = blok_col_is_columnar(sides[i].name) ? load_columnar(&sides[i], &o, sides[i].name)
+                                                      : load_log(&sides[i], &o, sides[i].name);
+        if (ret < 0) {
+            return EXIT_TROUBLE;
+        }
+    }
+    struct side *a = &sides[0];
+    struct side *b = &sides[1];
+    struct regressions reg = { NULL, 0 };
+    FILE *out = stdout;
+
+    fputs("{\"before\":", out);
+    blok_json_str(out, a->name, strlen(a->name));
+    fputs(",\"after\":", out);
+    blok_json_str(out, b->name, strlen(b->name));
+
+    fputs(",\"totals\":{", out);
+    print_totals(out, "before", a->ops, a->bytes);
+    putc(',', out);
+    print_totals(out, "after", b->ops, b->bytes);
+    fputs(",\"ops_change_pct\":", out);
+    json_change(out, change_pct(a->ops, b->ops));
+    fputs(",\"bytes_change_pct\":", out);
+    json_change(out, change_pct(a->bytes[0] + a->bytes[1], b->bytes[0] + b->bytes[1]));
+    putc('}', out);
+    check_growth(&reg, &o, "total", a->ops, b->ops, a->bytes[0] + a->bytes[1], b->bytes[0] + b->bytes[1]);
+
+    fputs(",\"phases\":[", out);
+    if (o.markers) {
+        print_marker_phases(out, &reg, &o, a, b);
+    } else {
+        for (int p = 0; p < o.nphases; p++) {
+            fprintf(out, "%s{\"phase\":%d,", p > 0 ? "," : "", p);
+            char what[32];
+            snprintf(what, sizeof(what), "phase %d", p);
+            print_phase(out, &reg, &o, o.nphases > 1 ? what : NULL, &a->phases[p], &b->phases[p]);
+        }
+    }
+    putc(']', out);
+
+    static const char *dir_names[] = { "read", "written" };
+    fputs(",\"files\":{", out);
+    for (int dir = 0; dir < 2; dir++) {
+        size_t added, removed;
+        fprintf(out, "%s\"%s\":{\"new\":", dir > 0 ? "," : "", dir_names[dir]);
+        print_file_set(out, b, a, dir, &o, &added);
+        fputs(",\"gone\":", out);
+        print_file_set(out, a, b, dir, &o, &removed);
+        fprintf(out, ",\"new_count\":%zu,\"gone_count\":%zu}", added, removed);
+        if (o.fail_new_files && added > 0) {
+            regression(&reg, "%zu files newly %s", added, dir_names[dir]);
+        }
+    }
+    putc('}', out);
+
+    // coverage of the files both traces accessed
+    struct coverage *cov = xrealloc(NULL, (b->nfiles ? b->nfiles : 1) * sizeof(struct coverage));
+    size_t ncov = 0;
+    for (size_t i = 0; i < b->nfiles; i++) {
+        const struct file_stats *fb = &b->files[i];
+        long j = file_find(a, fb->path, fb->len, fb->hash);
+        if (j < 0) {
+            continue;
+        }
+        cov[ncov] = (struct coverage) { &a->files[j], fb, 0, 0 };
+        ncov++;
+    }
+    if (ncov > 0) {
+        // one walk over each block table, rather than one per file
+        uint64_t *added = calloc(b->nfiles, sizeof(uint64_t));
+        uint64_t *removed = calloc(a->nfiles, sizeof(uint64_t));
+        if (added == NULL || removed == NULL) {
+            perror("blok-diff");
+            return EXIT_TROUBLE;
+        }
+        long *to_a = xrealloc(NULL, b->nfiles * sizeof(long));
+        long *to_b = xrealloc(NULL, a->nfiles * sizeof(long));
+        for (size_t i = 0; i < a->nfiles; i++) {
+            to_b[i] = -1;
+        }
+        for (size_t i = 0; i < b->nfiles; i++) {
+            to_a[i] = file_find(a, b->files[i].path, b->files[i].len, b->files[i].hash);
+            if (to_a[i] >= 0) {
+                to_b[to_a[i]] = i;
+            }
+        }
+        for (size_t i = 0; i < b->blocks_cap; i++) {
+            uint64_t key = b->blocks[i];
+            if (key-- == 0 || to_a[key >> 40] < 0) {
+                continue;
+            }
+            added[key >> 40] += !block_contains(a, (uint64_t) to_a[key >> 40] << 40 | (key & ((1ULL << 40) - 1)));
+        }
+        for (size_t i = 0; i < a->blocks_cap; i++) {
+            uint64_t key = a->blocks[i];
+            if (key-- == 0 || to_b[key >> 40] < 0) {
+                continue;
+            }
+            removed[key >> 40] += !block_contains(b, (uint64_t) to_b[key >> 40] << 40 | (key & ((1ULL << 40) - 1)));
+        }
+        for (size_t i = 0; i < ncov; i++) {
+            cov[i].added = added[cov[i].b - b->files];
+            cov[i].removed = removed[cov[i].a - a->files];
+        }
+        free(added);
+        free(removed);
+        free(to_a);
+        free(to_b);
+    }
+    qsort(cov, ncov, sizeof(struct coverage), coverage_cmp);
+    fprintf(out, ",\"coverage\":{\"block_size\":%llu,\"before_blocks\":%zu,\"after_blocks\":%zu,\"files\":[",
+            (unsigned long long) o.block_size, a->nblocks, b->nblocks);
+    for (size_t i = 0, n = 0; i < ncov && n < o.limit; i++) {
+        if (cov[i].added == 0 && cov[i].removed == 0) {
+            break;
+        }
+        fputs(n++ > 0 ? ",{\"file\":" : "{\"file\":", out);
+        blok_json_str(out, cov[i].b->path, cov[i].b->len);
+        fprintf(out, ",\"before\":%llu,\"after\":%llu,\"added\":%llu,\"removed\":%llu}",
+                (unsigned long long) cov[i].a->blocks, (unsigned long long) cov[i].b->blocks,
+                (unsigned long long) cov[i].added, (unsigned long long) cov[i].removed);
+    }
+    fputs("]}", out);
+
+    // request sizes: power-of-two buckets, compared by total variation distance
+    fputs(",\"sizes\":{", out);
+    static const char *op_names[] = { "read", "write" };
+    for (int dir = 0; dir < 2; dir++) {
+        uint64_t ta = 0, tb = 0;
+        for (int k = 0; k < SIZE_BUCKETS; k++) {
+            ta += a->sizes[dir][k];
+            tb += b->sizes[dir][k];
+        }
+        double distance = 0;
+        fprintf(out, "%s\"%s\":{\"buckets\":[", dir > 0 ? "," : "", op_names[dir]);
+        for (int k = 0, n = 0; k < SIZE_BUCKETS; k++) {
+            if (a->sizes[dir][k] == 0 && b->sizes[dir][k] == 0) {
+                continue;
+            }
+            double fa = ta ? (double) a->sizes[dir][k] / ta : 0;
+            double fb = tb ? (double) b->sizes[dir][k] / tb : 0;
+            distance += fabs(fa - fb) / 2;
+            fprintf(out, "%s{\"le\":%llu,\"before\":%.4f,\"after\":%.4f}", n++ > 0 ? "," : "",
+                    k == 0 ? 0ULL : (1ULL << k) - 1, fa, fb);
+        }
+        if (ta == 0 || tb == 0) {
+            distance = ta == tb ? 0 : 1;
+        }
+        fprintf(out, "],\"distance\":%.4f}", distance);
+        if (o.fail_sizes >= 0 && distance > o.fail_sizes) {
+            regression(&reg, "%s sizes moved by %.4f", op_names[dir], distance);
+        }
+    }
+    putc('}', out);
+
+    fputs(",\"patterns\":[", out);
+    size_t npattern = 0;
+    for (size_t i = 0; i < b->nfiles; i++) {
+        const struct file_stats *fb = &b->files[i];
+        long j = file_find(a, fb->path, fb->len, fb->hash);
+        if (j < 0) {
+            continue;
+        }
+        enum pattern pa = file_pattern(&a->files[j]);
+        enum pattern pb = file_pattern(fb);
+        if (pa == pb || pa == PATTERN_UNKNOWN || pb == PATTERN_UNKNOWN) {
+            continue;
+        }
+        if (npattern < o.limit) {
+            fputs(npattern > 0 ? ",{\"file\":" : "{\"file\":", out);
+            blok_json_str(out, fb->path, fb->len);
+            fprintf(out, ",\"before\":\"%s\",\"after\":\"%s\",\"before_sequential\":%.3f,\"after_sequential\":%.3f}",
+                    pattern_names[pa], pattern_names[pb], (double) a->files[j].sequential / a->files[j].accesses,
+                    (double) fb->sequential / fb->accesses);
+        }
+        npattern++;
+        if (o.fail_pattern && pb > pa) {
+            regression(&reg, "%s went from %s to %s", fb->path, pattern_names[pa], pattern_names[pb]);
+        }
+    }
+    putc(']', out);
+
+    fputs(",\"regressions\":[", out);
+    for (size_t i = 0; i < reg.n; i++) {
+        if (i > 0) {
+            putc(',', out);
+        }
+        blok_json_str(out, reg.items[i], strlen(reg.items[i]));
+    }
+    fputs("]}\n", out);
+
+    for (size_t i = 0; i < reg.n; i++) {
+        fprintf(stderr, "blok-diff: regression: %s\n", reg.items[i]);
+    }
+    return reg.n > 0 ? EXIT_REGRESSION : EXIT_SUCCESS;
+}
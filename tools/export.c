@@ -0,0 +1,680 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Converts blok.log into a trace for a timeline viewer: Chrome's JSON trace format (chrome://tracing, Perfetto UI) or
+// Perfetto's protobuf format.  Each traced call becomes a slice on its thread's track, grouped by process, and two
+// counter tracks show the calls in flight and the read/write throughput.
+//
+//     blok-export [--format=chrome|perfetto] [-o OUT] [--window=MS] [--bucket=MS] blok.log
+//
+// The conversion streams: records are logged when calls return, so the calls still in flight at any point are
+// within the last --window of records, and only that window is held in memory.
+//
+// The replay formats (fio2, fio3, blktrace, oraclegeneral) are converted by replay.c instead:
+//
+//     blok-export --format=oraclegeneral [--threads=N] [--block=BYTES] -o OUT blok.log
+//
+// and --format=columnar writes the operation records to a columnar file (columnar.h) for the analysis tools.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "columnar.h"
+#include "pool.h"
+#include "replay.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sink {
+    void (*begin)(FILE *out);
+    void (*slice)(FILE *out, const struct blok_record *rec);
+    void (*counter)(FILE *out, int track, const char *name, uint64_t ts, double value);
+    void (*end)(FILE *out);
+};
+
+enum {
+    COUNTER_IN_FLIGHT,
+    COUNTER_READ,
+    COUNTER_WRITE,
+    COUNTER_MAX
+};
+
+static const char *counter_names[COUNTER_MAX] = { "in_flight", "read_MBps", "write_MBps" };
+
+// A set of 64-bit keys, for the tracks already described.
+struct key_set {
+    uint64_t *keys;
+    size_t cap;
+    size_t used;
+};
+
+static uint64_t mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// Inserts key (never 0); returns 1 if it was new.
+static int key_set_add(struct key_set *set, uint64_t key)
+{
+    if (set->used * 2 >= set->cap) {
+        struct key_set grown = { calloc(set->cap ? set->cap * 2 : 64, sizeof(uint64_t)), set->cap ? set->cap * 2 : 64, 0 };
+        if (grown.keys == NULL) {
+            perror("blok-export");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < set->cap; i++) {
+            if (set->keys[i] != 0) {
+                key_set_add(&grown, set->keys[i]);
+            }
+        }
+        free(set->keys);
+        *set = grown;
+    }
+    for (size_t i = mix64(key) & (set->cap - 1);; i = (i + 1) & (set->cap - 1)) {
+        if (set->keys[i] == key) {
+            return 0;
+        }
+        if (set->keys[i] == 0) {
+            set->keys[i] = key;
+            set->used++;
+            return 1;
+        }
+    }
+}
+
+// Chrome JSON.  Paths are already valid JSON strings in the log, so they are copied as they are.
+
+static int chrome_first = 1;
+
+static void chrome_sep(FILE *out)
+{
+    fputs(chrome_first ? "\n" : ",\n", out);
+    chrome_first = 0;
+}
+
+static void chrome_begin(FILE *out)
+{
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    chrome_sep(out);
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"blok\"}}", out);
+}
+
+static void chrome_slice(FILE *out, const struct blok_record *rec)
+{
+    chrome_sep(out);
+    fprintf(out, "{\"name\":\"%s\",\"cat\":\"fuse\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{\"path\":\"%.*s\",\"result\":%lld",
+            blok_trace_op_name(rec->op), (unsigned long long) rec->ts / 1000, (unsigned long long) rec->ts % 1000,
+            (unsigned long long) rec->dur / 1000, (unsigned long long) rec->dur % 1000, rec->pid, rec->tid,
+            (int) rec->filename.len, rec->filename.p, (long long) rec->result);
+    if (rec->fields & BLOK_FIELD_NEWNAME) {
+        fprintf(out, ",\"newpath\":\"%.*s\"", (int) rec->newname.len, rec->newname.p);
+    }
+    if (rec->fields & BLOK_FIELD_RANGE) {
+        fprintf(out, ",\"offset\":%lld,\"size\":%llu", (long long) rec->offset, (unsigned long long) rec->size);
+    }
+    fputs("}}", out);
+}
+
+static void chrome_counter(FILE *out, int track, const char *name, uint64_t ts, double value)
+{
+    (void) track;
+    chrome_sep(out);
+    fprintf(out, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%llu.%03llu,\"pid\":0,\"args\":{\"value\":%.6g}}", name,
+            (unsigned long long) ts / 1000, (unsigned long long) ts % 1000, value);
+}
+
+static void chrome_end(FILE *out)
+{
+    fputs("\n]}\n", out);
+}
+
+// Perfetto protobuf: a Trace is a sequence of 'repeated TracePacket packet = 1', so packets can be written one at a
+// time.  Field numbers are from perfetto's trace_packet.proto and track_event.proto.
+
+#define PB_VARINT 0
+#define PB_LEN 2
+
+#define TRACE_PACKET 1
+#define PACKET_TIMESTAMP 8
+#define PACKET_SEQUENCE_ID 10
+#define PACKET_TRACK_EVENT 11
+#define PACKET_SEQUENCE_FLAGS 13
+#define PACKET_TRACK_DESCRIPTOR 60
+#define SEQ_INCREMENTAL_STATE_CLEARED 1
+
+#define TRACK_UUID 1
+#define TRACK_NAME 2
+#define TRACK_PROCESS 3
+#define TRACK_THREAD 4
+#define TRACK_PARENT_UUID 5
+#define TRACK_COUNTER 8
+#define PROCESS_PID 1
+#define THREAD_PID 1
+#define THREAD_TID 2
+
+#define EVENT_DEBUG_ANNOTATIONS 4
+#define EVENT_TYPE 9
+#define EVENT_TRACK_UUID 11
+#define EVENT_CATEGORIES 22
+#define EVENT_NAME 23
+#define EVENT_COUNTER_VALUE 30
+#define EVENT_DOUBLE_COUNTER_VALUE 44
+#define TYPE_SLICE_BEGIN 1
+#define TYPE_SLICE_END 2
+#define TYPE_COUNTER 4
+
+#define ANNOTATION_INT 4
+#define ANNOTATION_STRING 6
+#define ANNOTATION_NAME 10
+
+#define SEQUENCE_ID 1
+#define COUNTER_UUID_BASE 1
+#define PROCESS_UUID(pid) ((1ULL << 62) | (uint32_t) (pid))
+#define THREAD_UUID(pid, tid) ((2ULL << 62) | ((uint64_t) (uint32_t) (pid) << 31) | (uint32_t) (tid))
+
+// Each nested message is encoded into its own buffer and then copied into its parent with a length prefix.  Packets
+// are small, so fixed buffers are enough; a message that doesn't fit is marked overflowed, as is every message it is
+// nested into, and its packet is dropped whole rather than written cut.
+struct pb {
+    uint8_t buf[3 * PATH_MAX];
+    size_t len;
+    int overflow;
+};
+
+// Whether n more bytes fit, marking the message overflowed if not.
+static int pb_room(struct pb *m, size_t n)
+{
+    if (m->overflow || sizeof(m->buf) - m->len < n) {
+        m->overflow = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void pb_varint(struct pb *m, uint64_t v)
+{
+    if (!pb_room(m, 10)) {
+        return;
+    }
+    while (v >= 0x80) {
+        m->buf[m->len++] = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    m->buf[m->len++] = (uint8_t) v;
+}
+
+static void pb_uint(struct pb *m, int field, uint64_t v)
+{
+    pb_varint(m, (uint64_t) field << 3 | PB_VARINT);
+    pb_varint(m, v);
+}
+
+static void pb_bytes(struct pb *m, int field, const void *p, size_t len)
+{
+    // room for the tag and length varints, 10 bytes each at most
+    if (!pb_room(m, len + 20)) {
+        return;
+    }
+    pb_varint(m, (uint64_t) field << 3 | PB_LEN);
+    pb_varint(m, len);
+    memcpy(m->buf + m->len, p, len);
+    m->len += len;
+}
+
+static void pb_string(struct pb *m, int field, const char *s)
+{
+    pb_bytes(m, field, s, strlen(s));
+}
+
+static void pb_double(struct pb *m, int field, double v)
+{
+    if (!pb_room(m, 18)) {
+        return;
+    }
+    pb_varint(m, (uint64_t) field << 3 | 1);
+    memcpy(m->buf + m->len, &v, 8);
+    m->len += 8;
+}
+
+static void pb_nested(struct pb *m, int field, const struct pb *child)
+{
+    if (child->overflow) {
+        m->overflow = 1;
+        return;
+    }
+    pb_bytes(m, field, child->buf, child->len);
+}
+
+static uint64_t perfetto_dropped;
+
+static void perfetto_packet(FILE *out, struct pb *packet)
+{
+    struct pb outer = { .len = 0 };
+    pb_uint(packet, PACKET_SEQUENCE_ID, SEQUENCE_ID);
+    pb_nested(&outer, TRACE_PACKET, packet);
+    if (outer.overflow) {
+        perfetto_dropped++;
+        return;
+    }
+    fwrite(outer.buf, 1, outer.len, out);
+}
+
+static void perfetto_track(FILE *out, uint64_t uuid, uint64_t parent, const char *name, int pid, int tid)
+{
+    struct pb track = { .len = 0 };
+    pb_uint(&track, TRACK_UUID, uuid);
+    if (parent != 0) {
+        pb_uint(&track, TRACK_PARENT_UUID, parent);
+    }
+    if (name != NULL) {
+        pb_string(&track, TRACK_NAME, name);
+    }
+    struct pb desc = { .len = 0 };
+    if (tid != 0) {
+        pb_uint(&desc, THREAD_PID, pid);
+        pb_uint(&desc, THREAD_TID, tid);
+        pb_nested(&track, TRACK_THREAD, &desc);
+    } else if (pid != 0) {
+        pb_uint(&desc, PROCESS_PID, pid);
+        pb_nested(&track, TRACK_PROCESS, &desc);
+    } else {
+        pb_nested(&track, TRACK_COUNTER, &desc);
+    }
+    struct pb packet = { .len = 0 };
+    pb_nested(&packet, PACKET_TRACK_DESCRIPTOR, &track);
+    perfetto_packet(out, &packet);
+}
+
+static struct key_set perfetto_tracks;
+
+static void perfetto_begin(FILE *out)
+{
+    struct pb packet = { .len = 0 };
+    pb_uint(&packet, PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+    perfetto_packet(out, &packet);
+    for (int i = 0; i < COUNTER_MAX; i++) {
+        perfetto_track(out, COUNTER_UUID_BASE + i, 0, counter_names[i], 0, 0);
+    }
+}
+
+static void annotation_int(struct pb *event, const char *name, int64_t v)
+{
+    struct pb a = { .len = 0 };
+    pb_string(&a, ANNOTATION_NAME, name);
+    pb_uint(&a, ANNOTATION_INT, v);
+    pb_nested(event, EVENT_DEBUG_ANNOTATIONS, &a);
+}
+
+static void annotation_string(struct pb *event, const char *name, const struct blok_str *s)
+{
+    char value[PATH_MAX];
+    blok_str_copy(s, value, sizeof(value));
+    struct pb a = { .len = 0 };
+    pb_string(&a, ANNOTATION_NAME, name);
+    pb_string(&a, ANNOTATION_STRING, value);
+    pb_nested(event, EVENT_DEBUG_ANNOTATIONS, &a);
+}
+
+static void perfetto_slice(FILE *out, const struct blok_record *rec)
+{
+    uint64_t track = THREAD_UUID(rec->pid, rec->tid);
+    if (key_set_add(&perfetto_tracks, PROCESS_UUID(rec->pid))) {
+        perfetto_track(out, PROCESS_UUID(rec->pid), 0, NULL, rec->pid, 0);
+    }
+    if (key_set_add(&perfetto_tracks, track)) {
+        perfetto_track(out, track, PROCESS_UUID(rec->pid), NULL, rec->pid, rec->tid);
+    }
+
+    struct pb event = { .len = 0 };
+    pb_uint(&event, EVENT_TYPE, TYPE_SLICE_BEGIN);
+    pb_uint(&event, EVENT_TRACK_UUID, track);
+    pb_string(&event, EVENT_CATEGORIES, "fuse");
+    pb_string(&event, EVENT_NAME, blok_trace_op_name(rec->op));
+    annotation_string(&event, "path", &rec->filename);
+    if (rec->fields & BLOK_FIELD_NEWNAME) {
+        annotation_string(&event, "newpath", &rec->newname);
+    }
+    if (rec->fields & BLOK_FIELD_RANGE) {
+        annotation_int(&event, "offset", rec->offset);
+        annotation_int(&event, "size", rec->size);
+    }
+    annotation_int(&event, "result", rec->result);
+    struct pb packet = { .len = 0 };
+    pb_uint(&packet, PACKET_TIMESTAMP, rec->ts);
+    pb_nested(&packet, PACKET_TRACK_EVENT, &event);
+    perfetto_packet(out, &packet);
+
+    event.len = 0;
+    event.overflow = 0;
+    pb_uint(&event, EVENT_TYPE, TYPE_SLICE_END);
+    pb_uint(&event, EVENT_TRACK_UUID, track);
+    packet.len = 0;
+    packet.overflow = 0;
+    pb_uint(&packet, PACKET_TIMESTAMP, rec->ts + rec->dur);
+    pb_nested(&packet, PACKET_TRACK_EVENT, &event);
+    perfetto_packet(out, &packet);
+}
+
+static void perfetto_counter(FILE *out, int track, const char *name, uint64_t ts, double value)
+{
+    (void) name;
+    struct pb event = { .len = 0 };
+    pb_uint(&event, EVENT_TYPE, TYPE_COUNTER);
+    pb_uint(&event, EVENT_TRACK_UUID, COUNTER_UUID_BASE + track);
+    pb_double(&event, EVENT_DOUBLE_COUNTER_VALUE, value);
+    struct pb packet = { .len = 0 };
+    pb_uint(&packet, PACKET_TIMESTAMP, ts);
+    pb_nested(&packet, PACKET_TRACK_EVENT, &event);
+    perfetto_packet(out, &packet);
+}
+
+static void perfetto_end(FILE *out)
+{
+    (void) out;
+    if (perfetto_dropped != 0) {
+        fprintf(stderr, "blok-export: dropped %llu packets too large to encode\n", (unsigned long long) perfetto_dropped);
+    }
+}
+
+static const struct sink sinks[] = {
+    { chrome_begin, chrome_slice, chrome_counter, chrome_end },
+    { perfetto_begin, perfetto_slice, perfetto_counter, perfetto_end },
+};
+
+// Min-heap of (start, end) pairs, used twice: calls not yet swept, ordered by start, and calls in flight, ordered by
+// end.
+struct span {
+    uint64_t key;
+    uint64_t other;
+};
+
+struct heap {
+    struct span *items;
+    size_t len;
+    size_t cap;
+};
+
+static void heap_push(struct heap *h, struct span s)
+{
+    if (h->len == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 1024;
+        h->items = realloc(h->items, h->cap * sizeof(struct span));
+        if (h->items == NULL) {
+            perror("blok-export");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t i = h->len++;
+    while (i > 0 && h->items[(i - 1) / 2].key > s.key) {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i] = s;
+}
+
+static struct span heap_pop(struct heap *h)
+{
+    struct span top = h->items[0];
+    struct span last = h->items[--h->len];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= h->len) {
+            break;
+        }
+        if (c + 1 < h->len && h->items[c + 1].key < h->items[c].key) {
+            c++;
+        }
+        if (h->items[c].key >= last.key) {
+            break;
+        }
+        h->items[i] = h->items[c];
+        i = c;
+    }
+    if (h->len > 0) {
+        h->items[i] = last;
+    }
+    return top;
+}
+
+struct sweep {
+    const struct sink *sink;
+    FILE *out;
+    struct heap pending;
+    struct heap active;
+    uint64_t swept;
+
+    // throughput per bucket, in a ring that covers the window
+    uint64_t bucket_ns;
+    uint64_t *bytes[2];
+    size_t nbuckets;
+    uint64_t first_bucket;
+    uint64_t last_bucket;
+    int started;
+};
+
+static void sweep_flush_buckets(struct sweep *sw, uint64_t upto)
+{
+    while (sw->started && sw->first_bucket < upto) {
+        size_t slot = sw->first_bucket % sw->nbuckets;
+        uint64_t ts = sw->first_bucket * sw->bucket_ns;
+        double seconds = sw->bucket_ns / 1e9;
+        sw->sink->counter(sw->out, COUNTER_READ, counter_names[COUNTER_READ], ts, sw->bytes[0][slot] / seconds / 1e6);
+        sw->sink->counter(sw->out, COUNTER_WRITE, counter_names[COUNTER_WRITE], ts,
+                          sw->bytes[1][slot] / seconds / 1e6);
+        sw->bytes[0][slot] = 0;
+        sw->bytes[1][slot] = 0;
+        sw->first_bucket++;
+    }
+}
+
+static void sweep_bytes(struct sweep *sw, uint64_t ts, int write, uint64_t bytes)
+{
+    uint64_t bucket = ts / sw->bucket_ns;
+    if (!sw->started) {
+        sw->first_bucket = bucket;
+        sw->started = 1;
+    }
+    if (bucket < sw->first_bucket) {
+        bucket = sw->first_bucket;
+    }
+    if (bucket > sw->last_bucket) {
+        sw->last_bucket = bucket;
+    }
+    if (bucket >= sw->first_bucket + sw->nbuckets) {
+        sweep_flush_buckets(sw, bucket - sw->nbuckets + 1);
+    }
+    sw->bytes[write][bucket % sw->nbuckets] += bytes;
+}
+
+// Sweeps the starts before 'watermark' in time order, emitting the in-flight count at each change.
+static void sweep_until(struct sweep *sw, uint64_t watermark)
+{
+    while (sw->pending.len > 0 && sw->pending.items[0].key < watermark) {
+        struct span call = heap_pop(&sw->pending);
+        // a call longer than the window started before what was already swept; count it from there
+        uint64_t start = call.key < sw->swept ? sw->swept : call.key;
+        while (sw->active.len > 0 && sw->active.items[0].key <= start) {
+            uint64_t end = heap_pop(&sw->active).key;
+            sw->sink->counter(sw->out, COUNTER_IN_FLIGHT, counter_names[COUNTER_IN_FLIGHT], end, sw->active.len);
+        }
+        heap_push(&sw->active, (struct span) { call.other, start });
+        sw->sink->counter(sw->out, COUNTER_IN_FLIGHT, counter_names[COUNTER_IN_FLIGHT], start, sw->active.len);
+        sw->swept = start;
+    }
+}
+
+static int export_columnar(struct blok_trace *trace, FILE *out)
+{
+    struct blok_col_writer w;
+    if (blok_col_writer_open(&w, out) < 0) {
+        perror("blok-export");
+        return EXIT_FAILURE;
+    }
+    struct blok_segment seg = { trace->map, trace->map + trace->size };
+    const char *line;
+    size_t len;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) == 0 && rec.kind == BLOK_RECORD_OP) {
+            blok_col_writer_add(&w, &rec);
+        }
+    }
+    int err = blok_col_writer_close(&w);
+    blok_trace_close(trace);
+    if (fclose(out) != 0 || err < 0) {
+        perror("blok-export");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-export [--format=chrome|perfetto] [-o OUT] [--window=MS] [--bucket=MS] blok.log\n"
+                    "       blok-export --format=fio2|fio3|blktrace|oraclegeneral [--threads=N] [--block=BYTES] -o OUT "
+                    "blok.log\n"
+                    "       blok-export --format=columnar -o OUT blok.log\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "window", required_argument, NULL, 'w' },
+        { "bucket", required_argument, NULL, 'b' },
+        { "threads", required_argument, NULL, 't' },
+        { "block", required_argument, NULL, 'B' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct blok_replay_options replay = { .threads = blok_default_threads(), .block_size = 4096 };
+    int replay_format = -1;
+    int columnar = 0;
+    const struct sink *sink = &sinks[0];
+    const char *output = NULL;
+    uint64_t window_ms = 1000;
+    uint64_t bucket_ms = 100;
+    int c;
+    while ((c = getopt_long(argc, argv, "f:o:w:b:", options, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            if (strcmp(optarg, "chrome") == 0 || strcmp(optarg, "json") == 0) {
+                sink = &sinks[0];
+            } else if (strcmp(optarg, "perfetto") == 0) {
+                sink = &sinks[1];
+            } else if (strcmp(optarg, "fio2") == 0 || strcmp(optarg, "fio") == 0) {
+                replay_format = BLOK_REPLAY_FIO2;
+            } else if (strcmp(optarg, "fio3") == 0) {
+                replay_format = BLOK_REPLAY_FIO3;
+            } else if (strcmp(optarg, "blktrace") == 0) {
+                replay_format = BLOK_REPLAY_BLKTRACE;
+            } else if (strcmp(optarg, "oraclegeneral") == 0) {
+                replay_format = BLOK_REPLAY_ORACLE;
+            } else if (strcmp(optarg, "columnar") == 0) {
+                columnar = 1;
+            } else {
+                usage();
+            }
+            break;
+        case 'o': output = optarg; break;
+        case 'w': window_ms = strtoull(optarg, NULL, 10); break;
+        case 'b': bucket_ms = strtoull(optarg, NULL, 10); break;
+        case 't': replay.threads = atoi(optarg); break;
+        case 'B': replay.block_size = strtoull(optarg, NULL, 10); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || bucket_ms == 0 || replay.threads < 1 || replay.block_size == 0) {
+        usage();
+    }
+    // oraclegeneral is patched in place afterwards, so it can't go to a pipe
+    if ((replay_format == BLOK_REPLAY_ORACLE || columnar) && output == NULL) {
+        usage();
+    }
+
+    struct blok_trace trace;
+    if (blok_trace_open(&trace, argv[optind]) < 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    FILE *out = output != NULL ? fopen(output, replay_format == BLOK_REPLAY_ORACLE ? "w+" : "w") : stdout;
+    if (out == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    if (columnar) {
+        return export_columnar(&trace, out);
+    }
+    if (replay_format >= 0) {
+        replay.format = replay_format;
+        if (blok_replay_export(&trace, out, &replay) < 0) {
+            perror("blok-export");
+            return EXIT_FAILURE;
+        }
+        blok_trace_close(&trace);
+        return fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    struct sweep sw = { .sink = sink, .out = out, .bucket_ns = bucket_ms * 1000000 };
+    sw.nbuckets = window_ms / bucket_ms + 2;
+    sw.bytes[0] = calloc(sw.nbuckets, sizeof(uint64_t));
+    sw.bytes[1] = calloc(sw.nbuckets, sizeof(uint64_t));
+    if (sw.bytes[0] == NULL || sw.bytes[1] == NULL) {
+        perror("blok-export");
+        return EXIT_FAILURE;
+    }
+
+    sink->begin(out);
+    struct blok_segment seg = { trace.map, trace.map + trace.size };
+    const char *line;
+    size_t len;
+    uint64_t skipped = 0;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) < 0 || rec.kind != BLOK_RECORD_OP) {
+            continue;
+        }
+        // records from before blok logged call times
+        if (!(rec.fields & BLOK_FIELD_TIME)) {
+            skipped++;
+            continue;
+        }
+        sink->slice(out, &rec);
+        uint64_t end = rec.ts + rec.dur;
+        heap_push(&sw.pending, (struct span) { rec.ts, end });
+        if ((rec.op == BLOK_OP_READ || rec.op == BLOK_OP_WRITE) && rec.result > 0) {
+            sweep_bytes(&sw, end, rec.op == BLOK_OP_WRITE, rec.result);
+        }
+        uint64_t window = window_ms * 1000000;
+        if (end > window) {
+            sweep_until(&sw, end - window);
+        }
+    }
+    sweep_until(&sw, UINT64_MAX);
+    while (sw.active.len > 0) {
+        uint64_t end = heap_pop(&sw.active).key;
+        sink->counter(out, COUNTER_IN_FLIGHT, counter_names[COUNTER_IN_FLIGHT], end, sw.active.len);
+    }
+    sweep_flush_buckets(&sw, sw.last_bucket + 1);
+    sink->end(out);
+
+    if (skipped != 0) {
+        fprintf(stderr, "blok-export: skipped %llu records without timing\n", (unsigned long long) skipped);
+    }
+    blok_trace_close(&trace);
+    return fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
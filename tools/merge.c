@@ -0,0 +1,426 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Merges the logs of several mounts into one time-ordered log:
+//
+//     blok-merge [--window=MS] [-o OUT] [NAME=]blok.log...
+//
+// Every record gets a "source" (NAME, by default the mount from the log's header) and a "file" ID from one
+// dictionary over all inputs, so the same backing file seen through two mounts gets the same ID.  Timestamps are
+// moved onto the clock of the first input using the header records: logs written during the same boot already share
+// the monotonic clock, others are shifted by the difference between their realtime anchors.
+//
+// Records are logged when calls return, so a log is only ordered by start time within the reorder window: a record
+// is emitted once every input has seen a call end --window (default 1000) ms after it started.  Memory is bounded by
+// the window, and each input is parsed ahead on a thread of its own.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "dict.h"
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Records handed from a reader to the merger at a time, and queued per input
+#define BATCH 256
+#define QUEUE_BATCHES 16
+
+struct item {
+    struct blok_record rec;
+    const char *line;
+    size_t len;
+    uint64_t ts;                // on the merged clock
+    uint64_t end;
+    uint64_t seq;               // input order, to keep ties stable
+    int input;
+};
+
+struct input {
+    const char *path;
+    char *name;                 // source tag, as a JSON string
+    struct blok_trace trace;
+    int64_t shift;              // added to the timestamps of records before the next header
+    pthread_t reader;
+
+    // reader to merger queue of batches
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct item *queue[QUEUE_BATCHES];
+    size_t counts[QUEUE_BATCHES];
+    size_t head;
+    size_t tail;
+
+    // merger side
+    struct item *batch;
+    size_t batch_count;
+    size_t batch_pos;
+    uint64_t max_end;
+    int eof;
+};
+
+struct merge {
+    struct input *inputs;
+    int ninputs;
+    uint64_t window;
+    // the first input's first header, which every other clock is moved onto
+    int have_ref;
+    uint64_t ref_realtime;
+    uint64_t ref_monotonic;
+    char ref_boot[64];
+};
+
+static struct merge merge;
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+static int64_t header_shift(const struct blok_record *h)
+{
+    char boot[64];
+    blok_str_copy(&h->boot_id, boot, sizeof(boot));
+    if (!merge.have_ref || (boot[0] != '\0' && strcmp(boot, merge.ref_boot) == 0)) {
+        return 0;
+    }
+    // realtime - monotonic is the boot time on the realtime clock
+    return (int64_t) (h->realtime - h->monotonic) - (int64_t) (merge.ref_realtime - merge.ref_monotonic);
+}
+
+static void *reader(void *arg)
+{
+    struct input *in = arg;
+    struct blok_segment seg = { in->trace.map, in->trace.map + in->trace.size };
+    uint64_t seq = 0;
+    uint64_t last_ts = 0;
+    int64_t shift = in->shift;
+    const char *line;
+    size_t len;
+
+    for (;;) {
+        struct item *batch = malloc(BATCH * sizeof(struct item));
+        if (batch == NULL) {
+            die("blok-merge");
+        }
+        size_t n = 0;
+        while (n < BATCH && (line = blok_segment_next(&seg, &len)) != NULL) {
+            struct item *it = &batch[n];
+            if (blok_record_parse(line, len, &it->rec) < 0) {
+                continue;
+            }
+            if (it->rec.kind == BLOK_RECORD_HEADER) {
+                shift = header_shift(&it->rec);
+                continue;
+            }
+            // records without a time (older logs) stay where they are among their neighbours
+            it->ts = (it->rec.fields & BLOK_FIELD_TIME) ? (uint64_t) ((int64_t) it->rec.ts + shift) : last_ts;
+            it->end = it->ts + it->rec.dur;
+            last_ts = it->ts;
+            it->line = line;
+            it->len = len;
+            it->seq = seq++;
+            it->input = in - merge.inputs;
+            n++;
+        }
+
+        pthread_mutex_lock(&in->lock);
+        while (in->tail - in->head == QUEUE_BATCHES) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        in->queue[in->tail % QUEUE_BATCHES] = batch;
+        in->counts[in->tail % QUEUE_BATCHES] = n;
+        in->tail++;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+        if (n < BATCH) {
+            return NULL;
+        }
+    }
+}
+
+// Next record of an input, NULL at its end.  The item stays valid until the following call for the same input.
+static struct item *input_next(struct input *in)
+{
+    while (in->batch == NULL || in->batch_pos == in->batch_count) {
+        if (in->batch != NULL && in->batch_count < BATCH) {
+            return NULL;
+        }
+        pthread_mutex_lock(&in->lock);
+        if (in->batch != NULL) {
+            free(in->batch);
+            in->head++;
+            pthread_cond_broadcast(&in->cond);
+        }
+        while (in->head == in->tail) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        in->batch = in->queue[in->head % QUEUE_BATCHES];
+        in->batch_count = in->counts[in->head % QUEUE_BATCHES];
+        in->batch_pos = 0;
+        pthread_mutex_unlock(&in->lock);
+    }
+    return &in->batch[in->batch_pos++];
+}
+
+// Min-heap of pending records by merged time
+struct heap {
+    struct item *items;
+    size_t n;
+    size_t cap;
+};
+
+static int item_before(const struct item *a, const struct item *b)
+{
+    if (a->ts != b->ts) {
+        return a->ts < b->ts;
+    }
+    return a->input != b->input ? a->input < b->input : a->seq < b->seq;
+}
+
+static void heap_push(struct heap *h, const struct item *it)
+{
+    if (h->n == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 4096;
+        h->items = realloc(h->items, h->cap * sizeof(struct item));
+        if (h->items == NULL) {
+            die("blok-merge");
+        }
+    }
+    size_t i = h->n++;
+    while (i > 0 && item_before(it, &h->items[(i - 1) / 2])) {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i] = *it;
+}
+
+static void heap_pop(struct heap *h, struct item *out)
+{
+    *out = h->items[0];
+    struct item last = h->items[--h->n];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= h->n) {
+            break;
+        }
+        if (c + 1 < h->n && item_before(&h->items[c + 1], &h->items[c])) {
+            c++;
+        }
+        if (!item_before(&h->items[c], &last)) {
+            break;
+        }
+        h->items[i] = h->items[c];
+        i = c;
+    }
+    if (h->n > 0) {
+        h->items[i] = last;
+    }
+}
+
+// The original line with its timestamp replaced, and the source and file ID added at the end
+static void emit(FILE *out, struct blok_dict *dict, const struct item *it)
+{
+    const char *line = it->line;
+    size_t len = it->len;
+    const char *ts = memmem(line, len, "\"ts\":", 5);
+    if (ts != NULL && (it->rec.fields & BLOK_FIELD_TIME)) {
+        const char *num = ts + 5;
+        const char *rest = num;
+        while (rest < line + len && *rest >= '0' && *rest <= '9') {
+            rest++;
+        }
+        fwrite(line, 1, num - line, out);
+        fprintf(out, "%llu", (unsigned long long) it->ts);
+        len -= rest - line;
+        line = rest;
+    }
+    // drop the closing brace; records of a merged log already end with their source and file, and keep the source
+    const char *source = merge.inputs[it->input].name;
+    int source_len = strlen(source);
+    while (len > 0 && line[len - 1] != '}') {
+        len--;
+    }
+    len = len > 0 ? len - 1 : 0;
+    if (it->rec.fields & BLOK_FIELD_SOURCE) {
+        source = it->rec.source.p - 1;
+        source_len = it->rec.source.len + 2;
+        len = source - (sizeof(",\"source\":") - 1) - line;
+    }
+    fwrite(line, 1, len, out);
+    fprintf(out, ",\"source\":%.*s", source_len, source);
+    if (it->rec.kind == BLOK_RECORD_OP) {
+        char path[PATH_MAX];
+        struct blok_file_key key;
+        blok_file_key_from_record(&it->rec, &key, path);
+        fprintf(out, ",\"file\":%u", blok_dict_add(dict, &key));
+    }
+    fputs("}\n", out);
+}
+
+static char *json_quote(const char *s, size_t len)
+{
+    char *q = malloc(6 * len + 3);
+    if (q == NULL) {
+        die("blok-merge");
+    }
+    blok_json_quote(q, s, len);
+    return q;
+}
+
+// Finds the input's first header: it sets the reference clock for the first input and the initial shift for the
+// others.  The source name defaults to the header's mount.
+static void input_open(struct input *in, int index, const char *arg)
+{
+    const char *eq = strchr(arg, '=');
+    const char *name = NULL;
+    size_t name_len = 0;
+    in->path = arg;
+    if (eq != NULL && eq != arg) {
+        name = arg;
+        name_len = eq - arg;
+        in->path = eq + 1;
+    }
+    if (blok_trace_open(&in->trace, in->path) < 0) {
+        die(in->path);
+    }
+
+    struct blok_segment seg = { in->trace.map, in->trace.map + in->trace.size };
+    struct blok_record rec;
+    const char *line;
+    size_t len;
+    int found = 0;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        if (blok_record_parse(line, len, &rec) == 0 && rec.kind == BLOK_RECORD_HEADER) {
+            found = 1;
+            break;
+        }
+        if (rec.kind == BLOK_RECORD_OP) {
+            // an older log whose records start before any header
+            break;
+        }
+    }
+    if (found && index == 0) {
+        merge.have_ref = 1;
+        merge.ref_realtime = rec.realtime;
+        merge.ref_monotonic = rec.monotonic;
+        blok_str_copy(&rec.boot_id, merge.ref_boot, sizeof(merge.ref_boot));
+    }
+    in->shift = found ? header_shift(&rec) : 0;
+    if (!found && index > 0 && merge.have_ref) {
+        fprintf(stderr, "blok-merge: %s has no header, assuming it shares the first log's clock\n", in->path);
+    }
+
+    char mount[PATH_MAX];
+    if (name != NULL) {
+        in->name = json_quote(name, name_len);
+    } else if (found && rec.mount.len > 0) {
+        in->name = json_quote(mount, blok_str_copy(&rec.mount, mount, sizeof(mount)));
+    } else {
+        in->name = json_quote(in->path, strlen(in->path));
+    }
+
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    if (pthread_create(&in->reader, NULL, reader, in) != 0) {
+        die("blok-merge: reader");
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-merge [--window=MS] [-o OUT] [NAME=]blok.log...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "window", required_argument, NULL, 'w' },
+        { "output", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *output = NULL;
+    merge.window = 1000000000ULL;
+    int c;
+    while ((c = getopt_long(argc, argv, "o:", options, NULL)) != -1) {
+        switch (c) {
+        case 'w': merge.window = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+        case 'o': output = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind == argc) {
+        usage();
+    }
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        die(output);
+    }
+
+    merge.ninputs = argc - optind;
+    merge.inputs = calloc(merge.ninputs, sizeof(struct input));
+    if (merge.inputs == NULL) {
+        die("blok-merge");
+    }
+    for (int i = 0; i < merge.ninputs; i++) {
+        input_open(&merge.inputs[i], i, argv[optind + i]);
+    }
+
+    // the merged log carries the reference anchor, so it can itself be merged with others
+    fprintf(out, "{\"header\":\"blok\",\"version\":1,\"realtime\":%llu,\"monotonic\":%llu,\"boot_id\":",
+            (unsigned long long) merge.ref_realtime, (unsigned long long) merge.ref_monotonic);
+    char *boot = json_quote(merge.ref_boot, strlen(merge.ref_boot));
+    fprintf(out, "%s,\"mount\":\"merged\",\"sources\":%d}\n", boot, merge.ninputs);
+    free(boot);
+
+    struct heap heap = { NULL, 0, 0 };
+    struct blok_dict dict;
+    blok_dict_init(&dict);
+    struct item it;
+    for (;;) {
+        // read from the input that holds everything back, until the oldest pending record is safe
+        struct input *lag = NULL;
+        for (int i = 0; i < merge.ninputs; i++) {
+            struct input *in = &merge.inputs[i];
+            if (!in->eof && (lag == NULL || in->max_end < lag->max_end)) {
+                lag = in;
+            }
+        }
+        uint64_t safe = lag == NULL ? UINT64_MAX
+                        : lag->max_end > merge.window ? lag->max_end - merge.window : 0;
+        while (heap.n > 0 && heap.items[0].ts <= safe) {
+            heap_pop(&heap, &it);
+            emit(out, &dict, &it);
+        }
+        if (lag == NULL) {
+            break;
+        }
+        struct item *next = input_next(lag);
+        if (next == NULL) {
+            lag->eof = 1;
+            continue;
+        }
+        lag->max_end = next->end > lag->max_end ? next->end : lag->max_end;
+        heap_push(&heap, next);
+    }
+
+    for (int i = 0; i < merge.ninputs; i++) {
+        pthread_join(merge.inputs[i].reader, NULL);
+        free(merge.inputs[i].batch);
+        blok_trace_close(&merge.inputs[i].trace);
+    }
+    if (fclose(out) != 0) {
+        die(output != NULL ? output : "stdout");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Work stealing: every thread starts with a contiguous range of the items and takes from its front, which keeps
+// neighbouring segments (and their pages) on one thread.  A thread that runs dry steals the back half of the
+// largest remaining range.  Ranges are only ever touched under their own lock, and a lock is held for a few
+// instructions, so plain mutexes do.
+struct pool_range {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} __attribute__((aligned(64)));
+
+struct pool_job {
+    struct pool_range *ranges;
+    int nthreads;
+    void (*fn)(size_t i, void *arg);
+    void *arg;
+};
+
+struct pool_worker_arg {
+    struct pool_job *job;
+    int self;
+};
+
+static int range_take(struct pool_range *r, size_t *i)
+{
+    pthread_mutex_lock(&r->lock);
+    int ok = r->next < r->end;
+    if (ok) {
+        *i = r->next++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ok;
+}
+
+static int pool_steal(struct pool_job *job, int self)
+{
+    for (;;) {
+        int victim = -1;
+        size_t most = 0;
+        for (int t = 0; t < job->nthreads; t++) {
+            struct pool_range *r = &job->ranges[t];
+            size_t left = __atomic_load_n(&r->end, __ATOMIC_RELAXED) - __atomic_load_n(&r->next, __ATOMIC_RELAXED);
+            if (t != self && left > most && left < (size_t) -1 / 2) {
+                most = left;
+                victim = t;
+            }
+        }
+        if (victim < 0) {
+            return 0;
+        }
+
+        struct pool_range *v = &job->ranges[victim];
+        size_t lo = 0, hi = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->next < v->end) {
+            size_t half = (v->end - v->next + 1) / 2;
+            hi = v->end;
+            lo = v->end - half;
+            v->end = lo;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (lo == hi) {
+            continue;
+        }
+
+        struct pool_range *mine = &job->ranges[self];
+        pthread_mutex_lock(&mine->lock);
+        mine->next = lo;
+        mine->end = hi;
+        pthread_mutex_unlock(&mine->lock);
+        return 1;
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    struct pool_worker_arg *w = arg;
+    struct pool_job *job = w->job;
+    size_t i;
+    do {
+        while (range_take(&job->ranges[w->self], &i)) {
+            job->fn(i, job->arg);
+        }
+    } while (pool_steal(job, w->self));
+    return NULL;
+}
+
+void blok_parallel(size_t n, int nthreads, void (*fn)(size_t i, void *arg), void *arg)
+{
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if ((size_t) nthreads > n) {
+        nthreads = n > 0 ? n : 1;
+    }
+    struct pool_range *ranges = aligned_alloc(64, sizeof(struct pool_range) * nthreads);
+    struct pool_worker_arg *args = calloc(nthreads, sizeof(struct pool_worker_arg));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (ranges == NULL || args == NULL || threads == NULL) {
+        // no memory for the bookkeeping: do it all here
+        for (size_t i = 0; i < n; i++) {
+            fn(i, arg);
+        }
+        free(ranges);
+        free(args);
+        free(threads);
+        return;
+    }
+
+    struct pool_job job = { ranges, nthreads, fn, arg };
+    for (int t = 0; t < nthreads; t++) {
+        pthread_mutex_init(&ranges[t].lock, NULL);
+        ranges[t].next = n * t / nthreads;
+        ranges[t].end = n * (t + 1) / nthreads;
+        args[t].job = &job;
+        args[t].self = t;
+    }
+    int started[nthreads];
+    for (int t = 1; t < nthreads; t++) {
+        started[t] = pthread_create(&threads[t], NULL, pool_worker, &args[t]) == 0;
+    }
+    pool_worker(&args[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    // a thread that failed to start leaves its range to be stolen, which pool_worker() above has done
+    for (int t = 0; t < nthreads; t++) {
+        pthread_mutex_destroy(&ranges[t].lock);
+    }
+    free(ranges);
+    free(args);
+    free(threads);
+}
+
+int blok_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
@@ -0,0 +1,19 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+// Runs fn(i, arg) for every i in [0, n) on up to nthreads threads (the calling thread included) and returns when all
+// are done.  Each thread works through its own share of the items in order and steals from the others when it
+// finishes early, so uneven items balance out.
+void blok_parallel(size_t n, int nthreads, void (*fn)(size_t i, void *arg), void *arg);
+int blok_default_threads(void);
+
+#endif
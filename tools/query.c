@@ -0,0 +1,888 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Ad-hoc queries over a log or a columnar file: filter calls, group them and aggregate each group.
+//
+//     blok-query [filters] [--group=KEYS] [--agg=AGGS] [--sort=count|bytes|key] [--limit=N] [--threads=N] FILE
+//
+// Filters:  --from=T --to=T      time range; plain numbers are monotonic ns, a trailing 's' means seconds from the
+//                                start of the trace
+//           --file=GLOB          path (fnmatch, '*' crosses directories)
+//           --pid=N  --op=LIST   process, operations
+//           --offset=A-B         calls touching this byte range
+// Groups:   file, dir[:N] (first N components, default the whole directory), pid, tid, op, block[:SIZE],
+//           time[:SECS]; several separated by commas
+// Aggs:     count, bytes, blocks (distinct blocks, estimated), p50, p90, p99 (call duration); default count,bytes
+//
+// The input is cut into segments (a log) or row groups (a columnar file) that threads take from a work-stealing
+// pool; every thread aggregates into its own table and the tables are merged at the end.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "columnar.h"
+#include "pool.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum group_key {
+    GROUP_FILE,
+    GROUP_DIR,
+    GROUP_PID,
+    GROUP_TID,
+    GROUP_OP,
+    GROUP_BLOCK,
+    GROUP_TIME
+};
+
+#define MAX_GROUP_KEYS 4
+
+#define AGG_COUNT (1 << 0)
+#define AGG_BYTES (1 << 1)
+#define AGG_BLOCKS (1 << 2)
+#define AGG_P50 (1 << 3)
+#define AGG_P90 (1 << 4)
+#define AGG_P99 (1 << 5)
+#define AGG_QUANTILES (AGG_P50 | AGG_P90 | AGG_P99)
+#define AGG_MAX 6
+
+// output columns, by bit
+static const char *agg_names[AGG_MAX] = { "count", "bytes", "blocks", "p50_ns", "p90_ns", "p99_ns" };
+
+// HyperLogLog with 2^10 registers, about 3% error
+#define HLL_BITS 10
+#define HLL_REGS (1 << HLL_BITS)
+
+// Log-linear duration histogram: four buckets per power of two
+#define HIST_BUCKETS 256
+
+struct query {
+    // filters
+    uint64_t from;
+    uint64_t to;
+    const char *from_arg;
+    const char *to_arg;
+    const char *file_glob;
+    int pid;
+    uint64_t op_mask;
+    int64_t offset_lo;
+    int64_t offset_hi;
+
+    int group[MAX_GROUP_KEYS];
+    uint64_t group_arg[MAX_GROUP_KEYS];     // dir components, block size or time bucket in ns
+    int ngroups;
+    unsigned aggs;
+    uint64_t block_size;            // for 'blocks'
+    uint64_t start_ts;
+};
+
+// One call, whichever input it came from
+struct row {
+    int op;
+    uint64_t ts;
+    uint64_t dur;
+    int32_t pid;
+    int32_t tid;
+    int64_t result;
+    int64_t offset;
+    uint64_t size;
+    int has_range;
+    uint64_t file_hash;
+    const char *path;
+    size_t path_len;
+};
+
+struct group {
+    uint8_t *key;
+    size_t key_len;
+    uint64_t hash;
+    uint64_t count;
+    uint64_t bytes;
+    uint8_t *hll;
+    uint32_t *hist;
+};
+
+struct table {
+    struct group *groups;
+    size_t cap;
+    size_t used;
+};
+
+struct worker {
+    struct table table;
+} __attribute__((aligned(64)));
+
+struct run {
+    struct query *q;
+    struct blok_segment *segs;
+    struct blok_col_file *col;
+    uint8_t *file_match;            // columnar: per file ID, whether it matches --file
+    struct worker *workers;
+    int nthreads;
+    pthread_key_t worker_key;
+    int next_worker;
+    pthread_mutex_t lock;
+};
+
+static void *xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (p == NULL) {
+        perror("blok-query");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static uint64_t hash_bytes(const void *p, size_t len)
+{
+    const uint8_t *b = p;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ b[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t mix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static int hist_bucket(uint64_t v)
+{
+    if (v < 4) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - 1) * 4 + ((v >> (e - 2)) & 3);
+}
+
+static double hist_value(int b)
+{
+    if (b < 4) {
+        return b;
+    }
+    int e = b / 4 + 1;
+    double lo = (double) ((uint64_t) (4 + b % 4) << (e - 2));
+    return lo + ldexp(0.5, e - 2);
+}
+
+static double hist_quantile(const uint32_t *hist, double p)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    uint64_t rank = (uint64_t) ceil(p * total);
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen > 0) {
+            return hist_value(b);
+        }
+    }
+    return 0;
+}
+
+static void hll_add(uint8_t *hll, uint64_t hash)
+{
+    uint32_t reg = hash >> (64 - HLL_BITS);
+    uint64_t rest = hash << HLL_BITS | (1ULL << (HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    if (rank > hll[reg]) {
+        hll[reg] = rank;
+    }
+}
+
+static double hll_estimate(const uint8_t *hll)
+{
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGS; i++) {
+        sum += ldexp(1.0, -hll[i]);
+        zeros += hll[i] == 0;
+    }
+    double m = HLL_REGS;
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros != 0) {
+        e = m * log(m / zeros);
+    }
+    return e;
+}
+
+static struct group *table_get(struct table *t, const uint8_t *key, size_t len, unsigned aggs)
+{
+    uint64_t hash = hash_bytes(key, len);
+    if (t->used * 4 >= t->cap * 3) {
+        struct table grown = { xcalloc(t->cap ? t->cap * 2 : 256, sizeof(struct group)), t->cap ? t->cap * 2 : 256, 0 };
+        for (size_t i = 0; i < t->cap; i++) {
+            struct group *g = &t->groups[i];
+            if (g->key == NULL) {
+                continue;
+            }
+            size_t j = g->hash & (grown.cap - 1);
+            while (grown.groups[j].key != NULL) {
+                j = (j + 1) & (grown.cap - 1);
+            }
+            grown.groups[j] = *g;
+            grown.used++;
+        }
+        free(t->groups);
+        *t = grown;
+    }
+    size_t i = hash & (t->cap - 1);
+    for (;; i = (i + 1) & (t->cap - 1)) {
+        struct group *g = &t->groups[i];
+        if (g->key == NULL) {
+            g->key = xcalloc(1, len ? len : 1);
+            memcpy(g->key, key, len);
+            g->key_len = len;
+            g->hash = hash;
+            if (aggs & AGG_BLOCKS) {
+                g->hll = xcalloc(HLL_REGS, 1);
+            }
+            if (aggs & AGG_QUANTILES) {
+                g->hist = xcalloc(HIST_BUCKETS, sizeof(uint32_t));
+            }
+            t->used++;
+            return g;
+        }
+        if (g->hash == hash && g->key_len == len && memcmp(g->key, key, len) == 0) {
+            return g;
+        }
+    }
+}
+
+// Group keys are the concatenation of their parts: 8 bytes for numbers, a 2-byte length and the bytes for paths.
+static size_t key_put_int(uint8_t *key, size_t len, uint64_t v)
+{
+    memcpy(key + len, &v, 8);
+    return len + 8;
+}
+
+static size_t key_put_str(uint8_t *key, size_t len, const char *s, size_t n)
+{
+    uint16_t n16 = n;
+    memcpy(key + len, &n16, 2);
+    memcpy(key + len + 2, s, n);
+    return len + 2 + n;
+}
+
+static size_t dir_prefix(const char *path, size_t len, int components)
+{
+    if (components <= 0) {
+        const char *slash = memrchr(path, '/', len);
+        return slash == NULL || slash == path ? 1 : (size_t) (slash - path);
+    }
+    size_t i = 0;
+    for (int c = 0; c <= components && i < len; i++) {
+        if (path[i] == '/' && ++c > components) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int row_matches(const struct query *q, const struct row *r)
+{
+    if (r->ts < q->from || r->ts > q->to) {
+        return 0;
+    }
+    if (q->pid >= 0 && r->pid != q->pid) {
+        return 0;
+    }
+    if (r->op < 0 || !((q->op_mask >> r->op) & 1)) {
+        return 0;
+    }
+    if (q->offset_lo > INT64_MIN || q->offset_hi < INT64_MAX) {
+        if (!r->has_range || r->offset > q->offset_hi || r->offset + (int64_t) r->size <= q->offset_lo) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void aggregate(struct table *t, const struct query *q, const struct row *r, uint64_t block, uint64_t bytes)
+{
+    uint8_t key[MAX_GROUP_KEYS * (PATH_MAX + 8)];
+    size_t len = 0;
+    for (int k = 0; k < q->ngroups; k++) {
+        switch (q->group[k]) {
+        case GROUP_FILE: len = key_put_str(key, len, r->path, r->path_len); break;
+        case GROUP_DIR: len = key_put_str(key, len, r->path, dir_prefix(r->path, r->path_len, q->group_arg[k])); break;
+        case GROUP_PID: len = key_put_int(key, len, r->pid); break;
+        case GROUP_TID: len = key_put_int(key, len, r->tid); break;
+        case GROUP_OP: len = key_put_int(key, len, r->op); break;
+        case GROUP_BLOCK: len = key_put_int(key, len, block); break;
+        case GROUP_TIME: len = key_put_int(key, len, (r->ts - q->start_ts) / q->group_arg[k]); break;
+        }
+    }
+    struct group *g = table_get(t, key, len, q->aggs);
+    g->count++;
+    g->bytes += bytes;
+    if (g->hist != NULL) {
+        g->hist[hist_bucket(r->dur)]++;
+    }
+    if (g->hll != NULL && r->has_range && r->size > 0) {
+        uint64_t first = r->offset / q->block_size;
+        uint64_t last = (r->offset + r->size - 1) / q->block_size;
+        for (uint64_t b = first; b <= last && b - first < (1 << 20); b++) {
+            hll_add(g->hll, mix64(r->file_hash ^ mix64(b + 1)));
+        }
+    }
+}
+
+static uint64_t group_block_size(const struct query *q)
+{
+    for (int k = 0; k < q->ngroups; k++) {
+        if (q->group[k] == GROUP_BLOCK) {
+            return q->group_arg[k];
+        }
+    }
+    return 0;
+}
+
+static void query_row(struct table *t, const struct query *q, const struct row *r)
+{
+    if (!row_matches(q, r)) {
+        return;
+    }
+    uint64_t moved = (r->op == BLOK_OP_READ || r->op == BLOK_OP_WRITE) && r->result > 0 ? r->result : 0;
+    uint64_t bs = group_block_size(q);
+    if (bs == 0 || !r->has_range || r->size == 0) {
+        aggregate(t, q, r, 0, moved);
+        return;
+    }
+    // grouped by block: a call counts once for every block it touches, with the bytes that fell into it
+    uint64_t end = r->offset + (moved > 0 ? moved : r->size);
+    for (uint64_t b = r->offset / bs; b * bs < end && b - r->offset / bs < (1 << 20); b++) {
+        uint64_t lo = b * bs > (uint64_t) r->offset ? b * bs : (uint64_t) r->offset;
+        uint64_t hi = (b + 1) * bs < end ? (b + 1) * bs : end;
+        aggregate(t, q, r, b, moved > 0 ? hi - lo : 0);
+    }
+}
+
+static struct worker *run_worker(struct run *run)
+{
+    struct worker *w = pthread_getspecific(run->worker_key);
+    if (w == NULL) {
+        pthread_mutex_lock(&run->lock);
+        w = &run->workers[run->next_worker++];
+        pthread_mutex_unlock(&run->lock);
+        pthread_setspecific(run->worker_key, w);
+    }
+    return w;
+}
+
+static void scan_segment(size_t i, void *arg)
+{
+    struct run *run = arg;
+    const struct query *q = run->q;
+    struct table *t = &run_worker(run)->table;
+    struct blok_segment seg = run->segs[i];
+    char path[PATH_MAX];
+    const char *line;
+    size_t len;
+
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) < 0 || rec.kind != BLOK_RECORD_OP) {
+            continue;
+        }
+        struct row r = {
+            .op = rec.op, .ts = rec.ts, .dur = rec.dur, .pid = rec.pid, .tid = rec.tid, .result = rec.result,
+            .offset = rec.offset, .size = rec.size, .has_range = (rec.fields & BLOK_FIELD_RANGE) != 0,
+        };
+        // cheap filters first, the path is only unescaped for calls that pass them
+        if (!row_matches(q, &r)) {
+            continue;
+        }
+        r.path_len = blok_str_copy(&rec.filename, path, sizeof(path));
+        r.path = path;
+        if (q->file_glob != NULL && fnmatch(q->file_glob, path, 0) != 0) {
+            continue;
+        }
+        if (rec.fields & BLOK_FIELD_ID) {
+            uint64_t id[3] = { rec.dev, rec.ino, rec.gen };
+            r.file_hash = hash_bytes(id, sizeof(id));
+        } else {
+            r.file_hash = hash_bytes(path, r.path_len);
+        }
+        query_row(t, q, &r);
+    }
+}
+
+static void scan_rowgroup(size_t rg, void *arg)
+{
+    struct run *run = arg;
+    const struct query *q = run->q;
+    const struct blok_col_file *f = run->col;
+    struct table *t = &run_worker(run)->table;
+
+    struct blok_col_filter filter;
+    blok_col_filter_init(&filter);
+    filter.min[BLOK_COL_TS] = q->from > INT64_MAX ? INT64_MAX : (int64_t) q->from;
+    filter.max[BLOK_COL_TS] = q->to > INT64_MAX ? INT64_MAX : (int64_t) q->to;
+    if (filter.min[BLOK_COL_TS] == 0 && filter.max[BLOK_COL_TS] == INT64_MAX) {
+        filter.min[BLOK_COL_TS] = INT64_MIN;
+    }
+    if (q->pid >= 0) {
+        filter.min[BLOK_COL_PID] = filter.max[BLOK_COL_PID] = q->pid;
+    }
+    if (q->op_mask != (1ULL << BLOK_OP_MAX) - 1) {
+        filter.min[BLOK_COL_OP] = __builtin_ctzll(q->op_mask);
+        filter.max[BLOK_COL_OP] = 63 - __builtin_clzll(q->op_mask);
+    }
+    if (!blok_col_rowgroup_may_match(f, rg, &filter)) {
+        return;
+    }
+
+    // only the columns the query reads are decoded
+    size_t n = f->rowgroups[rg].rows;
+    int64_t *col[BLOK_COL_MAX] = { NULL };
+    int need[BLOK_COL_MAX] = { 0 };
+    need[BLOK_COL_TS] = need[BLOK_COL_OP] = need[BLOK_COL_PID] = need[BLOK_COL_FILE] = 1;
+    need[BLOK_COL_DUR] = (q->aggs & AGG_QUANTILES) != 0;
+    need[BLOK_COL_RESULT] = (q->aggs & AGG_BYTES) != 0 || group_block_size(q) != 0;
+    need[BLOK_COL_OFFSET] = need[BLOK_COL_SIZE] = (q->aggs & AGG_BLOCKS) || group_block_size(q) != 0
+                                                  || q->offset_lo > INT64_MIN || q->offset_hi < INT64_MAX;
+    for (int k = 0; k < q->ngroups; k++) {
+        need[BLOK_COL_TID] |= q->group[k] == GROUP_TID;
+    }
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        if (need[c]) {
+            col[c] = malloc(n * sizeof(int64_t));
+            if (col[c] == NULL || blok_col_decode(f, rg, c, col[c]) < 0) {
+                fprintf(stderr, "blok-query: row group %zu is damaged\n", rg);
+                goto out;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t id = col[BLOK_COL_FILE][i];
+        if (id >= f->nfiles || (run->file_match != NULL && !run->file_match[id])) {
+            continue;
+        }
+        const struct blok_col_fileinfo *file = &f->files[id];
+        struct row r = {
+            .op = col[BLOK_COL_OP][i], .ts = col[BLOK_COL_TS][i], .pid = col[BLOK_COL_PID][i],
+            .dur = need[BLOK_COL_DUR] ? col[BLOK_COL_DUR][i] : 0,
+            .tid = need[BLOK_COL_TID] ? col[BLOK_COL_TID][i] : 0,
+            .result = need[BLOK_COL_RESULT] ? col[BLOK_COL_RESULT][i] : 0,
+            .offset = need[BLOK_COL_OFFSET] ? col[BLOK_COL_OFFSET][i] : 0,
+            .size = need[BLOK_COL_SIZE] ? col[BLOK_COL_SIZE][i] : 0,
+            .path = file->path, .path_len = file->len,
+        };
+        r.has_range = (r.op == BLOK_OP_READ || r.op == BLOK_OP_WRITE) && need[BLOK_COL_OFFSET];
+        uint64_t key[3] = { file->dev, file->ino, file->gen };
+        r.file_hash = file->ino != 0 ? hash_bytes(key, sizeof(key)) : hash_bytes(file->path, file->len);
+        query_row(t, q, &r);
+    }
+out:
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        free(col[c]);
+    }
+}
+
+static void table_merge(struct table *into, struct table *from, unsigned aggs)
+{
+    for (size_t i = 0; i < from->cap; i++) {
+        struct group *src = &from->groups[i];
+        if (src->key == NULL) {
+            continue;
+        }
+        struct group *dst = table_get(into, src->key, src->key_len, aggs);
+        dst->count += src->count;
+        dst->bytes += src->bytes;
+        for (int r = 0; dst->hll != NULL && r < HLL_REGS; r++) {
+            dst->hll[r] = src->hll[r] > dst->hll[r] ? src->hll[r] : dst->hll[r];
+        }
+        for (int b = 0; dst->hist != NULL && b < HIST_BUCKETS; b++) {
+            dst->hist[b] += src->hist[b];
+        }
+        free(src->key);
+        free(src->hll);
+        free(src->hist);
+    }
+    free(from->groups);
+}
+
+static int sort_field;
+
+static int group_cmp(const void *a, const void *b)
+{
+    const struct group *x = *(const struct group *const *) a;
+    const struct group *y = *(const struct group *const *) b;
+    if (sort_field == 2) {
+        size_t n = x->key_len < y->key_len ? x->key_len : y->key_len;
+        int c = memcmp(x->key, y->key, n);
+        return c != 0 ? c : (x->key_len > y->key_len) - (x->key_len < y->key_len);
+    }
+    uint64_t vx = sort_field == 1 ? x->bytes : x->count;
+    uint64_t vy = sort_field == 1 ? y->bytes : y->count;
+    return (vx < vy) - (vx > vy);
+}
+
+static void print_agg(const struct group *g, int agg)
+{
+    switch (agg) {
+    case AGG_COUNT: printf("%llu", (unsigned long long) g->count); break;
+    case AGG_BYTES: printf("%llu", (unsigned long long) g->bytes); break;
+    case AGG_BLOCKS: printf("%.0f", hll_estimate(g->hll)); break;
+    case AGG_P50: printf("%.0f", hist_quantile(g->hist, 0.5)); break;
+    case AGG_P90: printf("%.0f", hist_quantile(g->hist, 0.9)); break;
+    case AGG_P99: printf("%.0f", hist_quantile(g->hist, 0.99)); break;
+    }
+}
+
+static void print_key(const struct query *q, const struct group *g)
+{
+    size_t pos = 0;
+    for (int k = 0; k < q->ngroups; k++) {
+        if (k > 0) {
+            putchar('\t');
+        }
+        if (q->group[k] == GROUP_FILE || q->group[k] == GROUP_DIR) {
+            uint16_t n;
+            memcpy(&n, g->key + pos, 2);
+            printf("%.*s", (int) n, (const char *) g->key + pos + 2);
+            pos += 2 + n;
+            continue;
+        }
+        int64_t v;
+        memcpy(&v, g->key + pos, 8);
+        pos += 8;
+        switch (q->group[k]) {
+        case GROUP_OP: printf("%s", blok_trace_op_name(v)); break;
+        case GROUP_TIME: printf("%.3f", (double) v * q->group_arg[k] / 1e9); break;
+        default: printf("%lld", (long long) v); break;
+        }
+    }
+}
+
+static const char *group_names[] = { "file", "dir", "pid", "tid", "op", "block", "time" };
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-query [--from=T] [--to=T] [--file=GLOB] [--pid=N] [--op=LIST] [--offset=A-B]\n"
+                    "                  [--group=file|dir[:N]|pid|tid|op|block[:SIZE]|time[:SECS],...]\n"
+                    "                  [--agg=count,bytes,blocks,p50,p90,p99] [--sort=count|bytes|key] [--limit=N]\n"
+                    "                  [--block=SIZE] [--threads=N] blok.log|trace.blokc\n");
+    exit(EXIT_FAILURE);
+}
+
+// A group's parameter, range checked: at most PATH_MAX directory components, a block size of at least a byte and a
+// time bucket between a nanosecond and 10^9 seconds.
+static uint64_t parse_group_arg(int k, const char *param)
+{
+    char *end = NULL;
+    switch (k) {
+    case GROUP_DIR:
+    case GROUP_BLOCK: {
+        if (param == NULL) {
+            return k == GROUP_DIR ? 0 : 4096;
+        }
+        if (*param < '0' || *param > '9') {
+            usage();
+        }
+        errno = 0;
+        unsigned long long v = strtoull(param, &end, 10);
+        if (*end != '\0' || errno != 0 || (k == GROUP_DIR && v > PATH_MAX) || (k == GROUP_BLOCK && v == 0)) {
+            usage();
+        }
+        return v;
+    }
+    case GROUP_TIME: {
+        if (param == NULL) {
+            return 1000000000;
+        }
+        double secs = strtod(param, &end);
+        if (end == param || *end != '\0' || !(secs * 1e9 >= 1 && secs <= 1e9)) {
+            usage();
+        }
+        return (uint64_t) (secs * 1e9);
+    }
+    default:
+        return 0;
+    }
+}
+
+static void parse_groups(struct query *q, char *arg)
+{
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if (q->ngroups == MAX_GROUP_KEYS) {
+            usage();
+        }
+        char *param = strchr(tok, ':');
+        if (param != NULL) {
+            *param++ = '\0';
+        }
+        int k;
+        for (k = 0; k < (int) (sizeof(group_names) / sizeof(group_names[0])); k++) {
+            if (strcmp(tok, group_names[k]) == 0) {
+                break;
+            }
+        }
+        if (k == (int) (sizeof(group_names) / sizeof(group_names[0]))) {
+            usage();
+        }
+        q->group[q->ngroups] = k;
+        q->group_arg[q->ngroups] = parse_group_arg(k, param);
+        q->ngroups++;
+    }
+}
+
+static unsigned parse_aggs(char *arg)
+{
+    static const char *names[] = { "count", "bytes", "blocks", "p50", "p90", "p99" };
+    unsigned aggs = 0;
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int a;
+        for (a = 0; a < 6 && strcmp(tok, names[a]) != 0; a++) {
+        }
+        if (a == 6) {
+            usage();
+        }
+        aggs |= 1u << a;
+    }
+    return aggs;
+}
+
+static uint64_t parse_op_mask(char *arg)
+{
+    uint64_t mask = 0;
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int op = blok_op_lookup(tok, strlen(tok));
+        if (op < 0) {
+            usage();
+        }
+        mask |= 1ULL << op;
+    }
+    return mask;
+}
+
+// Absolute ns, or seconds from the start of the trace with a trailing 's'
+static uint64_t parse_time(const char *arg, uint64_t start)
+{
+    char *end;
+    double v = strtod(arg, &end);
+    if (*end == 's') {
+        return start + (uint64_t) (v * 1e9);
+    }
+    return strtoull(arg, NULL, 10);
+}
+
+struct log_start {
+    struct blok_segment *segs;
+    uint64_t *min;
+};
+
+static void scan_start(size_t i, void *arg)
+{
+    struct log_start *ls = arg;
+    struct blok_segment seg = ls->segs[i];
+    const char *line;
+    size_t len;
+    ls->min[i] = UINT64_MAX;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) == 0 && rec.kind == BLOK_RECORD_OP && (rec.fields & BLOK_FIELD_TIME)
+            && rec.ts < ls->min[i]) {
+            ls->min[i] = rec.ts;
+        }
+    }
+}
+
+// Records are written when calls return, so the earliest start can be anywhere in the log
+static uint64_t log_start(struct blok_segment *segs, size_t nsegs, int nthreads)
+{
+    struct log_start ls = { segs, xcalloc(nsegs ? nsegs : 1, sizeof(uint64_t)) };
+    blok_parallel(nsegs, nthreads, scan_start, &ls);
+    uint64_t start = UINT64_MAX;
+    for (size_t i = 0; i < nsegs; i++) {
+        start = ls.min[i] < start ? ls.min[i] : start;
+    }
+    free(ls.min);
+    return start == UINT64_MAX ? 0 : start;
+}
+
+static int needs_start(const struct query *q)
+{
+    int relative = (q->from_arg != NULL && strchr(q->from_arg, 's') != NULL)
+                   || (q->to_arg != NULL && strchr(q->to_arg, 's') != NULL);
+    for (int k = 0; k < q->ngroups; k++) {
+        relative |= q->group[k] == GROUP_TIME;
+    }
+    return relative;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "from", required_argument, NULL, 'F' },
+        { "to", required_argument, NULL, 'T' },
+        { "file", required_argument, NULL, 'f' },
+        { "pid", required_argument, NULL, 'p' },
+        { "op", required_argument, NULL, 'o' },
+        { "offset", required_argument, NULL, 'O' },
+        { "group", required_argument, NULL, 'g' },
+        { "agg", required_argument, NULL, 'a' },
+        { "sort", required_argument, NULL, 's' },
+        { "limit", required_argument, NULL, 'l' },
+        { "block", required_argument, NULL, 'b' },
+        { "threads", required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct query q = {
+        .to = UINT64_MAX, .pid = -1, .op_mask = (1ULL << BLOK_OP_MAX) - 1,
+        .offset_lo = INT64_MIN, .offset_hi = INT64_MAX, .aggs = AGG_COUNT | AGG_BYTES, .block_size = 4096,
+    };
+    int nthreads = blok_default_threads();
+    size_t limit = SIZE_MAX;
+    int c;
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+        case 'F': q.from_arg = optarg; break;
+        case 'T': q.to_arg = optarg; break;
+        case 'f': q.file_glob = optarg; break;
+        case 'p': q.pid = atoi(optarg); break;
+        case 'o': q.op_mask = parse_op_mask(optarg); break;
+        case 'O':
+            if (sscanf(optarg, "%ld-%ld", &q.offset_lo, &q.offset_hi) != 2) {
+                usage();
+            }
+            break;
+        case 'g': parse_groups(&q, optarg); break;
+        case 'a': q.aggs = parse_aggs(optarg); break;
+        case 's':
+            sort_field = strcmp(optarg, "bytes") == 0 ? 1 : strcmp(optarg, "key") == 0 ? 2 : 0;
+            break;
+        case 'l': limit = strtoull(optarg, NULL, 10); break;
+        case 'b': q.block_size = strtoull(optarg, NULL, 10); break;
+        case 't': nthreads = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || q.block_size == 0 || nthreads < 1) {
+        usage();
+    }
+    const char *path = argv[optind];
+
+    struct run run = { .q = &q, .nthreads = nthreads, .lock = PTHREAD_MUTEX_INITIALIZER };
+    run.workers = aligned_alloc(64, sizeof(struct worker) * nthreads);
+    if (run.workers == NULL) {
+        perror("blok-query");
+        return EXIT_FAILURE;
+    }
+    memset(run.workers, 0, sizeof(struct worker) * nthreads);
+    pthread_key_create(&run.worker_key, NULL);
+
+    struct blok_trace trace;
+    struct blok_col_file col;
+    int columnar = blok_col_is_columnar(path);
+    size_t units;
+    if (columnar) {
+        if (blok_col_open(&col, path) < 0) {
+            fprintf(stderr, "blok-query: %s: not a valid columnar file\n", path);
+            return EXIT_FAILURE;
+        }
+        run.col = &col;
+        q.start_ts = UINT64_MAX;
+        for (size_t rg = 0; rg < col.nrowgroups; rg++) {
+            if ((uint64_t) col.rowgroups[rg].col[BLOK_COL_TS].min < q.start_ts) {
+                q.start_ts = col.rowgroups[rg].col[BLOK_COL_TS].min;
+            }
+        }
+        if (q.file_glob != NULL) {
+            run.file_match = xcalloc(col.nfiles ? col.nfiles : 1, 1);
+            char name[PATH_MAX];
+            for (size_t i = 0; i < col.nfiles; i++) {
+                size_t n = col.files[i].len < PATH_MAX - 1 ? col.files[i].len : PATH_MAX - 1;
+                memcpy(name, col.files[i].path, n);
+                name[n] = '\0';
+                run.file_match[i] = fnmatch(q.file_glob, name, 0) == 0;
+            }
+        }
+        q.start_ts = q.start_ts == UINT64_MAX ? 0 : q.start_ts;
+        units = col.nrowgroups;
+    } else {
+        if (blok_trace_open(&trace, path) < 0) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+        // many more segments than threads, so that stealing has something to balance
+        size_t nsegs = (size_t) nthreads * 16;
+        run.segs = xcalloc(nsegs, sizeof(struct blok_segment));
+        units = blok_trace_split(&trace, run.segs, nsegs);
+        if (needs_start(&q)) {
+            q.start_ts = log_start(run.segs, units, nthreads);
+        }
+    }
+    if (q.from_arg != NULL) {
+        q.from = parse_time(q.from_arg, q.start_ts);
+    }
+    if (q.to_arg != NULL) {
+        q.to = parse_time(q.to_arg, q.start_ts);
+    }
+
+    blok_parallel(units, nthreads, columnar ? scan_rowgroup : scan_segment, &run);
+
+    struct table result = { 0 };
+    for (int t = 0; t < run.next_worker; t++) {
+        table_merge(&result, &run.workers[t].table, q.aggs);
+    }
+    struct group **sorted = xcalloc(result.used ? result.used : 1, sizeof(struct group *));
+    size_t n = 0;
+    for (size_t i = 0; i < result.cap; i++) {
+        if (result.groups[i].key != NULL) {
+            sorted[n++] = &result.groups[i];
+        }
+    }
+    qsort(sorted, n, sizeof(struct group *), group_cmp);
+
+    // tabs go between columns only, so cut and awk see no empty last field
+    const char *sep = "";
+    for (int k = 0; k < q.ngroups; k++) {
+        printf("%s%s", sep, group_names[q.group[k]]);
+        sep = "\t";
+    }
+    for (int a = 0; a < AGG_MAX; a++) {
+        if (q.aggs & 1 << a) {
+            printf("%s%s", sep, agg_names[a]);
+            sep = "\t";
+        }
+    }
+    putchar('\n');
+    for (size_t i = 0; i < n && i < limit; i++) {
+        struct group *g = sorted[i];
+        print_key(&q, g);
+        sep = q.ngroups > 0 ? "\t" : "";
+        for (int a = 0; a < AGG_MAX; a++) {
+            if (q.aggs & 1 << a) {
+                fputs(sep, stdout);
+                print_agg(g, 1 << a);
+                sep = "\t";
+            }
+        }
+        putchar('\n');
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,379 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "replay.h"
+#include "dict.h"
+#include "pool.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// blktrace_api.h
+#define BLK_IO_TRACE_MAGIC 0x65617400
+#define BLK_IO_TRACE_VERSION 0x07
+#define BLK_TC_READ (1 << 0)
+#define BLK_TC_WRITE (1 << 1)
+#define BLK_TC_SHIFT 16
+#define BLK_TA_QUEUE 1
+#define BLK_TA_COMPLETE 8
+
+struct blk_io_trace {
+    uint32_t magic;
+    uint32_t sequence;
+    uint64_t time;
+    uint64_t sector;
+    uint32_t bytes;
+    uint32_t action;
+    uint32_t pid;
+    uint32_t device;
+    uint32_t cpu;
+    uint16_t error;
+    uint16_t pdu_len;
+};
+
+// blkparse reads the records as the kernel lays them out
+_Static_assert(sizeof(struct blk_io_trace) == 48, "blk_io_trace size");
+_Static_assert(offsetof(struct blk_io_trace, cpu) == 40, "blk_io_trace.cpu offset");
+_Static_assert(offsetof(struct blk_io_trace, error) == 44, "blk_io_trace.error offset");
+_Static_assert(offsetof(struct blk_io_trace, pdu_len) == 46, "blk_io_trace.pdu_len offset");
+
+// libCacheSim oracleGeneral
+struct oracle_request {
+    uint32_t clock_time;
+    uint64_t obj_id;
+    uint32_t obj_size;
+    int64_t next_access_vtime;
+} __attribute__((packed));
+
+#define ORACLE_BLOCK_BITS 40
+
+struct replay_segment {
+    struct blok_segment seg;
+    struct blok_dict dict;
+    uint32_t *ids;              // local ID -> global ID
+    uint64_t requests;          // records, or blocks for oraclegeneral
+    uint64_t min_ts;
+    uint64_t max_ts;
+    uint64_t first_request;
+    FILE *out;
+};
+
+struct replay {
+    const struct blok_replay_options *opts;
+    struct replay_segment *segs;
+    struct blok_dict files;
+    uint64_t base_ts;
+    uint64_t last_ts;
+};
+
+// Reads and writes that moved data; 0 for anything else.
+static int replay_record(const char *line, size_t len, struct blok_record *rec)
+{
+    if (blok_record_parse(line, len, rec) < 0 || rec->kind != BLOK_RECORD_OP) {
+        return 0;
+    }
+    if ((rec->op != BLOK_OP_READ && rec->op != BLOK_OP_WRITE) || !(rec->fields & BLOK_FIELD_RANGE)) {
+        return 0;
+    }
+    // logs from before results were recorded have none; take the requested size then
+    if (!(rec->fields & BLOK_FIELD_TIME)) {
+        rec->result = rec->size;
+    }
+    return rec->result > 0;
+}
+
+static uint64_t replay_blocks(const struct blok_record *rec, uint64_t block_size)
+{
+    uint64_t first = rec->offset / block_size;
+    uint64_t last = (rec->offset + rec->result - 1) / block_size;
+    return last - first + 1;
+}
+
+static void replay_scan(size_t i, void *arg)
+{
+    struct replay *r = arg;
+    struct replay_segment *s = &r->segs[i];
+    struct blok_segment seg = s->seg;
+    char path[PATH_MAX];
+    const char *line;
+    size_t len;
+
+    blok_dict_init(&s->dict);
+    s->min_ts = UINT64_MAX;
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (!replay_record(line, len, &rec)) {
+            continue;
+        }
+        struct blok_file_key key;
+        blok_file_key_from_record(&rec, &key, path);
+        blok_dict_add(&s->dict, &key);
+        s->requests += r->opts->format == BLOK_REPLAY_ORACLE ? replay_blocks(&rec, r->opts->block_size) : 1;
+        if (!(rec.fields & BLOK_FIELD_TIME)) {
+            continue;
+        }
+        if (rec.ts < s->min_ts) {
+            s->min_ts = rec.ts;
+        }
+        if (rec.ts > s->max_ts) {
+            s->max_ts = rec.ts;
+        }
+    }
+}
+
+static void fio_name(FILE *out, const char *path)
+{
+    // fio splits iolog lines on whitespace
+    for (const char *p = path; *p != '\0'; p++) {
+        fputc((unsigned char) *p <= ' ' ? '_' : *p, out);
+    }
+}
+
+static void fio_line(FILE *out, const struct replay *r, uint64_t ts, uint32_t id, const char *action)
+{
+    if (r->opts->format == BLOK_REPLAY_FIO3) {
+        fprintf(out, "%llu ", (unsigned long long) (ts > r->base_ts ? (ts - r->base_ts) / 1000000 : 0));
+    }
+    fio_name(out, r->files.entries[id].key.path);
+    fprintf(out, " %s", action);
+}
+
+static void replay_write(size_t i, void *arg)
+{
+    struct replay *r = arg;
+    struct replay_segment *s = &r->segs[i];
+    struct blok_segment seg = s->seg;
+    uint64_t request = s->first_request;
+    uint64_t block_size = r->opts->block_size;
+    char path[PATH_MAX];
+    const char *line;
+    size_t len;
+
+    s->out = tmpfile();
+    if (s->out == NULL) {
+        perror("blok-export: tmpfile");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(s->out, NULL, _IOFBF, 1 << 20);
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (!replay_record(line, len, &rec)) {
+            continue;
+        }
+        struct blok_file_key key;
+        blok_file_key_from_record(&rec, &key, path);
+        uint32_t id = s->ids[blok_dict_find(&s->dict, &key)];
+        uint64_t ts = rec.ts > r->base_ts ? rec.ts - r->base_ts : 0;
+        int write = rec.op == BLOK_OP_WRITE;
+
+        switch (r->opts->format) {
+        case BLOK_REPLAY_FIO2:
+        case BLOK_REPLAY_FIO3:
+            fio_line(s->out, r, rec.ts, id, write ? "write" : "read");
+            fprintf(s->out, " %lld %lld\n", (long long) rec.offset, (long long) rec.result);
+            break;
+        case BLOK_REPLAY_BLKTRACE: {
+            struct blk_io_trace t = {
+                .magic = BLK_IO_TRACE_MAGIC | BLK_IO_TRACE_VERSION,
+                .sequence = 2 * request,
+                .time = ts,
+                .sector = ((uint64_t) id << 32) + rec.offset / 512,
+                .bytes = rec.result,
+                .action = BLK_TA_QUEUE | ((write ? BLK_TC_WRITE : BLK_TC_READ) << BLK_TC_SHIFT),
+                .pid = rec.pid,
+            };
+            fwrite(&t, sizeof(t), 1, s->out);
+            t.sequence++;
+            t.time += rec.dur;
+            t.action = BLK_TA_COMPLETE | ((write ? BLK_TC_WRITE : BLK_TC_READ) << BLK_TC_SHIFT);
+            fwrite(&t, sizeof(t), 1, s->out);
+            request++;
+            break;
+        }
+        case BLOK_REPLAY_ORACLE: {
+            uint64_t first = rec.offset / block_size;
+            uint64_t n = replay_blocks(&rec, block_size);
+            for (uint64_t b = 0; b < n; b++) {
+                struct oracle_request req = {
+                    .clock_time = ts / 1000000000,
+                    .obj_id = ((uint64_t) id << ORACLE_BLOCK_BITS) | ((first + b) & ((1ULL << ORACLE_BLOCK_BITS) - 1)),
+                    .obj_size = block_size,
+                    .next_access_vtime = -1,
+                };
+                fwrite(&req, sizeof(req), 1, s->out);
+            }
+            request += n;
+            break;
+        }
+        }
+    }
+    rewind(s->out);
+}
+
+static void replay_copy(FILE *from, FILE *to)
+{
+    static char buf[1 << 20];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+        fwrite(buf, 1, n, to);
+    }
+}
+
+// Object ID -> virtual time of its most recent access seen so far, for the backward pass.
+struct vtime_map {
+    uint64_t *keys;             // obj_id + 1, 0 for empty
+    int64_t *vtimes;
+    size_t cap;
+    size_t used;
+};
+
+static int64_t *vtime_slot(struct vtime_map *m, uint64_t obj)
+{
+    if (m->used * 4 >= m->cap * 3) {
+        struct vtime_map grown = { calloc(m->cap * 2, sizeof(uint64_t)), calloc(m->cap * 2, sizeof(int64_t)),
+                                   m->cap * 2, 0 };
+        if (grown.keys == NULL || grown.vtimes == NULL) {
+            perror("blok-export");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < m->cap; i++) {
+            if (m->keys[i] != 0) {
+                *vtime_slot(&grown, m->keys[i] - 1) = m->vtimes[i];
+            }
+        }
+        free(m->keys);
+        free(m->vtimes);
+        *m = grown;
+    }
+    uint64_t h = (obj + 1) * 0x9e3779b97f4a7c15ULL;
+    size_t i = (h ^ (h >> 32)) & (m->cap - 1);
+    while (m->keys[i] != 0 && m->keys[i] != obj + 1) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    if (m->keys[i] == 0) {
+        m->keys[i] = obj + 1;
+        m->vtimes[i] = -1;
+        m->used++;
+    }
+    return &m->vtimes[i];
+}
+
+static int oracle_fill_next(FILE *out, uint64_t total)
+{
+    int fd = fileno(out);
+    struct vtime_map map = { calloc(1024, sizeof(uint64_t)), calloc(1024, sizeof(int64_t)), 1024, 0 };
+    size_t chunk = 1 << 16;
+    struct oracle_request *reqs = malloc(chunk * sizeof(struct oracle_request));
+    if (map.keys == NULL || map.vtimes == NULL || reqs == NULL) {
+        return -1;
+    }
+    uint64_t end = total;
+    while (end > 0) {
+        uint64_t begin = end > chunk ? end - chunk : 0;
+        size_t n = end - begin;
+        off_t pos = begin * sizeof(struct oracle_request);
+        if (pread(fd, reqs, n * sizeof(struct oracle_request), pos) != (ssize_t) (n * sizeof(struct oracle_request))) {
+            return -1;
+        }
+        for (size_t i = n; i-- > 0;) {
+            int64_t *next = vtime_slot(&map, reqs[i].obj_id);
+            reqs[i].next_access_vtime = *next;
+            *next = begin + i;
+        }
+        if (pwrite(fd, reqs, n * sizeof(struct oracle_request), pos) != (ssize_t) (n * sizeof(struct oracle_request))) {
+            return -1;
+        }
+        end = begin;
+    }
+    free(reqs);
+    free(map.keys);
+    free(map.vtimes);
+    return 0;
+}
+
+int blok_replay_export(const struct blok_trace *trace, FILE *out, const struct blok_replay_options *opts)
+{
+    struct replay r = { .opts = opts };
+    size_t nsegs = (size_t) opts->threads * 4;
+    r.segs = calloc(nsegs, sizeof(struct replay_segment));
+    struct blok_segment *split = calloc(nsegs, sizeof(struct blok_segment));
+    if (r.segs == NULL || split == NULL) {
+        return -1;
+    }
+    nsegs = blok_trace_split(trace, split, nsegs);
+    for (size_t i = 0; i < nsegs; i++) {
+        r.segs[i].seg = split[i];
+    }
+    free(split);
+
+    // First pass: per-segment dictionaries and counts.  They are merged in segment order, which gives the same IDs
+    // as one thread reading the whole log would.
+    blok_parallel(nsegs, opts->threads, replay_scan, &r);
+    blok_dict_init(&r.files);
+    r.base_ts = UINT64_MAX;
+    uint64_t requests = 0;
+    for (size_t i = 0; i < nsegs; i++) {
+        struct replay_segment *s = &r.segs[i];
+        s->ids = malloc((s->dict.count + 1) * sizeof(uint32_t));
+        if (s->ids == NULL) {
+            return -1;
+        }
+        for (size_t n = 0; n < s->dict.count; n++) {
+            s->ids[n] = blok_dict_add(&r.files, &s->dict.entries[n].key);
+        }
+        s->first_request = requests;
+        requests += s->requests;
+        if (s->min_ts < r.base_ts) {
+            r.base_ts = s->min_ts;
+        }
+        if (s->max_ts > r.last_ts) {
+            r.last_ts = s->max_ts;
+        }
+    }
+
+    if (r.base_ts > r.last_ts) {
+        r.base_ts = r.last_ts;
+    }
+    blok_parallel(nsegs, opts->threads, replay_write, &r);
+
+    int fio = opts->format == BLOK_REPLAY_FIO2 || opts->format == BLOK_REPLAY_FIO3;
+    if (fio) {
+        fprintf(out, "fio version %d iolog\n", opts->format == BLOK_REPLAY_FIO3 ? 3 : 2);
+        for (uint32_t id = 0; id < r.files.count; id++) {
+            fio_line(out, &r, r.base_ts, id, "add\n");
+        }
+        for (uint32_t id = 0; id < r.files.count; id++) {
+            fio_line(out, &r, r.base_ts, id, "open\n");
+        }
+    }
+    for (size_t i = 0; i < nsegs; i++) {
+        replay_copy(r.segs[i].out, out);
+        fclose(r.segs[i].out);
+    }
+    if (fio) {
+        for (uint32_t id = 0; id < r.files.count; id++) {
+            fio_line(out, &r, r.last_ts, id, "close\n");
+        }
+    }
+
+    int ret = 0;
+    if (opts->format == BLOK_REPLAY_ORACLE) {
+        ret = fflush(out) == 0 ? oracle_fill_next(out, requests) : -1;
+    }
+
+    for (size_t i = 0; i < nsegs; i++) {
+        blok_dict_free(&r.segs[i].dict);
+        free(r.segs[i].ids);
+    }
+    blok_dict_free(&r.files);
+    free(r.segs);
+    return ret;
+}
@@ -0,0 +1,39 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdio.h>
+#include "trace.h"
+
+// Conversions of the reads and writes in a log to the input formats of replay and simulation tools:
+//
+//   fio2, fio3      fio's iolog, version 2 (ordering only) or 3 (with millisecond timestamps)
+//   blktrace        blkparse-compatible binary, a queue and a complete event per request; files are laid out on a
+//                   virtual device, each starting at (file ID << 32) sectors
+//   oraclegeneral   libCacheSim's oracleGeneral, one request per block with the virtual time of its next access
+//
+// Segments of the log are converted on separate threads.  File IDs come from a dictionary built in a first pass, in
+// order of first appearance in the log, so the output doesn't depend on the number of threads.
+enum blok_replay_format {
+    BLOK_REPLAY_FIO2,
+    BLOK_REPLAY_FIO3,
+    BLOK_REPLAY_BLKTRACE,
+    BLOK_REPLAY_ORACLE
+};
+
+struct blok_replay_options {
+    enum blok_replay_format format;
+    int threads;
+    uint64_t block_size;        // oraclegeneral object size
+};
+
+// out has to be a regular file for oraclegeneral, whose next-access times are filled in by a backward pass over it.
+int blok_replay_export(const struct blok_trace *trace, FILE *out, const struct blok_replay_options *opts);
+
+#endif
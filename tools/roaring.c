@@ -0,0 +1,473 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "roaring.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum container_type {
+    CONTAINER_ARRAY,
+    CONTAINER_BITMAP,
+    CONTAINER_RUNS
+};
+
+// Four words at a time; compilers map this onto whatever vector registers the target has.
+typedef uint64_t words4 __attribute__((vector_size(32)));
+
+static void *roaring_realloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL && size != 0) {
+        perror("blok roaring");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static uint64_t *bitmap_alloc(void)
+{
+    uint64_t *bits = calloc(BLOK_ROARING_WORDS, sizeof(uint64_t));
+    if (bits == NULL) {
+        perror("blok roaring");
+        exit(EXIT_FAILURE);
+    }
+    return bits;
+}
+
+void blok_roaring_init(struct blok_roaring *r)
+{
+    r->c = NULL;
+    r->n = 0;
+    r->cap = 0;
+}
+
+static void container_free(struct blok_roaring_container *c)
+{
+    free(c->array);
+    free(c->bits);
+}
+
+void blok_roaring_free(struct blok_roaring *r)
+{
+    for (size_t i = 0; i < r->n; i++) {
+        container_free(&r->c[i]);
+    }
+    free(r->c);
+    blok_roaring_init(r);
+}
+
+static void array_reserve(struct blok_roaring_container *c, uint32_t card)
+{
+    if (card > c->cap) {
+        c->cap = c->cap ? c->cap : 16;
+        while (c->cap < card) {
+            c->cap *= 2;
+        }
+        c->array = roaring_realloc(c->array, c->cap * sizeof(uint16_t));
+    }
+}
+
+static void to_bitmap(struct blok_roaring_container *c)
+{
+    c->bits = bitmap_alloc();
+    for (uint32_t i = 0; i < c->card; i++) {
+        c->bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+    }
+    free(c->array);
+    c->array = NULL;
+    c->cap = 0;
+}
+
+static void to_array(struct blok_roaring_container *c)
+{
+    c->array = roaring_realloc(NULL, (c->card ? c->card : 1) * sizeof(uint16_t));
+    c->cap = c->card;
+    uint32_t n = 0;
+    for (uint32_t w = 0; w < BLOK_ROARING_WORDS; w++) {
+        for (uint64_t word = c->bits[w]; word != 0; word &= word - 1) {
+            c->array[n++] = w * 64 + __builtin_ctzll(word);
+        }
+    }
+    free(c->bits);
+    c->bits = NULL;
+}
+
+// The container for key, inserted empty in key order if there is none.  Values mostly arrive in order, so the last
+// container is tried first.
+static struct blok_roaring_container *container_get(struct blok_roaring *r, uint64_t key)
+{
+    size_t lo = 0, hi = r->n;
+    if (r->n > 0 && r->c[r->n - 1].key < key) {
+        lo = r->n;
+    } else {
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (r->c[mid].key < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < r->n && r->c[lo].key == key) {
+            return &r->c[lo];
+        }
+    }
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 8;
+        r->c = roaring_realloc(r->c, r->cap * sizeof(struct blok_roaring_container));
+    }
+    memmove(&r->c[lo + 1], &r->c[lo], (r->n - lo) * sizeof(struct blok_roaring_container));
+    r->n++;
+    r->c[lo] = (struct blok_roaring_container) { .key = key };
+    return &r->c[lo];
+}
+
+static uint32_t array_lower_bound(const struct blok_roaring_container *c, uint32_t v)
+{
+    uint32_t lo = 0, hi = c->card;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (c->array[mid] < v) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void bitmap_set_range(struct blok_roaring_container *c, uint32_t lo, uint32_t hi)
+{
+    for (uint32_t w = lo >> 6; w <= hi >> 6; w++) {
+        uint64_t mask = ~0ULL;
+        if (w == lo >> 6) {
+            mask &= ~0ULL << (lo & 63);
+        }
+        if (w == hi >> 6) {
+            mask &= ~0ULL >> (63 - (hi & 63));
+        }
+        c->card += __builtin_popcountll(mask & ~c->bits[w]);
+        c->bits[w] |= mask;
+    }
+}
+
+static void container_add_range(struct blok_roaring_container *c, uint32_t lo, uint32_t hi)
+{
+    if (c->bits == NULL && c->card + (hi - lo + 1) > BLOK_ROARING_ARRAY_MAX) {
+        to_bitmap(c);
+    }
+    if (c->bits != NULL) {
+        bitmap_set_range(c, lo, hi);
+        return;
+    }
+    // the values from i to j are inside the range already; the range replaces them
+    uint32_t i = array_lower_bound(c, lo);
+    uint32_t j = array_lower_bound(c, hi + 1);
+    uint32_t card = c->card - (j - i) + (hi - lo + 1);
+    array_reserve(c, card);
+    memmove(&c->array[i + (hi - lo + 1)], &c->array[j], (c->card - j) * sizeof(uint16_t));
+    for (uint32_t v = lo; v <= hi; v++) {
+        c->array[i++] = v;
+    }
+    c->card = card;
+}
+
+void blok_roaring_add_range(struct blok_roaring *r, uint64_t lo, uint64_t hi)
+{
+    for (;;) {
+        uint64_t key = lo >> 16;
+        uint64_t end = (key << 16 | 0xffff) < hi ? key << 16 | 0xffff : hi;
+        container_add_range(container_get(r, key), lo & 0xffff, end & 0xffff);
+        if (end == hi) {
+            break;
+        }
+        lo = end + 1;
+    }
+}
+
+uint64_t blok_roaring_card(const struct blok_roaring *r)
+{
+    uint64_t card = 0;
+    for (size_t i = 0; i < r->n; i++) {
+        card += r->c[i].card;
+    }
+    return card;
+}
+
+static void copy_container(struct blok_roaring_container *out, const struct blok_roaring_container *c)
+{
+    *out = (struct blok_roaring_container) { .key = c->key, .card = c->card };
+    if (c->bits != NULL) {
+        out->bits = bitmap_alloc();
+        memcpy(out->bits, c->bits, BLOK_ROARING_WORDS * sizeof(uint64_t));
+    } else {
+        array_reserve(out, c->card);
+        memcpy(out->array, c->array, c->card * sizeof(uint16_t));
+    }
+}
+
+static void array_op(struct blok_roaring_container *out, const struct blok_roaring_container *a,
+                     const struct blok_roaring_container *b, enum blok_roaring_op op)
+{
+    array_reserve(out, op == BLOK_ROARING_OR ? a->card + b->card : a->card);
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < a->card || j < b->card) {
+        int from_a = i < a->card && (j == b->card || a->array[i] <= b->array[j]);
+        int from_b = j < b->card && (i == a->card || b->array[j] <= a->array[i]);
+        uint16_t v = from_a ? a->array[i] : b->array[j];
+        if (op == BLOK_ROARING_OR || (op == BLOK_ROARING_AND ? from_a && from_b : from_a && !from_b)) {
+            out->array[n++] = v;
+        }
+        i += from_a;
+        j += from_b;
+        if (op != BLOK_ROARING_OR && i == a->card) {
+            break;
+        }
+    }
+    out->card = n;
+    if (n > BLOK_ROARING_ARRAY_MAX) {
+        to_bitmap(out);
+    }
+}
+
+static void expand(uint64_t *bits, const struct blok_roaring_container *c)
+{
+    if (c->bits != NULL) {
+        memcpy(bits, c->bits, BLOK_ROARING_WORDS * sizeof(uint64_t));
+        return;
+    }
+    memset(bits, 0, BLOK_ROARING_WORDS * sizeof(uint64_t));
+    for (uint32_t i = 0; i < c->card; i++) {
+        bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+    }
+}
+
+static void bitmap_op(struct blok_roaring_container *out, const struct blok_roaring_container *a,
+                      const struct blok_roaring_container *b, enum blok_roaring_op op)
+{
+    words4 scratch[BLOK_ROARING_WORDS / 4];
+    out->bits = bitmap_alloc();
+    expand(out->bits, a);
+    const uint64_t *y = b->bits;
+    if (y == NULL) {
+        expand((uint64_t *) scratch, b);
+        y = (const uint64_t *) scratch;
+    }
+    uint32_t card = 0;
+    for (uint32_t w = 0; w < BLOK_ROARING_WORDS; w += 4) {
+        words4 va, vb;
+        memcpy(&va, &out->bits[w], sizeof(va));
+        memcpy(&vb, &y[w], sizeof(vb));
+        va = op == BLOK_ROARING_AND ? va & vb : op == BLOK_ROARING_OR ? va | vb : va & ~vb;
+        memcpy(&out->bits[w], &va, sizeof(va));
+        card += __builtin_popcountll(va[0]) + __builtin_popcountll(va[1]) + __builtin_popcountll(va[2])
+                + __builtin_popcountll(va[3]);
+    }
+    out->card = card;
+    if (card <= BLOK_ROARING_ARRAY_MAX) {
+        to_array(out);
+    }
+}
+
+static void append(struct blok_roaring *out, struct blok_roaring_container *c)
+{
+    if (c->card == 0) {
+        container_free(c);
+        return;
+    }
+    if (out->n == out->cap) {
+        out->cap = out->cap ? out->cap * 2 : 8;
+        out->c = roaring_realloc(out->c, out->cap * sizeof(struct blok_roaring_container));
+    }
+    out->c[out->n++] = *c;
+}
+
+void blok_roaring_op(struct blok_roaring *out, const struct blok_roaring *a, const struct blok_roaring *b,
+                     enum blok_roaring_op op)
+{
+    blok_roaring_init(out);
+    size_t i = 0, j = 0;
+    while (i < a->n || j < b->n) {
+        int in_a = i < a->n && (j == b->n || a->c[i].key <= b->c[j].key);
+        int in_b = j < b->n && (i == a->n || b->c[j].key <= a->c[i].key);
+        struct blok_roaring_container c = { .key = in_a ? a->c[i].key : b->c[j].key };
+        if (in_a && in_b) {
+            if (a->c[i].bits == NULL && b->c[j].bits == NULL) {
+                array_op(&c, &a->c[i], &b->c[j], op);
+            } else {
+                bitmap_op(&c, &a->c[i], &b->c[j], op);
+            }
+            append(out, &c);
+        } else if (in_a ? op != BLOK_ROARING_AND : op == BLOK_ROARING_OR) {
+            copy_container(&c, in_a ? &a->c[i] : &b->c[j]);
+            append(out, &c);
+        }
+        i += in_a;
+        j += in_b;
+    }
+}
+
+// Calls fn(lo, hi) for the runs of one container, offset by its key; a run still open at the container's end is
+// left in *lo for the next container to extend.
+static void container_runs(const struct blok_roaring_container *c, uint64_t *lo, uint64_t *hi,
+                           void (*fn)(uint64_t, uint64_t, void *), void *arg)
+{
+    uint64_t base = c->key << 16;
+    for (uint32_t v = 0, i = 0; c->bits != NULL ? v < 65536 : i < c->card; ) {
+        uint64_t value;
+        if (c->bits != NULL) {
+            uint64_t word = c->bits[v >> 6] >> (v & 63);
+            if (word == 0) {
+                v = (v | 63) + 1;
+                continue;
+            }
+            v += __builtin_ctzll(word);
+            value = base + v++;
+        } else {
+            value = base + c->array[i++];
+        }
+        if (*lo != UINT64_MAX && value == *hi + 1) {
+            *hi = value;
+            continue;
+        }
+        if (*lo != UINT64_MAX) {
+            fn(*lo, *hi, arg);
+        }
+        *lo = *hi = value;
+    }
+}
+
+void blok_roaring_runs(const struct blok_roaring *r, void (*fn)(uint64_t lo, uint64_t hi, void *arg), void *arg)
+{
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (size_t i = 0; i < r->n; i++) {
+        container_runs(&r->c[i], &lo, &hi, fn, arg);
+    }
+    if (lo != UINT64_MAX) {
+        fn(lo, hi, arg);
+    }
+}
+
+struct run_list {
+    uint16_t (*runs)[2];
+    uint32_t n;
+};
+
+static void collect_run(uint64_t lo, uint64_t hi, void *arg)
+{
+    struct run_list *l = arg;
+    l->runs[l->n][0] = lo & 0xffff;
+    l->runs[l->n][1] = hi - lo;
+    l->n++;
+}
+
+// Per container: key, type, cardinality and the values as an array, a bitmap or runs of (start, length - 1),
+// whichever is smallest; arrays only ever hold up to ARRAY_MAX values and bitmaps more, so the one a container has is
+// the smaller of those two.  Native byte order, like the columnar files.
+int blok_roaring_write(const struct blok_roaring *r, FILE *out)
+{
+    uint32_t n = r->n;
+    fwrite(&n, sizeof(n), 1, out);
+    uint16_t (*runs)[2] = roaring_realloc(NULL, 32768 * sizeof(*runs));
+    for (size_t i = 0; i < r->n; i++) {
+        const struct blok_roaring_container *c = &r->c[i];
+        struct blok_roaring tmp = { (struct blok_roaring_container *) c, 1, 1 };
+        struct run_list l = { runs, 0 };
+        blok_roaring_runs(&tmp, collect_run, &l);
+
+        size_t array_size = c->card * sizeof(uint16_t);
+        size_t bitmap_size = BLOK_ROARING_WORDS * sizeof(uint64_t);
+        size_t run_size = sizeof(uint32_t) + l.n * sizeof(*runs);
+        uint8_t type = run_size < (c->bits != NULL ? bitmap_size : array_size) ? CONTAINER_RUNS
+                       : c->bits != NULL ? CONTAINER_BITMAP : CONTAINER_ARRAY;
+        fwrite(&c->key, sizeof(c->key), 1, out);
+        fwrite(&type, 1, 1, out);
+        fwrite(&c->card, sizeof(c->card), 1, out);
+        if (type == CONTAINER_RUNS) {
+            fwrite(&l.n, sizeof(l.n), 1, out);
+            fwrite(runs, sizeof(*runs), l.n, out);
+        } else if (type == CONTAINER_ARRAY) {
+            fwrite(c->array, sizeof(uint16_t), c->card, out);
+        } else {
+            fwrite(c->bits, sizeof(uint64_t), BLOK_ROARING_WORDS, out);
+        }
+    }
+    free(runs);
+    return ferror(out) ? -1 : 0;
+}
+
+static int take(const uint8_t **p, const uint8_t *end, void *dst, size_t len)
+{
+    if ((size_t) (end - *p) < len) {
+        return -1;
+    }
+    memcpy(dst, *p, len);
+    *p += len;
+    return 0;
+}
+
+int blok_roaring_read(struct blok_roaring *r, const uint8_t **p, const uint8_t *end)
+{
+    blok_roaring_init(r);
+    uint32_t n;
+    if (take(p, end, &n, sizeof(n)) < 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t key;
+        uint8_t type;
+        uint32_t card;
+        if (take(p, end, &key, sizeof(key)) < 0 || take(p, end, &type, 1) < 0 || take(p, end, &card, sizeof(card)) < 0
+            || card == 0 || card > 65536 || (r->n > 0 && key <= r->c[r->n - 1].key)) {
+            return -1;
+        }
+        struct blok_roaring_container *c = container_get(r, key);
+        if (type == CONTAINER_ARRAY) {
+            array_reserve(c, card);
+            if (card > BLOK_ROARING_ARRAY_MAX || take(p, end, c->array, card * sizeof(uint16_t)) < 0) {
+                return -1;
+            }
+            c->card = card;
+            for (uint32_t v = 1; v < card; v++) {
+                if (c->array[v] <= c->array[v - 1]) {
+                    return -1;
+                }
+            }
+        } else if (type == CONTAINER_BITMAP) {
+            c->bits = bitmap_alloc();
+            if (take(p, end, c->bits, BLOK_ROARING_WORDS * sizeof(uint64_t)) < 0) {
+                return -1;
+            }
+            for (uint32_t w = 0; w < BLOK_ROARING_WORDS; w++) {
+                c->card += __builtin_popcountll(c->bits[w]);
+            }
+            if (c->card <= BLOK_ROARING_ARRAY_MAX) {
+                to_array(c);
+            }
+        } else if (type == CONTAINER_RUNS) {
+            uint32_t nruns;
+            if (take(p, end, &nruns, sizeof(nruns)) < 0 || nruns > 32768) {
+                return -1;
+            }
+            for (uint32_t k = 0; k < nruns; k++) {
+                uint16_t run[2];
+                if (take(p, end, run, sizeof(run)) < 0 || (uint32_t) run[0] + run[1] > 0xffff) {
+                    return -1;
+                }
+                container_add_range(c, run[0], run[0] + run[1]);
+            }
+        } else {
+            return -1;
+        }
+        if (c->card != card) {
+            return -1;
+        }
+    }
+    return 0;
+}
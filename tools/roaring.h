@@ -0,0 +1,58 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _ROARING_H_
+#define _ROARING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Compressed sets of 64-bit integers (block numbers), after Roaring bitmaps: values are split by their high 48 bits
+// into containers of 2^16 values, each a sorted array of the low 16 bits while it holds at most
+// BLOK_ROARING_ARRAY_MAX of them and a plain bitmap of 1024 words above that.  Set operations between two bitmaps run
+// a word at a time over vector registers; an array meeting a bitmap is expanded first.  On disk a container is also
+// written as runs of consecutive values when that is smallest, which sequential access almost always is.
+#define BLOK_ROARING_ARRAY_MAX 4096
+#define BLOK_ROARING_WORDS 1024
+
+struct blok_roaring_container {
+    uint64_t key;
+    uint32_t card;
+    uint32_t cap;               // of array
+    uint16_t *array;            // NULL for a bitmap
+    uint64_t *bits;             // NULL for an array
+};
+
+struct blok_roaring {
+    struct blok_roaring_container *c;
+    size_t n;
+    size_t cap;
+};
+
+enum blok_roaring_op {
+    BLOK_ROARING_AND,
+    BLOK_ROARING_OR,
+    BLOK_ROARING_ANDNOT
+};
+
+void blok_roaring_init(struct blok_roaring *r);
+void blok_roaring_free(struct blok_roaring *r);
+// Adds every value from lo to hi inclusive.
+void blok_roaring_add_range(struct blok_roaring *r, uint64_t lo, uint64_t hi);
+uint64_t blok_roaring_card(const struct blok_roaring *r);
+// out = a OP b; out is initialized by the call and must not be a or b.
+void blok_roaring_op(struct blok_roaring *out, const struct blok_roaring *a, const struct blok_roaring *b,
+                     enum blok_roaring_op op);
+// Calls fn for every maximal run of consecutive values, in order.
+void blok_roaring_runs(const struct blok_roaring *r, void (*fn)(uint64_t lo, uint64_t hi, void *arg), void *arg);
+
+int blok_roaring_write(const struct blok_roaring *r, FILE *out);
+// Reads a set written by blok_roaring_write() from [*p, end) and advances *p; -1 for malformed input.
+int blok_roaring_read(struct blok_roaring *r, const uint8_t **p, const uint8_t *end);
+
+#endif
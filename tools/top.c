@@ -0,0 +1,421 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Live view of a mounted blok, in the manner of iotop:
+//
+//     blok-top [--interval=SECS] [--lines=N] [--sort=ops|bytes] [--batch] [--iterations=N] MOUNTPOINT
+//
+// Every interval it reads MOUNTPOINT/.blok/stats and MOUNTPOINT/.blok/top and shows, for that interval, per-operation
+// rates and latency percentiles with the calls in flight and dropped log records, and the hottest files, processes
+// and directories by reads and writes.  Both files are rendered from counters that the FUSE threads keep without
+// locks, so watching a mount doesn't slow it down.
+//
+// The hot lists come from per-thread sketches (see include/top.h) that only track the heaviest keys; a key that just
+// entered a sketch has no rate until the next interval.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_BUCKETS 40
+
+enum kind {
+    KIND_FILE,
+    KIND_DIR,
+    KIND_PID,
+    KIND_JOB,
+    KIND_MAX
+};
+
+static const char *kind_names[KIND_MAX] = { "file", "dir", "pid", "job" };
+
+struct op_sample {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t in_flight;
+    uint64_t dropped;
+    uint64_t latency[HIST_BUCKETS];
+};
+
+struct top_entry {
+    char *key;                  // path as a JSON string, or the pid
+    uint64_t ops;
+    uint64_t bytes;
+};
+
+struct sample {
+    struct timespec when;
+    struct op_sample op[BLOK_OP_MAX];
+    uint64_t heat_dropped;
+    struct top_entry *top[KIND_MAX];
+    size_t ntop[KIND_MAX];
+};
+
+struct row {
+    const char *key;
+    double ops;
+    double bytes;
+};
+
+static int sort_bytes;
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+    size_t cap = 1 << 16;
+    size_t n = 0;
+    size_t got;
+    char *buf = malloc(cap + 1);
+    while (buf != NULL && (got = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += got;
+        if (n == cap) {
+            cap *= 2;
+            char *grown = realloc(buf, cap + 1);
+            if (grown == NULL) {
+                free(buf);
+            }
+            buf = grown;
+        }
+    }
+    fclose(f);
+    if (buf != NULL) {
+        buf[n] = '\0';
+        *len = n;
+    }
+    return buf;
+}
+
+// "op.NAME.FIELD VALUE" lines; everything else but heat.dropped is ignored
+static void parse_stats(struct sample *s, char *text)
+{
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char *space = strchr(line, ' ');
+        if (space == NULL) {
+            continue;
+        }
+        *space = '\0';
+        uint64_t v = strtoull(space + 1, NULL, 10);
+        if (strcmp(line, "heat.dropped") == 0) {
+            s->heat_dropped = v;
+            continue;
+        }
+        if (strncmp(line, "op.", 3) != 0) {
+            continue;
+        }
+        char *name = line + 3;
+        char *field = strchr(name, '.');
+        if (field == NULL) {
+            continue;
+        }
+        int op = blok_op_lookup(name, field - name);
+        if (op < 0) {
+            continue;
+        }
+        field++;
+        struct op_sample *o = &s->op[op];
+        if (strcmp(field, "ops") == 0) {
+            o->ops = v;
+        } else if (strcmp(field, "bytes") == 0) {
+            o->bytes = v;
+        } else if (strcmp(field, "errors") == 0) {
+            o->errors = v;
+        } else if (strcmp(field, "in_flight") == 0) {
+            o->in_flight = v;
+        } else if (strcmp(field, "dropped") == 0) {
+            o->dropped = v;
+        } else if (strncmp(field, "latency_ns.lt_", 14) == 0) {
+            uint64_t bound = strtoull(field + 14, NULL, 10);
+            int b = bound == 0 ? 0 : __builtin_ctzll(bound);
+            if (b < HIST_BUCKETS) {
+                o->latency[b] = v;
+            }
+        }
+    }
+}
+
+// "KIND OPS BYTES ERROR KEY" lines
+static void parse_top(struct sample *s, char *text)
+{
+    size_t cap[KIND_MAX] = { 0 };
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char kind_name[8];
+        unsigned long long ops, bytes, error;
+        int key_at;
+        if (sscanf(line, "%7s %llu %llu %llu %n", kind_name, &ops, &bytes, &error, &key_at) != 4) {
+            continue;
+        }
+        int kind;
+        for (kind = 0; kind < KIND_MAX && strcmp(kind_name, kind_names[kind]) != 0; kind++) {
+        }
+        if (kind == KIND_MAX) {
+            continue;
+        }
+        if (s->ntop[kind] == cap[kind]) {
+            cap[kind] = cap[kind] ? cap[kind] * 2 : 64;
+            s->top[kind] = realloc(s->top[kind], cap[kind] * sizeof(struct top_entry));
+            if (s->top[kind] == NULL) {
+                perror("blok-top");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct top_entry *e = &s->top[kind][s->ntop[kind]++];
+        e->key = strdup(line + key_at);
+        e->ops = ops;
+        e->bytes = bytes;
+    }
+}
+
+static int take_sample(const char *mount, struct sample *s)
+{
+    char path[PATH_MAX];
+    size_t len;
+    memset(s, 0, sizeof(*s));
+    clock_gettime(CLOCK_MONOTONIC, &s->when);
+
+    snprintf(path, sizeof(path), "%s/.blok/stats", mount);
+    char *text = read_file(path, &len);
+    if (text == NULL) {
+        return -1;
+    }
+    parse_stats(s, text);
+    free(text);
+
+    snprintf(path, sizeof(path), "%s/.blok/top", mount);
+    text = read_file(path, &len);
+    if (text == NULL) {
+        return -1;
+    }
+    parse_top(s, text);
+    free(text);
+    return 0;
+}
+
+static void free_sample(struct sample *s)
+{
+    for (int kind = 0; kind < KIND_MAX; kind++) {
+        for (size_t i = 0; i < s->ntop[kind]; i++) {
+            free(s->top[kind][i].key);
+        }
+        free(s->top[kind]);
+    }
+}
+
+// Counters only grow, except that latency histograms restart when the counters are reset.
+static uint64_t delta(uint64_t now, uint64_t before)
+{
+    return now >= before ? now - before : now;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, double p)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p * total + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= (rank ? rank : 1)) {
+            return 1ULL << b;
+        }
+    }
+    return 1ULL << (HIST_BUCKETS - 1);
+}
+
+static const char *format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns == 0) {
+        snprintf(buf, size, "-");
+    } else if (ns < 1000) {
+        snprintf(buf, size, "%lluns", (unsigned long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+static int row_cmp(const void *a, const void *b)
+{
+    const struct row *x = a;
+    const struct row *y = b;
+    double vx = sort_bytes ? x->bytes : x->ops;
+    double vy = sort_bytes ? y->bytes : y->ops;
+    return (vx < vy) - (vx > vy);
+}
+
+static const char *comm(const char *pid, char *buf, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%s/comm", pid);
+    FILE *f = fopen(path, "r");
+    buf[0] = '\0';
+    if (f != NULL) {
+        if (fgets(buf, size, f) != NULL) {
+            buf[strcspn(buf, "\n")] = '\0';
+        }
+        fclose(f);
+    }
+    return buf[0] != '\0' ? buf : "?";
+}
+
+static void show_hot(const struct sample *now, const struct sample *before, int kind, double secs, int lines)
+{
+    struct row *rows = calloc(now->ntop[kind] + 1, sizeof(struct row));
+    size_t n = 0;
+    if (rows == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < now->ntop[kind]; i++) {
+        const struct top_entry *e = &now->top[kind][i];
+        for (size_t j = 0; j < before->ntop[kind]; j++) {
+            const struct top_entry *p = &before->top[kind][j];
+            if (strcmp(e->key, p->key) == 0 && e->ops >= p->ops) {
+                rows[n++] = (struct row) { e->key, (e->ops - p->ops) / secs, (e->bytes - p->bytes) / secs };
+                break;
+            }
+        }
+    }
+    qsort(rows, n, sizeof(struct row), row_cmp);
+
+    static const char *titles[KIND_MAX] = { "FILE", "DIRECTORY", "PID     COMMAND", "JOB     COMMAND" };
+    printf("\n%10s %10s  %s\n", "OPS/S", "MB/S", titles[kind]);
+    for (size_t i = 0; i < n && (int) i < lines && rows[i].ops > 0; i++) {
+        printf("%10.1f %10.2f  ", rows[i].ops, rows[i].bytes / 1e6);
+        if (kind == KIND_PID || kind == KIND_JOB) {
+            char name[64];
+            printf("%-7s %s\n", rows[i].key, comm(rows[i].key, name, sizeof(name)));
+        } else {
+            // the key is a JSON string; its escapes keep control characters off the terminal
+            int len = strlen(rows[i].key);
+            printf("%.*s\n", len >= 2 ? len - 2 : len, rows[i].key + (len >= 2));
+        }
+    }
+    free(rows);
+}
+
+static void show(const char *mount, const struct sample *now, const struct sample *before, int lines, int batch)
+{
+    double secs = (now->when.tv_sec - before->when.tv_sec) + (now->when.tv_nsec - before->when.tv_nsec) / 1e9;
+    if (secs <= 0) {
+        secs = 1;
+    }
+    uint64_t dropped = 0;
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        dropped += now->op[op].dropped;
+    }
+    if (!batch) {
+        fputs("\033[H\033[2J", stdout);
+    }
+    time_t t = time(NULL);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&t));
+    printf("blok-top  %s  %s  %.1fs   dropped: log %llu, heat %llu\n", mount, clock, secs,
+           (unsigned long long) dropped, (unsigned long long) now->heat_dropped);
+    printf("\n%-12s %10s %10s %8s %9s %9s %9s\n", "OP", "OPS/S", "MB/S", "ERR/S", "P50", "P99", "IN FLIGHT");
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        const struct op_sample *a = &now->op[op];
+        const struct op_sample *b = &before->op[op];
+        uint64_t ops = delta(a->ops, b->ops);
+        if (ops == 0 && a->in_flight == 0) {
+            continue;
+        }
+        uint64_t hist[HIST_BUCKETS];
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            hist[i] = delta(a->latency[i], b->latency[i]);
+        }
+        char p50[16], p99[16];
+        printf("%-12s %10.1f %10.2f %8.1f %9s %9s %9llu\n", blok_trace_op_name(op), ops / secs,
+               delta(a->bytes, b->bytes) / secs / 1e6, delta(a->errors, b->errors) / secs,
+               format_ns(p50, sizeof(p50), hist_percentile(hist, 0.5)),
+               format_ns(p99, sizeof(p99), hist_percentile(hist, 0.99)), (unsigned long long) a->in_flight);
+    }
+    show_hot(now, before, KIND_FILE, secs, lines);
+    show_hot(now, before, KIND_PID, secs, lines);
+    show_hot(now, before, KIND_DIR, secs, lines);
+    if (now->ntop[KIND_JOB] != 0) {
+        show_hot(now, before, KIND_JOB, secs, lines);
+    }
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-top [--interval=SECS] [--lines=N] [--sort=ops|bytes] [--batch] [--iterations=N] "
+                    "MOUNTPOINT\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "interval", required_argument, NULL, 'i' },
+        { "lines", required_argument, NULL, 'n' },
+        { "sort", required_argument, NULL, 's' },
+        { "batch", no_argument, NULL, 'b' },
+        { "iterations", required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    double interval = 1.0;
+    int lines = 10;
+    int batch = !isatty(STDOUT_FILENO);
+    long iterations = -1;
+    int c;
+    while ((c = getopt_long(argc, argv, "i:n:s:bc:", options, NULL)) != -1) {
+        switch (c) {
+        case 'i': interval = atof(optarg); break;
+        case 'n': lines = atoi(optarg); break;
+        case 's': sort_bytes = strcmp(optarg, "bytes") == 0; break;
+        case 'b': batch = 1; break;
+        case 'c': iterations = atol(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || interval <= 0) {
+        usage();
+    }
+    const char *mount = argv[optind];
+
+    struct sample samples[2];
+    if (take_sample(mount, &samples[0]) < 0) {
+        fprintf(stderr, "blok-top: %s/.blok: %s (is it a blok mount?)\n", mount, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct timespec pause = { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+    for (long i = 0; iterations < 0 || i < iterations; i++) {
+        nanosleep(&pause, NULL);
+        struct sample *before = &samples[i % 2];
+        struct sample *now = &samples[(i + 1) % 2];
+        if (take_sample(mount, now) < 0) {
+            fprintf(stderr, "blok-top: %s/.blok: %s\n", mount, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        show(mount, now, before, lines, batch);
+        free_sample(before);
+    }
+    free_sample(&samples[iterations % 2]);
+    return EXIT_SUCCESS;
+}
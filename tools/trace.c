@@ -0,0 +1,345 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *op_names[BLOK_OP_MAX] = {
+#define BLOK_OP_NAME(NAME, name) [BLOK_OP_##NAME] = #name,
+    BLOK_OP_LIST(BLOK_OP_NAME)
+#undef BLOK_OP_NAME
+};
+
+int blok_trace_open(struct blok_trace *trace, const char *path)
+{
+    memset(trace, 0, sizeof(*trace));
+    trace->fd = open(path, O_RDONLY);
+    if (trace->fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(trace->fd, &st) < 0) {
+        close(trace->fd);
+        return -1;
+    }
+    trace->size = st.st_size;
+    if (trace->size == 0) {
+        trace->map = "";
+        return 0;
+    }
+    void *map = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, trace->fd, 0);
+    if (map == MAP_FAILED) {
+        close(trace->fd);
+        return -1;
+    }
+    // the tools mostly stream through the log once
+    madvise(map, trace->size, MADV_SEQUENTIAL);
+    trace->map = map;
+    return 0;
+}
+
+void blok_trace_close(struct blok_trace *trace)
+{
+    if (trace->size != 0) {
+        munmap((void *) trace->map, trace->size);
+    }
+    close(trace->fd);
+}
+
+size_t blok_trace_split(const struct blok_trace *trace, struct blok_segment *segs, size_t n)
+{
+    const char *begin = trace->map;
+    const char *end = trace->map + trace->size;
+    size_t count = 0;
+    for (size_t i = 0; i < n && begin < end; i++) {
+        const char *cut = i == n - 1 ? end : trace->map + trace->size / n * (i + 1);
+        if (cut < begin) {
+            cut = begin;
+        }
+        if (cut < end) {
+            const char *nl = memchr(cut, '\n', end - cut);
+            cut = nl != NULL ? nl + 1 : end;
+        }
+        segs[count].begin = begin;
+        segs[count].end = cut;
+        count++;
+        begin = cut;
+    }
+    return count;
+}
+
+const char *blok_segment_next(struct blok_segment *seg, size_t *len)
+{
+    if (seg->begin >= seg->end) {
+        return NULL;
+    }
+    const char *line = seg->begin;
+    const char *nl = memchr(line, '\n', seg->end - line);
+    const char *stop = nl != NULL ? nl : seg->end;
+    *len = stop - line;
+    seg->begin = nl != NULL ? nl + 1 : seg->end;
+    return line;
+}
+
+int blok_op_lookup(const char *name, size_t len)
+{
+    for (int op = 0; op < BLOK_OP_MAX; op++) {
+        if (strlen(op_names[op]) == len && memcmp(op_names[op], name, len) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+const char *blok_trace_op_name(int op)
+{
+    return op >= 0 && op < BLOK_OP_MAX ? op_names[op] : "unknown";
+}
+
+// Parses a string starting at the opening quote; leaves *p after the closing one.
+static int parse_string(const char **p, const char *end, struct blok_str *s)
+{
+    const char *q = *p + 1;
+    s->p = q;
+    s->escaped = 0;
+    while (q < end && *q != '"') {
+        if (*q == '\\') {
+            s->escaped = 1;
+            q++;
+        }
+        q++;
+    }
+    if (q >= end) {
+        return -1;
+    }
+    s->len = q - s->p;
+    *p = q + 1;
+    return 0;
+}
+
+static int parse_int(const char **p, const char *end, int64_t *v)
+{
+    const char *q = *p;
+    int neg = 0;
+    if (q < end && *q == '-') {
+        neg = 1;
+        q++;
+    }
+    if (q >= end || *q < '0' || *q > '9') {
+        return -1;
+    }
+    uint64_t n = 0;
+    while (q < end && *q >= '0' && *q <= '9') {
+        n = n * 10 + (*q++ - '0');
+    }
+    // fractions and exponents only occur in rollups, whose values the tools don't read
+    while (q < end && (*q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-' || (*q >= '0' && *q <= '9'))) {
+        q++;
+    }
+    *v = neg ? -(int64_t) n : (int64_t) n;
+    *p = q;
+    return 0;
+}
+
+#define KEY_IS(s, lit) ((s).len == sizeof(lit) - 1 && memcmp((s).p, lit, sizeof(lit) - 1) == 0)
+
+int blok_record_parse(const char *line, size_t len, struct blok_record *rec)
+{
+    const char *p = line;
+    const char *end = line + len;
+    memset(rec, 0, sizeof(*rec));
+    rec->op = -1;
+    rec->kind = BLOK_RECORD_OTHER;
+
+    if (p >= end || *p++ != '{') {
+        return -1;
+    }
+    int first = 1;
+    while (p < end && *p != '}') {
+        if (!first && *p++ != ',') {
+            return -1;
+        }
+        first = 0;
+        struct blok_str key;
+        if (p >= end || *p != '"' || parse_string(&p, end, &key) < 0 || p >= end || *p++ != ':') {
+            return -1;
+        }
+        if (p < end && *p == '"') {
+            struct blok_str value;
+            if (parse_string(&p, end, &value) < 0) {
+                return -1;
+            }
+            if (KEY_IS(key, "op")) {
+                rec->kind = BLOK_RECORD_OP;
+                rec->op = blok_op_lookup(value.p, value.len);
+            } else if (KEY_IS(key, "rollup")) {
+                rec->kind = BLOK_RECORD_ROLLUP;
+                rec->op = blok_op_lookup(value.p, value.len);
+            } else if (KEY_IS(key, "header")) {
+                rec->kind = BLOK_RECORD_HEADER;
+            } else if (KEY_IS(key, "marker")) {
+                rec->kind = BLOK_RECORD_MARKER;
+                rec->marker = value;
+            } else if (KEY_IS(key, "filename")) {
+                rec->filename = value;
+            } else if (KEY_IS(key, "newname")) {
+                rec->newname = value;
+                rec->fields |= BLOK_FIELD_NEWNAME;
+            } else if (KEY_IS(key, "source")) {
+                rec->source = value;
+                rec->fields |= BLOK_FIELD_SOURCE;
+            } else if (KEY_IS(key, "boot_id")) {
+                rec->boot_id = value;
+            } else if (KEY_IS(key, "mount")) {
+                rec->mount = value;
+            }
+            continue;
+        }
+        int64_t v;
+        if (parse_int(&p, end, &v) < 0) {
+            return -1;
+        }
+        if (KEY_IS(key, "ts")) {
+            rec->ts = v;
+            rec->fields |= BLOK_FIELD_TIME;
+        } else if (KEY_IS(key, "dur")) {
+            rec->dur = v;
+        } else if (KEY_IS(key, "pid")) {
+            rec->pid = v;
+        } else if (KEY_IS(key, "tid")) {
+            rec->tid = v;
+        } else if (KEY_IS(key, "cgroup")) {
+            rec->cgroup = v;
+        } else if (KEY_IS(key, "job")) {
+            rec->job = v;
+        } else if (KEY_IS(key, "result")) {
+            rec->result = v;
+        } else if (KEY_IS(key, "offset")) {
+            rec->offset = v;
+            rec->fields |= BLOK_FIELD_RANGE;
+        } else if (KEY_IS(key, "size")) {
+            rec->size = v;
+        } else if (KEY_IS(key, "dev")) {
+            rec->dev = v;
+        } else if (KEY_IS(key, "ino")) {
+            rec->ino = v;
+            rec->fields |= v != 0 ? BLOK_FIELD_ID : 0;
+        } else if (KEY_IS(key, "gen")) {
+            rec->gen = v;
+        } else if (KEY_IS(key, "realtime")) {
+            rec->realtime = v;
+        } else if (KEY_IS(key, "monotonic")) {
+            rec->monotonic = v;
+        }
+    }
+    return p < end ? 0 : -1;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// blok writes \u00XX for bytes that aren't valid UTF-8, so those come back as the raw byte; other \u escapes are
+// encoded as UTF-8.
+size_t blok_str_copy(const struct blok_str *s, char *buf, size_t size)
+{
+    size_t n = 0;
+    if (!s->escaped) {
+        n = s->len < size - 1 ? s->len : size - 1;
+        memcpy(buf, s->p, n);
+        buf[n] = '\0';
+        return n;
+    }
+    const char *p = s->p;
+    const char *end = s->p + s->len;
+    char tmp[4];
+    while (p < end) {
+        size_t tlen = 1;
+        if (*p != '\\' || p + 1 >= end) {
+            tmp[0] = *p++;
+        } else {
+            p++;
+            char c = *p++;
+            switch (c) {
+            case 'b': tmp[0] = '\b'; break;
+            case 'f': tmp[0] = '\f'; break;
+            case 'n': tmp[0] = '\n'; break;
+            case 'r': tmp[0] = '\r'; break;
+            case 't': tmp[0] = '\t'; break;
+            case 'u': {
+                unsigned cp = 0;
+                for (int i = 0; i < 4 && p < end; i++) {
+                    int h = hex_value(*p++);
+                    cp = (cp << 4) | (h < 0 ? 0 : h);
+                }
+                if (cp < 0x100) {
+                    tmp[0] = cp;
+                } else if (cp < 0x800) {
+                    tmp[0] = 0xc0 | (cp >> 6);
+                    tmp[1] = 0x80 | (cp & 0x3f);
+                    tlen = 2;
+                } else {
+                    tmp[0] = 0xe0 | (cp >> 12);
+                    tmp[1] = 0x80 | ((cp >> 6) & 0x3f);
+                    tmp[2] = 0x80 | (cp & 0x3f);
+                    tlen = 3;
+                }
+                break;
+            }
+            default: tmp[0] = c; break;
+            }
+        }
+        if (n + tlen >= size) {
+            break;
+        }
+        memcpy(buf + n, tmp, tlen);
+        n += tlen;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// The daemon's own escaper, so that tools write paths exactly as blok.log has them: valid UTF-8 as is, other bytes as
+// \u00XX.
+void blok_json_str(FILE *out, const char *s, size_t len)
+{
+    char stack[1024];
+    char *buf = BLOK_JSON_STRING_MAX(len) <= sizeof(stack) ? stack : malloc(BLOK_JSON_STRING_MAX(len));
+    if (buf == NULL) {
+        perror("blok trace");
+        exit(EXIT_FAILURE);
+    }
+    char *end = blok_json_string(buf, s, len);
+    fwrite(buf, 1, end - buf, out);
+    if (buf != stack) {
+        free(buf);
+    }
+}
+
+size_t blok_json_quote(char *out, const char *s, size_t len)
+{
+    char *end = blok_json_string(out, s, len);
+    *end = '\0';
+    return end - out;
+}
@@ -0,0 +1,100 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "../include/event.h"
+
+// Reading blok.log for the offline tools.  The log is mapped whole and split into segments that start and end on
+// record boundaries, so that tools can parse segments on separate threads.  Records are parsed in place: strings
+// point into the mapping and are only unescaped when asked for.
+
+struct blok_trace {
+    int fd;
+    const char *map;
+    size_t size;
+};
+
+struct blok_segment {
+    const char *begin;
+    const char *end;
+};
+
+struct blok_str {
+    const char *p;
+    uint32_t len;
+    int escaped;
+};
+
+enum blok_record_kind {
+    BLOK_RECORD_OP,
+    BLOK_RECORD_ROLLUP,
+    BLOK_RECORD_HEADER,
+    BLOK_RECORD_MARKER,
+    BLOK_RECORD_OTHER
+};
+
+// Which optional fields a record had
+#define BLOK_FIELD_NEWNAME (1 << 0)
+#define BLOK_FIELD_RANGE   (1 << 1)
+#define BLOK_FIELD_TIME    (1 << 2)
+#define BLOK_FIELD_ID      (1 << 3)
+#define BLOK_FIELD_SOURCE  (1 << 4)
+
+struct blok_record {
+    enum blok_record_kind kind;
+    int op;                     // enum blok_op, -1 when unknown
+    unsigned fields;
+    uint64_t ts;
+    uint64_t dur;
+    int32_t pid;
+    int32_t tid;
+    uint64_t cgroup;            // with -o cgroups and -o jobs, 0 otherwise
+    int32_t job;
+    int64_t result;
+    struct blok_str filename;
+    struct blok_str newname;
+    int64_t offset;
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t gen;
+    struct blok_str source;     // mount the record came from, in merged logs
+    struct blok_str marker;     // phase name of marker records
+
+    // header records
+    uint64_t realtime;
+    uint64_t monotonic;
+    struct blok_str boot_id;
+    struct blok_str mount;
+};
+
+int blok_trace_open(struct blok_trace *trace, const char *path);
+void blok_trace_close(struct blok_trace *trace);
+// Splits the trace into at most n segments of roughly equal size; returns how many it made.
+size_t blok_trace_split(const struct blok_trace *trace, struct blok_segment *segs, size_t n);
+
+// Returns the next line of the segment and advances past it, NULL at its end.
+const char *blok_segment_next(struct blok_segment *seg, size_t *len);
+
+// 0 on success, -1 for a line that isn't a blok record
+int blok_record_parse(const char *line, size_t len, struct blok_record *rec);
+// Copies the unescaped string into buf (always terminated) and returns its length, truncated to size - 1.
+size_t blok_str_copy(const struct blok_str *s, char *buf, size_t size);
+// JSON string output for the tools, escaped like blok.log (see ndjson.h): valid UTF-8 is copied as it is, '"', '\\',
+// control characters and bytes that aren't valid UTF-8 are escaped.  blok_json_quote() writes into out, which must
+// hold 6 * len + 3 bytes, and returns the length written, not counting the terminator.
+void blok_json_str(FILE *out, const char *s, size_t len);
+size_t blok_json_quote(char *out, const char *s, size_t len);
+int blok_op_lookup(const char *name, size_t len);
+const char *blok_trace_op_name(int op);
+
+#endif
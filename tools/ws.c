@@ -0,0 +1,515 @@
+/*
+  Blok File System
+  Copyright (C) 2019 Kamil Noster <kamil.noster@gmail.com>
+
+  Distributed under the GNU GPLv3.
+*/
+
+// Working sets: the blocks each file had read or written in a run, saved as compressed bitmaps (see roaring.h) so
+// runs can be compared without their traces:
+//
+//     blok-ws build [--block=SIZE] [--op=read|write|all] [--pid=PID] [--job=ID] -o OUT.ws TRACE
+//     blok-ws union|intersect|diff -o OUT.ws A.ws B.ws
+//     blok-ws compare [--limit=N] A.ws B.ws
+//     blok-ws show [--ranges] WS.ws
+//
+// build takes a log or a columnar file; --job selects one job of a log written with -o jobs.  diff is A without B.
+// compare prints a JSON document with the sizes of both sets, their intersection and differences, in total and for
+// the --limit files that changed most.  show lists each file's block count and, with --ranges, its block ranges.
+// Files are matched by path, as inode numbers differ between runs, and both sets must have the same block size.
+//
+// A working set file is the magic, the block size and the file count, then per file its path and its bitmap.
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "columnar.h"
+#include "dict.h"
+#include "roaring.h"
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define WS_MAGIC "BLOKWS1\n"
+#define EXIT_TROUBLE 2
+
+enum ws_ops {
+    WS_READ = 1 << 0,
+    WS_WRITE = 1 << 1
+};
+
+struct ws_file {
+    char *path;
+    uint32_t len;
+    struct blok_roaring blocks;
+};
+
+struct ws {
+    uint64_t block_size;
+    struct ws_file *files;
+    size_t n;
+    size_t cap;
+    struct blok_dict paths;     // path-only keys, for matching
+};
+
+struct options {
+    uint64_t block_size;
+    unsigned ops;
+    int32_t pid;
+    int32_t job;
+    const char *out;
+    size_t limit;
+    int ranges;
+};
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("blok-ws");
+        exit(EXIT_TROUBLE);
+    }
+    return p;
+}
+
+static void ws_init(struct ws *ws, uint64_t block_size)
+{
+    *ws = (struct ws) { .block_size = block_size };
+    blok_dict_init(&ws->paths);
+}
+
+static void ws_free(struct ws *ws)
+{
+    for (size_t i = 0; i < ws->n; i++) {
+        free(ws->files[i].path);
+        blok_roaring_free(&ws->files[i].blocks);
+    }
+    free(ws->files);
+    blok_dict_free(&ws->paths);
+}
+
+// The file named path, added empty if the set doesn't have it yet.
+static struct ws_file *ws_get(struct ws *ws, const char *path, size_t len)
+{
+    struct blok_file_key key = { .path = path, .len = len };
+    uint32_t id = blok_dict_add(&ws->paths, &key);
+    if (id == ws->n) {
+        if (ws->n == ws->cap) {
+            ws->cap = ws->cap ? ws->cap * 2 : 256;
+            ws->files = xrealloc(ws->files, ws->cap * sizeof(struct ws_file));
+        }
+        struct ws_file *f = &ws->files[ws->n++];
+        f->path = xrealloc(NULL, len + 1);
+        memcpy(f->path, path, len);
+        f->path[len] = '\0';
+        f->len = len;
+        blok_roaring_init(&f->blocks);
+    }
+    return &ws->files[id];
+}
+
+static const struct ws_file *ws_find(const struct ws *ws, const struct ws_file *f)
+{
+    struct blok_file_key key = { .path = f->path, .len = f->len };
+    uint32_t id = blok_dict_find(&ws->paths, &key);
+    return id != UINT32_MAX ? &ws->files[id] : NULL;
+}
+
+static void add_call(struct ws *ws, const struct options *o, int op, int64_t offset, int64_t result,
+                     const char *path, size_t len)
+{
+    unsigned want = op == BLOK_OP_READ ? WS_READ : op == BLOK_OP_WRITE ? WS_WRITE : 0;
+    if (!(o->ops & want) || result <= 0 || offset < 0) {
+        return;
+    }
+    blok_roaring_add_range(&ws_get(ws, path, len)->blocks, offset / ws->block_size,
+                           (offset + result - 1) / ws->block_size);
+}
+
+static int build_log(struct ws *ws, const struct options *o, const char *path)
+{
+    struct blok_trace trace;
+    if (blok_trace_open(&trace, path) < 0) {
+        perror(path);
+        return -1;
+    }
+    struct blok_segment seg = { trace.map, trace.map + trace.size };
+    const char *line;
+    size_t len;
+    char name[PATH_MAX];
+    while ((line = blok_segment_next(&seg, &len)) != NULL) {
+        struct blok_record rec;
+        if (blok_record_parse(line, len, &rec) < 0 || rec.kind != BLOK_RECORD_OP) {
+            continue;
+        }
+        if ((o->pid != 0 && rec.pid != o->pid) || (o->job != 0 && rec.job != o->job)) {
+            continue;
+        }
+        size_t n = blok_str_copy(&rec.filename, name, sizeof(name));
+        add_call(ws, o, rec.op, rec.offset, rec.result, name, n);
+    }
+    blok_trace_close(&trace);
+    return 0;
+}
+
+static int build_columnar(struct ws *ws, const struct options *o, const char *path)
+{
+    if (o->job != 0) {
+        fprintf(stderr, "blok-ws: %s: columnar files have no jobs\n", path);
+        return -1;
+    }
+    struct blok_col_file f;
+    if (blok_col_open(&f, path) < 0) {
+        fprintf(stderr, "blok-ws: %s: not a valid columnar file\n", path);
+        return -1;
+    }
+    static const enum blok_col needed[] = { BLOK_COL_OP, BLOK_COL_PID, BLOK_COL_FILE, BLOK_COL_OFFSET, BLOK_COL_RESULT };
+    int64_t *col[BLOK_COL_MAX] = { NULL };
+    int ret = 0;
+    for (size_t rg = 0; rg < f.nrowgroups && ret == 0; rg++) {
+        size_t rows = f.rowgroups[rg].rows;
+        for (size_t c = 0; c < sizeof(needed) / sizeof(needed[0]); c++) {
+            col[needed[c]] = xrealloc(col[needed[c]], rows * sizeof(int64_t));
+            if (blok_col_decode(&f, rg, needed[c], col[needed[c]]) < 0) {
+                fprintf(stderr, "blok-ws: %s: row group %zu is damaged\n", path, rg);
+                ret = -1;
+            }
+        }
+        for (size_t i = 0; i < rows && ret == 0; i++) {
+            if (o->pid != 0 && col[BLOK_COL_PID][i] != o->pid) {
+                continue;
+            }
+            uint64_t id = col[BLOK_COL_FILE][i];
+            add_call(ws, o, col[BLOK_COL_OP][i], col[BLOK_COL_OFFSET][i], col[BLOK_COL_RESULT][i],
+                     id < f.nfiles ? f.files[id].path : "", id < f.nfiles ? f.files[id].len : 0);
+        }
+    }
+    for (int c = 0; c < BLOK_COL_MAX; c++) {
+        free(col[c]);
+    }
+    blok_col_close(&f);
+    return ret;
+}
+
+static int ws_write(const struct ws *ws, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < ws->n; i++) {
+        n += ws->files[i].blocks.n > 0;
+    }
+    fwrite(WS_MAGIC, 8, 1, out);
+    fwrite(&ws->block_size, sizeof(ws->block_size), 1, out);
+    fwrite(&n, sizeof(n), 1, out);
+    for (size_t i = 0; i < ws->n; i++) {
+        const struct ws_file *f = &ws->files[i];
+        if (f->blocks.n == 0) {
+            continue;
+        }
+        fwrite(&f->len, sizeof(f->len), 1, out);
+        fwrite(f->path, 1, f->len, out);
+        blok_roaring_write(&f->blocks, out);
+    }
+    if (ferror(out) | fclose(out)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int ws_read(struct ws *ws, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const uint8_t *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "blok-ws: %s: not a working set file\n", path);
+        return -1;
+    }
+    const uint8_t *p = map + 8;
+    const uint8_t *end = map + st.st_size;
+    uint64_t block_size, n;
+    int ret = -1;
+    if ((size_t) st.st_size >= 24 && memcmp(map, WS_MAGIC, 8) == 0) {
+        memcpy(&block_size, p, 8);
+        memcpy(&n, p + 8, 8);
+        p += 16;
+        ws_init(ws, block_size);
+        ret = 0;
+        for (uint64_t i = 0; i < n && ret == 0; i++) {
+            uint32_t len;
+            if (end - p < 4 || (memcpy(&len, p, 4), (size_t) (end - p - 4) < len) || len >= PATH_MAX) {
+                ret = -1;
+                break;
+            }
+            struct ws_file *f = ws_get(ws, (const char *) p + 4, len);
+            p += 4 + len;
+            if (f->blocks.n != 0) {
+                ret = -1;
+                break;
+            }
+            ret = blok_roaring_read(&f->blocks, &p, end);
+        }
+    }
+    munmap((void *) map, st.st_size);
+    if (ret < 0) {
+        fprintf(stderr, "blok-ws: %s: not a working set file\n", path);
+    }
+    return ret;
+}
+
+static int ws_combine(const char *a_path, const char *b_path, const char *out, enum blok_roaring_op op)
+{
+    struct ws a, b, r;
+    if (ws_read(&a, a_path) < 0 || ws_read(&b, b_path) < 0) {
+        return EXIT_TROUBLE;
+    }
+    if (a.block_size != b.block_size) {
+        fprintf(stderr, "blok-ws: %s and %s have different block sizes\n", a_path, b_path);
+        return EXIT_TROUBLE;
+    }
+    static const struct blok_roaring empty;
+    ws_init(&r, a.block_size);
+    for (int side = 0; side < 2; side++) {
+        const struct ws *from = side == 0 ? &a : &b;
+        const struct ws *other = side == 0 ? &b : &a;
+        for (size_t i = 0; i < from->n; i++) {
+            const struct ws_file *f = &from->files[i];
+            const struct ws_file *g = ws_find(other, f);
+            if (side == 1 && (g != NULL || op != BLOK_ROARING_OR)) {
+                continue;       // done from a's side, or can't be in the result
+            }
+            struct ws_file *dst = ws_get(&r, f->path, f->len);
+            blok_roaring_op(&dst->blocks, &f->blocks, g != NULL ? &g->blocks : &empty, op);
+        }
+    }
+    int ret = ws_write(&r, out) < 0 ? EXIT_TROUBLE : 0;
+    ws_free(&a);
+    ws_free(&b);
+    ws_free(&r);
+    return ret;
+}
+
+struct file_delta {
+    const char *path;
+    uint64_t a, b, both;
+};
+
+static int delta_cmp(const void *x, const void *y)
+{
+    const struct file_delta *p = x;
+    const struct file_delta *q = y;
+    uint64_t dp = (p->a - p->both) + (p->b - p->both);
+    uint64_t dq = (q->a - q->both) + (q->b - q->both);
+    return dp != dq ? (dp < dq ? 1 : -1) : strcmp(p->path, q->path);
+}
+
+static void print_sizes(FILE *out, uint64_t a, uint64_t b, uint64_t both)
+{
+    fprintf(out, "\"a\":%llu,\"b\":%llu,\"both\":%llu,\"only_a\":%llu,\"only_b\":%llu", (unsigned long long) a,
+            (unsigned long long) b, (unsigned long long) both, (unsigned long long) (a - both),
+            (unsigned long long) (b - both));
+}
+
+// How much of b was already in a, and the Jaccard index.
+static int ws_compare(const char *a_path, const char *b_path, const struct options *o)
+{
+    struct ws a, b;
+    if (ws_read(&a, a_path) < 0 || ws_read(&b, b_path) < 0) {
+        return EXIT_TROUBLE;
+    }
+    if (a.block_size != b.block_size) {
+        fprintf(stderr, "blok-ws: %s and %s have different block sizes\n", a_path, b_path);
+        return EXIT_TROUBLE;
+    }
+    struct file_delta *deltas = xrealloc(NULL, (a.n + b.n + 1) * sizeof(struct file_delta));
+    size_t n = 0;
+    uint64_t total_a = 0, total_b = 0, total_both = 0;
+    for (int side = 0; side < 2; side++) {
+        const struct ws *from = side == 0 ? &a : &b;
+        const struct ws *other = side == 0 ? &b : &a;
+        for (size_t i = 0; i < from->n; i++) {
+            const struct ws_file *f = &from->files[i];
+            const struct ws_file *g = ws_find(other, f);
+            if (side == 1 && g != NULL) {
+                continue;
+            }
+            struct file_delta d = { f->path, blok_roaring_card(&f->blocks), 0, 0 };
+            if (g != NULL) {
+                struct blok_roaring both;
+                blok_roaring_op(&both, &f->blocks, &g->blocks, BLOK_ROARING_AND);
+                d.b = blok_roaring_card(&g->blocks);
+                d.both = blok_roaring_card(&both);
+                blok_roaring_free(&both);
+            }
+            if (side == 1) {
+                d.b = d.a;
+                d.a = 0;
+            }
+            total_a += d.a;
+            total_b += d.b;
+            total_both += d.both;
+            deltas[n++] = d;
+        }
+    }
+    qsort(deltas, n, sizeof(struct file_delta), delta_cmp);
+
+    FILE *out = stdout;
+    fputs("{\"a\":", out);
+    blok_json_str(out, a_path, strlen(a_path));
+    fputs(",\"b\":", out);
+    blok_json_str(out, b_path, strlen(b_path));
+    fprintf(out, ",\"block\":%llu,\"totals\":{", (unsigned long long) a.block_size);
+    print_sizes(out, total_a, total_b, total_both);
+    uint64_t any = total_a + total_b - total_both;
+    fprintf(out, ",\"b_in_a_pct\":%.2f,\"jaccard\":%.4f}", total_b ? 100.0 * total_both / total_b : 0.0,
+            any ? (double) total_both / any : 0.0);
+    fputs(",\"files\":[", out);
+    for (size_t i = 0; i < n && i < o->limit; i++) {
+        if (deltas[i].a == deltas[i].both && deltas[i].b == deltas[i].both) {
+            break;
+        }
+        fputs(i > 0 ? ",{\"file\":" : "{\"file\":", out);
+        blok_json_str(out, deltas[i].path, strlen(deltas[i].path));
+        putc(',', out);
+        print_sizes(out, deltas[i].a, deltas[i].b, deltas[i].both);
+        putc('}', out);
+    }
+    fputs("]}\n", out);
+    free(deltas);
+    ws_free(&a);
+    ws_free(&b);
+    return 0;
+}
+
+static void print_range(uint64_t lo, uint64_t hi, void *arg)
+{
+    int *first = arg;
+    if (lo == hi) {
+        printf("%s%llu", *first ? "\t" : ",", (unsigned long long) lo);
+    } else {
+        printf("%s%llu-%llu", *first ? "\t" : ",", (unsigned long long) lo, (unsigned long long) hi);
+    }
+    *first = 0;
+}
+
+static int ws_show(const char *path, const struct options *o)
+{
+    struct ws ws;
+    if (ws_read(&ws, path) < 0) {
+        return EXIT_TROUBLE;
+    }
+    printf("# block %llu\n", (unsigned long long) ws.block_size);
+    for (size_t i = 0; i < ws.n; i++) {
+        const struct ws_file *f = &ws.files[i];
+        printf("%s\t%llu", f->path, (unsigned long long) blok_roaring_card(&f->blocks));
+        if (o->ranges) {
+            int first = 1;
+            blok_roaring_runs(&f->blocks, print_range, &first);
+        }
+        putchar('\n');
+    }
+    ws_free(&ws);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: blok-ws build [--block=SIZE] [--op=read|write|all] [--pid=PID] [--job=ID] -o OUT TRACE\n"
+                    "       blok-ws union|intersect|diff -o OUT A B\n"
+                    "       blok-ws compare [--limit=N] A B\n"
+                    "       blok-ws show [--ranges] WS\n");
+    exit(EXIT_TROUBLE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "block", required_argument, NULL, 'b' },
+        { "op", required_argument, NULL, 'p' },
+        { "pid", required_argument, NULL, 'P' },
+        { "job", required_argument, NULL, 'j' },
+        { "limit", required_argument, NULL, 'l' },
+        { "ranges", no_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 }
+    };
+    if (argc < 2) {
+        usage();
+    }
+    const char *cmd = argv[1];
+    struct options o = { .block_size = 4096, .ops = WS_READ | WS_WRITE, .limit = 50 };
+    int c;
+    optind = 2;
+    while ((c = getopt_long(argc, argv, "o:", options, NULL)) != -1) {
+        switch (c) {
+        case 'b': o.block_size = strtoull(optarg, NULL, 10); break;
+        case 'p':
+            o.ops = strcmp(optarg, "read") == 0 ? WS_READ : strcmp(optarg, "write") == 0 ? WS_WRITE
+                    : strcmp(optarg, "all") == 0 ? WS_READ | WS_WRITE : 0;
+            break;
+        case 'P': o.pid = atoi(optarg); break;
+        case 'j': o.job = atoi(optarg); break;
+        case 'l': o.limit = strtoull(optarg, NULL, 10); break;
+        case 'r': o.ranges = 1; break;
+        case 'o': o.out = optarg; break;
+        default: usage();
+        }
+    }
+    int args = argc - optind;
+
+    if (strcmp(cmd, "build") == 0) {
+        if (args != 1 || o.out == NULL || o.block_size == 0 || o.ops == 0) {
+            usage();
+        }
+        struct ws ws;
+        ws_init(&ws, o.block_size);
+        const char *trace = argv[optind];
+        int ret = blok_col_is_columnar(trace) ? build_columnar(&ws, &o, trace) : build_log(&ws, &o, trace);
+        if (ret == 0) {
+            ret = ws_write(&ws, o.out);
+        }
+        ws_free(&ws);
+        return ret < 0 ? EXIT_TROUBLE : 0;
+    }
+    static const struct {
+        const char *name;
+        enum blok_roaring_op op;
+    } combines[] = {
+        { "union", BLOK_ROARING_OR }, { "intersect", BLOK_ROARING_AND }, { "diff", BLOK_ROARING_ANDNOT },
+    };
+    for (size_t i = 0; i < sizeof(combines) / sizeof(combines[0]); i++) {
+        if (strcmp(cmd, combines[i].name) == 0) {
+            if (args != 2 || o.out == NULL) {
+                usage();
+            }
+            return ws_combine(argv[optind], argv[optind + 1], o.out, combines[i].op);
+        }
+    }
+    if (strcmp(cmd, "compare") == 0 && args == 2) {
+        return ws_compare(argv[optind], argv[optind + 1], &o);
+    }
+    if (strcmp(cmd, "show") == 0 && args == 1) {
+        return ws_show(argv[optind], &o);
+    }
+    usage();
+    return EXIT_TROUBLE;
+}